@@ -0,0 +1,174 @@
+#include "bloom.h"
+#include <stdlib.h>
+#include <string.h>
+#include "xassert.h"
+#include "utils.h"
+
+#define BLOOM_MAGIC UINT64_C(0x004D4F4F4C424B50) // "PKBLOOM\0" (little-endian).
+enum {
+	BLOOM_VERSION = 1,
+	BLOOM_BLOCK_WORDS = 8, // 512 bits.
+	BLOOM_MAX_HASHES = 16
+};
+
+struct Bloom { // Typedef'd in the header file.
+	uint64_t *words; // Of the blocks, one after another.
+	uint64_t n_blocks; // A power of 2.
+	int n_hashes; // Bits per key.
+	uint64_t capacity;
+	uint64_t n_keys;
+	uint64_t n_stale;
+};
+
+// The start of the file (followed by the words).
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t n_hashes;
+	uint64_t n_blocks;
+	uint64_t capacity;
+	uint64_t n_keys;
+	uint64_t n_stale;
+} BloomHeader;
+
+static Bloom *bloom_alloc(uint64_t n_blocks, int n_hashes) {
+	Bloom *bloom = malloc(sizeof(*bloom));
+	xassert(1, bloom != NULL);
+	size_t n_bytes = n_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+	bloom->words = aligned_alloc(BLOOM_BLOCK_WORDS * sizeof(uint64_t), n_bytes);
+	xassert(1, bloom->words != NULL);
+	memset(bloom->words, 0, n_bytes);
+	bloom->n_blocks = n_blocks;
+	bloom->n_hashes = n_hashes;
+	bloom->capacity = 0;
+	bloom->n_keys = 0;
+	bloom->n_stale = 0;
+	return bloom;
+}
+
+Bloom *bloom_new(uint64_t capacity, int bits_per_key) {
+	xassert(1, bits_per_key > 0);
+	uint64_t n_bits = MAX(capacity, 1) * bits_per_key;
+	uint64_t block_bits = BLOOM_BLOCK_WORDS * 64;
+	uint64_t n_blocks = 1;
+	while (n_blocks * block_bits < n_bits)
+		n_blocks *= 2;
+	// ln(2) hashes per bit of a key give the fewest false positives.
+	unsigned n_hashes = ((unsigned) bits_per_key * 69 + 50) / 100;
+	n_hashes = MIN(MAX(n_hashes, 1u), (unsigned) BLOOM_MAX_HASHES);
+	Bloom *bloom = bloom_alloc(n_blocks, n_hashes);
+	bloom->capacity = capacity;
+	return bloom;
+}
+
+void bloom_destroy(Bloom *bloom) {
+	free(bloom->words);
+	free(bloom);
+}
+
+static uint64_t bloom_hash(uint64_t key) {
+	// The finalizer of splitmix64 (every bit of the key affects every bit of
+	// the hash).
+	key ^= key >> 30;
+	key *= UINT64_C(0xBF58476D1CE4E5B9);
+	key ^= key >> 27;
+	key *= UINT64_C(0x94D049BB133111EB);
+	key ^= key >> 31;
+	return key;
+}
+
+static uint64_t *bloom_block(
+	const Bloom *bloom, uint64_t key, uint64_t masks[BLOOM_BLOCK_WORDS]) {
+
+	// The key's block (chosen by the low bits of the hash), and its bits in
+	// there (by double hashing with the high bits: bit i is a + i * b, where
+	// b is odd, so that the bits are distinct).
+	uint64_t hash = bloom_hash(key);
+	unsigned block_bits = BLOOM_BLOCK_WORDS * 64;
+	unsigned a = (hash >> 32) % block_bits;
+	unsigned b = (hash >> 48) | 1;
+	memset(masks, 0, BLOOM_BLOCK_WORDS * sizeof(*masks));
+	for (int i = 0; i < bloom->n_hashes; i++) {
+		unsigned bit = (a + i * b) % block_bits;
+		masks[bit / 64] |= UINT64_C(1) << bit % 64;
+	}
+	return bloom->words + (hash & (bloom->n_blocks - 1)) * BLOOM_BLOCK_WORDS;
+}
+
+void bloom_add(Bloom *bloom, uint64_t key) {
+	uint64_t masks[BLOOM_BLOCK_WORDS];
+	uint64_t *block = bloom_block(bloom, key, masks);
+	for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+		if (masks[i] != 0)
+			__atomic_fetch_or(&block[i], masks[i], __ATOMIC_RELAXED);
+	}
+	bloom->n_keys++;
+}
+
+bool bloom_may_contain(const Bloom *bloom, uint64_t key) {
+	// All words are checked, without branching on each.
+	uint64_t masks[BLOOM_BLOCK_WORDS];
+	uint64_t *block = bloom_block(bloom, key, masks);
+	uint64_t missing = 0;
+	for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+		missing |= masks[i] & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+	return missing == 0;
+}
+
+void bloom_count_removed(Bloom *bloom) {
+	xassert(1, bloom->n_keys > 0);
+	bloom->n_keys--;
+	bloom->n_stale++;
+}
+
+uint64_t bloom_capacity(const Bloom *bloom) {
+	return bloom->capacity;
+}
+
+uint64_t bloom_n_keys(const Bloom *bloom) {
+	return bloom->n_keys;
+}
+
+uint64_t bloom_n_stale(const Bloom *bloom) {
+	return bloom->n_stale;
+}
+
+static size_t bloom_n_bytes(const Bloom *bloom) {
+	return bloom->n_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+void bloom_save(const Bloom *bloom, FsFile *file) {
+	BloomHeader header = {
+		.magic = BLOOM_MAGIC,
+		.version = BLOOM_VERSION,
+		.n_hashes = bloom->n_hashes,
+		.n_blocks = bloom->n_blocks,
+		.capacity = bloom->capacity,
+		.n_keys = bloom->n_keys,
+		.n_stale = bloom->n_stale
+	};
+	fs_set_size(file, sizeof(header) + bloom_n_bytes(bloom));
+	fs_write(file, &header, 0, sizeof(header));
+	fs_write(file, bloom->words, sizeof(header), bloom_n_bytes(bloom));
+}
+
+Bloom *bloom_load(FsFile *file) {
+	BloomHeader header;
+	if (fs_size(file) < sizeof(header))
+		return NULL;
+	fs_read(file, &header, 0, sizeof(header));
+	if (header.magic != BLOOM_MAGIC || header.version != BLOOM_VERSION ||
+	    header.n_hashes < 1 || header.n_hashes > BLOOM_MAX_HASHES ||
+	    header.n_blocks == 0 ||
+	    (header.n_blocks & (header.n_blocks - 1)) != 0 ||
+	    fs_size(file) != sizeof(header) +
+	    header.n_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t))
+		return NULL;
+
+	Bloom *bloom = bloom_alloc(header.n_blocks, header.n_hashes);
+	bloom->capacity = header.capacity;
+	bloom->n_keys = header.n_keys;
+	bloom->n_stale = header.n_stale;
+	fs_read(file, bloom->words, sizeof(header), bloom_n_bytes(bloom));
+	return bloom;
+}
@@ -0,0 +1,33 @@
+// Bloom filter over integer keys: tells that a key is surely not in a set, or
+// that it may be. Blocked: all of a key's bits are in one 64-byte block (a
+// cache line), so a check reads one line.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "fs.h"
+
+typedef struct Bloom Bloom;
+
+// Sized for `capacity` keys with bits_per_key bits each (rounded up to a
+// power of 2 of blocks). With 10 bits per key, about 1% of the keys which
+// aren't in the set get through.
+Bloom *bloom_new(uint64_t capacity, int bits_per_key);
+void bloom_destroy(Bloom *bloom);
+
+// Several threads may check keys while one adds them.
+void bloom_add(Bloom *bloom, uint64_t key);
+bool bloom_may_contain(const Bloom *bloom, uint64_t key);
+
+// Keys can't be taken out, but the filter keeps count of the ones removed
+// from the set (whose bits stay set), so that the user can tell when to
+// rebuild it. For the counts to be right, keys have to be added once (until
+// they're removed).
+void bloom_count_removed(Bloom *bloom);
+uint64_t bloom_capacity(const Bloom *bloom);
+uint64_t bloom_n_keys(const Bloom *bloom); // Added, minus removed.
+uint64_t bloom_n_stale(const Bloom *bloom); // Removed.
+
+// The filter (with its counts) as the whole contents of a file.
+void bloom_save(const Bloom *bloom, FsFile *file);
+// NULL if the file doesn't contain a filter (e.g. it's empty).
+Bloom *bloom_load(FsFile *file);
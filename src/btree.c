@@ -4,8 +4,13 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
 #include "xassert.h"
 #include "fs.h"
+#include "space.h"
+#include "bloom.h"
 #include "utils.h"
 
 int btree_key_cmp(BtreeKey a, BtreeKey b) {
@@ -21,662 +26,4808 @@ typedef uint64_t BtreePtr;
 #define BTREE_PTR_PRINT PRIu64
 // A "pointer" to a B-tree node is just the block index.
 
-enum {
-	BTREE_MAX_POSSIBLE_KEYS =
-		(BTREE_BLOCK_SIZE
-		 - sizeof(uint8_t) - sizeof(uint16_t) - sizeof(BtreePtr))
-		/ (sizeof(BtreeKey) + sizeof(BtreeValue) + sizeof(BtreePtr)),
-	BTREE_MIN_KEYS = BTREE_MAX_POSSIBLE_KEYS / 2,
-	BTREE_MAX_KEYS = BTREE_MIN_KEYS * 2,
-	// The assignment requires BTREE_MAX_KEYS = BTREE_MIN_KEYS * 2, but we could
-	// also use BTREE_MAX_KEYS = BTREE_MAX_POSSIBLE_KEYS, BTREE_MIN_KEYS =
-	// BTREE_MAX_KEYS / 2 + BTREE_MAX_KEYS % 2 (division by 2, but rounded up
-	// instead of down). See
+enum { BTREE_NODE_HEADER_SIZE = 8 }; // See the node layout below.
+
+typedef enum {
+	BTREE_NODE_INTERNAL = 0,
+	BTREE_NODE_LEAF = 1,
+	// B+ tree (BTREE_LAYOUT_BPLUS) nodes.
+	BTREE_NODE_PLUS_INTERNAL = 2, // Keys and children, but no values.
+	BTREE_NODE_PLUS_LEAF = 3, // Instead of children, links to the neighbors.
+	// BTREE_LAYOUT_BYTES nodes (see the slotted layout below).
+	BTREE_NODE_SLOTTED_INTERNAL = 4,
+	BTREE_NODE_SLOTTED_LEAF = 5,
+	// BTREE_LAYOUT_PACKED leaves (see the packed layout below). Other nodes
+	// of those trees are B+ tree nodes.
+	BTREE_NODE_PACKED_LEAF = 6, // In memory: a BTREE_NODE_PLUS_LEAF with
+	                            // more room.
+	BTREE_NODE_ENCODED_LEAF = 7 // In the file.
+} BtreeNodeKind;
+
+static int btree_max_keys(size_t block_size, BtreeNodeKind kind) {
+	// The node capacity for a block size. The assignment requires
+	// max_keys = min_keys * 2 (where min_keys = max_keys / 2 is the minimum
+	// number of keys in a node other than the root), but we could also use
+	// all the space, with min_keys = max_keys / 2 + max_keys % 2 (division by
+	// 2, but rounded up instead of down). See
 	// <https://en.wikipedia.org/wiki/B-tree#Definition>.
+	// B-tree leaves have room for children too, so that all nodes have the
+	// same capacity.
+	size_t fixed_size = BTREE_NODE_HEADER_SIZE + sizeof(BtreePtr);
+	size_t item_size = sizeof(BtreeKey) + sizeof(BtreeValue)
+		+ sizeof(BtreePtr);
+	if (kind == BTREE_NODE_PLUS_INTERNAL) {
+		item_size -= sizeof(BtreeValue);
+	} else if (kind == BTREE_NODE_PLUS_LEAF) {
+		fixed_size += sizeof(BtreePtr);
+		item_size -= sizeof(BtreePtr);
+	}
+	int max_possible_keys = (block_size - fixed_size) / item_size;
+	return max_possible_keys / 2 * 2;
+}
+
+// The first block (address 0) of the B-tree's file is the superblock (which
+// stores metadata). It starts with a magic number and a format version.
+#define BTREE_MAGIC UINT64_C(0x0045455254424B50) // "PKBTREE\0" (little-endian).
+enum { BTREE_VERSION = 1 };
+
+typedef struct {
+	BtreePtr root;
+	BtreePtr n_free; // Free blocks below `end` (see space.h).
+	BtreePtr end; // Number of used blocks.
+	BtreePtr block_size;
+	BtreeLayout layout;
+} BtreeSuperblock;
+
+// Nodes are accessed in place, directly in the bytes of their block (pinned
+// in the buffer pool, or in the write queue), instead of being deserialized.
+// A node's block is a header followed by arrays of keys, values and children
+// (struct-of-arrays), so that the keys are contiguous and can be searched
+// with SIMD instructions:
+//   uint16_t n_items
+//   uint8_t kind (BtreeNodeKind)
+//   (padding)
+//   uint16_t max_keys (see btree_max_keys)
+//   (padding up to BTREE_NODE_HEADER_SIZE)
+//   BtreeKey keys[max_keys]
+//   BtreeValue values[max_keys] (not in BTREE_NODE_PLUS_INTERNAL)
+//   BtreePtr children[max_keys + 1] (in BTREE_NODE_PLUS_LEAF, the previous
+//                                    and next leaf instead)
+// Invariant: keys in children[i] < keys[i] < keys in children[i + 1]. In a
+// B+ tree, keys[i] is a copy of a key in children[i + 1] (or a key that was
+// deleted from there), so that's keys[i] <= keys in children[i + 1].
+// Blocks are aligned to the block size in the file and in memory, and
+// max_keys is even, so all the arrays are naturally aligned. Storing
+// max_keys in the node lets the accessors find the arrays without a
+// reference to the tree.
+enum {
+	BTREE_NODE_N_ITEMS = 0, // Offsets in the block.
+	BTREE_NODE_KIND = sizeof(uint16_t),
+	BTREE_NODE_MAX_KEYS = 2 * sizeof(uint16_t),
+	BTREE_NODE_KEYS = BTREE_NODE_HEADER_SIZE
+};
+
+enum { BTREE_LINK_PREV = 0, BTREE_LINK_NEXT = 1 }; // See the layout.
+
+static BtreeNodeKind btree_node_kind(const char *node) {
+	return node[BTREE_NODE_KIND];
+}
+
+static bool btree_node_is_plus_leaf(const char *node) {
+	// Packed leaves are accessed like B+ tree leaves.
+	return btree_node_kind(node) == BTREE_NODE_PLUS_LEAF ||
+		btree_node_kind(node) == BTREE_NODE_PACKED_LEAF;
+}
+
+static bool btree_node_is_leaf(const char *node) {
+	return btree_node_kind(node) == BTREE_NODE_LEAF ||
+		btree_node_is_plus_leaf(node) ||
+		btree_node_kind(node) == BTREE_NODE_SLOTTED_LEAF;
+}
+
+static bool btree_node_has_values(const char *node) {
+	return btree_node_kind(node) != BTREE_NODE_PLUS_INTERNAL &&
+		btree_node_kind(node) != BTREE_NODE_SLOTTED_INTERNAL;
+}
+
+static int btree_node_n_items(const char *node) {
+	return *(const uint16_t *) (node + BTREE_NODE_N_ITEMS);
+}
+
+static int btree_node_max_keys(const char *node) {
+	return *(const uint16_t *) (node + BTREE_NODE_MAX_KEYS);
+}
+
+static int btree_node_min_keys(const char *node) {
+	// Except in the root. A packed leaf has the minimum of the B+ tree leaf
+	// it may be written as (see btree_init).
+	if (btree_node_kind(node) == BTREE_NODE_PACKED_LEAF)
+		return (btree_node_max_keys(node) + 2) / 4;
+	return btree_node_max_keys(node) / 2;
+}
+
+static size_t btree_node_values_offset(const char *node) {
+	return BTREE_NODE_KEYS + btree_node_max_keys(node) * sizeof(BtreeKey);
+}
+
+static size_t btree_node_children_offset(const char *node) {
+	if (!btree_node_has_values(node))
+		return btree_node_values_offset(node);
+	return btree_node_values_offset(node)
+		+ btree_node_max_keys(node) * sizeof(BtreeValue);
+}
+
+static const BtreeKey *btree_node_keys(const char *node) {
+	return (const BtreeKey *) (node + BTREE_NODE_KEYS);
+}
+
+static BtreeKey btree_node_key(const char *node, int i) {
+	return btree_node_keys(node)[i];
+}
+
+static BtreeValue btree_node_value(const char *node, int i) {
+	return ((const BtreeValue *) (node + btree_node_values_offset(node)))[i];
+}
+
+static BtreeItem btree_node_item(const char *node, int i) {
+	// The value is 0 in nodes without values.
+	BtreeItem item = {btree_node_key(node, i), 0};
+	if (btree_node_has_values(node))
+		item.value = btree_node_value(node, i);
+	return item;
+}
+
+static BtreePtr btree_node_child(const char *node, int i) {
+	return ((const BtreePtr *) (node + btree_node_children_offset(node)))[i];
+}
+
+static BtreePtr btree_node_link(const char *node, int link) {
+	xassert(1, btree_node_is_plus_leaf(node));
+	return btree_node_child(node, link);
+}
+
+static void btree_node_set_kind(char *node, BtreeNodeKind kind) {
+	node[BTREE_NODE_KIND] = kind;
+}
+
+static void btree_node_set_n_items(char *node, int n_items) {
+	*(uint16_t *) (node + BTREE_NODE_N_ITEMS) = n_items;
+}
+
+static void btree_node_set_max_keys(char *node, int max_keys) {
+	*(uint16_t *) (node + BTREE_NODE_MAX_KEYS) = max_keys;
+}
+
+static void btree_node_set_value(char *node, int i, BtreeValue value) {
+	((BtreeValue *) (node + btree_node_values_offset(node)))[i] = value;
+}
+
+static void btree_node_set_item(char *node, int i, BtreeItem item) {
+	((BtreeKey *) (node + BTREE_NODE_KEYS))[i] = item.key;
+	if (btree_node_has_values(node))
+		btree_node_set_value(node, i, item.value);
+}
+
+static void btree_node_set_child(char *node, int i, BtreePtr child) {
+	((BtreePtr *) (node + btree_node_children_offset(node)))[i] = child;
+}
+
+static void btree_node_set_link(char *node, int link, BtreePtr leaf) {
+	xassert(1, btree_node_is_plus_leaf(node));
+	btree_node_set_child(node, link, leaf);
+}
+
+#if BTREE_SIMD_SEARCH && defined(__AVX2__)
+	#include <immintrin.h>
+	#define BTREE_SIMD_WIDTH 8
+#elif BTREE_SIMD_SEARCH && defined(__SSE2__)
+	#include <emmintrin.h>
+	#define BTREE_SIMD_WIDTH 4
+#endif
+
+static int btree_node_lower_bound(const char *node, BtreeKey key) {
+	// Index of first key which is >= `key`, or n_items if there are none.
+
+	const BtreeKey *keys = btree_node_keys(node);
+	int n_items = btree_node_n_items(node);
+
+#if defined(BTREE_SIMD_WIDTH)
+	// Count the keys which are < `key` (the keys are sorted, so that's the
+	// index we want), BTREE_SIMD_WIDTH at a time. There are only signed
+	// comparisons, so flip the sign bits first. The last vector can extend
+	// past the keys (into the values or children, which are masked out), but
+	// not past the block.
+	int count = 0;
+	for (int i = 0; i < n_items; i += BTREE_SIMD_WIDTH) {
+	#if BTREE_SIMD_WIDTH == 8
+		__m256i sign = _mm256_set1_epi32(INT32_MIN);
+		__m256i flipped_key = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+		__m256i flipped_keys = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *) (keys + i)), sign);
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpgt_epi32(flipped_key, flipped_keys)));
+	#else
+		__m128i sign = _mm_set1_epi32(INT32_MIN);
+		__m128i flipped_key = _mm_xor_si128(_mm_set1_epi32(key), sign);
+		__m128i flipped_keys = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *) (keys + i)), sign);
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(
+			_mm_cmpgt_epi32(flipped_key, flipped_keys)));
+	#endif
+		if (n_items - i < BTREE_SIMD_WIDTH)
+			mask &= (1 << (n_items - i)) - 1;
+		count += __builtin_popcount(mask);
+	}
+	return count;
+#else
+	// Branchless binary search (the comparison compiles to a conditional
+	// move, so there are no mispredictions).
+	if (n_items == 0)
+		return 0;
+	const BtreeKey *base = keys;
+	while (n_items > 1) {
+		int half = n_items / 2;
+		base += (btree_key_cmp(base[half], key) < 0) * half;
+		n_items -= half;
+	}
+	return (base - keys) + (btree_key_cmp(*base, key) < 0);
+#endif
+}
+
+static int btree_node_find_child(const char *node, BtreeKey key) {
+	// In a B+ tree's internal node, the child whose subtree can contain the
+	// key (see the layout).
+	int i_child = btree_node_lower_bound(node, key);
+	if (i_child < btree_node_n_items(node) &&
+	    btree_key_cmp(btree_node_key(node, i_child), key) == 0)
+		i_child++;
+	return i_child;
+}
+
+static void btree_node_insert(
+	char *node, int i_item, BtreeItem item, BtreePtr right_child) {
+
+	// Insert the item (and its right child, if the node isn't a leaf) in
+	// place. The node mustn't be full.
+
+	int n_items = btree_node_n_items(node);
+	xassert(1, n_items < btree_node_max_keys(node) && i_item <= n_items);
+
+	BtreeKey *keys = (BtreeKey *) (node + BTREE_NODE_KEYS);
+	memmove(keys + i_item + 1, keys + i_item,
+	        (n_items - i_item) * sizeof(*keys));
+	if (btree_node_has_values(node)) {
+		BtreeValue *values =
+			(BtreeValue *) (node + btree_node_values_offset(node));
+		memmove(values + i_item + 1, values + i_item,
+		        (n_items - i_item) * sizeof(*values));
+	}
+	btree_node_set_item(node, i_item, item);
+
+	if (!btree_node_is_leaf(node)) {
+		BtreePtr *children =
+			(BtreePtr *) (node + btree_node_children_offset(node));
+		memmove(children + i_item + 2, children + i_item + 1,
+		        (n_items - i_item) * sizeof(*children));
+		btree_node_set_child(node, i_item + 1, right_child);
+	}
+
+	btree_node_set_n_items(node, n_items + 1);
+}
+
+static void btree_node_remove(char *node, int i_item) {
+	// Remove the item (and its right child, if the node isn't a leaf) in
+	// place.
+
+	int n_items = btree_node_n_items(node);
+	xassert(1, i_item < n_items);
+
+	BtreeKey *keys = (BtreeKey *) (node + BTREE_NODE_KEYS);
+	memmove(keys + i_item, keys + i_item + 1,
+	        (n_items - i_item - 1) * sizeof(*keys));
+	if (btree_node_has_values(node)) {
+		BtreeValue *values =
+			(BtreeValue *) (node + btree_node_values_offset(node));
+		memmove(values + i_item, values + i_item + 1,
+		        (n_items - i_item - 1) * sizeof(*values));
+	}
+
+	if (!btree_node_is_leaf(node)) {
+		BtreePtr *children =
+			(BtreePtr *) (node + btree_node_children_offset(node));
+		memmove(children + i_item + 1, children + i_item + 2,
+		        (n_items - i_item - 1) * sizeof(*children));
+	}
+
+	btree_node_set_n_items(node, n_items - 1);
+}
+
+static int btree_node_get_items(const char *node, BtreeItem *items) {
+	// Returns the number of items.
+	int n_items = btree_node_n_items(node);
+	for (int i_item = 0; i_item < n_items; i_item++)
+		items[i_item] = btree_node_item(node, i_item);
+	return n_items;
+}
+
+static void btree_node_get_children(const char *node, BtreePtr *children) {
+	for (int i_child = 0; i_child <= btree_node_n_items(node); i_child++)
+		children[i_child] = btree_node_child(node, i_child);
+}
+
+static void btree_node_fill(
+	char *node, const BtreeItem *items, const BtreePtr *children,
+	int n_items) {
+
+	// `children` (n_items + 1 of them) is ignored for leaves.
+	btree_node_set_n_items(node, n_items);
+	for (int i_item = 0; i_item < n_items; i_item++)
+		btree_node_set_item(node, i_item, items[i_item]);
+	if (!btree_node_is_leaf(node)) {
+		for (int i_child = 0; i_child <= n_items; i_child++)
+			btree_node_set_child(node, i_child, children[i_child]);
+	}
+}
+
+// Leaves of BTREE_LAYOUT_PACKED trees are worked on in memory as
+// BTREE_NODE_PACKED_LEAF nodes, which are laid out like BTREE_NODE_PLUS_LEAF
+// ones, but don't fit in a block when they're full. They're decoded when
+// they're read (see btree_unpack_leaf), and encoded when they're written (see
+// btree_pack_leaf), as plain B+ tree leaves, or if that's smaller, as:
+//   uint16_t n_items
+//   uint8_t kind (BTREE_NODE_ENCODED_LEAF)
+//   uint8_t key_bits
+//   uint8_t value_bits (at most BTREE_PACKED_MAX_BITS)
+//   (padding up to BTREE_NODE_HEADER_SIZE)
+//   BtreePtr links[2] (the previous and next leaf)
+//   BtreeKey first_key
+//   BtreeKey min_gap
+//   BtreeValue min_value
+//   bit fields, from the lowest bit of each byte up:
+//     n_items - 1 gaps between keys, minus min_gap, key_bits each
+//     n_items values, minus min_value, value_bits each
+//   (at least 8 bytes of padding)
+// Every field can be read with an unaligned 64-bit load, which assumes a
+// little-endian machine (like the superblock's magic number).
+enum {
+	BTREE_PACKED_KEY_BITS = BTREE_NODE_KIND + 1, // Offsets in the block.
+	BTREE_PACKED_VALUE_BITS = BTREE_NODE_KIND + 2,
+	BTREE_PACKED_LINKS = BTREE_NODE_HEADER_SIZE,
+	BTREE_PACKED_FIRST_KEY = BTREE_PACKED_LINKS + 2 * sizeof(BtreePtr),
+	BTREE_PACKED_MIN_GAP = BTREE_PACKED_FIRST_KEY + sizeof(BtreeKey),
+	BTREE_PACKED_MIN_VALUE = BTREE_PACKED_MIN_GAP + sizeof(BtreeKey),
+	BTREE_PACKED_FIELDS = BTREE_PACKED_MIN_VALUE + sizeof(BtreeValue),
+
+	BTREE_PACKED_MAX_BITS = 57 // A field and its offset in a byte fit in 64.
+};
+
+#if BTREE_SIMD_UNPACK && defined(__AVX2__)
+	#include <immintrin.h>
+	#define BTREE_UNPACK_WIDTH 8
+#elif BTREE_SIMD_UNPACK && defined(__SSE2__)
+	#include <emmintrin.h>
+	#define BTREE_UNPACK_WIDTH 4
+#endif
+
+typedef struct {
+	// Of items added in key order (see btree_packed_add).
+	int n_items;
+	BtreeKey last_key;
+	BtreeKey min_gap, max_gap;
+	BtreeValue min_value, max_value;
+} BtreePackedStats;
+
+static void btree_packed_add(BtreePackedStats *stats, BtreeItem item) {
+	if (stats->n_items == 0) {
+		stats->min_gap = (BtreeKey) -1;
+		stats->max_gap = 0;
+		stats->min_value = stats->max_value = item.value;
+	} else {
+		BtreeKey gap = item.key - stats->last_key;
+		stats->min_gap = MIN(stats->min_gap, gap);
+		stats->max_gap = MAX(stats->max_gap, gap);
+		stats->min_value = MIN(stats->min_value, item.value);
+		stats->max_value = MAX(stats->max_value, item.value);
+	}
+	stats->last_key = item.key;
+	stats->n_items++;
+}
+
+static BtreePackedStats btree_packed_stats(const char *node) {
+	BtreePackedStats stats = {.n_items = 0};
+	for (int i_item = 0; i_item < btree_node_n_items(node); i_item++)
+		btree_packed_add(&stats, btree_node_item(node, i_item));
+	return stats;
+}
+
+static int btree_bit_width(uint64_t range) {
+	return range == 0 ? 0 : 64 - __builtin_clzll(range);
+}
+
+static int btree_packed_key_bits(const BtreePackedStats *stats) {
+	return stats->n_items > 1
+		? btree_bit_width(stats->max_gap - stats->min_gap) : 0;
+}
+
+static int btree_packed_value_bits(const BtreePackedStats *stats) {
+	return stats->n_items > 0
+		? btree_bit_width(stats->max_value - stats->min_value) : 0;
+}
+
+static size_t btree_packed_size(const BtreePackedStats *stats) {
+	// Of the encoded leaf, or SIZE_MAX if the values are too far apart.
+	int value_bits = btree_packed_value_bits(stats);
+	if (value_bits > BTREE_PACKED_MAX_BITS)
+		return SIZE_MAX;
+	size_t n_items = stats->n_items;
+	size_t n_bits = (n_items > 0 ? n_items - 1 : 0)
+		* btree_packed_key_bits(stats) + n_items * value_bits;
+	return BTREE_PACKED_FIELDS + (n_bits + 7) / 8 + sizeof(uint64_t);
+}
+
+static uint64_t btree_bit_mask(int n_bits) {
+	return (UINT64_C(1) << n_bits) - 1;
+}
+
+static void btree_pack_field(char *fields, size_t bit, uint64_t field) {
+	// The fields are zeroed first.
+	uint64_t word;
+	memcpy(&word, fields + bit / 8, sizeof(word));
+	word |= field << bit % 8;
+	memcpy(fields + bit / 8, &word, sizeof(word));
+}
+
+static uint64_t btree_unpack_field(const char *fields, size_t bit, int n_bits) {
+	uint64_t word;
+	memcpy(&word, fields + bit / 8, sizeof(word));
+	return (word >> bit % 8) & btree_bit_mask(n_bits);
+}
+
+static void btree_pack_leaf(
+	const char *node, char *block, size_t block_size, int max_plain_keys) {
+
+	// Write a packed leaf into its block, as a plain B+ tree leaf (with room
+	// for max_plain_keys) unless encoding it is smaller. Leaves with more
+	// items than that have to fit encoded (see btree_leaf_fits).
+	int n_items = btree_node_n_items(node);
+	BtreePackedStats stats = btree_packed_stats(node);
+	size_t size = btree_packed_size(&stats);
+	size_t plain_size = BTREE_NODE_HEADER_SIZE + 2 * sizeof(BtreePtr)
+		+ n_items * (sizeof(BtreeKey) + sizeof(BtreeValue));
+	memset(block, 0, block_size);
+	if (n_items <= max_plain_keys && size >= plain_size) {
+		btree_node_set_kind(block, BTREE_NODE_PLUS_LEAF);
+		btree_node_set_max_keys(block, max_plain_keys);
+		btree_node_set_n_items(block, n_items);
+		for (int i_item = 0; i_item < n_items; i_item++)
+			btree_node_set_item(block, i_item, btree_node_item(node, i_item));
+		for (int link = BTREE_LINK_PREV; link <= BTREE_LINK_NEXT; link++)
+			btree_node_set_link(block, link, btree_node_link(node, link));
+		return;
+	}
+	xassert(1, size <= block_size);
+
+	int key_bits = btree_packed_key_bits(&stats);
+	int value_bits = btree_packed_value_bits(&stats);
+	btree_node_set_kind(block, BTREE_NODE_ENCODED_LEAF);
+	btree_node_set_n_items(block, n_items);
+	block[BTREE_PACKED_KEY_BITS] = key_bits;
+	block[BTREE_PACKED_VALUE_BITS] = value_bits;
+	BtreePtr *links = (BtreePtr *) (block + BTREE_PACKED_LINKS);
+	for (int link = BTREE_LINK_PREV; link <= BTREE_LINK_NEXT; link++)
+		links[link] = btree_node_link(node, link);
+	*(BtreeKey *) (block + BTREE_PACKED_FIRST_KEY) = btree_node_key(node, 0);
+	*(BtreeKey *) (block + BTREE_PACKED_MIN_GAP) = stats.min_gap;
+	*(BtreeValue *) (block + BTREE_PACKED_MIN_VALUE) = stats.min_value;
+
+	char *fields = block + BTREE_PACKED_FIELDS;
+	size_t bit = 0;
+	for (int i_item = 1; i_item < n_items; i_item++, bit += key_bits) {
+		BtreeKey gap =
+			btree_node_key(node, i_item) - btree_node_key(node, i_item - 1);
+		btree_pack_field(fields, bit, gap - stats.min_gap);
+	}
+	for (int i_item = 0; i_item < n_items; i_item++, bit += value_bits) {
+		btree_pack_field(fields, bit,
+		                 btree_node_value(node, i_item) - stats.min_value);
+	}
+}
+
+static void btree_unpack_keys(
+	const char *block, BtreeKey *keys, int n_items) {
+
+	// Each key is the previous one plus min_gap plus its field. The vectors
+	// can go past the keys (into the values, which are decoded later), but
+	// the reads of the fields are masked at the end.
+	const char *fields = block + BTREE_PACKED_FIELDS;
+	int key_bits = (uint8_t) block[BTREE_PACKED_KEY_BITS];
+	BtreeKey min_gap = *(const BtreeKey *) (block + BTREE_PACKED_MIN_GAP);
+	BtreeKey key = *(const BtreeKey *) (block + BTREE_PACKED_FIRST_KEY);
+	keys[0] = key;
+	int i_item = 1;
+
+#if BTREE_UNPACK_WIDTH == 8
+	// Gather the 32-bit words the fields start in, and shift the fields down
+	// (which needs them to fit in 25 bits). Then add up the gaps in each
+	// 128-bit half, and carry the low half's total over to the high one.
+	if (key_bits <= 25) {
+		__m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		__m256i lane_bits =
+			_mm256_mullo_epi32(lanes, _mm256_set1_epi32(key_bits));
+		__m256i mask = _mm256_set1_epi32(btree_bit_mask(key_bits));
+		for (; i_item < n_items; i_item += 8) {
+			__m256i bits = _mm256_add_epi32(
+				_mm256_set1_epi32((i_item - 1) * key_bits), lane_bits);
+			__m256i in_leaf =
+				_mm256_cmpgt_epi32(_mm256_set1_epi32(n_items - i_item), lanes);
+			__m256i words = _mm256_mask_i32gather_epi32(
+				_mm256_setzero_si256(), (const int *) fields,
+				_mm256_srli_epi32(bits, 3), in_leaf, 1);
+			__m256i gaps = _mm256_and_si256(
+				_mm256_srlv_epi32(
+					words, _mm256_and_si256(bits, _mm256_set1_epi32(7))),
+				mask);
+			gaps = _mm256_add_epi32(gaps, _mm256_set1_epi32(min_gap));
+			gaps = _mm256_add_epi32(gaps, _mm256_slli_si256(gaps, 4));
+			gaps = _mm256_add_epi32(gaps, _mm256_slli_si256(gaps, 8));
+			__m256i low_total =
+				_mm256_permutevar8x32_epi32(gaps, _mm256_set1_epi32(3));
+			gaps = _mm256_add_epi32(gaps, _mm256_blend_epi32(
+				_mm256_setzero_si256(), low_total, 0xF0));
+			__m256i sums = _mm256_add_epi32(gaps, _mm256_set1_epi32(key));
+			_mm256_storeu_si256((__m256i *) (keys + i_item), sums);
+			key = _mm256_extract_epi32(sums, 7);
+		}
+	}
+#endif
+	for (size_t bit = (i_item - 1) * key_bits; i_item < n_items;
+	     i_item++, bit += key_bits) {
+		BtreeKey gap = min_gap + btree_unpack_field(fields, bit, key_bits);
+#if BTREE_UNPACK_WIDTH == 4
+		keys[i_item] = gap; // Added up below.
+#else
+		keys[i_item] = key += gap;
+#endif
+	}
+#if BTREE_UNPACK_WIDTH == 4
+	// There are no variable shifts, so only the sums are vectorized.
+	for (i_item = 1; i_item < n_items; i_item += 4) {
+		__m128i sums = _mm_loadu_si128((const __m128i *) (keys + i_item));
+		sums = _mm_add_epi32(sums, _mm_slli_si128(sums, 4));
+		sums = _mm_add_epi32(sums, _mm_slli_si128(sums, 8));
+		sums = _mm_add_epi32(sums, _mm_set1_epi32(key));
+		_mm_storeu_si128((__m128i *) (keys + i_item), sums);
+		key = _mm_cvtsi128_si32(_mm_shuffle_epi32(sums, 0xFF));
+	}
+#endif
+}
+
+static void btree_unpack_values(
+	const char *block, BtreeValue *values, int n_items) {
+
+	const char *fields = block + BTREE_PACKED_FIELDS;
+	size_t start = (size_t) (n_items - 1)
+		* (uint8_t) block[BTREE_PACKED_KEY_BITS];
+	int value_bits = (uint8_t) block[BTREE_PACKED_VALUE_BITS];
+	BtreeValue min_value =
+		*(const BtreeValue *) (block + BTREE_PACKED_MIN_VALUE);
+	int i_item = 0;
+
+#if BTREE_UNPACK_WIDTH == 8
+	// Like the keys, but 64 bits at a time. The vectors can go past the
+	// values, into the links.
+	__m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i lane_bits = _mm_mullo_epi32(lanes, _mm_set1_epi32(value_bits));
+	__m256i mask = _mm256_set1_epi64x(btree_bit_mask(value_bits));
+	for (; i_item < n_items; i_item += 4) {
+		__m128i bits = _mm_add_epi32(
+			_mm_set1_epi32(start + i_item * value_bits), lane_bits);
+		__m256i in_leaf = _mm256_cmpgt_epi64(
+			_mm256_set1_epi64x(n_items - i_item),
+			_mm256_setr_epi64x(0, 1, 2, 3));
+		__m256i words = _mm256_mask_i32gather_epi64(
+			_mm256_setzero_si256(), (const long long *) fields,
+			_mm_srli_epi32(bits, 3), in_leaf, 1);
+		__m256i shifts = _mm256_cvtepu32_epi64(
+			_mm_and_si128(bits, _mm_set1_epi32(7)));
+		__m256i unpacked =
+			_mm256_and_si256(_mm256_srlv_epi64(words, shifts), mask);
+		_mm256_storeu_si256(
+			(__m256i *) (values + i_item),
+			_mm256_add_epi64(unpacked, _mm256_set1_epi64x(min_value)));
+	}
+#endif
+	for (size_t bit = start + i_item * value_bits; i_item < n_items;
+	     i_item++, bit += value_bits)
+		values[i_item] =
+			min_value + btree_unpack_field(fields, bit, value_bits);
+}
+
+static void btree_unpack_leaf(const char *block, char *node, int max_keys) {
+	// Decode a packed tree's leaf from its block (encoded, or a plain B+ tree
+	// leaf) into a BTREE_NODE_PACKED_LEAF with room for max_keys items.
+	int n_items = btree_node_n_items(block);
+	xassert(1, n_items <= max_keys);
+	btree_node_set_kind(node, BTREE_NODE_PACKED_LEAF);
+	btree_node_set_max_keys(node, max_keys);
+	btree_node_set_n_items(node, n_items);
+	BtreeKey *keys = (BtreeKey *) (node + BTREE_NODE_KEYS);
+	BtreeValue *values = (BtreeValue *) (node + btree_node_values_offset(node));
+
+	if (btree_node_kind(block) == BTREE_NODE_PLUS_LEAF) {
+		memcpy(keys, btree_node_keys(block), n_items * sizeof(*keys));
+		memcpy(values, block + btree_node_values_offset(block),
+		       n_items * sizeof(*values));
+		for (int link = BTREE_LINK_PREV; link <= BTREE_LINK_NEXT; link++)
+			btree_node_set_link(node, link, btree_node_link(block, link));
+		return;
+	}
+
+	xassert(1, btree_node_kind(block) == BTREE_NODE_ENCODED_LEAF);
+	if (n_items > 0) {
+		btree_unpack_keys(block, keys, n_items);
+		btree_unpack_values(block, values, n_items);
+	}
+	const BtreePtr *links = (const BtreePtr *) (block + BTREE_PACKED_LINKS);
+	for (int link = BTREE_LINK_PREV; link <= BTREE_LINK_NEXT; link++)
+		btree_node_set_link(node, link, links[link]);
+}
+
+// Nodes of trees with variable-length keys (BTREE_LAYOUT_BYTES) are slotted
+// pages. The keys (with their values or children) are in cells, packed at
+// the end of the block, and an array of slots at the start points to them in
+// key order, so that an insertion only moves the slots. The bytes which all
+// the keys in a node start with (the prefix) are stored once:
+//   uint16_t n_items
+//   uint8_t kind (BtreeNodeKind)
+//   (padding)
+//   uint16_t prefix_size
+//   (padding)
+//   uint32_t cells_start (the offset of the lowest cell)
+//   (padding)
+//   BtreePtr links[2] (in an internal node, children[0]; in a leaf, the
+//                      previous and next leaf)
+//   char prefix[prefix_size]
+//   (padding to an even offset)
+//   uint16_t slots[n_items] (offsets of the cells)
+//   (free space)
+//   cells, each of them:
+//     uint16_t suffix_size
+//     char suffix[suffix_size] (the key without the prefix)
+//     BtreeValue value (in a leaf) or BtreePtr child (children[i + 1])
+// Like in a B+ tree, keys[i] <= keys in children[i + 1], and values are only
+// in the leaves. Keys in internal nodes are only as long as necessary to
+// separate the children (see btree_bytes_up_pass). Cells aren't aligned, so
+// they're accessed with memcpy.
+enum {
+	BTREE_SLOTTED_PREFIX_SIZE = BTREE_NODE_MAX_KEYS, // Offsets in the block.
+	BTREE_SLOTTED_CELLS_START = 8,
+	BTREE_SLOTTED_LINKS = 16,
+	BTREE_SLOTTED_PREFIX = 32 // Also the size of the header.
+};
+
+static int btree_bytes_cmp(
+	const char *a, size_t a_size, const char *b, size_t b_size) {
+
+	// Like btree_key_cmp, for variable-length keys.
+	int cmp = memcmp(a, b, MIN(a_size, b_size));
+	if (cmp != 0)
+		return cmp;
+	return (a_size > b_size) - (a_size < b_size);
+}
+
+static bool btree_node_is_slotted(const char *node) {
+	return btree_node_kind(node) == BTREE_NODE_SLOTTED_INTERNAL ||
+		btree_node_kind(node) == BTREE_NODE_SLOTTED_LEAF;
+}
+
+static size_t btree_slotted_prefix_size(const char *node) {
+	return *(const uint16_t *) (node + BTREE_SLOTTED_PREFIX_SIZE);
+}
+
+static const char *btree_slotted_prefix(const char *node) {
+	return node + BTREE_SLOTTED_PREFIX;
+}
+
+static size_t btree_slotted_cells_start(const char *node) {
+	return *(const uint32_t *) (node + BTREE_SLOTTED_CELLS_START);
+}
+
+static size_t btree_slotted_slots_offset(size_t prefix_size) {
+	return BTREE_SLOTTED_PREFIX + (prefix_size + 1) / 2 * 2;
+}
+
+static uint16_t *btree_slotted_slots(const char *node) {
+	return (uint16_t *) (node + btree_slotted_slots_offset(
+		btree_slotted_prefix_size(node)));
+}
+
+static size_t btree_slotted_payload_size(const char *node) {
+	return btree_node_is_leaf(node) ? sizeof(BtreeValue) : sizeof(BtreePtr);
+}
+
+static size_t btree_slotted_suffix_size(const char *node, int i) {
+	uint16_t suffix_size;
+	memcpy(&suffix_size, node + btree_slotted_slots(node)[i],
+	       sizeof(suffix_size));
+	return suffix_size;
+}
+
+static const char *btree_slotted_suffix(const char *node, int i) {
+	return node + btree_slotted_slots(node)[i] + sizeof(uint16_t);
+}
+
+static const char *btree_slotted_payload(const char *node, int i) {
+	return btree_slotted_suffix(node, i) + btree_slotted_suffix_size(node, i);
+}
+
+static BtreeValue btree_slotted_value(const char *node, int i) {
+	BtreeValue value;
+	memcpy(&value, btree_slotted_payload(node, i), sizeof(value));
+	return value;
+}
+
+static BtreePtr btree_slotted_link(const char *node, int link) {
+	return ((const BtreePtr *) (node + BTREE_SLOTTED_LINKS))[link];
+}
+
+static BtreePtr btree_slotted_child(const char *node, int i) {
+	if (i == 0)
+		return btree_slotted_link(node, 0);
+	BtreePtr child;
+	memcpy(&child, btree_slotted_payload(node, i - 1), sizeof(child));
+	return child;
+}
+
+static void btree_slotted_set_prefix_size(char *node, size_t prefix_size) {
+	*(uint16_t *) (node + BTREE_SLOTTED_PREFIX_SIZE) = prefix_size;
+}
+
+static void btree_slotted_set_cells_start(char *node, size_t cells_start) {
+	*(uint32_t *) (node + BTREE_SLOTTED_CELLS_START) = cells_start;
+}
+
+static void btree_slotted_set_link(char *node, int link, BtreePtr ptr) {
+	((BtreePtr *) (node + BTREE_SLOTTED_LINKS))[link] = ptr;
+}
+
+static void btree_slotted_set_value(char *node, int i, BtreeValue value) {
+	memcpy((char *) btree_slotted_payload(node, i), &value, sizeof(value));
+}
 
-	BTREE_MIN_CHILDREN = BTREE_MIN_KEYS + 1,
-	BTREE_MAX_CHILDREN = BTREE_MAX_KEYS + 1
+static int btree_slotted_lower_bound(
+	const char *node, const char *key, size_t key_size, bool *found) {
+
+	// Index of the first key which is >= `key` (or n_items), and whether
+	// it's equal. All the keys start with the prefix, so if `key` doesn't,
+	// it's before or after all of them. Otherwise, only the suffixes have to
+	// be compared.
+	int n_items = btree_node_n_items(node);
+	size_t prefix_size = btree_slotted_prefix_size(node);
+	*found = false;
+	int cmp = memcmp(key, btree_slotted_prefix(node),
+	                 MIN(key_size, prefix_size));
+	if (cmp < 0 || (cmp == 0 && key_size < prefix_size))
+		return 0;
+	if (cmp > 0)
+		return n_items;
+	key += prefix_size;
+	key_size -= prefix_size;
+
+	int low = 0, high = n_items;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (btree_bytes_cmp(btree_slotted_suffix(node, middle),
+		                    btree_slotted_suffix_size(node, middle),
+		                    key, key_size) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*found = low < n_items &&
+		btree_bytes_cmp(btree_slotted_suffix(node, low),
+		                btree_slotted_suffix_size(node, low),
+		                key, key_size) == 0;
+	return low;
+}
+
+static int btree_slotted_find_child(
+	const char *node, const char *key, size_t key_size) {
+
+	// Like btree_node_find_child.
+	bool found;
+	int i_child = btree_slotted_lower_bound(node, key, key_size, &found);
+	return i_child + found;
+}
+
+static bool btree_slotted_valid(const char *node) {
+	int n_items = btree_node_n_items(node);
+	size_t cells_start = btree_slotted_cells_start(node);
+	const uint16_t *slots = btree_slotted_slots(node);
+	if ((size_t) ((const char *) (slots + n_items) - node) > cells_start ||
+	    cells_start > BTREE_MAX_BLOCK_SIZE)
+		return false;
+
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		if (slots[i_item] < cells_start)
+			return false;
+		if (i_item > 0 &&
+		    btree_bytes_cmp(btree_slotted_suffix(node, i_item - 1),
+		                    btree_slotted_suffix_size(node, i_item - 1),
+		                    btree_slotted_suffix(node, i_item),
+		                    btree_slotted_suffix_size(node, i_item)) >= 0)
+			return false;
+	}
+
+	if (!btree_node_is_leaf(node)) {
+		for (int i_child = 0; i_child <= n_items; i_child++) {
+			if (btree_slotted_child(node, i_child) == BTREE_NULL)
+				return false;
+		}
+	}
+	return true;
+}
+
+static size_t btree_bytes_max_key_size(size_t block_size) {
+	// Small enough for a quarter of a node to hold an entry (a slot and a
+	// cell), with some room for padding. Then any overflowing node can be
+	// split in two (see btree_bytes_split_point).
+	size_t max_entry_size = (block_size - BTREE_SLOTTED_PREFIX) / 4;
+	return max_entry_size - 3 * sizeof(uint16_t)
+		- MAX(sizeof(BtreeValue), sizeof(BtreePtr));
+}
+
+typedef struct {
+	// A key of a slotted node, in two parts (the node's prefix and the
+	// cell's suffix), so that it can point into the node.
+	const char *prefix, *suffix;
+	size_t prefix_size, suffix_size;
+	size_t shared; // Bytes in common with the previous entry's key.
+	BtreeValue value; // In a leaf.
+	BtreePtr child; // In an internal node (children[i + 1]).
+} BtreeBytesEntry;
+
+static bool btree_node_valid(const char *node, bool is_root) {
+	if (btree_node_is_slotted(node))
+		return btree_slotted_valid(node);
+
+	int n_items = btree_node_n_items(node);
+	int max_keys = btree_node_max_keys(node);
+	if ((btree_node_kind(node) > BTREE_NODE_PLUS_LEAF &&
+	     btree_node_kind(node) != BTREE_NODE_PACKED_LEAF) ||
+	    n_items > max_keys)
+		return false;
+
+	if (!is_root && n_items < btree_node_min_keys(node))
+		return false;
+
+	if (!btree_node_is_leaf(node)) {
+		for (int i_child = 0; i_child <= n_items; i_child++) {
+			if (btree_node_child(node, i_child) == BTREE_NULL)
+				return false;
+		}
+	}
+
+	// Check that keys are in ascending order.
+	for (int i_item = 1; i_item < n_items; i_item++) {
+		if (btree_key_cmp(btree_node_key(node, i_item - 1),
+		                  btree_node_key(node, i_item)) >= 0)
+			return false;
+	}
+
+	return true;
+}
+
+typedef struct {
+	BtreePtr ptr;
+	uint64_t epoch; // The newest snapshot which may see the block.
+} BtreeRetired;
+
+// The upper levels of the tree, copied into memory (see btree_top_rebuild).
+typedef struct {
+	BtreePtr root; // The tree's root when the copies were made.
+	int n_levels;
+	size_t n_nodes; // 0 if the root is a leaf, or nothing fits.
+	char *nodes; // n_nodes blocks, level by level.
+	BtreePtr *ptrs; // Of the nodes.
+	int *depths;
+	size_t *slots; // Open addressing by ptr: node index + 1, 0 if empty.
+	size_t n_slots; // A power of 2.
+} BtreeTop;
+
+struct Btree { // Typedef'd in the header file.
+	FsFile *file;
+	BtreeSuperblock superblock; // Cache. `n_free` and `end` are only
+	                            // updated from `space` on sync.
+	Space *space;
+
+	// Writers (which may also read the write queue, and everything below)
+	// hold write_lock. Readers hold no locks: they copy nodes from the file,
+	// and start over if a writer got in the way. To tell, every write of a
+	// node happens between two increments of its latch (a version, odd while
+	// the node is being written), and the root they start from is only
+	// changed during the write (see btree_flush_writes).
+	pthread_mutex_t write_lock;
+	uint64_t *latches; // BTREE_N_LATCHES, shared by blocks modulo that.
+	BtreePtr published_root;
+	// Blocks freed by the current operation. They're latched with the
+	// written ones, so readers which got to them start over.
+	BtreePtr *freed_ptrs;
+	size_t n_freed;
+	size_t freed_capacity;
+
+	size_t block_size;
+	BtreeLayout layout;
+	// In each node. The minimum (except in the root) is half of that, or in
+	// a packed leaf, half of max_plain_leaf_keys.
+	int max_leaf_keys;
+	int max_internal_keys;
+	// Packed leaves (BTREE_LAYOUT_PACKED) have room for more items than plain
+	// B+ tree leaves, so they're worked on in buffers of node_size (twice the
+	// block size). Otherwise, it's the block size, and max_plain_leaf_keys is
+	// max_leaf_keys.
+	int max_plain_leaf_keys;
+	size_t node_size;
+
+	// For redistributing the items of two nodes (see btree_compensate).
+	BtreeItem *scratch_items;
+	BtreePtr *scratch_children;
+	// For rebuilding slotted nodes (see btree_bytes_up_pass), and comparing
+	// nodes (see btree_cow_changed). Of node_size.
+	char *scratch_block;
+	BtreeBytesEntry *scratch_entries;
+	size_t *scratch_sizes;
+	char *scratch_key;
+	// For decoding encoded leaves (see btree_pin_node), reused: as many as
+	// have been pinned at once, of node_size. The ones not in use are
+	// decode_buffers[0] to decode_buffers[n_free_decode_buffers - 1].
+	char **decode_buffers;
+	size_t n_decode_buffers;
+	size_t n_free_decode_buffers;
+
+	// Modified nodes are copied into the write queue and submitted as a
+	// single batch at the end of each operation (see btree_flush_writes), so
+	// that e.g. a split costs one submission instead of one system call per
+	// node. The blocks are allocated separately (and reused), so pointers to
+	// them stay valid while more are queued.
+	BtreePtr *queued_ptrs;
+	char **queued_blocks; // Of node_size.
+	char **packed_blocks; // The queued packed leaves, as they're written.
+	size_t n_queued;
+	size_t queue_capacity;
+	// Open addressing by ptr (like BtreeTop's): queue index + 1, 0 if empty.
+	size_t *queue_slots;
+	size_t n_queue_slots; // A power of 2, at least twice queue_capacity.
+
+	// The upper levels (as many levels of internal nodes as fit in
+	// BTREE_TOP_CACHE_SIZE), kept in memory so that going through them takes
+	// no I/O. Writers use the copies as they are (see btree_pin_node), and
+	// update them at the end of each operation (see btree_top_update).
+	// Lookups share top_lock. Built by the first operation after opening the
+	// tree or replaying the log (while top_valid is false).
+	pthread_rwlock_t top_lock;
+	BtreeTop top;
+	bool top_valid;
+
+	// The Bloom filter of the keys (see btree_bloom_stats), or NULL until
+	// one is built. Writers add keys to it in place. Lookups share
+	// bloom_lock, which the rebuild thread (see btree_bloom_thread) takes to
+	// replace the filter. While it's building one (bloom_next), the keys up
+	// to bloom_walked (if bloom_has_walked) are in it, and writers keep
+	// those up to date. The thread waits on bloom_wanted_cond (with
+	// write_lock) for bloom_wanted or bloom_stop.
+	bool bloom_enabled; // Otherwise there's no thread.
+	char *bloom_file_name;
+	pthread_rwlock_t bloom_lock;
+	Bloom *bloom;
+	Bloom *bloom_next;
+	bool bloom_has_walked;
+	BtreeKey bloom_walked;
+	pthread_t bloom_thread;
+	pthread_cond_t bloom_wanted_cond;
+	bool bloom_wanted;
+	bool bloom_stop;
+	BtreeBloomStats bloom_stats; // Counted atomically.
+
+	// Write-ahead logging (see btree_attach_wal). NULL if it's off.
+	Wal *wal;
+	uint8_t wal_id;
+	BtreePtr logged_root; // As of the last logged transaction.
+
+	// Open snapshots, newest first. While there are any, the blocks they may
+	// see aren't modified in place (see btree_cow_relocate) or freed. Those
+	// are all blocks but the ones allocated since the newest snapshot was
+	// taken, which are marked in fresh_map.
+	BtreeSnapshot *snapshots;
+	uint64_t snapshot_epoch; // Of the newest snapshot.
+	uint64_t *fresh_map;
+	size_t fresh_map_capacity; // In words.
+	BtreeRetired *retired; // Blocks replaced or freed while snapshots were
+	                       // open.
+	size_t n_retired;
+	size_t retired_capacity;
+
+	// Compaction in progress (see btree_compact): the next node to move is
+	// the first one at compact_depth whose keys are past compact_fence (or
+	// the first one at that depth, without a fence), and it goes to
+	// compact_next. That's BTREE_NULL if there's no compaction.
+	BtreePtr compact_next;
+	int compact_depth;
+	BtreeKey compact_fence;
+	bool compact_has_fence;
+	bool shrink_pending; // The file shrinks on the next sync.
 };
 
-// The first block (address 0) of the B-tree's file is the superblock (which
-// stores metadata).
-typedef struct {
-	BtreePtr root;
-	BtreePtr free_list_head;
-	BtreePtr end; // Number of used blocks.
-} BtreeSuperblock;
+struct BtreeSnapshot { // Typedef'd in the header file.
+	Btree *btree;
+	BtreePtr root;
+	uint64_t epoch;
+	BtreeSnapshot *next;
+};
+
+// Records in the write-ahead log. Blocks are logged whole, so replaying the
+// log more than once (after crashes during recovery) is harmless.
+typedef enum {
+	BTREE_WAL_BLOCK, // Arg: the block. Bytes: its new contents.
+	BTREE_WAL_ROOT, // Arg: the new root.
+	BTREE_WAL_ALLOC, // Arg: the allocated block.
+	BTREE_WAL_FREE, // Arg: the freed block.
+	BTREE_WAL_SNAPSHOT, // Arg: the root. Bytes: the space snapshot.
+	BTREE_WAL_SHRINK // See space_shrink.
+} BtreeWalRecord;
+
+#define DESERIALIZE(ptr, dest, type) \
+	do { \
+		(dest) = *(const type *) (ptr); \
+		(ptr) = (const char *) (ptr) + sizeof(type); \
+	} while (false)
+
+#define SERIALIZE(ptr, src, type) \
+	do { \
+		*(type *) (ptr) = (src); \
+		(ptr) = (char *) (ptr) + sizeof(type); \
+	} while (false)
+
+static bool btree_read_superblock(FsFile *file, BtreeSuperblock *superblock) {
+	// Returns false if the file doesn't contain a B-tree (in this format).
+
+	// The block size isn't known yet, so read as much as is surely in the
+	// file, and is a valid size for O_DIRECT (the file's size is aligned in
+	// that case).
+	size_t n_bytes = MIN(fs_size(file), (FsOffset) FS_DIRECT_ALIGNMENT);
+	if (n_bytes < BTREE_MIN_BLOCK_SIZE)
+		return false;
+	char *block = fs_alloc_buffer(n_bytes); // Aligned for O_DIRECT.
+	fs_read(file, block, 0, n_bytes);
+	const void *pos = block;
+
+	uint64_t magic;
+	uint32_t version;
+	DESERIALIZE(pos, magic, uint64_t);
+	DESERIALIZE(pos, version, uint32_t);
+	DESERIALIZE(pos, superblock->root, BtreePtr);
+	DESERIALIZE(pos, superblock->n_free, BtreePtr);
+	DESERIALIZE(pos, superblock->end, BtreePtr);
+	DESERIALIZE(pos, superblock->block_size, BtreePtr);
+	DESERIALIZE(pos, superblock->layout, uint32_t); // 0 in old files.
+	free(block);
+
+	return magic == BTREE_MAGIC && version == BTREE_VERSION &&
+		superblock->block_size >= BTREE_MIN_BLOCK_SIZE &&
+		superblock->block_size <= BTREE_MAX_BLOCK_SIZE &&
+		(superblock->block_size & (superblock->block_size - 1)) == 0 &&
+		superblock->layout <= BTREE_LAYOUT_PACKED &&
+		superblock->root < superblock->end &&
+		superblock->end * superblock->block_size <= fs_size(file);
+}
+
+static void btree_write_superblock(Btree *btree) {
+	char *block = fs_alloc_buffer(btree->block_size); // Aligned for O_DIRECT.
+	char *end = block;
+	SERIALIZE(end, BTREE_MAGIC, uint64_t);
+	SERIALIZE(end, BTREE_VERSION, uint32_t);
+	SERIALIZE(end, btree->superblock.root, BtreePtr);
+	SERIALIZE(end, btree->superblock.n_free, BtreePtr);
+	SERIALIZE(end, btree->superblock.end, BtreePtr);
+	SERIALIZE(end, btree->superblock.block_size, BtreePtr);
+	SERIALIZE(end, btree->superblock.layout, uint32_t);
+	memset(end, 0, btree->block_size - (end - block));
+	fs_write(btree->file, block, 0, btree->block_size);
+	free(block);
+}
+
+static bool btree_is_bplus(const Btree *btree) {
+	// Packed trees are B+ trees too.
+	return btree->layout == BTREE_LAYOUT_BPLUS ||
+		btree->layout == BTREE_LAYOUT_PACKED;
+}
+
+static bool btree_leaf_fits(Btree *btree, const char *node) {
+	// Whether the node can be written to its block. Only a packed leaf with
+	// more items than a plain one can hold may not, if it doesn't pack small
+	// enough.
+	if (btree_node_kind(node) != BTREE_NODE_PACKED_LEAF ||
+	    btree_node_n_items(node) <= btree->max_plain_leaf_keys)
+		return true;
+	BtreePackedStats stats = btree_packed_stats(node);
+	return btree_packed_size(&stats) <= btree->block_size;
+}
+
+static size_t btree_queue_home(const Btree *btree, BtreePtr ptr) {
+	return ptr * UINT64_C(0x9E3779B97F4A7C15) & (btree->n_queue_slots - 1);
+}
+
+static size_t btree_queue_slot(const Btree *btree, BtreePtr ptr) {
+	// The slot of the block's queued write, or the empty one where it would
+	// go. (A batch, see btree_set_batch, queues many leaves.)
+	size_t mask = btree->n_queue_slots - 1;
+	size_t slot = btree_queue_home(btree, ptr);
+	while (btree->queue_slots[slot] != 0 &&
+	       btree->queued_ptrs[btree->queue_slots[slot] - 1] != ptr)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+static void btree_queue_clear_slot(Btree *btree, size_t slot) {
+	// Empty the slot, and move back the entries after it which would no
+	// longer be found from their home slots.
+	size_t mask = btree->n_queue_slots - 1;
+	btree->queue_slots[slot] = 0;
+	for (size_t next = (slot + 1) & mask; btree->queue_slots[next] != 0;
+	     next = (next + 1) & mask) {
+		size_t home = btree_queue_home(
+			btree, btree->queued_ptrs[btree->queue_slots[next] - 1]);
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			btree->queue_slots[slot] = btree->queue_slots[next];
+			btree->queue_slots[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+static void btree_queue_rehash(Btree *btree) {
+	// After the queued ptrs change.
+	memset(btree->queue_slots, 0,
+	       btree->n_queue_slots * sizeof(*btree->queue_slots));
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		btree->queue_slots[btree_queue_slot(
+			btree, btree->queued_ptrs[i])] = i + 1;
+	}
+}
+
+static char *btree_find_queued(Btree *btree, BtreePtr ptr) {
+	if (btree->n_queued == 0)
+		return NULL;
+	size_t i = btree->queue_slots[btree_queue_slot(btree, ptr)];
+	return i != 0 ? btree->queued_blocks[i - 1] : NULL;
+}
+
+static bool btree_is_root(Btree *btree, BtreePtr ptr) {
+	// Of the tree, or of a snapshot.
+	if (ptr == btree->superblock.root)
+		return true;
+	for (BtreeSnapshot *snapshot = btree->snapshots; snapshot != NULL;
+	     snapshot = snapshot->next) {
+		if (ptr == snapshot->root)
+			return true;
+	}
+	return false;
+}
+
+static size_t btree_top_find(const BtreeTop *top, BtreePtr ptr) {
+	// The index of the node's copy, or SIZE_MAX if there isn't one.
+	if (top->n_slots == 0)
+		return SIZE_MAX;
+	size_t mask = top->n_slots - 1;
+	for (size_t slot = ptr * UINT64_C(0x9E3779B97F4A7C15) & mask;
+	     top->slots[slot] != 0; slot = (slot + 1) & mask) {
+		size_t i = top->slots[slot] - 1;
+		if (top->ptrs[i] == ptr)
+			return i;
+	}
+	return SIZE_MAX;
+}
+
+static char *btree_top_node(Btree *btree, size_t i) {
+	return btree->top.nodes + i * btree->block_size;
+}
+
+static char *btree_take_decode_buffer(Btree *btree) {
+	if (btree->n_free_decode_buffers > 0)
+		return btree->decode_buffers[--btree->n_free_decode_buffers];
+	btree->n_decode_buffers++;
+	btree->decode_buffers = realloc(
+		btree->decode_buffers,
+		btree->n_decode_buffers * sizeof(*btree->decode_buffers));
+	char *buffer = malloc(btree->node_size);
+	xassert(1, btree->decode_buffers != NULL && buffer != NULL);
+	return buffer;
+}
+
+static const char *btree_pin_node(Btree *btree, BtreePtr ptr) {
+	// The node's block, straight from the buffer pool (or the mapping), or
+	// from the write queue if the current operation has modified the node,
+	// or the copy of an upper level. Release it with btree_unpin_node.
+	// Encoded leaves are decoded into a buffer of their own (reused by the
+	// next pins once they're unpinned).
+	const char *node = btree_find_queued(btree, ptr);
+	if (node == NULL) {
+		size_t i_top = btree_top_find(&btree->top, ptr);
+		node = i_top != SIZE_MAX ? btree_top_node(btree, i_top)
+			: fs_pin(btree->file, ptr * btree->block_size, btree->block_size,
+			         false);
+	}
+	if (btree_node_kind(node) == BTREE_NODE_ENCODED_LEAF) {
+		char *unpacked = btree_take_decode_buffer(btree);
+		btree_unpack_leaf(node, unpacked, btree->max_leaf_keys);
+		fs_unpin(btree->file, ptr * btree->block_size, false);
+		node = unpacked;
+	}
+	xassert(2, btree_node_valid(node, btree_is_root(btree, ptr)));
+	return node;
+}
+
+static void btree_unpin_node(Btree *btree, BtreePtr ptr, const char *node) {
+	if (node == btree_find_queued(btree, ptr) ||
+	    btree_top_find(&btree->top, ptr) != SIZE_MAX)
+		return;
+	if (btree_node_kind(node) == BTREE_NODE_PACKED_LEAF) {
+		// Decoded by btree_pin_node.
+		btree->decode_buffers[btree->n_free_decode_buffers++] = (char *) node;
+	} else
+		fs_unpin(btree->file, ptr * btree->block_size, false);
+}
+
+static void btree_copy_node(Btree *btree, char *dest, const char *node) {
+	// Into a buffer of node_size. A packed tree's plain leaves become packed
+	// ones.
+	if (btree->layout == BTREE_LAYOUT_PACKED &&
+	    btree_node_kind(node) == BTREE_NODE_PLUS_LEAF)
+		btree_unpack_leaf(node, dest, btree->max_leaf_keys);
+	else if (btree_node_kind(node) == BTREE_NODE_PACKED_LEAF)
+		memcpy(dest, node, btree->node_size);
+	else
+		memcpy(dest, node, btree->block_size);
+}
+
+static char *btree_queue_block(Btree *btree, BtreePtr ptr) {
+	// Returns the buffer for the block's queued write.
+
+	char *queued = btree_find_queued(btree, ptr);
+	if (queued != NULL)
+		return queued;
+
+	if (btree->n_queued == btree->queue_capacity) {
+		size_t new_capacity = MAX(8, btree->queue_capacity * 2);
+		btree->queued_ptrs = realloc(
+			btree->queued_ptrs, new_capacity * sizeof(*btree->queued_ptrs));
+		btree->queued_blocks = realloc(
+			btree->queued_blocks,
+			new_capacity * sizeof(*btree->queued_blocks));
+		btree->packed_blocks = realloc(
+			btree->packed_blocks,
+			new_capacity * sizeof(*btree->packed_blocks));
+		xassert(1, btree->queued_ptrs != NULL &&
+		        btree->queued_blocks != NULL && btree->packed_blocks != NULL);
+
+		for (size_t i = btree->queue_capacity; i < new_capacity; i++) {
+			// Aligned for O_DIRECT.
+			btree->queued_blocks[i] = fs_alloc_buffer(btree->node_size);
+			btree->packed_blocks[i] = btree->layout == BTREE_LAYOUT_PACKED
+				? fs_alloc_buffer(btree->block_size) : NULL;
+		}
+		btree->queue_capacity = new_capacity;
+
+		btree->n_queue_slots = 2 * new_capacity;
+		btree->queue_slots = realloc(
+			btree->queue_slots,
+			btree->n_queue_slots * sizeof(*btree->queue_slots));
+		xassert(1, btree->queue_slots != NULL);
+		btree_queue_rehash(btree);
+	}
+
+	btree->queue_slots[btree_queue_slot(btree, ptr)] = btree->n_queued + 1;
+	btree->queued_ptrs[btree->n_queued] = ptr;
+	return btree->queued_blocks[btree->n_queued++];
+}
+
+static char *btree_modify_node(Btree *btree, BtreePtr ptr) {
+	// A writable copy of the node's block in the write queue.
+
+	char *queued = btree_find_queued(btree, ptr);
+	if (queued != NULL)
+		return queued;
+
+	const char *node = btree_pin_node(btree, ptr);
+	queued = btree_queue_block(btree, ptr);
+	btree_copy_node(btree, queued, node);
+	btree_unpin_node(btree, ptr, node);
+	return queued;
+}
+
+static char *btree_init_node(Btree *btree, BtreePtr ptr, bool is_leaf) {
+	// Queue an empty node to be written to a newly allocated block.
+	char *node = btree_queue_block(btree, ptr);
+	memset(node, 0xFF, btree->node_size); // All children are BTREE_NULL.
+	bool plus = btree_is_bplus(btree);
+	if (btree->layout == BTREE_LAYOUT_BYTES) {
+		btree_node_set_kind(node, is_leaf ? BTREE_NODE_SLOTTED_LEAF
+		                    : BTREE_NODE_SLOTTED_INTERNAL);
+		btree_slotted_set_prefix_size(node, 0);
+		btree_slotted_set_cells_start(node, btree->block_size);
+	} else if (is_leaf && btree->layout == BTREE_LAYOUT_PACKED) {
+		btree_node_set_kind(node, BTREE_NODE_PACKED_LEAF);
+		btree_node_set_max_keys(node, btree->max_leaf_keys);
+	} else if (is_leaf) {
+		btree_node_set_kind(
+			node, plus ? BTREE_NODE_PLUS_LEAF : BTREE_NODE_LEAF);
+		btree_node_set_max_keys(node, btree->max_leaf_keys);
+	} else {
+		btree_node_set_kind(
+			node, plus ? BTREE_NODE_PLUS_INTERNAL : BTREE_NODE_INTERNAL);
+		btree_node_set_max_keys(node, btree->max_internal_keys);
+	}
+	btree_node_set_n_items(node, 0);
+	return node;
+}
+
+static uint64_t *btree_latch(Btree *btree, BtreePtr ptr) {
+	return &btree->latches[ptr % BTREE_N_LATCHES];
+}
+
+static void btree_latch_acquire(Btree *btree, BtreePtr ptr) {
+	// By the writer. A latch can be shared with a block that's already
+	// latched.
+	uint64_t *latch = btree_latch(btree, ptr);
+	if (*latch % 2 == 0)
+		__atomic_store_n(latch, *latch + 1, __ATOMIC_RELAXED);
+}
+
+static void btree_latch_release(Btree *btree, BtreePtr ptr) {
+	uint64_t *latch = btree_latch(btree, ptr);
+	if (*latch % 2 == 1)
+		__atomic_store_n(latch, *latch + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t btree_latch_wait(Btree *btree, BtreePtr ptr) {
+	// The block's version, once it isn't being written.
+	uint64_t *latch = btree_latch(btree, ptr);
+	uint64_t version;
+	while ((version = __atomic_load_n(latch, __ATOMIC_ACQUIRE)) % 2 == 1)
+		sched_yield();
+	return version;
+}
+
+static bool btree_latch_unchanged(
+	Btree *btree, BtreePtr ptr, uint64_t version) {
+
+	// Whether the block hasn't been written since btree_latch_wait returned
+	// `version` -- if so, what was read from it meanwhile is consistent.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(btree_latch(btree, ptr), __ATOMIC_RELAXED) ==
+		version;
+}
+
+static void btree_top_rebuild(Btree *btree);
+
+static void btree_begin(Btree *btree) {
+	// Start a transaction (before the operation changes anything), and keep
+	// other writers out until btree_end. The log comes first (see wal.h).
+	if (btree->wal != NULL)
+		wal_begin(btree->wal);
+	pthread_mutex_lock(&btree->write_lock);
+	if (!btree->top_valid)
+		btree_top_rebuild(btree);
+}
+
+static void btree_log(
+	Btree *btree, BtreeWalRecord type, uint64_t arg,
+	const void *bytes, size_t n_bytes) {
+
+	if (btree->wal != NULL)
+		wal_append(btree->wal, btree->wal_id, type, arg, bytes, n_bytes);
+}
+
+static BtreePtr btree_top_child(const char *node, int i) {
+	return btree_node_is_slotted(node) ? btree_slotted_child(node, i)
+		: btree_node_child(node, i);
+}
+
+static void btree_top_free(BtreeTop *top) {
+	free(top->nodes);
+	free(top->ptrs);
+	free(top->depths);
+	free(top->slots);
+	*top = (BtreeTop) {.root = BTREE_NULL};
+}
+
+static void btree_top_rebuild(Btree *btree) {
+	// Copy the internal nodes level by level, from the root down, while the
+	// levels fit. The nodes come from btree_pin_node, so this also works at
+	// the end of an operation, before the write queue is cleared (and mostly
+	// copies the old copies).
+	size_t max_nodes = BTREE_TOP_CACHE_SIZE / btree->block_size;
+	BtreeTop top = {.root = btree->superblock.root};
+	size_t capacity = 0;
+	size_t n_nodes = 0; // Including the next level.
+	size_t level_start = 0;
+	if (max_nodes > 0) {
+		capacity = 16;
+		top.ptrs = malloc(capacity * sizeof(*top.ptrs));
+		xassert(1, top.ptrs != NULL);
+		top.ptrs[n_nodes++] = top.root;
+	}
+	while (level_start < n_nodes) {
+		size_t level_end = n_nodes;
+		top.nodes = realloc(top.nodes, level_end * btree->block_size);
+		top.depths = realloc(top.depths, level_end * sizeof(*top.depths));
+		xassert(1, top.nodes != NULL && top.depths != NULL);
+
+		// The tree is balanced, so a level is all leaves or none.
+		bool is_leaf = false;
+		size_t n_children = 0;
+		for (size_t i = level_start; i < level_end && !is_leaf; i++) {
+			const char *node = btree_pin_node(btree, top.ptrs[i]);
+			is_leaf = btree_node_is_leaf(node);
+			memcpy(top.nodes + i * btree->block_size, node,
+			       btree->block_size);
+			top.depths[i] = top.n_levels;
+			n_children += btree_node_n_items(node) + 1;
+			btree_unpin_node(btree, top.ptrs[i], node);
+		}
+		if (is_leaf) {
+			n_nodes = level_start;
+			break;
+		}
+		top.n_levels++;
+
+		// The next level, if it fits.
+		if (level_end + n_children > max_nodes)
+			break;
+		if (level_end + n_children > capacity) {
+			capacity = MAX(capacity * 2, level_end + n_children);
+			top.ptrs = realloc(top.ptrs, capacity * sizeof(*top.ptrs));
+			xassert(1, top.ptrs != NULL);
+		}
+		for (size_t i = level_start; i < level_end; i++) {
+			const char *node = top.nodes + i * btree->block_size;
+			for (int i_child = 0; i_child <= btree_node_n_items(node);
+			     i_child++)
+				top.ptrs[n_nodes++] = btree_top_child(node, i_child);
+		}
+		level_start = level_end;
+	}
+	top.n_nodes = n_nodes;
+
+	if (n_nodes > 0) {
+		top.n_slots = 16;
+		while (top.n_slots < 2 * n_nodes)
+			top.n_slots *= 2;
+		top.slots = calloc(top.n_slots, sizeof(*top.slots));
+		xassert(1, top.slots != NULL);
+		for (size_t i = 0; i < n_nodes; i++) {
+			size_t mask = top.n_slots - 1;
+			size_t slot = top.ptrs[i] * UINT64_C(0x9E3779B97F4A7C15) & mask;
+			while (top.slots[slot] != 0)
+				slot = (slot + 1) & mask;
+			top.slots[slot] = i + 1;
+		}
+	}
+
+	pthread_rwlock_wrlock(&btree->top_lock);
+	BtreeTop old_top = btree->top;
+	btree->top = top;
+	pthread_rwlock_unlock(&btree->top_lock);
+	btree_top_free(&old_top);
+	__atomic_store_n(&btree->top_valid, true, __ATOMIC_RELEASE);
+}
+
+static void btree_top_invalidate(Btree *btree) {
+	pthread_rwlock_wrlock(&btree->top_lock);
+	btree_top_free(&btree->top);
+	pthread_rwlock_unlock(&btree->top_lock);
+	__atomic_store_n(&btree->top_valid, false, __ATOMIC_RELEASE);
+}
+
+static void btree_top_update(Btree *btree) {
+	// At the end of an operation (after its writes): copy the modified nodes
+	// over their copies. If the upper levels changed shape -- a new root, or
+	// a freed node, or a modified one with children in the copies, which may
+	// have been split or merged -- make the copies anew.
+	if (!btree->top_valid)
+		return;
+	bool rebuild = btree->superblock.root != btree->top.root;
+	for (size_t i = 0; i < btree->n_freed && !rebuild; i++)
+		rebuild = btree_top_find(&btree->top, btree->freed_ptrs[i]) !=
+			SIZE_MAX;
+	for (size_t i = 0; i < btree->n_queued && !rebuild; i++) {
+		size_t i_top = btree_top_find(&btree->top, btree->queued_ptrs[i]);
+		rebuild = i_top != SIZE_MAX &&
+			btree->top.depths[i_top] < btree->top.n_levels - 1;
+	}
+	if (rebuild) {
+		btree_top_rebuild(btree);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&btree->top_lock);
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		size_t i_top = btree_top_find(&btree->top, btree->queued_ptrs[i]);
+		if (i_top != SIZE_MAX) {
+			memcpy(btree_top_node(btree, i_top), btree->queued_blocks[i],
+			       btree->block_size);
+		}
+	}
+	pthread_rwlock_unlock(&btree->top_lock);
+}
+
+static void btree_cow_relocate(Btree *btree);
+
+static const char *btree_written_block(Btree *btree, size_t i_queued) {
+	// What's written for a queued node (packed by btree_flush_writes).
+	const char *node = btree->queued_blocks[i_queued];
+	return btree_node_kind(node) == BTREE_NODE_PACKED_LEAF
+		? btree->packed_blocks[i_queued] : node;
+}
+
+static void btree_flush_writes(Btree *btree) {
+	// With write-ahead logging, this also commits the operation's
+	// transaction -- before any of it reaches the buffer pool, which may
+	// write it back at any time.
+	if (btree->snapshots != NULL)
+		btree_cow_relocate(btree);
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		if (btree_node_kind(btree->queued_blocks[i]) ==
+		    BTREE_NODE_PACKED_LEAF)
+			btree_pack_leaf(btree->queued_blocks[i], btree->packed_blocks[i],
+			                btree->block_size, btree->max_plain_leaf_keys);
+	}
+	if (btree->wal != NULL) {
+		for (size_t i = 0; i < btree->n_queued; i++) {
+			btree_log(btree, BTREE_WAL_BLOCK, btree->queued_ptrs[i],
+			          btree_written_block(btree, i), btree->block_size);
+		}
+		if (btree->superblock.root != btree->logged_root) {
+			btree_log(btree, BTREE_WAL_ROOT, btree->superblock.root, NULL, 0);
+			btree->logged_root = btree->superblock.root;
+		}
+		wal_commit(btree->wal);
+	}
+
+	// Readers see the new root once the nodes are written, and if they read
+	// any of the nodes (or the freed blocks) meanwhile, they start over.
+	for (size_t i = 0; i < btree->n_queued; i++)
+		btree_latch_acquire(btree, btree->queued_ptrs[i]);
+	for (size_t i = 0; i < btree->n_freed; i++)
+		btree_latch_acquire(btree, btree->freed_ptrs[i]);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (btree->n_queued > 0) {
+		FsRequest *requests = malloc(btree->n_queued * sizeof(*requests));
+		xassert(1, requests != NULL);
+		for (size_t i = 0; i < btree->n_queued; i++) {
+			xassert(2, btree_node_valid(
+				btree->queued_blocks[i],
+				btree_is_root(btree, btree->queued_ptrs[i])));
+			requests[i].write = true;
+			requests[i].buf = (void *) btree_written_block(btree, i);
+			requests[i].offset = btree->queued_ptrs[i] * btree->block_size;
+			requests[i].n_bytes = btree->block_size;
+		}
+		fs_submit_batch(btree->file, requests, btree->n_queued);
+		fs_wait(btree->file);
+		free(requests);
+	}
+
+	btree_top_update(btree);
+	__atomic_store_n(&btree->published_root, btree->superblock.root,
+	                 __ATOMIC_RELEASE);
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		btree_latch_release(btree, btree->queued_ptrs[i]);
+		btree_queue_clear_slot(
+			btree, btree_queue_slot(btree, btree->queued_ptrs[i]));
+	}
+	for (size_t i = 0; i < btree->n_freed; i++)
+		btree_latch_release(btree, btree->freed_ptrs[i]);
+	btree->n_queued = 0;
+	btree->n_freed = 0;
+}
+
+static bool btree_bloom_walked(Btree *btree, BtreeKey key) {
+	// Whether the key is in the part of the tree that the rebuild thread has
+	// added to bloom_next.
+	return btree->bloom_has_walked &&
+		btree_key_cmp(key, btree->bloom_walked) <= 0;
+}
+
+static void btree_bloom_add(Btree *btree, BtreeKey key) {
+	// A key was added to the tree (by a writer). Before the new nodes are
+	// written, so that no lookup can find the key but not the filter's bits.
+	if (btree->bloom != NULL)
+		bloom_add(btree->bloom, key);
+	if (btree->bloom_next != NULL && btree_bloom_walked(btree, key))
+		bloom_add(btree->bloom_next, key);
+}
+
+static void btree_bloom_remove(Btree *btree, BtreeKey key) {
+	if (btree->bloom != NULL)
+		bloom_count_removed(btree->bloom);
+	if (btree->bloom_next != NULL && btree_bloom_walked(btree, key))
+		bloom_count_removed(btree->bloom_next);
+}
+
+static void btree_bloom_request(Btree *btree) {
+	// Wake the rebuild thread if the filter needs rebuilding (see
+	// btree_bloom_stats). With write_lock held.
+	if (!btree->bloom_enabled || btree->bloom_next != NULL ||
+	    btree->bloom_wanted)
+		return;
+	Bloom *bloom = btree->bloom;
+	if (bloom == NULL ||
+	    bloom_n_keys(bloom) + bloom_n_stale(bloom) > bloom_capacity(bloom) ||
+	    bloom_n_stale(bloom) > bloom_n_keys(bloom)) {
+		btree->bloom_wanted = true;
+		pthread_cond_signal(&btree->bloom_wanted_cond);
+	}
+}
+
+static void btree_bloom_replace(Btree *btree, Bloom *bloom) {
+	// Lookups may be using the old filter, so wait for them.
+	pthread_rwlock_wrlock(&btree->bloom_lock);
+	Bloom *old = btree->bloom;
+	btree->bloom = bloom;
+	pthread_rwlock_unlock(&btree->bloom_lock);
+	if (old != NULL)
+		bloom_destroy(old);
+}
+
+static void btree_bloom_rebuild(Btree *btree) {
+	// Add the keys to bloom_next, BTREE_BLOOM_REBUILD_STEP at a time, each
+	// step with a cursor (which keeps writers out only for its duration),
+	// then put it in place of the filter. If there are more keys than it has
+	// room for, start over with a bigger one.
+	while (true) {
+		BtreeCursor *cursor = btree_cursor_seek(
+			btree, btree->bloom_has_walked ? btree->bloom_walked : 0);
+		if (btree->bloom_stop) {
+			bloom_destroy(btree->bloom_next);
+			btree->bloom_next = NULL;
+			btree_cursor_close(cursor);
+			return;
+		}
+
+		BtreeKey key;
+		BtreeValue value;
+		if (btree->bloom_has_walked && btree_cursor_get(cursor, &key, &value) &&
+		    btree_key_cmp(key, btree->bloom_walked) == 0)
+			btree_cursor_next(cursor);
+		for (int i = 0; i < BTREE_BLOOM_REBUILD_STEP &&
+		     btree_cursor_get(cursor, &key, &value); i++) {
+			bloom_add(btree->bloom_next, key);
+			btree->bloom_has_walked = true;
+			btree->bloom_walked = key;
+			btree_cursor_next(cursor);
+		}
+
+		Bloom *next = btree->bloom_next;
+		bool done = !btree_cursor_get(cursor, &key, &value);
+		if (bloom_n_keys(next) > bloom_capacity(next)) {
+			btree->bloom_next = bloom_new(
+				2 * bloom_capacity(next), BTREE_BLOOM_BITS_PER_KEY);
+			btree->bloom_has_walked = false;
+			bloom_destroy(next);
+		} else if (done) {
+			btree->bloom_next = NULL;
+			btree_bloom_replace(btree, next);
+			__atomic_fetch_add(&btree->bloom_stats.n_rebuilds, 1,
+			                   __ATOMIC_RELAXED);
+			btree_cursor_close(cursor);
+			return;
+		}
+		btree_cursor_close(cursor);
+	}
+}
+
+static void *btree_bloom_thread(void *btree_void) {
+	// Rebuild the filter whenever btree_bloom_request asks for it, with room
+	// for twice the keys in the old one.
+	Btree *btree = btree_void;
+	pthread_mutex_lock(&btree->write_lock);
+	while (true) {
+		while (!btree->bloom_wanted && !btree->bloom_stop)
+			pthread_cond_wait(&btree->bloom_wanted_cond, &btree->write_lock);
+		if (btree->bloom_stop)
+			break;
+		btree->bloom_wanted = false;
+		uint64_t capacity = BTREE_BLOOM_MIN_KEYS;
+		if (btree->bloom != NULL)
+			capacity = MAX(capacity, 2 * bloom_n_keys(btree->bloom));
+		btree->bloom_next = bloom_new(capacity, BTREE_BLOOM_BITS_PER_KEY);
+		btree->bloom_has_walked = false;
+		pthread_mutex_unlock(&btree->write_lock);
+
+		btree_bloom_rebuild(btree);
+		pthread_mutex_lock(&btree->write_lock);
+	}
+	pthread_mutex_unlock(&btree->write_lock);
+	return NULL;
+}
+
+static void btree_bloom_open(
+	Btree *btree, const char *file_name, bool create) {
+
+	// Start with an empty filter (for a new tree), or the saved one. The
+	// saved one is out of date once the tree changes, so the file is emptied
+	// until the tree is closed (and the filter rebuilt if the program
+	// crashes first).
+	if (BTREE_BLOOM_BITS_PER_KEY == 0 || btree->layout == BTREE_LAYOUT_BYTES)
+		return;
+	btree->bloom_enabled = true;
+	const char SUFFIX[] = ".bloom";
+	btree->bloom_file_name = malloc(strlen(file_name) + sizeof(SUFFIX));
+	xassert(1, btree->bloom_file_name != NULL);
+	strcpy(btree->bloom_file_name, file_name);
+	strcat(btree->bloom_file_name, SUFFIX);
+
+	FsFile *file = fs_open(btree->bloom_file_name, create, FS_MODE_BUFFERED);
+	if (create) {
+		btree->bloom = bloom_new(BTREE_BLOOM_MIN_KEYS,
+		                         BTREE_BLOOM_BITS_PER_KEY);
+	} else {
+		btree->bloom = bloom_load(file);
+		fs_set_size(file, 0);
+	}
+	fs_sync(file);
+	fs_close(file);
+
+	int create_result = pthread_create(&btree->bloom_thread, NULL,
+	                                   btree_bloom_thread, btree);
+	xassert(1, create_result == 0);
+}
+
+static void btree_bloom_close(Btree *btree) {
+	// Stop the thread (abandoning a rebuild), and save the filter.
+	if (!btree->bloom_enabled)
+		return;
+	pthread_mutex_lock(&btree->write_lock);
+	btree->bloom_stop = true;
+	pthread_cond_signal(&btree->bloom_wanted_cond);
+	pthread_mutex_unlock(&btree->write_lock);
+	int join_result = pthread_join(btree->bloom_thread, NULL);
+	xassert(1, join_result == 0);
+
+	FsFile *file = fs_open(btree->bloom_file_name, true, FS_MODE_BUFFERED);
+	if (btree->bloom != NULL) {
+		bloom_save(btree->bloom, file);
+		fs_sync(file);
+	}
+	fs_close(file);
+}
+
+static void btree_end(Btree *btree) {
+	// Finish the operation started by btree_begin.
+	btree_flush_writes(btree);
+	btree_bloom_request(btree);
+	pthread_mutex_unlock(&btree->write_lock);
+}
+
+static void btree_sync(Btree *btree) {
+	space_save(btree->space);
+	btree->superblock.n_free = space_n_free(btree->space);
+	btree->superblock.end = space_end(btree->space);
+	btree_write_superblock(btree);
+	fs_sync(btree->file);
+	if (btree->shrink_pending) {
+		space_truncate(btree->space);
+		btree->shrink_pending = false;
+	}
+}
+
+static Btree *btree_init(
+	FsFile *file, size_t block_size, BtreeLayout layout) {
+
+	// The part of opening the tree that's common to btree_new and btree_open.
+
+	Btree *btree = malloc(sizeof(*btree));
+	xassert(1, btree != NULL);
+
+	btree->block_size = block_size;
+	btree->layout = layout;
+	bool plus = btree_is_bplus(btree);
+	btree->max_leaf_keys = btree_max_keys(
+		block_size, plus ? BTREE_NODE_PLUS_LEAF : BTREE_NODE_LEAF);
+	btree->max_internal_keys = btree_max_keys(
+		block_size, plus ? BTREE_NODE_PLUS_INTERNAL : BTREE_NODE_INTERNAL);
+	btree->max_plain_leaf_keys = btree->max_leaf_keys;
+	btree->node_size = block_size;
+	if (layout == BTREE_LAYOUT_PACKED) {
+		// Few enough that a packed leaf with an item more can always be
+		// split into two plain ones (see btree_set_up_pass).
+		btree->max_leaf_keys = 2 * btree->max_plain_leaf_keys - 2;
+		btree->node_size = 2 * block_size;
+	}
+	btree->scratch_block = malloc(btree->node_size);
+	btree->scratch_entries = NULL;
+	btree->scratch_sizes = NULL;
+	btree->scratch_key = NULL;
+	btree->decode_buffers = NULL;
+	btree->n_decode_buffers = 0;
+	btree->n_free_decode_buffers = 0;
+	if (layout == BTREE_LAYOUT_BYTES) {
+		// Slotted nodes have no fixed capacity, but each entry takes at
+		// least a slot and a cell with an empty suffix.
+		size_t max_entries = (block_size - BTREE_SLOTTED_PREFIX) /
+			(2 * sizeof(uint16_t) + MIN(sizeof(BtreeValue), sizeof(BtreePtr)))
+			+ 2;
+		btree->scratch_entries = malloc(
+			max_entries * sizeof(*btree->scratch_entries));
+		btree->scratch_sizes = malloc(
+			(max_entries + 1) * sizeof(*btree->scratch_sizes));
+		btree->scratch_key = malloc(btree_bytes_max_key_size(block_size));
+		xassert(1, btree->scratch_entries != NULL &&
+		        btree->scratch_sizes != NULL && btree->scratch_key != NULL);
+	}
+	int max_keys = MAX(btree->max_leaf_keys, btree->max_internal_keys);
+	btree->scratch_items = malloc(
+		(max_keys * 2 + 2) * sizeof(*btree->scratch_items));
+	btree->scratch_children = malloc(
+		(max_keys * 2 + 3) * sizeof(*btree->scratch_children));
+	xassert(1, btree->scratch_items != NULL &&
+	        btree->scratch_children != NULL && btree->scratch_block != NULL);
+
+	btree->queued_ptrs = NULL;
+	btree->queued_blocks = NULL;
+	btree->packed_blocks = NULL;
+	btree->n_queued = 0;
+	btree->queue_capacity = 0;
+	btree->queue_slots = NULL;
+	btree->n_queue_slots = 0;
+
+	int lock_result = pthread_mutex_init(&btree->write_lock, NULL);
+	xassert(1, lock_result == 0);
+	btree->latches = calloc(BTREE_N_LATCHES, sizeof(*btree->latches));
+	xassert(1, btree->latches != NULL);
+	btree->published_root = BTREE_NULL;
+	btree->freed_ptrs = NULL;
+	btree->n_freed = 0;
+	btree->freed_capacity = 0;
+
+	lock_result = pthread_rwlock_init(&btree->top_lock, NULL);
+	xassert(1, lock_result == 0);
+	btree->top = (BtreeTop) {.root = BTREE_NULL};
+	btree->top_valid = false;
+
+	btree->bloom_enabled = false;
+	btree->bloom_file_name = NULL;
+	lock_result = pthread_rwlock_init(&btree->bloom_lock, NULL);
+	xassert(1, lock_result == 0);
+	btree->bloom = NULL;
+	btree->bloom_next = NULL;
+	btree->bloom_has_walked = false;
+	int cond_result = pthread_cond_init(&btree->bloom_wanted_cond, NULL);
+	xassert(1, cond_result == 0);
+	btree->bloom_wanted = false;
+	btree->bloom_stop = false;
+	btree->bloom_stats = (BtreeBloomStats) {0};
+
+	btree->wal = NULL;
+	btree->wal_id = 0;
+	btree->logged_root = BTREE_NULL;
+
+	btree->snapshots = NULL;
+	btree->snapshot_epoch = 0;
+	btree->fresh_map = NULL;
+	btree->fresh_map_capacity = 0;
+	btree->retired = NULL;
+	btree->n_retired = 0;
+	btree->retired_capacity = 0;
+
+	btree->compact_next = BTREE_NULL;
+	btree->compact_depth = 0;
+	btree->compact_has_fence = false;
+	btree->shrink_pending = false;
+
+	btree->file = file;
+	// A page has to hold whole blocks.
+	fs_set_cache(btree->file, MAX(BTREE_CACHE_PAGE_SIZE, block_size),
+	             BTREE_CACHE_SIZE);
+	// Without the buffer pool, O_DIRECT reads and writes whole blocks.
+	xassert(1, BTREE_FS_MODE != FS_MODE_DIRECT || BTREE_CACHE_SIZE > 0 ||
+	        block_size % FS_DIRECT_ALIGNMENT == 0);
+
+	return btree;
+}
+
+Btree *btree_new(
+	const char *file_name, size_t block_size, BtreeLayout layout) {
+
+	xassert(1, block_size >= BTREE_MIN_BLOCK_SIZE &&
+	        block_size <= BTREE_MAX_BLOCK_SIZE &&
+	        (block_size & (block_size - 1)) == 0);
+
+	Btree *btree = btree_init(
+		fs_open(file_name, true, BTREE_FS_MODE), block_size, layout);
+	btree->space = space_new(btree->file, 0, block_size, 1, block_size);
+
+	btree->superblock.root = space_alloc(btree->space, SPACE_NULL);
+	btree->superblock.end = space_end(btree->space);
+	btree->superblock.n_free = 0;
+	btree->superblock.block_size = block_size;
+	btree->superblock.layout = layout;
+	btree_write_superblock(btree);
+
+	btree_init_node(btree, btree->superblock.root, true);
+	btree_flush_writes(btree);
+	btree_bloom_open(btree, file_name, true);
+
+	return btree;
+}
+
+Btree *btree_open(const char *file_name) {
+	FsFile *file = fs_open(file_name, false, BTREE_FS_MODE);
+	BtreeSuperblock superblock;
+	if (!btree_read_superblock(file, &superblock)) {
+		fs_close(file);
+		return NULL;
+	}
+
+	// Everything else (including the free space map) is read lazily.
+	Btree *btree = btree_init(file, superblock.block_size, superblock.layout);
+	btree->superblock = superblock;
+	btree->published_root = superblock.root;
+	btree->space = space_load(btree->file, 0, btree->block_size, 1,
+	                          btree->block_size, superblock.end,
+	                          superblock.n_free);
+	btree_bloom_open(btree, file_name, false);
+	return btree;
+}
+
+void btree_destroy(Btree *btree) {
+	xassert(1, btree->file != NULL && btree->snapshots == NULL);
+	btree_bloom_close(btree);
+	btree_sync(btree);
+	if (btree->wal != NULL)
+		wal_detach(btree->wal, btree->wal_id);
+	space_destroy(btree->space);
+	fs_close(btree->file);
+	free(btree->queued_ptrs);
+	for (size_t i = 0; i < btree->queue_capacity; i++) {
+		free(btree->queued_blocks[i]);
+		free(btree->packed_blocks[i]);
+	}
+	free(btree->queued_blocks);
+	free(btree->packed_blocks);
+	free(btree->queue_slots);
+	free(btree->scratch_items);
+	free(btree->scratch_children);
+	free(btree->scratch_block);
+	free(btree->scratch_entries);
+	free(btree->scratch_sizes);
+	free(btree->scratch_key);
+	xassert(1, btree->n_free_decode_buffers == btree->n_decode_buffers);
+	for (size_t i = 0; i < btree->n_decode_buffers; i++)
+		free(btree->decode_buffers[i]);
+	free(btree->decode_buffers);
+	free(btree->fresh_map);
+	free(btree->retired);
+	pthread_mutex_destroy(&btree->write_lock);
+	btree_top_free(&btree->top);
+	pthread_rwlock_destroy(&btree->top_lock);
+	if (btree->bloom != NULL)
+		bloom_destroy(btree->bloom);
+	free(btree->bloom_file_name);
+	pthread_rwlock_destroy(&btree->bloom_lock);
+	pthread_cond_destroy(&btree->bloom_wanted_cond);
+	free(btree->latches);
+	free(btree->freed_ptrs);
+	free(btree);
+}
+
+static bool btree_is_fresh(Btree *btree, BtreePtr ptr) {
+	// Allocated since the newest snapshot was taken (so no snapshot can see
+	// the block).
+	return ptr / 64 < btree->fresh_map_capacity &&
+		((btree->fresh_map[ptr / 64] >> (ptr % 64)) & 1);
+}
+
+static void btree_set_fresh(Btree *btree, BtreePtr ptr, bool fresh) {
+	if (ptr / 64 >= btree->fresh_map_capacity) {
+		if (!fresh)
+			return;
+		size_t new_capacity = MAX(ptr / 64 + 1, btree->fresh_map_capacity * 2);
+		btree->fresh_map = realloc(
+			btree->fresh_map, new_capacity * sizeof(*btree->fresh_map));
+		xassert(1, btree->fresh_map != NULL);
+		memset(btree->fresh_map + btree->fresh_map_capacity, 0,
+		       (new_capacity - btree->fresh_map_capacity)
+		       * sizeof(*btree->fresh_map));
+		btree->fresh_map_capacity = new_capacity;
+	}
+	if (fresh)
+		btree->fresh_map[ptr / 64] |= UINT64_C(1) << (ptr % 64);
+	else
+		btree->fresh_map[ptr / 64] &= ~(UINT64_C(1) << (ptr % 64));
+}
+
+static bool btree_is_shared(Btree *btree, BtreePtr ptr) {
+	// A snapshot may see the block.
+	return btree->snapshots != NULL && !btree_is_fresh(btree, ptr);
+}
+
+static BtreePtr btree_alloc_block(Btree *btree, BtreePtr near) {
+	// Allocate a block close to `near` (for locality), or anywhere if it's
+	// BTREE_NULL.
+	BtreePtr ptr =
+		space_alloc(btree->space, near == BTREE_NULL ? SPACE_NULL : near);
+	btree_log(btree, BTREE_WAL_ALLOC, ptr, NULL, 0);
+	if (btree->snapshots != NULL)
+		btree_set_fresh(btree, ptr, true);
+	return ptr;
+}
+
+static void btree_retire_block(Btree *btree, BtreePtr ptr) {
+	if (btree->n_retired == btree->retired_capacity) {
+		btree->retired_capacity = MAX(16, btree->retired_capacity * 2);
+		btree->retired = realloc(
+			btree->retired,
+			btree->retired_capacity * sizeof(*btree->retired));
+		xassert(1, btree->retired != NULL);
+	}
+	BtreeRetired *retired = &btree->retired[btree->n_retired++];
+	retired->ptr = ptr;
+	retired->epoch = btree->snapshot_epoch;
+}
+
+static void btree_dealloc_block(Btree *btree, BtreePtr ptr) {
+	// Only marks the block as free; doesn't shrink the file (see
+	// btree_compact). Drops the block's queued write, if there is one.
+	if (btree->n_freed == btree->freed_capacity) {
+		btree->freed_capacity = MAX(8, btree->freed_capacity * 2);
+		btree->freed_ptrs = realloc(
+			btree->freed_ptrs,
+			btree->freed_capacity * sizeof(*btree->freed_ptrs));
+		xassert(1, btree->freed_ptrs != NULL);
+	}
+	btree->freed_ptrs[btree->n_freed++] = ptr;
+
+	size_t slot = btree->n_queued > 0 ? btree_queue_slot(btree, ptr) : 0;
+	if (btree->n_queued > 0 && btree->queue_slots[slot] != 0) {
+		// Swap it with the last one (the buffers are reused).
+		size_t i = btree->queue_slots[slot] - 1;
+		btree_queue_clear_slot(btree, slot);
+		btree->n_queued--;
+		if (i != btree->n_queued) {
+			BtreePtr last_ptr = btree->queued_ptrs[btree->n_queued];
+			btree->queue_slots[btree_queue_slot(btree, last_ptr)] = i + 1;
+		}
+		char *block = btree->queued_blocks[i];
+		btree->queued_ptrs[i] = btree->queued_ptrs[btree->n_queued];
+		btree->queued_blocks[i] = btree->queued_blocks[btree->n_queued];
+		btree->queued_blocks[btree->n_queued] = block;
+	}
+
+	// A block that snapshots may see is only freed when they're closed.
+	if (btree_is_shared(btree, ptr)) {
+		btree_retire_block(btree, ptr);
+		return;
+	}
+	btree_set_fresh(btree, ptr, false);
+	space_free(btree->space, ptr);
+	btree_log(btree, BTREE_WAL_FREE, ptr, NULL, 0);
+}
+
+static void btree_wal_redo(
+	void *btree_void, uint8_t type, uint64_t arg,
+	const void *bytes, size_t n_bytes) {
+
+	Btree *btree = btree_void;
+	// The log may add keys which aren't in the saved filter.
+	if (btree->bloom != NULL)
+		btree_bloom_replace(btree, NULL);
+	switch ((BtreeWalRecord) type) {
+	case BTREE_WAL_BLOCK: {
+		xassert(1, n_bytes == btree->block_size &&
+		        arg < space_end(btree->space));
+		char *block = fs_alloc_buffer(n_bytes); // Aligned for O_DIRECT.
+		memcpy(block, bytes, n_bytes);
+		fs_write(btree->file, block, arg * btree->block_size, n_bytes);
+		free(block);
+		break;
+	}
+	case BTREE_WAL_ROOT:
+		btree->superblock.root = btree->published_root = arg;
+		break;
+	case BTREE_WAL_ALLOC:
+		space_alloc_at(btree->space, arg);
+		break;
+	case BTREE_WAL_FREE:
+		space_free(btree->space, arg);
+		break;
+	case BTREE_WAL_SNAPSHOT:
+		btree->superblock.root = btree->published_root = arg;
+		space_restore(btree->space, bytes);
+		break;
+	case BTREE_WAL_SHRINK:
+		space_shrink(btree->space);
+		btree->shrink_pending = true;
+		break;
+	default:
+		xassert(1, false);
+	}
+}
+
+static void btree_wal_sync(void *btree_void) {
+	Btree *btree = btree_void;
+	pthread_mutex_lock(&btree->write_lock);
+	btree_sync(btree);
+	pthread_mutex_unlock(&btree->write_lock);
+}
+
+static void btree_wal_snapshot(void *btree_void) {
+	Btree *btree = btree_void;
+	pthread_mutex_lock(&btree->write_lock);
+	size_t n_bytes = space_snapshot_size(btree->space);
+	char *snapshot = malloc(n_bytes);
+	xassert(1, snapshot != NULL);
+	space_snapshot(btree->space, snapshot);
+	btree_log(btree, BTREE_WAL_SNAPSHOT, btree->superblock.root,
+	          snapshot, n_bytes);
+	btree->logged_root = btree->superblock.root;
+	free(snapshot);
+	pthread_mutex_unlock(&btree->write_lock);
+}
+
+void btree_attach_wal(Btree *btree, Wal *wal, uint8_t id) {
+	xassert(1, btree->wal == NULL && btree->n_queued == 0);
+	btree->wal = wal;
+	btree->wal_id = id;
+	fs_set_write_hook(btree->file, wal_write_hook, wal);
+	WalParticipant participant = {
+		btree_wal_redo, btree_wal_sync, btree_wal_snapshot, btree};
+	wal_attach(wal, id, &participant);
+	btree_top_invalidate(btree); // The log may have changed any node.
+}
+
+static BtreePtr btree_find_parent(Btree *btree, BtreePtr ptr) {
+	// Go down to one of the node's keys. BTREE_NULL for the root.
+	if (ptr == btree->superblock.root)
+		return BTREE_NULL;
+	const char *node = btree_pin_node(btree, ptr);
+	xassert(1, btree_node_n_items(node) > 0);
+	BtreeKey key = btree_node_key(node, 0);
+	btree_unpin_node(btree, ptr, node);
+
+	BtreePtr parent_ptr = btree->superblock.root;
+	while (true) {
+		const char *parent = btree_pin_node(btree, parent_ptr);
+		xassert(1, !btree_node_is_leaf(parent));
+		BtreePtr child_ptr =
+			btree_node_child(parent, btree_node_find_child(parent, key));
+		btree_unpin_node(btree, parent_ptr, parent);
+		if (child_ptr == ptr)
+			return parent_ptr;
+		parent_ptr = child_ptr;
+	}
+}
+
+static bool btree_cow_changed(Btree *btree, BtreePtr ptr, const char *queued) {
+	// Whether the queued node differs from the block in the file in more than
+	// the leaf links. Snapshots don't follow the links, so they're updated in
+	// place.
+	const char *old = fs_pin(
+		btree->file, ptr * btree->block_size, btree->block_size, false);
+	const char *new = queued;
+	bool changed;
+	if (btree_node_kind(queued) == BTREE_NODE_PACKED_LEAF) {
+		// The same items may have been packed differently, so compare them
+		// decoded.
+		btree_unpack_leaf(old, btree->scratch_block, btree->max_leaf_keys);
+		int n_items = btree_node_n_items(queued);
+		changed = btree_node_n_items(btree->scratch_block) != n_items ||
+			memcmp(btree_node_keys(btree->scratch_block),
+			       btree_node_keys(queued), n_items * sizeof(BtreeKey)) ||
+			memcmp(btree->scratch_block + btree_node_values_offset(queued),
+			       queued + btree_node_values_offset(queued),
+			       n_items * sizeof(BtreeValue));
+	} else {
+		if (btree_node_kind(queued) == BTREE_NODE_PLUS_LEAF &&
+		    btree_node_kind(old) == BTREE_NODE_PLUS_LEAF) {
+			memcpy(btree->scratch_block, queued, btree->block_size);
+			btree_node_set_link(btree->scratch_block, BTREE_LINK_PREV,
+			                    btree_node_link(old, BTREE_LINK_PREV));
+			btree_node_set_link(btree->scratch_block, BTREE_LINK_NEXT,
+			                    btree_node_link(old, BTREE_LINK_NEXT));
+			new = btree->scratch_block;
+		}
+		changed = memcmp(old, new, btree->block_size) != 0;
+	}
+	fs_unpin(btree->file, ptr * btree->block_size, false);
+	return changed;
+}
+
+static bool btree_ptr_in(BtreePtr ptr, const BtreePtr *ptrs, size_t n_ptrs) {
+	for (size_t i = 0; i < n_ptrs; i++) {
+		if (ptrs[i] == ptr)
+			return true;
+	}
+	return false;
+}
+
+static BtreePtr btree_remap(
+	BtreePtr ptr, const BtreePtr *old_ptrs, const BtreePtr *new_ptrs,
+	size_t n_moved) {
+
+	for (size_t i = 0; i < n_moved; i++) {
+		if (old_ptrs[i] == ptr)
+			return new_ptrs[i];
+	}
+	return ptr;
+}
+
+static void btree_cow_relocate(Btree *btree) {
+	// Copy-on-write: move the queued nodes which snapshots may see to new
+	// blocks, along with their ancestors (whose child pointers change), up
+	// to a new root, and retire the old blocks. Other nodes (allocated since
+	// the newest snapshot) are written in place.
+
+	// Find the nodes to move. The write queue grows as parents are added.
+	BtreePtr *old_ptrs = NULL;
+	size_t n_moved = 0;
+	size_t moved_capacity = 0;
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		BtreePtr ptr = btree->queued_ptrs[i];
+		if (!btree_is_shared(btree, ptr) ||
+		    btree_ptr_in(ptr, old_ptrs, n_moved) ||
+		    !btree_cow_changed(btree, ptr, btree->queued_blocks[i]))
+			continue;
+
+		while (true) {
+			if (n_moved == moved_capacity) {
+				moved_capacity = MAX(16, moved_capacity * 2);
+				old_ptrs = realloc(old_ptrs,
+				                   moved_capacity * sizeof(*old_ptrs));
+				xassert(1, old_ptrs != NULL);
+			}
+			old_ptrs[n_moved++] = ptr;
+
+			BtreePtr parent_ptr = btree_find_parent(btree, ptr);
+			if (parent_ptr == BTREE_NULL)
+				break;
+			btree_modify_node(btree, parent_ptr);
+			if (!btree_is_shared(btree, parent_ptr) ||
+			    btree_ptr_in(parent_ptr, old_ptrs, n_moved))
+				break;
+			ptr = parent_ptr;
+		}
+	}
+	if (n_moved == 0)
+		return;
+
+	BtreePtr *new_ptrs = malloc(n_moved * sizeof(*new_ptrs));
+	xassert(1, new_ptrs != NULL);
+	for (size_t i = 0; i < n_moved; i++)
+		new_ptrs[i] = btree_alloc_block(btree, old_ptrs[i]);
+
+	// Point the queued nodes at the moved ones.
+	for (size_t i = 0; i < btree->n_queued; i++) {
+		btree->queued_ptrs[i] = btree_remap(
+			btree->queued_ptrs[i], old_ptrs, new_ptrs, n_moved);
+		char *node = btree->queued_blocks[i];
+		if (btree_node_is_plus_leaf(node)) {
+			for (int link = BTREE_LINK_PREV; link <= BTREE_LINK_NEXT; link++) {
+				btree_node_set_link(node, link, btree_remap(
+					btree_node_link(node, link), old_ptrs, new_ptrs,
+					n_moved));
+			}
+		} else if (!btree_node_is_leaf(node)) {
+			for (int i_child = 0; i_child <= btree_node_n_items(node);
+			     i_child++) {
+				btree_node_set_child(node, i_child, btree_remap(
+					btree_node_child(node, i_child), old_ptrs, new_ptrs,
+					n_moved));
+			}
+		}
+	}
+	btree_queue_rehash(btree);
+	btree->superblock.root = btree_remap(
+		btree->superblock.root, old_ptrs, new_ptrs, n_moved);
+
+	// Moved leaves' neighbors have to link to them (in place, unless they
+	// were moved too).
+	for (size_t i = 0; i < n_moved; i++) {
+		char *node = btree_find_queued(btree, new_ptrs[i]);
+		if (!btree_node_is_plus_leaf(node))
+			continue;
+		BtreePtr prev_ptr = btree_node_link(node, BTREE_LINK_PREV);
+		BtreePtr next_ptr = btree_node_link(node, BTREE_LINK_NEXT);
+		if (prev_ptr != BTREE_NULL) {
+			btree_node_set_link(btree_modify_node(btree, prev_ptr),
+			                    BTREE_LINK_NEXT, new_ptrs[i]);
+		}
+		if (next_ptr != BTREE_NULL) {
+			btree_node_set_link(btree_modify_node(btree, next_ptr),
+			                    BTREE_LINK_PREV, new_ptrs[i]);
+		}
+	}
+
+	for (size_t i = 0; i < n_moved; i++)
+		btree_retire_block(btree, old_ptrs[i]);
+	free(old_ptrs);
+	free(new_ptrs);
+}
+
+static void btree_reclaim(Btree *btree) {
+	// Free the retired blocks which no open snapshot can see.
+	uint64_t oldest_epoch = UINT64_MAX;
+	for (BtreeSnapshot *snapshot = btree->snapshots; snapshot != NULL;
+	     snapshot = snapshot->next)
+		oldest_epoch = MIN(oldest_epoch, snapshot->epoch);
+
+	for (size_t i = 0; i < btree->n_retired;) {
+		BtreeRetired retired = btree->retired[i];
+		if (retired.epoch >= oldest_epoch) {
+			i++;
+			continue;
+		}
+		btree->retired[i] = btree->retired[--btree->n_retired];
+		space_free(btree->space, retired.ptr);
+		btree_log(btree, BTREE_WAL_FREE, retired.ptr, NULL, 0);
+	}
+}
+
+BtreeSnapshot *btree_snapshot_open(Btree *btree) {
+	pthread_mutex_lock(&btree->write_lock);
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES && btree->n_queued == 0);
+	BtreeSnapshot *snapshot = malloc(sizeof(*snapshot));
+	xassert(1, snapshot != NULL);
+	snapshot->btree = btree;
+	snapshot->root = btree->superblock.root;
+	snapshot->epoch = ++btree->snapshot_epoch;
+	snapshot->next = btree->snapshots;
+	btree->snapshots = snapshot;
+
+	// Every block is now visible to a snapshot.
+	if (btree->fresh_map != NULL) {
+		memset(btree->fresh_map, 0,
+		       btree->fresh_map_capacity * sizeof(*btree->fresh_map));
+	}
+	pthread_mutex_unlock(&btree->write_lock);
+	return snapshot;
+}
+
+void btree_snapshot_close(BtreeSnapshot *snapshot) {
+	Btree *btree = snapshot->btree;
+	btree_begin(btree);
+	BtreeSnapshot **link = &btree->snapshots;
+	while (*link != snapshot) {
+		xassert(1, *link != NULL);
+		link = &(*link)->next;
+	}
+	*link = snapshot->next;
+	free(snapshot);
+
+	btree_reclaim(btree);
+	btree_end(btree);
+}
+
+static bool btree_in_tree(Btree *btree, BtreePtr ptr) {
+	// Whether the allocated block is a node of the tree -- it may also have
+	// leaked, if the program crashed while snapshots were open. Like
+	// btree_find_parent, but the block may hold anything.
+	if (ptr == btree->superblock.root || btree_find_queued(btree, ptr) != NULL)
+		return true;
+	const char *node = fs_pin(
+		btree->file, ptr * btree->block_size, btree->block_size, false);
+	// Check the capacity first, so that the arrays are inside the block. An
+	// encoded leaf starts with its first key.
+	bool valid;
+	BtreeKey key = 0;
+	if (btree_node_kind(node) == BTREE_NODE_ENCODED_LEAF) {
+		valid = btree->layout == BTREE_LAYOUT_PACKED &&
+			btree_node_n_items(node) > 0 &&
+			btree_node_n_items(node) <= btree->max_leaf_keys;
+		if (valid)
+			key = *(const BtreeKey *) (node + BTREE_PACKED_FIRST_KEY);
+	} else {
+		valid = btree_node_kind(node) <= BTREE_NODE_PLUS_LEAF &&
+			btree_node_max_keys(node) ==
+			btree_max_keys(btree->block_size, btree_node_kind(node)) &&
+			btree_node_valid(node, false) && btree_node_n_items(node) > 0;
+		if (valid)
+			key = btree_node_key(node, 0);
+	}
+	fs_unpin(btree->file, ptr * btree->block_size, false);
+	if (!valid)
+		return false;
+
+	BtreePtr parent_ptr = btree->superblock.root;
+	while (true) {
+		const char *parent = btree_pin_node(btree, parent_ptr);
+		if (btree_node_is_leaf(parent)) {
+			btree_unpin_node(btree, parent_ptr, parent);
+			return false;
+		}
+		BtreePtr child_ptr =
+			btree_node_child(parent, btree_node_find_child(parent, key));
+		btree_unpin_node(btree, parent_ptr, parent);
+		if (child_ptr == ptr)
+			return true;
+		parent_ptr = child_ptr;
+	}
+}
+
+static void btree_move_node(Btree *btree, BtreePtr from, BtreePtr to) {
+	// Copy the node to the (allocated) block `to`, point its parent (or the
+	// superblock) and its neighbors in the list of leaves at the copy, and
+	// free the old block.
+	BtreePtr parent_ptr = btree_find_parent(btree, from);
+	const char *node = btree_pin_node(btree, from);
+	char *moved = btree_queue_block(btree, to);
+	btree_copy_node(btree, moved, node);
+	btree_unpin_node(btree, from, node);
+
+	if (parent_ptr == BTREE_NULL) {
+		btree->superblock.root = to;
+	} else {
+		char *parent = btree_modify_node(btree, parent_ptr);
+		for (int i_child = 0; i_child <= btree_node_n_items(parent);
+		     i_child++) {
+			if (btree_node_child(parent, i_child) == from)
+				btree_node_set_child(parent, i_child, to);
+		}
+	}
+
+	if (btree_node_is_plus_leaf(moved)) {
+		BtreePtr prev_ptr = btree_node_link(moved, BTREE_LINK_PREV);
+		BtreePtr next_ptr = btree_node_link(moved, BTREE_LINK_NEXT);
+		if (prev_ptr != BTREE_NULL) {
+			btree_node_set_link(btree_modify_node(btree, prev_ptr),
+			                    BTREE_LINK_NEXT, to);
+		}
+		if (next_ptr != BTREE_NULL) {
+			btree_node_set_link(btree_modify_node(btree, next_ptr),
+			                    BTREE_LINK_PREV, to);
+		}
+	}
+
+	btree_dealloc_block(btree, from);
+}
+
+static BtreePtr btree_compact_find(
+	Btree *btree, BtreeKey *fence, bool *has_fence) {
+
+	// The next node to move (see struct Btree), and the fence of the one after
+	// it at the same depth (the nearest separator to its right), if there is
+	// one. BTREE_NULL if the leaves are done.
+	BtreePtr ptr = btree->superblock.root;
+	*has_fence = false;
+	for (int depth = 0; depth < btree->compact_depth; depth++) {
+		const char *node = btree_pin_node(btree, ptr);
+		if (btree_node_is_leaf(node)) {
+			btree_unpin_node(btree, ptr, node);
+			return BTREE_NULL;
+		}
+		int i_child = btree->compact_has_fence
+			? btree_node_find_child(node, btree->compact_fence) : 0;
+		if (i_child < btree_node_n_items(node)) {
+			*fence = btree_node_key(node, i_child);
+			*has_fence = true;
+		}
+		BtreePtr child_ptr = btree_node_child(node, i_child);
+		btree_unpin_node(btree, ptr, node);
+		ptr = child_ptr;
+	}
+	return ptr;
+}
+
+bool btree_compact(Btree *btree, size_t max_nodes) {
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	btree_begin(btree);
+	// Moving nodes would change them under the snapshots, so it waits until
+	// they're closed.
+	if (btree->snapshots != NULL) {
+		btree_end(btree);
+		return false;
+	}
+	if (btree->compact_next == BTREE_NULL) {
+		btree->compact_next = 1; // Past the superblock.
+		btree->compact_depth = 0;
+		btree->compact_has_fence = false;
+	}
+
+	bool done = false;
+	for (size_t i = 0; i < max_nodes && !done; i++) {
+		BtreeKey fence = 0;
+		bool has_fence;
+		BtreePtr ptr = btree_compact_find(btree, &fence, &has_fence);
+		if (ptr == BTREE_NULL) {
+			done = true;
+			break;
+		}
+
+		BtreePtr dest = btree->compact_next++;
+		if (ptr != dest) {
+			// Move the node in the way (if there's one) anywhere else.
+			if (space_is_used(btree->space, dest) &&
+			    btree_in_tree(btree, dest)) {
+				btree_move_node(btree, dest,
+				                btree_alloc_block(btree, BTREE_NULL));
+			}
+			if (!space_is_used(btree->space, dest)) {
+				space_alloc_at(btree->space, dest);
+				btree_log(btree, BTREE_WAL_ALLOC, dest, NULL, 0);
+			}
+			btree_move_node(btree, ptr, dest);
+		}
+
+		btree->compact_fence = fence;
+		btree->compact_has_fence = has_fence;
+		if (!has_fence)
+			btree->compact_depth++;
+	}
+	if (!done) {
+		btree_end(btree);
+		return false;
+	}
+
+	// The free blocks are now at the end. The file only shrinks on the next
+	// sync (once the moves and the new end are durable, as the blocks past it
+	// held the old nodes), which is done right away.
+	btree_log(btree, BTREE_WAL_SHRINK, 0, NULL, 0);
+	space_shrink(btree->space);
+	btree->shrink_pending = true;
+	btree->compact_next = BTREE_NULL;
+	btree_end(btree);
+	if (btree->wal != NULL)
+		wal_checkpoint(btree->wal);
+	else
+		btree_wal_sync(btree);
+	return true;
+}
+
+static void btree_array_insert(
+	void *array, size_t n_elems_before_insert, size_t elem_size,
+	void *new, size_t i_new) {
+
+	xassert(1, i_new <= n_elems_before_insert);
+	memmove((char *) array + (i_new + 1) * elem_size,
+			(char *) array + i_new * elem_size,
+			(n_elems_before_insert - i_new) * elem_size);
+	memcpy((char *) array + i_new * elem_size, new, elem_size);
+}
+
+static int btree_gather(
+	Btree *btree, const char *parent, int i_separator,
+	const char *left, const char *right) {
+
+	// Collect the items of two neighboring nodes and the item separating
+	// them in the parent into btree->scratch_items, and their children into
+	// btree->scratch_children. Returns the number of items. In a B+ tree's
+	// leaves, the separator is only a copy of a key, so it's left out.
+
+	int n_left_items = btree_node_n_items(left);
+	int n_right_items = btree_node_n_items(right);
+	bool is_leaf = btree_node_is_leaf(left);
+	xassert(1, btree_node_kind(left) == btree_node_kind(right));
+	bool copied_separator = btree_node_is_plus_leaf(left);
+
+	BtreeItem separator = btree_node_item(parent, i_separator);
+	xassert(1, n_left_items == 0 ||
+	        btree_key_cmp(btree_node_key(left, n_left_items - 1),
+	                      separator.key) < 0);
+	xassert(1, n_right_items == 0 || (copied_separator
+	        ? btree_key_cmp(separator.key, btree_node_key(right, 0)) <= 0
+	        : btree_key_cmp(separator.key, btree_node_key(right, 0)) < 0));
+
+	BtreeItem *all_items = btree->scratch_items;
+	int n_all_items = btree_node_get_items(left, all_items);
+	if (!copied_separator)
+		all_items[n_all_items++] = separator;
+	n_all_items += btree_node_get_items(right, all_items + n_all_items);
+
+	if (!is_leaf) {
+		btree_node_get_children(left, btree->scratch_children);
+		btree_node_get_children(
+			right, btree->scratch_children + n_left_items + 1);
+	}
+	return n_all_items;
+}
+
+static int btree_n_separators(const char *left) {
+	// Items that btree_gather takes from the parent.
+	return btree_node_is_plus_leaf(left) ? 0 : 1;
+}
+
+static void btree_redistribute(
+	Btree *btree, char *parent, int i_separator, char *left, char *right,
+	int n_all_items, int n_new_left_items) {
+
+	// Distribute the items gathered by btree_gather (and maybe changed
+	// since) among the left node, the place for an item in the parent, and
+	// the right node.
+
+	BtreeItem *all_items = btree->scratch_items;
+	BtreePtr *all_children = btree->scratch_children;
+	int n_separators = btree_n_separators(left);
+	btree_node_fill(left, all_items, all_children, n_new_left_items);
+	btree_node_set_item(parent, i_separator, all_items[n_new_left_items]);
+	btree_node_fill(right, all_items + n_new_left_items + n_separators,
+	                all_children + n_new_left_items + 1,
+	                n_all_items - n_new_left_items - n_separators);
+}
+
+static bool btree_items_fit(
+	Btree *btree, const BtreeItem *items, int n_items) {
+
+	// Whether a packed leaf with these items fits in its block (see
+	// btree_leaf_fits).
+	if (n_items <= btree->max_plain_leaf_keys)
+		return true;
+	BtreePackedStats stats = {.n_items = 0};
+	for (int i_item = 0; i_item < n_items; i_item++)
+		btree_packed_add(&stats, items[i_item]);
+	return btree_packed_size(&stats) <= btree->block_size;
+}
+
+static bool btree_compensate(
+	Btree *btree, char *parent, int i_separator, char *left, char *right,
+	BtreeItem new_item, BtreePtr new_right_child,
+	bool new_item_in_left, int i_new_item) {
+
+	// Insert new_item into the left or right node, and distribute the items
+	// of both (and the item separating them in the parent) evenly. Returns
+	// false, without changing anything, if that would leave a packed leaf
+	// which doesn't fit in its block.
+
+	int n_left_items = btree_node_n_items(left);
+	int n_right_items = btree_node_n_items(right);
+	int max_keys = btree_node_max_keys(left);
+	xassert(1, n_left_items < max_keys || n_right_items < max_keys);
+	xassert(1, btree_node_is_leaf(left) == (new_right_child == BTREE_NULL));
+
+	int n_all_items = btree_gather(btree, parent, i_separator, left, right);
+	int n_separators = n_all_items - n_left_items - n_right_items;
+
+	// Add the item to insert (new_item), and its right child.
+	int i_new_item_in_all = new_item_in_left
+		? i_new_item : n_left_items + n_separators + i_new_item;
+	btree_array_insert(btree->scratch_items, n_all_items,
+	                   sizeof(btree->scratch_items[0]),
+	                   &new_item, i_new_item_in_all);
+	n_all_items++;
+	if (!btree_node_is_leaf(left)) {
+		btree_array_insert(btree->scratch_children,
+		                   n_left_items + n_right_items + 2,
+		                   sizeof(btree->scratch_children[0]),
+		                   &new_right_child, i_new_item_in_all + 1);
+	}
+
+	int n_new_left_items = (n_all_items - n_separators) / 2;
+	if (btree_node_kind(left) == BTREE_NODE_PACKED_LEAF &&
+	    (!btree_items_fit(btree, btree->scratch_items, n_new_left_items) ||
+	     !btree_items_fit(btree, btree->scratch_items + n_new_left_items,
+	                      n_all_items - n_new_left_items)))
+		return false;
+	btree_redistribute(btree, parent, i_separator, left, right, n_all_items,
+	                   n_new_left_items);
+	return true;
+}
+
+static void btree_link_leaf(
+	Btree *btree, BtreePtr leaf_ptr, char *leaf, BtreePtr new_ptr,
+	char *new_leaf) {
+
+	// Add a new B+ tree leaf to the list, after `leaf`.
+	BtreePtr next_ptr = btree_node_link(leaf, BTREE_LINK_NEXT);
+	btree_node_set_link(new_leaf, BTREE_LINK_PREV, leaf_ptr);
+	btree_node_set_link(new_leaf, BTREE_LINK_NEXT, next_ptr);
+	btree_node_set_link(leaf, BTREE_LINK_NEXT, new_ptr);
+	if (next_ptr != BTREE_NULL) {
+		btree_node_set_link(btree_modify_node(btree, next_ptr),
+		                    BTREE_LINK_PREV, new_ptr);
+	}
+}
+
+static bool btree_node_has_room(Btree *btree, BtreePtr ptr) {
+	const char *node = btree_pin_node(btree, ptr);
+	bool has_room = btree_node_n_items(node) < btree_node_max_keys(node);
+	btree_unpin_node(btree, ptr, node);
+	return has_room;
+}
+
+static bool btree_set_try_compensate(
+	Btree *btree, char *node, BtreePtr parent_ptr, int i_node_in_parent,
+	BtreeItem new_item, BtreePtr new_right_child, int i_in_node) {
+
+	const char *parent = btree_pin_node(btree, parent_ptr);
+	BtreePtr left_sibling_ptr = i_node_in_parent > 0
+		? btree_node_child(parent, i_node_in_parent - 1) : BTREE_NULL;
+	BtreePtr right_sibling_ptr =
+		i_node_in_parent < btree_node_n_items(parent)
+		? btree_node_child(parent, i_node_in_parent + 1) : BTREE_NULL;
+	btree_unpin_node(btree, parent_ptr, parent);
+
+	if (left_sibling_ptr != BTREE_NULL &&
+	    btree_node_has_room(btree, left_sibling_ptr) &&
+	    btree_compensate(btree, btree_modify_node(btree, parent_ptr),
+	                     i_node_in_parent - 1,
+	                     btree_modify_node(btree, left_sibling_ptr), node,
+	                     new_item, new_right_child, false, i_in_node))
+		return true;
+
+	return right_sibling_ptr != BTREE_NULL &&
+		btree_node_has_room(btree, right_sibling_ptr) &&
+		btree_compensate(btree, btree_modify_node(btree, parent_ptr),
+		                 i_node_in_parent,
+		                 node, btree_modify_node(btree, right_sibling_ptr),
+		                 new_item, new_right_child, true, i_in_node);
+}
+
+// A step of the path from the root to a node: a block, and the index of the
+// child the path continues to (or, in the last step, the insertion position).
+typedef struct {
+	BtreePtr ptr;
+	int i_child;
+} BtreePathStep;
+
+enum { BTREE_MAX_DEPTH = 32 };
+// Should exceed log_{min_keys + 1}(max possible number of items in the tree).
+
+static bool btree_set_up_pass(
+	Btree *btree, BtreePathStep *path, int depth,
+	BtreeItem new_item, BtreePtr new_right_child) {
+
+	// Insert new_item into the node at path[depth]. Go up the path, splitting
+	// nodes, as long as necessary. Returns false if any node other than
+	// path[depth] changed (so the path may no longer be right).
+
+	while (true) {
+		BtreePtr node_ptr = path[depth].ptr;
+		int i_in_node = path[depth].i_child;
+		char *node = btree_modify_node(btree, node_ptr);
+		bool is_leaf = btree_node_is_leaf(node);
+		int n_items = btree_node_n_items(node);
+
+		xassert(1, i_in_node <= n_items);
+		xassert(1, (node_ptr == btree->superblock.root) == (depth == 0));
+		xassert(1, is_leaf == (new_right_child == BTREE_NULL));
+
+		// If there's free space in the node, just insert the item. (A packed
+		// leaf which then doesn't fit in its block is split like a full
+		// node.)
+
+		int max_keys = btree_node_max_keys(node);
+		if (n_items < max_keys) {
+			btree_node_insert(node, i_in_node, new_item, new_right_child);
+			if (btree_leaf_fits(btree, node))
+				return is_leaf;
+			btree_node_remove(node, i_in_node);
+		}
+
+		// The node is full. If it's not the root, try to compensate
+		// (move some items to a sibling node).
+
+		if (depth > 0 && btree_set_try_compensate(
+			    btree, node, path[depth - 1].ptr, path[depth - 1].i_child,
+			    new_item, new_right_child, i_in_node))
+			return false;
+
+		// Can't compensate. We'll have to split the node (add a right
+		// sibling).
+
+		// Collect items in the node to split and the new item into an array.
+		BtreeItem *all_items = btree->scratch_items;
+		btree_node_get_items(node, all_items);
+		btree_array_insert(all_items, n_items, sizeof(all_items[0]),
+		                   &new_item, i_in_node);
+
+		// Same for children.
+		BtreePtr *all_children = btree->scratch_children;
+		if (!is_leaf) {
+			btree_node_get_children(node, all_children);
+			btree_array_insert(all_children, n_items + 1,
+			                   sizeof(all_children[0]),
+			                   &new_right_child, i_in_node + 1);
+		}
+
+		// Distribute them between the two nodes and the item separating
+		// them (which, in a B+ tree's leaf, stays in the right node too).
+		BtreePtr new_sibling_ptr = btree_alloc_block(btree, node_ptr);
+		char *new_sibling = btree_init_node(btree, new_sibling_ptr, is_leaf);
+		int n_left_items = (n_items + 1) / 2;
+		int i_right = btree_node_is_plus_leaf(node)
+			? n_left_items : n_left_items + 1;
+		btree_node_fill(node, all_items, all_children, n_left_items);
+		BtreeItem separator = all_items[n_left_items];
+		btree_node_fill(new_sibling, all_items + i_right,
+		                all_children + n_left_items + 1,
+		                n_items + 1 - i_right);
+		if (btree_node_is_plus_leaf(node))
+			btree_link_leaf(btree, node_ptr, node,
+			                new_sibling_ptr, new_sibling);
+
+		if (depth == 0) { // We're splitting the root.
+			BtreePtr new_root_ptr = btree_alloc_block(btree, node_ptr);
+			char *new_root = btree_init_node(btree, new_root_ptr, false);
+			BtreePtr children[] = {node_ptr, new_sibling_ptr};
+			btree_node_fill(new_root, &separator, children, 1);
+			btree->superblock.root = new_root_ptr;
+			return false;
+		}
+
+		new_item = separator;
+		new_right_child = new_sibling_ptr;
+		depth--;
+	}
+}
+
+static bool btree_refit_leaf(Btree *btree, BtreePathStep *path, int depth) {
+	// A packed leaf (at path[depth]) may stop fitting in its block when one
+	// of its values changes, or even when an item is removed (which widens a
+	// gap). Then split it, by taking its last item out and inserting it
+	// again. Returns false like btree_set_up_pass.
+	char *leaf = btree_modify_node(btree, path[depth].ptr);
+	if (btree_leaf_fits(btree, leaf))
+		return true;
+	int i_last = btree_node_n_items(leaf) - 1;
+	BtreeItem last = btree_node_item(leaf, i_last);
+	btree_node_remove(leaf, i_last);
+	path[depth].i_child = i_last;
+	return btree_set_up_pass(btree, path, depth, last, BTREE_NULL);
+}
+
+// The path to the leaf where the last key was set, so that the next key in a
+// batch can skip the descent if it falls in the same leaf.
+typedef struct {
+	BtreePathStep steps[BTREE_MAX_DEPTH];
+	int depth; // Of the leaf.
+	bool valid; // False if the tree changed in a way that can affect the path.
+	// Keys which can be in the leaf are between these (strictly, except for
+	// the lower one in a B+ tree).
+	bool has_lower, has_upper;
+	BtreeKey lower, upper;
+} BtreeSetPath;
+
+static bool btree_set_path_covers(
+	Btree *btree, const BtreeSetPath *path, BtreeKey key) {
+
+	if (!path->valid)
+		return false;
+	if (path->has_lower) {
+		int cmp = btree_key_cmp(path->lower, key);
+		if (cmp > 0 || (cmp == 0 && !btree_is_bplus(btree)))
+			return false;
+	}
+	return !path->has_upper || btree_key_cmp(key, path->upper) < 0;
+}
+
+static void btree_set_with_path(
+	Btree *btree, BtreeSetPath *path, BtreeItem item,
+	const BtreeValue *expected, bool *replaced, BtreeValue *old_value) {
+
+	// If `expected` isn't NULL, the key is only set if it's in the tree with
+	// that value.
+	if (!btree_set_path_covers(btree, path, item.key)) {
+		// Go down the tree to the leaf where the key should be (unless we
+		// find it on the way), and remember the path.
+		path->valid = false;
+		path->has_lower = path->has_upper = false;
+		int depth = 0;
+		BtreePtr node_ptr = btree->superblock.root;
+		while (true) {
+			xassert(1, depth < BTREE_MAX_DEPTH);
+			const char *node = btree_pin_node(btree, node_ptr);
+			path->steps[depth].ptr = node_ptr;
+			if (btree_node_is_leaf(node)) {
+				btree_unpin_node(btree, node_ptr, node);
+				break;
+			}
+
+			int i_item = btree_node_lower_bound(node, item.key);
+			int n_items = btree_node_n_items(node);
+			bool found = i_item < n_items &&
+				btree_key_cmp(btree_node_key(node, i_item), item.key) == 0;
+			if (found && btree_is_bplus(btree)) {
+				// Only the leaves have values. The key is in the right
+				// subtree (see btree_node_find_child).
+				i_item++;
+			} else if (found) {
+				// We found the exact key, so let's set its associated value.
+				BtreeValue value = btree_node_value(node, i_item);
+				btree_unpin_node(btree, node_ptr, node);
+				if (expected != NULL && value != *expected)
+					return;
+				if (replaced != NULL) {
+					*replaced = true;
+					*old_value = value;
+				}
+				btree_node_set_value(btree_modify_node(btree, node_ptr),
+				                     i_item, item.value);
+				return;
+			}
+
+			// We know that keys[i_item - 1] < key < keys[i_item] (or <= key,
+			// in a B+ tree), so the key (if it exists) will be in the i_item-th
+			// child's subtree.
+			if (i_item > 0) {
+				path->has_lower = true;
+				path->lower = btree_node_key(node, i_item - 1);
+			}
+			if (i_item < n_items) {
+				path->has_upper = true;
+				path->upper = btree_node_key(node, i_item);
+			}
+			path->steps[depth].i_child = i_item;
+			BtreePtr child_ptr = btree_node_child(node, i_item);
+			btree_unpin_node(btree, node_ptr, node);
+			node_ptr = child_ptr;
+			depth++;
+		}
+		path->depth = depth;
+		path->valid = true;
+	}
+
+	BtreePtr leaf_ptr = path->steps[path->depth].ptr;
+	const char *leaf = btree_pin_node(btree, leaf_ptr);
+	int i_item = btree_node_lower_bound(leaf, item.key);
+	bool found = i_item < btree_node_n_items(leaf) &&
+		btree_key_cmp(btree_node_key(leaf, i_item), item.key) == 0;
+	BtreeValue value = found ? btree_node_value(leaf, i_item) : 0;
+	btree_unpin_node(btree, leaf_ptr, leaf);
+	if (expected != NULL && (!found || value != *expected))
+		return;
+	if (found && replaced != NULL) {
+		*replaced = true;
+		*old_value = value;
+	}
+
+	if (found) {
+		btree_node_set_value(btree_modify_node(btree, leaf_ptr),
+		                     i_item, item.value);
+		path->valid = btree_refit_leaf(btree, path->steps, path->depth);
+	} else {
+		btree_bloom_add(btree, item.key);
+		path->steps[path->depth].i_child = i_item;
+		path->valid = btree_set_up_pass(
+			btree, path->steps, path->depth, item, BTREE_NULL);
+	}
+}
+
+void btree_set(
+	Btree *btree, BtreeKey key, BtreeValue value,
+	bool *replaced, BtreeValue *old_value) {
+
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	xassert(1, (replaced == NULL) == (old_value == NULL));
+	btree_begin(btree);
+	BtreeSetPath path = {.valid = false};
+	BtreeItem item = {key, value};
+	btree_set_with_path(btree, &path, item, NULL, replaced, old_value);
+	btree_end(btree);
+}
+
+typedef struct {
+	BtreeItem item;
+	size_t i_in_batch;
+} BtreeBatchItem;
+
+static int btree_batch_item_cmp(const void *a_void, const void *b_void) {
+	const BtreeBatchItem *a = a_void, *b = b_void;
+	int cmp = btree_key_cmp(a->item.key, b->item.key);
+	if (cmp != 0)
+		return cmp;
+	return (a->i_in_batch > b->i_in_batch) - (a->i_in_batch < b->i_in_batch);
+}
+
+static void btree_do_set_batch(
+	Btree *btree, const BtreeItem *items, size_t n_items,
+	const BtreeValue *expected, bool *replaced, BtreeValue *old_values) {
+
+	// For btree_set_batch and btree_replace_batch (old_values may be NULL
+	// even if replaced isn't).
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	if (n_items == 0)
+		return;
+	btree_begin(btree);
+
+	// Sort by key (and, for equal keys, by position, so that the last one
+	// wins), then go through the keys in order, reusing the path while they
+	// fall in the same leaf. Modified nodes stay in the write queue until the
+	// end of the batch, so each is written once.
+	BtreeBatchItem *sorted = malloc(n_items * sizeof(*sorted));
+	xassert(1, sorted != NULL);
+	for (size_t i = 0; i < n_items; i++) {
+		sorted[i].item = items[i];
+		sorted[i].i_in_batch = i;
+	}
+	qsort(sorted, n_items, sizeof(*sorted), btree_batch_item_cmp);
+
+	BtreeSetPath path = {.valid = false};
+	for (size_t i = 0; i < n_items; i++) {
+		size_t i_in_batch = sorted[i].i_in_batch;
+		bool item_replaced = false;
+		BtreeValue old_value;
+		btree_set_with_path(
+			btree, &path, sorted[i].item,
+			expected != NULL ? &expected[i_in_batch] : NULL,
+			&item_replaced, &old_value);
+		if (replaced != NULL)
+			replaced[i_in_batch] = item_replaced;
+		if (old_values != NULL && item_replaced)
+			old_values[i_in_batch] = old_value;
+	}
+
+	free(sorted);
+	btree_end(btree);
+}
+
+void btree_set_batch(
+	Btree *btree, const BtreeItem *items, size_t n_items,
+	bool *replaced, BtreeValue *old_values) {
+
+	xassert(1, (replaced == NULL) == (old_values == NULL));
+	btree_do_set_batch(btree, items, n_items, NULL, replaced, old_values);
+}
+
+void btree_replace_batch(
+	Btree *btree, const BtreeItem *items, size_t n_items,
+	const BtreeValue *expected, bool *replaced) {
+
+	xassert(1, expected != NULL && replaced != NULL);
+	btree_do_set_batch(btree, items, n_items, expected, replaced, NULL);
+}
+
+static int btree_node_spare_items(Btree *btree, BtreePtr ptr) {
+	// Items above the minimum (negative if there are too few). A node which
+	// has just lost an item is in the write queue, and mustn't go through
+	// btree_pin_node's validation.
+	const char *node = btree_find_queued(btree, ptr);
+	if (node != NULL)
+		return btree_node_n_items(node) - btree_node_min_keys(node);
+
+	node = btree_pin_node(btree, ptr);
+	int n_spare_items = btree_node_n_items(node) - btree_node_min_keys(node);
+	btree_unpin_node(btree, ptr, node);
+	return n_spare_items;
+}
+
+static void btree_borrow(
+	Btree *btree, BtreePtr parent_ptr, int i_separator,
+	BtreePtr left_ptr, BtreePtr right_ptr) {
+
+	// Even out the items of two neighbors (one of which has too few). The
+	// one with too few of two packed leaves only gets up to the minimum, as
+	// the other may have more items than would fit in one block unpacked.
+	char *parent = btree_modify_node(btree, parent_ptr);
+	char *left = btree_modify_node(btree, left_ptr);
+	char *right = btree_modify_node(btree, right_ptr);
+	int n_all_items = btree_gather(btree, parent, i_separator, left, right);
+	int n_new_left_items = (n_all_items - btree_n_separators(left)) / 2;
+	if (btree_node_kind(left) == BTREE_NODE_PACKED_LEAF) {
+		int min_keys = btree_node_min_keys(left);
+		n_new_left_items = btree_node_n_items(left) < min_keys
+			? min_keys : n_all_items - min_keys;
+	}
+	btree_redistribute(btree, parent, i_separator, left, right, n_all_items,
+	                   n_new_left_items);
+}
+
+static void btree_merge(
+	Btree *btree, BtreePtr parent_ptr, int i_separator,
+	BtreePtr left_ptr, BtreePtr right_ptr) {
+
+	// Move the items of the right node (and the separator) to the left one,
+	// and free the right one. (The nodes are modified through the write
+	// queue, as one of them may have too few items for btree_pin_node.)
+	char *parent = btree_modify_node(btree, parent_ptr);
+	char *left = btree_modify_node(btree, left_ptr);
+	char *right = btree_modify_node(btree, right_ptr);
+	int n_all_items = btree_gather(btree, parent, i_separator, left, right);
+	xassert(1, n_all_items <= btree_node_max_keys(left));
+	btree_node_fill(left, btree->scratch_items, btree->scratch_children,
+	                n_all_items);
+
+	if (btree_node_is_plus_leaf(left)) {
+		BtreePtr next_ptr = btree_node_link(right, BTREE_LINK_NEXT);
+		btree_node_set_link(left, BTREE_LINK_NEXT, next_ptr);
+		if (next_ptr != BTREE_NULL) {
+			btree_node_set_link(btree_modify_node(btree, next_ptr),
+			                    BTREE_LINK_PREV, left_ptr);
+		}
+	}
+
+	btree_node_remove(parent, i_separator);
+	btree_dealloc_block(btree, right_ptr);
+}
+
+static void btree_delete_up_pass(
+	Btree *btree, BtreePathStep *path, int depth) {
+
+	// The node at path[depth] has lost an item. Go up the path, borrowing
+	// items from siblings or merging nodes, as long as necessary.
+
+	for (; depth > 0; depth--) {
+		BtreePtr node_ptr = path[depth].ptr;
+		if (btree_node_spare_items(btree, node_ptr) >= 0)
+			return;
+
+		BtreePtr parent_ptr = path[depth - 1].ptr;
+		int i_node_in_parent = path[depth - 1].i_child;
+		const char *parent = btree_pin_node(btree, parent_ptr);
+		BtreePtr left_sibling_ptr = i_node_in_parent > 0
+			? btree_node_child(parent, i_node_in_parent - 1) : BTREE_NULL;
+		BtreePtr right_sibling_ptr =
+			i_node_in_parent < btree_node_n_items(parent)
+			? btree_node_child(parent, i_node_in_parent + 1) : BTREE_NULL;
+		btree_unpin_node(btree, parent_ptr, parent);
+
+		// Borrow (like btree_compensate) from a sibling which has items to
+		// spare.
+		if (left_sibling_ptr != BTREE_NULL &&
+		    btree_node_spare_items(btree, left_sibling_ptr) > 0) {
+			btree_borrow(btree, parent_ptr, i_node_in_parent - 1,
+			             left_sibling_ptr, node_ptr);
+			return;
+		}
+		if (right_sibling_ptr != BTREE_NULL &&
+		    btree_node_spare_items(btree, right_sibling_ptr) > 0) {
+			btree_borrow(btree, parent_ptr, i_node_in_parent,
+			             node_ptr, right_sibling_ptr);
+			return;
+		}
+
+		// Both siblings have the minimum number of items, so together with
+		// this node (and the separator), they fit in one node. The parent
+		// loses an item.
+		if (left_sibling_ptr != BTREE_NULL) {
+			btree_merge(btree, parent_ptr, i_node_in_parent - 1,
+			            left_sibling_ptr, node_ptr);
+		} else {
+			btree_merge(btree, parent_ptr, i_node_in_parent,
+			            node_ptr, right_sibling_ptr);
+		}
+	}
+
+	// If the root is empty, its only child becomes the root.
+	BtreePtr root_ptr = btree->superblock.root;
+	const char *root = btree_pin_node(btree, root_ptr);
+	BtreePtr new_root_ptr =
+		(btree_node_n_items(root) == 0 && !btree_node_is_leaf(root))
+		? btree_node_child(root, 0) : BTREE_NULL;
+	btree_unpin_node(btree, root_ptr, root);
+	if (new_root_ptr != BTREE_NULL) {
+		btree->superblock.root = new_root_ptr;
+		btree_dealloc_block(btree, root_ptr);
+	}
+}
+
+bool btree_delete(Btree *btree, BtreeKey key, BtreeValue *old_value) {
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	// Go down the tree to the key, and remember the path. If the key is in
+	// an internal node, keep going down to its predecessor (the last item in
+	// its left subtree), which will take its place.
+
+	btree_begin(btree);
+	BtreePathStep path[BTREE_MAX_DEPTH];
+	int depth = 0;
+	int found_depth = -1;
+	BtreePtr node_ptr = btree->superblock.root;
+	while (true) {
+		xassert(1, depth < BTREE_MAX_DEPTH);
+		const char *node = btree_pin_node(btree, node_ptr);
+		bool is_leaf = btree_node_is_leaf(node);
+		int n_items = btree_node_n_items(node);
+
+		int i_item;
+		if (found_depth >= 0) {
+			i_item = is_leaf ? n_items - 1 : n_items;
+		} else {
+			i_item = btree_node_lower_bound(node, key);
+			bool found = i_item < n_items &&
+				btree_key_cmp(btree_node_key(node, i_item), key) == 0;
+			if (found && !btree_node_has_values(node)) {
+				i_item++; // A B+ tree's separator (see btree_node_find_child).
+			} else if (found) {
+				found_depth = depth;
+				if (old_value != NULL)
+					*old_value = btree_node_value(node, i_item);
+			}
+		}
+
+		path[depth].ptr = node_ptr;
+		path[depth].i_child = i_item;
+		BtreePtr child_ptr = is_leaf ? BTREE_NULL
+			: btree_node_child(node, i_item);
+		btree_unpin_node(btree, node_ptr, node);
+		if (is_leaf)
+			break;
+
+		node_ptr = child_ptr;
+		depth++;
+	}
+
+	if (found_depth < 0) {
+		btree_end(btree);
+		return false;
+	}
+
+	char *leaf = btree_modify_node(btree, path[depth].ptr);
+	int i_in_leaf = path[depth].i_child;
+	if (found_depth < depth) {
+		btree_node_set_item(
+			btree_modify_node(btree, path[found_depth].ptr),
+			path[found_depth].i_child, btree_node_item(leaf, i_in_leaf));
+	}
+	btree_node_remove(leaf, i_in_leaf);
+	btree_bloom_remove(btree, key);
+
+	// A packed leaf which doesn't fit any more has more than enough items.
+	if (btree_leaf_fits(btree, leaf))
+		btree_delete_up_pass(btree, path, depth);
+	else
+		btree_refit_leaf(btree, path, depth);
+	btree_end(btree);
+	return true;
+}
+
+// A step of a lookup: the child to go to next, or BTREE_NULL if the search
+// ends in this node (then `found` and `value` are set).
+typedef BtreePtr (*BtreeLookupStep)(
+	const char *node, const void *key, size_t key_size,
+	bool *found, BtreeValue *value);
+
+typedef enum {
+	BTREE_TOP_NONE, // Nothing is cached.
+	BTREE_TOP_FOUND, // The search ended in the upper levels.
+	BTREE_TOP_BELOW, // Go on from the node below them.
+	BTREE_TOP_RETRY
+} BtreeTopResult;
+
+static BtreeTopResult btree_top_lookup(
+	Btree *btree, BtreeLookupStep step, const void *key, size_t key_size,
+	bool *found, BtreeValue *value, BtreePtr *below_ptr, uint64_t *version) {
+
+	// Go through the copies of the upper levels. The version of the node
+	// below them is read while the copies can't change -- they're updated
+	// while the written nodes are latched (see btree_flush_writes), so if it
+	// isn't odd, the node's parent among the copies was current when it was
+	// read.
+	pthread_rwlock_rdlock(&btree->top_lock);
+	if (btree->top.n_nodes == 0) {
+		pthread_rwlock_unlock(&btree->top_lock);
+		return BTREE_TOP_NONE;
+	}
+	BtreePtr ptr = btree->top.root;
+	size_t i_top;
+	while ((i_top = btree_top_find(&btree->top, ptr)) != SIZE_MAX) {
+		ptr = step(btree_top_node(btree, i_top), key, key_size, found, value);
+		if (ptr == BTREE_NULL) {
+			pthread_rwlock_unlock(&btree->top_lock);
+			return BTREE_TOP_FOUND;
+		}
+	}
+	*below_ptr = ptr;
+	*version = __atomic_load_n(btree_latch(btree, ptr), __ATOMIC_ACQUIRE);
+	pthread_rwlock_unlock(&btree->top_lock);
+	if (*version % 2 == 1) {
+		sched_yield();
+		return BTREE_TOP_RETRY;
+	}
+	return BTREE_TOP_BELOW;
+}
+
+static bool btree_try_lookup(
+	Btree *btree, BtreePtr root_ptr, BtreeLookupStep step,
+	const void *key, size_t key_size, char *node,
+	bool *found, BtreeValue *value) {
+
+	// Copies the nodes on the path into `node` (without holding any locks),
+	// checking each copy against the node's latch (see struct Btree) before
+	// using it, and the parent's latch after getting to the child (so that
+	// the child wasn't freed and reused in the meantime). Encoded leaves are
+	// decoded past the copy. Returns false if a writer got in the way, and
+	// the lookup has to start over. A root_ptr of BTREE_NULL means the
+	// current root.
+
+	BtreePtr node_ptr;
+	uint64_t version;
+	BtreeTopResult top_result = root_ptr == BTREE_NULL
+		? btree_top_lookup(btree, step, key, key_size, found, value,
+		                   &node_ptr, &version)
+		: BTREE_TOP_NONE;
+	if (top_result == BTREE_TOP_FOUND)
+		return true;
+	if (top_result == BTREE_TOP_RETRY)
+		return false;
+	if (top_result == BTREE_TOP_NONE) {
+		bool is_current = root_ptr == BTREE_NULL;
+		if (is_current) {
+			root_ptr = __atomic_load_n(&btree->published_root,
+			                           __ATOMIC_ACQUIRE);
+		}
+		node_ptr = root_ptr;
+		version = btree_latch_wait(btree, node_ptr);
+		if (is_current && __atomic_load_n(&btree->published_root,
+		                                  __ATOMIC_RELAXED) != root_ptr)
+			return false;
+	}
+
+	for (int depth = 0; ; depth++) {
+		xassert(1, depth < BTREE_MAX_DEPTH);
+		// The block may be past the end if compaction shrank the file.
+		if (!fs_try_read(btree->file, node, node_ptr * btree->block_size,
+		                 btree->block_size) ||
+		    !btree_latch_unchanged(btree, node_ptr, version))
+			return false;
+		const char *read = node;
+		if (btree_node_kind(node) == BTREE_NODE_ENCODED_LEAF) {
+			btree_unpack_leaf(node, node + btree->block_size,
+			                  btree->max_leaf_keys);
+			read = node + btree->block_size;
+		}
+		xassert(2, btree_node_valid(read, node_ptr == root_ptr));
+
+		BtreePtr child_ptr = step(read, key, key_size, found, value);
+		if (child_ptr == BTREE_NULL)
+			return true;
+		uint64_t child_version = btree_latch_wait(btree, child_ptr);
+		if (!btree_latch_unchanged(btree, node_ptr, version))
+			return false;
+		node_ptr = child_ptr;
+		version = child_version;
+	}
+}
+
+static bool btree_lookup(
+	Btree *btree, BtreePtr root_ptr, BtreeLookupStep step,
+	const void *key, size_t key_size, BtreeValue *value) {
+
+	// The first lookup after opening the tree makes the copies of the upper
+	// levels, unless a writer (or a walk) is busy.
+	if (!__atomic_load_n(&btree->top_valid, __ATOMIC_ACQUIRE) &&
+	    pthread_mutex_trylock(&btree->write_lock) == 0) {
+		if (!btree->top_valid)
+			btree_top_rebuild(btree);
+		pthread_mutex_unlock(&btree->write_lock);
+	}
+
+	char *node = malloc(btree->block_size + btree->node_size);
+	xassert(1, node != NULL);
+	bool found;
+	BtreeValue found_value;
+	while (!btree_try_lookup(btree, root_ptr, step, key, key_size, node,
+	                         &found, &found_value))
+		;
+	free(node);
+	if (found && value != NULL)
+		*value = found_value;
+	return found;
+}
+
+static BtreePtr btree_lookup_step(
+	const char *node, const void *key_void, size_t key_size,
+	bool *found, BtreeValue *value) {
+
+	(void) key_size;
+	BtreeKey key = *(const BtreeKey *) key_void;
+	int i_item = btree_node_lower_bound(node, key);
+
+	*found = i_item < btree_node_n_items(node) &&
+		btree_key_cmp(btree_node_key(node, i_item), key) == 0;
+	if (*found && !btree_node_has_values(node)) {
+		// A B+ tree's separator. The item is in the right subtree.
+		*found = false;
+		i_item++;
+	}
+	if (*found) {
+		*value = btree_node_value(node, i_item);
+		return BTREE_NULL;
+	}
+	if (btree_node_is_leaf(node))
+		return BTREE_NULL;
+	// We know that keys[i_item - 1] < item.key < keys[i_item], so the key
+	// (if it exists) will be in the i_item-th child's subtree.
+	return btree_node_child(node, i_item);
+}
+
+bool btree_get(Btree *btree, BtreeKey key, BtreeValue *value) {
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+
+	// Most missing keys are ruled out by the filter. If there isn't one, the
+	// first lookup asks for it (unless a writer is busy, and will).
+	pthread_rwlock_rdlock(&btree->bloom_lock);
+	bool filtered = btree->bloom != NULL;
+	bool ruled_out = filtered && !bloom_may_contain(btree->bloom, key);
+	pthread_rwlock_unlock(&btree->bloom_lock);
+	if (ruled_out) {
+		__atomic_fetch_add(&btree->bloom_stats.n_negatives, 1,
+		                   __ATOMIC_RELAXED);
+		return false;
+	}
+	if (!filtered && btree->bloom_enabled &&
+	    pthread_mutex_trylock(&btree->write_lock) == 0) {
+		btree_bloom_request(btree);
+		pthread_mutex_unlock(&btree->write_lock);
+	}
+
+	bool found = btree_lookup(btree, BTREE_NULL, btree_lookup_step,
+	                          &key, sizeof(key), value);
+	if (filtered && !found) {
+		__atomic_fetch_add(&btree->bloom_stats.n_false_positives, 1,
+		                   __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+bool btree_snapshot_get(
+	BtreeSnapshot *snapshot, BtreeKey key, BtreeValue *value) {
+
+	return btree_lookup(snapshot->btree, snapshot->root, btree_lookup_step,
+	                    &key, sizeof(key), value);
+}
+
+static void btree_print_at_node(
+	Btree *btree, FILE *stream, BtreePtr node_ptr, int level) {
+
+	enum { INDENT_WIDTH = 4 };
+
+	// The node stays pinned while its children are printed.
+	const char *node = btree_pin_node(btree, node_ptr);
+	bool is_leaf = btree_node_is_leaf(node);
+	int n_items = btree_node_n_items(node);
+
+	fprintf(stream, "%*sNode %" BTREE_PTR_PRINT ":\n",
+	        level * INDENT_WIDTH, "", node_ptr);
+
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		if (!is_leaf) {
+			btree_print_at_node(btree, stream,
+			                    btree_node_child(node, i_item), level + 1);
+		}
+		if (btree_node_has_values(node)) {
+			fprintf(stream, "%*s%" BTREE_KEY_PRINT " => %" BTREE_VALUE_PRINT
+			        "\n", (level + 1) * INDENT_WIDTH, "",
+			        btree_node_key(node, i_item),
+			        btree_node_value(node, i_item));
+		} else {
+			fprintf(stream, "%*s%" BTREE_KEY_PRINT "\n",
+			        (level + 1) * INDENT_WIDTH, "",
+			        btree_node_key(node, i_item));
+		}
+	}
+	if (!is_leaf && n_items > 0) {
+		btree_print_at_node(btree, stream,
+		                    btree_node_child(node, n_items), level + 1);
+	}
+
+	btree_unpin_node(btree, node_ptr, node);
+}
+
+static void btree_print_bytes(FILE *stream, const char *bytes, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		if (isprint((unsigned char) bytes[i]) && bytes[i] != '\\')
+			fputc(bytes[i], stream);
+		else
+			fprintf(stream, "\\x%02X", (unsigned char) bytes[i]);
+	}
+}
+
+static void btree_bytes_print_at_node(
+	Btree *btree, FILE *stream, BtreePtr node_ptr, int level) {
+
+	// Like btree_print_at_node. Keys are printed with the node's prefix
+	// separated by a "|".
+	enum { INDENT_WIDTH = 4 };
+
+	const char *node = btree_pin_node(btree, node_ptr);
+	bool is_leaf = btree_node_is_leaf(node);
+	int n_items = btree_node_n_items(node);
+
+	fprintf(stream, "%*sNode %" BTREE_PTR_PRINT ":\n",
+	        level * INDENT_WIDTH, "", node_ptr);
+
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		if (!is_leaf) {
+			btree_bytes_print_at_node(btree, stream,
+			                          btree_slotted_child(node, i_item),
+			                          level + 1);
+		}
+		fprintf(stream, "%*s", (level + 1) * INDENT_WIDTH, "");
+		btree_print_bytes(stream, btree_slotted_prefix(node),
+		                  btree_slotted_prefix_size(node));
+		fputc('|', stream);
+		btree_print_bytes(stream, btree_slotted_suffix(node, i_item),
+		                  btree_slotted_suffix_size(node, i_item));
+		if (is_leaf) {
+			fprintf(stream, " => %" BTREE_VALUE_PRINT,
+			        btree_slotted_value(node, i_item));
+		}
+		fputc('\n', stream);
+	}
+	if (!is_leaf) {
+		btree_bytes_print_at_node(btree, stream,
+		                          btree_slotted_child(node, n_items),
+		                          level + 1);
+	}
+
+	btree_unpin_node(btree, node_ptr, node);
+}
+
+void btree_print(Btree *btree, FILE *stream) {
+	pthread_mutex_lock(&btree->write_lock);
+	if (btree->layout == BTREE_LAYOUT_BYTES)
+		btree_bytes_print_at_node(btree, stream, btree->superblock.root, 0);
+	else
+		btree_print_at_node(btree, stream, btree->superblock.root, 0);
+	pthread_mutex_unlock(&btree->write_lock);
+}
+
+static void btree_walk_at_node(
+	Btree *btree, BtreePtr node_ptr,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+
+	const char *node = btree_pin_node(btree, node_ptr);
+	bool is_leaf = btree_node_is_leaf(node);
+	int n_items = btree_node_n_items(node);
 
-typedef struct {
-	BtreeKey key;
-	BtreeValue value;
-} BtreeItem;
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		if (!is_leaf) {
+			btree_walk_at_node(btree, btree_node_child(node, i_item),
+			                   callback, callback_context);
+		}
+		if (btree_node_has_values(node)) { // Not a B+ tree's separator.
+			callback(btree_node_key(node, i_item),
+			         btree_node_value(node, i_item), callback_context);
+		}
+	}
+	if (!is_leaf) {
+		btree_walk_at_node(btree, btree_node_child(node, n_items),
+		                   callback, callback_context);
+	}
 
-static int btree_item_cmp(BtreeItem a, BtreeItem b) {
-	// Convenience function.
-	return btree_key_cmp(a.key, b.key);
+	btree_unpin_node(btree, node_ptr, node);
 }
 
-typedef struct {
-	bool is_leaf; // Serialized as uint8_t.
-	uint16_t n_items;
-	// Invariant: keys in children[i] < keys[i] < keys in children[i + 1].
-	BtreeItem items[BTREE_MAX_KEYS];
-	BtreePtr children[BTREE_MAX_CHILDREN];
-} BtreeNode;
-
-static bool btree_node_valid(BtreeNode node, bool is_root) {
-	if (node.n_items > BTREE_MAX_KEYS)
-		return false;
+static void btree_walk_leaves(
+	Btree *btree,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
 
-	if (!is_root && node.n_items < BTREE_MIN_KEYS)
-		return false;
+	// In a B+ tree, go down to the first leaf, and then along the list of
+	// leaves.
+	BtreePtr node_ptr = btree->superblock.root;
+	while (true) {
+		const char *node = btree_pin_node(btree, node_ptr);
+		bool is_leaf = btree_node_is_leaf(node);
+		BtreePtr child_ptr = is_leaf ? BTREE_NULL : btree_node_child(node, 0);
+		btree_unpin_node(btree, node_ptr, node);
+		if (is_leaf)
+			break;
+		node_ptr = child_ptr;
+	}
 
-	if (!node.is_leaf) {
-		for (int i_child = 0; i_child <= node.n_items; i_child++) {
-			if (node.children[i_child] == BTREE_NULL)
-				return false;
+	while (node_ptr != BTREE_NULL) {
+		const char *node = btree_pin_node(btree, node_ptr);
+		for (int i_item = 0; i_item < btree_node_n_items(node); i_item++) {
+			callback(btree_node_key(node, i_item),
+			         btree_node_value(node, i_item), callback_context);
 		}
+		BtreePtr next_ptr = btree_node_link(node, BTREE_LINK_NEXT);
+		btree_unpin_node(btree, node_ptr, node);
+		node_ptr = next_ptr;
 	}
+}
 
-	// Check that keys are in ascending order.
-	BtreeItem prev_item = node.items[0];
-	for (int i_item = 1; i_item < node.n_items; i_item++) {
-		if (btree_item_cmp(prev_item, node.items[i_item]) >= 0)
-			return false;
-		prev_item = node.items[i_item];
+void btree_walk(
+	Btree *btree,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	pthread_mutex_lock(&btree->write_lock);
+	if (btree_is_bplus(btree)) {
+		btree_walk_leaves(btree, callback, callback_context);
+	} else {
+		btree_walk_at_node(btree, btree->superblock.root,
+		                   callback, callback_context);
 	}
+	pthread_mutex_unlock(&btree->write_lock);
+}
 
-	return true;
+static const char *btree_snapshot_copy_node(
+	Btree *btree, BtreePtr ptr, bool is_root, char *node) {
+
+	// Copies a node that a snapshot sees into `node` (block_size +
+	// node_size bytes, as in btree_try_lookup), without any locks. Writers
+	// copy such nodes instead of changing them, and their blocks aren't
+	// reused before the snapshot is closed, but a node may still be
+	// rewritten in place with the same items (see btree_cow_changed), so the
+	// copy is checked against its latch.
+	while (true) {
+		uint64_t version = btree_latch_wait(btree, ptr);
+		bool read = fs_try_read(btree->file, node, ptr * btree->block_size,
+		                        btree->block_size);
+		xassert(1, read); // No compaction while snapshots are open.
+		if (btree_latch_unchanged(btree, ptr, version))
+			break;
+	}
+	const char *copy = node;
+	if (btree_node_kind(node) == BTREE_NODE_ENCODED_LEAF) {
+		btree_unpack_leaf(node, node + btree->block_size,
+		                  btree->max_leaf_keys);
+		copy = node + btree->block_size;
+	}
+	xassert(2, btree_node_valid(copy, is_root));
+	return copy;
+}
+
+static void btree_snapshot_walk_at_node(
+	BtreeSnapshot *snapshot, BtreePtr node_ptr, int depth, char *nodes,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+
+	// Like btree_walk_at_node. `nodes` has room for a copy per level.
+	Btree *btree = snapshot->btree;
+	xassert(1, depth < BTREE_MAX_DEPTH);
+	const char *node = btree_snapshot_copy_node(
+		btree, node_ptr, node_ptr == snapshot->root,
+		nodes + depth * (btree->block_size + btree->node_size));
+	bool is_leaf = btree_node_is_leaf(node);
+	int n_items = btree_node_n_items(node);
+
+	for (int i_item = 0; i_item <= n_items; i_item++) {
+		if (!is_leaf) {
+			btree_snapshot_walk_at_node(
+				snapshot, btree_node_child(node, i_item), depth + 1, nodes,
+				callback, callback_context);
+		}
+		if (i_item < n_items && btree_node_has_values(node)) {
+			callback(btree_node_key(node, i_item),
+			         btree_node_value(node, i_item), callback_context);
+		}
+	}
+}
+
+void btree_snapshot_walk(
+	BtreeSnapshot *snapshot,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+
+	// Without the write lock, so that writers (including the callback) go on
+	// during the walk. Not along the leaves of a B+ tree -- their links are
+	// updated in place (see btree_cow_changed).
+	Btree *btree = snapshot->btree;
+	char *nodes = malloc(BTREE_MAX_DEPTH *
+	                     (btree->block_size + btree->node_size));
+	xassert(1, nodes != NULL);
+	btree_snapshot_walk_at_node(snapshot, snapshot->root, 0, nodes,
+	                            callback, callback_context);
+	free(nodes);
 }
 
+// Parallel walks. The upper levels are split into a list of tasks in key
+// order: disjoint subtrees, and (in a B-tree) the items between them. Worker
+// threads take the tasks in turn, and walk the subtrees with
+// btree_walk_at_node. The writers are kept out (by the calling thread), so
+// the workers read the nodes without locking.
 typedef struct {
-	BtreePtr next_free;
-} BtreeFree; // Free block (which is always an entry in the free list).
+	BtreePtr ptr; // BTREE_NULL if the task is a single item.
+	BtreeItem item;
+	// Ordered walks: the task's items, and whether it's done.
+	BtreeItem *items;
+	size_t n_items;
+	size_t capacity;
+	bool done;
+} BtreeWalkTask;
 
-struct Btree { // Typedef'd in the header file.
-	FsFile *file;
-	BtreeSuperblock superblock; // Cache.
-};
+typedef struct {
+	Btree *btree;
+	BtreeWalkTask *tasks;
+	size_t n_tasks;
+	size_t next_task;
+	void (*callback)(BtreeKey, BtreeValue, void *);
+	void **callback_contexts; // Unordered walks: one per thread.
+	int next_thread;
 
-#define DESERIALIZE(ptr, dest, type) \
-	do { \
-		(dest) = *(type *) (ptr); \
-		(ptr) = (char *) (ptr) + sizeof(type); \
-	} while (false)
+	// Ordered walks: tasks are only started while there are fewer than
+	// `window` of them waiting to be passed on (by the calling thread), so
+	// that their items don't pile up.
+	bool ordered;
+	size_t window;
+	size_t n_passed;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} BtreeWalkPool;
 
-#define SERIALIZE(ptr, src, type) \
-	do { \
-		*(type *) (ptr) = (src); \
-		(ptr) = (char *) (ptr) + sizeof(type); \
-	} while (false)
+static void btree_walk_add_task(
+	BtreeWalkTask **tasks, size_t *n_tasks, size_t *capacity,
+	BtreePtr ptr, BtreeItem item) {
+
+	if (*n_tasks == *capacity) {
+		*capacity = MAX(16, *capacity * 2);
+		*tasks = realloc(*tasks, *capacity * sizeof(**tasks));
+		xassert(1, *tasks != NULL);
+	}
+	(*tasks)[(*n_tasks)++] = (BtreeWalkTask) {
+		.ptr = ptr, .item = item, .items = NULL, .n_items = 0,
+		.capacity = 0, .done = false};
+}
+
+static BtreeWalkTask *btree_walk_split(
+	Btree *btree, size_t min_n_subtrees, size_t *n_tasks) {
 
-static void btree_read_superblock(Btree *btree) {
-	char block[BTREE_BLOCK_SIZE];
-	fs_read(btree->file, block, 0, sizeof(block));
-	void *pos = block;
+	// Replace the subtrees with their children (and the items between them),
+	// one level at a time, until there are enough of them, or they're
+	// leaves.
+	BtreeWalkTask *tasks = NULL;
+	size_t capacity = 0;
+	*n_tasks = 0;
+	BtreeItem no_item = {0, 0};
+	btree_walk_add_task(&tasks, n_tasks, &capacity, btree->superblock.root,
+	                    no_item);
+	size_t n_subtrees = 1;
 
-	DESERIALIZE(pos, btree->superblock.root, BtreePtr);
-	DESERIALIZE(pos, btree->superblock.free_list_head, BtreePtr);
-	DESERIALIZE(pos, btree->superblock.end, BtreePtr);
+	while (n_subtrees < min_n_subtrees) {
+		BtreeWalkTask *level = tasks;
+		size_t n_level = *n_tasks;
+		tasks = NULL;
+		capacity = 0;
+		*n_tasks = 0;
+		n_subtrees = 0;
+		bool is_leaf = false;
+		for (size_t i = 0; i < n_level; i++) {
+			BtreePtr ptr = level[i].ptr;
+			if (ptr == BTREE_NULL) {
+				btree_walk_add_task(&tasks, n_tasks, &capacity, ptr,
+				                    level[i].item);
+				continue;
+			}
+			const char *node = btree_pin_node(btree, ptr);
+			is_leaf = btree_node_is_leaf(node);
+			if (is_leaf) {
+				btree_unpin_node(btree, ptr, node);
+				break;
+			}
+			int n_items = btree_node_n_items(node);
+			for (int i_item = 0; i_item <= n_items; i_item++) {
+				btree_walk_add_task(&tasks, n_tasks, &capacity,
+				                    btree_node_child(node, i_item), no_item);
+				n_subtrees++;
+				if (i_item < n_items && btree_node_has_values(node)) {
+					btree_walk_add_task(&tasks, n_tasks, &capacity,
+					                    BTREE_NULL,
+					                    btree_node_item(node, i_item));
+				}
+			}
+			btree_unpin_node(btree, ptr, node);
+		}
+
+		// The tree is balanced, so the subtrees are leaves at the same level.
+		if (is_leaf) {
+			free(tasks);
+			tasks = level;
+			*n_tasks = n_level;
+			break;
+		}
+		free(level);
+	}
+	return tasks;
 }
 
-static void btree_write_superblock(Btree *btree) {
-	char block[BTREE_BLOCK_SIZE];
-	char *end = block;
-	SERIALIZE(end, btree->superblock.root, BtreePtr);
-	SERIALIZE(end, btree->superblock.free_list_head, BtreePtr);
-	SERIALIZE(end, btree->superblock.end, BtreePtr);
-	fs_write(btree->file, block, 0, end - block);
+static void btree_walk_buffer(BtreeKey key, BtreeValue value, void *task_void) {
+	BtreeWalkTask *task = task_void;
+	if (task->n_items == task->capacity) {
+		task->capacity = MAX(64, task->capacity * 2);
+		task->items = realloc(task->items,
+		                      task->capacity * sizeof(*task->items));
+		xassert(1, task->items != NULL);
+	}
+	task->items[task->n_items++] = (BtreeItem) {key, value};
 }
 
-static BtreeFree btree_read_free(Btree *btree, BtreePtr ptr) {
-	char block[BTREE_BLOCK_SIZE];
-	fs_read(btree->file, block, ptr * BTREE_BLOCK_SIZE, sizeof(block));
-	void *pos = block;
+static void *btree_walk_worker(void *pool_void) {
+	BtreeWalkPool *pool = pool_void;
+	int i_thread = __atomic_fetch_add(&pool->next_thread, 1,
+	                                  __ATOMIC_RELAXED);
+	while (true) {
+		size_t i_task;
+		if (pool->ordered) {
+			pthread_mutex_lock(&pool->lock);
+			while (pool->next_task < pool->n_tasks &&
+			       pool->next_task >= pool->n_passed + pool->window)
+				pthread_cond_wait(&pool->changed, &pool->lock);
+			i_task = pool->next_task;
+			if (i_task < pool->n_tasks)
+				pool->next_task++;
+			pthread_mutex_unlock(&pool->lock);
+		} else {
+			i_task = __atomic_fetch_add(&pool->next_task, 1,
+			                            __ATOMIC_RELAXED);
+		}
+		if (i_task >= pool->n_tasks)
+			return NULL;
 
-	BtreeFree free;
-	DESERIALIZE(pos, free.next_free, BtreePtr);
-	return free;
-}
+		BtreeWalkTask *task = &pool->tasks[i_task];
+		void (*callback)(BtreeKey, BtreeValue, void *) =
+			pool->ordered ? btree_walk_buffer : pool->callback;
+		void *context = pool->ordered ? (void *) task
+			: pool->callback_contexts[i_thread];
+		if (task->ptr == BTREE_NULL)
+			callback(task->item.key, task->item.value, context);
+		else
+			btree_walk_at_node(pool->btree, task->ptr, callback, context);
 
-static void btree_write_free(Btree *btree, BtreeFree free, BtreePtr ptr) {
-	char block[BTREE_BLOCK_SIZE];
-	char *end = block;
-	SERIALIZE(end, free.next_free, BtreePtr);
-	fs_write(btree->file, block, ptr * BTREE_BLOCK_SIZE, end - block);
+		if (pool->ordered) {
+			pthread_mutex_lock(&pool->lock);
+			task->done = true;
+			pthread_cond_broadcast(&pool->changed);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
 }
 
-static BtreeNode btree_read_node(Btree *btree, BtreePtr ptr) {
-	char block[BTREE_BLOCK_SIZE];
-	fs_read(btree->file, block, ptr * BTREE_BLOCK_SIZE, sizeof(block));
-	void *pos = block;
+static void btree_walk_pool(
+	Btree *btree, int n_threads, bool ordered,
+	void (*callback)(BtreeKey, BtreeValue, void *),
+	void **callback_contexts) {
 
-	BtreeNode node;
-	DESERIALIZE(pos, node.is_leaf, uint8_t);
-	DESERIALIZE(pos, node.n_items, uint16_t);
-	for (int i_item = 0; i_item < BTREE_MAX_KEYS; i_item++) {
-		DESERIALIZE(pos, node.items[i_item].key, BtreeKey);
-		DESERIALIZE(pos, node.items[i_item].value, BtreeKey);
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES && n_threads >= 1);
+	pthread_mutex_lock(&btree->write_lock);
+	BtreeWalkPool pool = {
+		.btree = btree, .next_task = 0, .callback = callback,
+		.callback_contexts = callback_contexts, .next_thread = 0,
+		.ordered = ordered, .window = 2 * (size_t) n_threads,
+		.n_passed = 0};
+	pool.tasks = btree_walk_split(
+		btree, (size_t) n_threads * BTREE_WALK_TASKS_PER_THREAD,
+		&pool.n_tasks);
+	int lock_result = pthread_mutex_init(&pool.lock, NULL);
+	int cond_result = pthread_cond_init(&pool.changed, NULL);
+	xassert(1, lock_result == 0 && cond_result == 0);
+
+	pthread_t *threads = malloc(n_threads * sizeof(*threads));
+	xassert(1, threads != NULL);
+	for (int i = 0; i < n_threads; i++) {
+		int create_result = pthread_create(&threads[i], NULL,
+		                                   btree_walk_worker, &pool);
+		xassert(1, create_result == 0);
 	}
-	for (int i_child = 0; i_child < BTREE_MAX_CHILDREN; i_child++)
-		DESERIALIZE(pos, node.children[i_child], BtreePtr);
 
-	xassert(2, btree_node_valid(node, ptr == btree->superblock.root));
-	return node;
+	// In an ordered walk, pass on the tasks' items as they're done.
+	for (size_t i_task = 0; ordered && i_task < pool.n_tasks; i_task++) {
+		BtreeWalkTask *task = &pool.tasks[i_task];
+		pthread_mutex_lock(&pool.lock);
+		while (!task->done)
+			pthread_cond_wait(&pool.changed, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		for (size_t i = 0; i < task->n_items; i++) {
+			callback(task->items[i].key, task->items[i].value,
+			         callback_contexts[0]);
+		}
+		free(task->items);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.n_passed++;
+		pthread_cond_broadcast(&pool.changed);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	for (int i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_cond_destroy(&pool.changed);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.tasks);
+	pthread_mutex_unlock(&btree->write_lock);
 }
 
-static void btree_write_node(Btree *btree, BtreeNode node, BtreePtr ptr) {
-	xassert(2, btree_node_valid(node, ptr == btree->superblock.root));
+void btree_walk_parallel(
+	Btree *btree, int n_threads,
+	void (*callback)(BtreeKey, BtreeValue, void *),
+	void **callback_contexts) {
 
-	char block[BTREE_BLOCK_SIZE];
-	char *end = block;
+	btree_walk_pool(btree, n_threads, false, callback, callback_contexts);
+}
 
-	SERIALIZE(end, node.is_leaf ? 1 : 0, uint8_t);
-	SERIALIZE(end, node.n_items, uint16_t);
-	for (int i_item = 0; i_item < BTREE_MAX_KEYS; i_item++) {
-		SERIALIZE(end, node.items[i_item].key, BtreeKey);
-		SERIALIZE(end, node.items[i_item].value, BtreeKey);
-	}
-	for (int i_child = 0; i_child < BTREE_MAX_CHILDREN; i_child++)
-		SERIALIZE(end, node.children[i_child], BtreePtr);
+void btree_walk_parallel_ordered(
+	Btree *btree, int n_threads,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
 
-	fs_write(btree->file, block, ptr * BTREE_BLOCK_SIZE, end - block);
+	btree_walk_pool(btree, n_threads, true, callback, &callback_context);
 }
 
-static void btree_sync(Btree *btree) {
-	btree_write_superblock(btree);
+// Cursors keep the path from the root to the current item pinned, so moving
+// within a node doesn't touch the file, and every node is read once while
+// the cursor passes through it. In a B+ tree, the items are all in the
+// leaves, which are linked, so only the current leaf is kept.
+typedef struct {
+	BtreePtr ptr;
+	const char *node;
+	// Index of the child the path continues to or, in the last step, of the
+	// current item.
+	int i;
+} BtreeCursorStep;
+
+struct BtreeCursor { // Typedef'd in the header file.
+	Btree *btree;
+	BtreeCursorStep path[BTREE_MAX_DEPTH];
+	int depth; // -1 if the cursor is outside the items.
+	bool past_end; // If it's outside: after the last item (or before the
+	               // first).
+};
+
+static void btree_cursor_pop(BtreeCursor *cursor) {
+	BtreeCursorStep *step = &cursor->path[cursor->depth--];
+	btree_unpin_node(cursor->btree, step->ptr, step->node);
 }
 
-static BtreeNode btree_new_node(void) {
-	BtreeNode node;
-	node.n_items = 0;
-	node.is_leaf = true;
+static void btree_cursor_push(
+	BtreeCursor *cursor, BtreePtr ptr, bool rightmost) {
 
-	// For debugging.
-	for (int i_key = 0; i_key < BTREE_MAX_KEYS; i_key++) {
-		node.items[i_key].key = 0xDEADBEEF;
-		node.items[i_key].value = 0xDEADBEEF;
+	// Go down to a node, to its first child or item (or to its last one). In
+	// a B+ tree, the node replaces its parent.
+	if (btree_is_bplus(cursor->btree) && cursor->depth >= 0)
+		btree_cursor_pop(cursor);
+	xassert(1, cursor->depth < BTREE_MAX_DEPTH - 1);
+	BtreeCursorStep *step = &cursor->path[++cursor->depth];
+	step->ptr = ptr;
+	step->node = btree_pin_node(cursor->btree, ptr);
+	step->i = 0;
+	if (rightmost) {
+		step->i = btree_node_n_items(step->node);
+		if (btree_node_is_leaf(step->node))
+			step->i--;
 	}
+}
 
-	for (int i_child = 0; i_child < BTREE_MAX_CHILDREN; i_child++)
-		node.children[i_child] = BTREE_NULL;
-
-	return node;
+static BtreeCursorStep *btree_cursor_top(BtreeCursor *cursor) {
+	return &cursor->path[cursor->depth];
 }
 
-Btree *btree_new(const char *file_name) {
-	Btree *btree = malloc(sizeof(*btree));
+static void btree_cursor_descend(BtreeCursor *cursor, bool rightmost) {
+	// Go down from the current child to the first (or last) item in its
+	// subtree.
+	while (!btree_node_is_leaf(btree_cursor_top(cursor)->node)) {
+		BtreeCursorStep *step = btree_cursor_top(cursor);
+		btree_cursor_push(cursor, btree_node_child(step->node, step->i),
+		                  rightmost);
+	}
+}
 
-	btree->file = fs_open(file_name, true);
-	fs_set_size(btree->file, BTREE_BLOCK_SIZE * 2);
+static void btree_cursor_settle_forward(BtreeCursor *cursor) {
+	// If the cursor is past the last item of a node, go up to the item that
+	// follows the node's subtree (child i is followed by item i), or in a B+
+	// tree, to the next leaf.
+	while (cursor->depth >= 0 &&
+	       btree_cursor_top(cursor)->i >=
+	       btree_node_n_items(btree_cursor_top(cursor)->node)) {
+		const char *node = btree_cursor_top(cursor)->node;
+		BtreePtr next_ptr = btree_node_is_plus_leaf(node)
+			? btree_node_link(node, BTREE_LINK_NEXT) : BTREE_NULL;
+		btree_cursor_pop(cursor);
+		if (next_ptr != BTREE_NULL)
+			btree_cursor_push(cursor, next_ptr, false);
+	}
+	if (cursor->depth < 0)
+		cursor->past_end = true;
+}
 
-	btree->superblock.root = 1;
-	btree->superblock.end = 2;
-	btree->superblock.free_list_head = BTREE_NULL;
-	btree_write_superblock(btree);
+static void btree_cursor_settle_backward(BtreeCursor *cursor) {
+	// Same, before the first item (child i is preceded by item i - 1).
+	while (cursor->depth >= 0 && btree_cursor_top(cursor)->i < 0) {
+		const char *node = btree_cursor_top(cursor)->node;
+		BtreePtr prev_ptr = btree_node_is_plus_leaf(node)
+			? btree_node_link(node, BTREE_LINK_PREV) : BTREE_NULL;
+		btree_cursor_pop(cursor);
+		if (prev_ptr != BTREE_NULL)
+			btree_cursor_push(cursor, prev_ptr, true);
+		else if (cursor->depth >= 0)
+			btree_cursor_top(cursor)->i--;
+	}
+	if (cursor->depth < 0)
+		cursor->past_end = false;
+}
 
-	BtreeNode root = btree_new_node();
-	btree_write_node(btree, root, btree->superblock.root);
+BtreeCursor *btree_cursor_seek(Btree *btree, BtreeKey key) {
+	xassert(1, btree->layout != BTREE_LAYOUT_BYTES);
+	BtreeCursor *cursor = malloc(sizeof(*cursor));
+	xassert(1, cursor != NULL);
+	cursor->btree = btree;
+	cursor->depth = -1;
+	pthread_mutex_lock(&btree->write_lock);
 
-	return btree;
+	btree_cursor_push(cursor, btree->superblock.root, false);
+	while (true) {
+		BtreeCursorStep *step = btree_cursor_top(cursor);
+		if (!btree_node_has_values(step->node)) {
+			step->i = btree_node_find_child(step->node, key);
+		} else {
+			step->i = btree_node_lower_bound(step->node, key);
+			if (step->i < btree_node_n_items(step->node) &&
+			    btree_key_cmp(btree_node_key(step->node, step->i), key) == 0)
+				break;
+		}
+		if (btree_node_is_leaf(step->node))
+			break;
+		btree_cursor_push(cursor, btree_node_child(step->node, step->i),
+		                  false);
+	}
+	btree_cursor_settle_forward(cursor);
+	return cursor;
 }
 
-void btree_destroy(Btree *btree) {
-	xassert(1, btree->file != NULL);
-	btree_sync(btree);
-	fs_close(btree->file);
-	free(btree);
+bool btree_cursor_get(
+	BtreeCursor *cursor, BtreeKey *key, BtreeValue *value) {
+
+	if (cursor->depth < 0)
+		return false;
+	BtreeCursorStep *step = btree_cursor_top(cursor);
+	*key = btree_node_key(step->node, step->i);
+	*value = btree_node_value(step->node, step->i);
+	return true;
 }
 
-static BtreePtr btree_alloc_block(Btree *btree) {
-	BtreePtr free = btree->superblock.free_list_head;
-	if (free != BTREE_NULL) {
-		// If the free list is non-empty, use its first element.
-		BtreePtr next_free = btree_read_free(btree, free).next_free;
-		btree->superblock.free_list_head = next_free;
-		return free;
+bool btree_cursor_next(BtreeCursor *cursor) {
+	if (cursor->depth < 0) {
+		if (cursor->past_end)
+			return false;
+		btree_cursor_push(cursor, cursor->btree->superblock.root, false);
 	} else {
-		// Otherwise, enlarge the file by 1 block.
-		BtreePtr old_end = btree->superblock.end;
-		btree->superblock.end++;
-		fs_set_size(btree->file, btree->superblock.end * BTREE_BLOCK_SIZE);
-		return old_end;
+		btree_cursor_top(cursor)->i++;
 	}
+	btree_cursor_descend(cursor, false);
+	btree_cursor_settle_forward(cursor);
+	return cursor->depth >= 0;
 }
 
-static void btree_dealloc_block(Btree *btree, BtreePtr ptr) {
-	// Only adds to the free list; doesn't shrink the file.
-	BtreeFree new_free;
-	new_free.next_free = btree->superblock.free_list_head;
-	btree_write_free(btree, new_free, ptr);
-	btree->superblock.free_list_head = ptr;
+bool btree_cursor_prev(BtreeCursor *cursor) {
+	if (cursor->depth < 0) {
+		if (!cursor->past_end)
+			return false;
+		btree_cursor_push(cursor, cursor->btree->superblock.root, true);
+	} else if (btree_node_is_leaf(btree_cursor_top(cursor)->node)) {
+		btree_cursor_top(cursor)->i--;
+	}
+	// In an internal node, the previous item is the last one in the subtree
+	// of child i.
+	btree_cursor_descend(cursor, true);
+	btree_cursor_settle_backward(cursor);
+	return cursor->depth >= 0;
 }
 
-static void btree_compensate(
-	BtreeItem *separator_in_parent,
-	BtreeNode *left, BtreeNode *right,
-	BtreeItem new_item, BtreePtr new_right_child,
-	bool new_item_in_left, int i_new_item) {
+void btree_cursor_close(BtreeCursor *cursor) {
+	while (cursor->depth >= 0)
+		btree_cursor_pop(cursor);
+	pthread_mutex_unlock(&cursor->btree->write_lock);
+	free(cursor);
+}
 
-	xassert(1, left->n_items < BTREE_MAX_KEYS ||
-	        right->n_items < BTREE_MAX_KEYS);
+// Variable-length keys (BTREE_LAYOUT_BYTES). Inserting a key into a slotted
+// node takes its slot and cell in place, if the key has the node's prefix
+// and there's room. Otherwise, the node's entries are decoded (pointing into
+// a copy of the node), and the node is rebuilt with their common prefix --
+// which may be longer than before, making room -- or split in two.
 
-	// The nodes *left and *right don't need to have a valid number of items.
-	// Because of that, we can use this function to make them valid.
-	xassert(1, left->n_items == 0 ||
-	        btree_item_cmp(left->items[left->n_items - 1],
-	                       *separator_in_parent) < 0);
-	xassert(1, right->n_items == 0 ||
-	        btree_item_cmp(*separator_in_parent,
-	                       right->items[0]) < 0);
+static size_t btree_entry_size(const BtreeBytesEntry *entry) {
+	return entry->prefix_size + entry->suffix_size;
+}
 
-	xassert(1, !!left->is_leaf == !!right->is_leaf &&
-	        !!right->is_leaf == (new_right_child == BTREE_NULL));
+static char btree_entry_byte(const BtreeBytesEntry *entry, size_t i) {
+	if (i < entry->prefix_size)
+		return entry->prefix[i];
+	return entry->suffix[i - entry->prefix_size];
+}
 
-	// Collect the items of both nodes, the item separating them and the item to
-	// insert (new_item) into an array.
+static size_t btree_entry_shared(
+	const BtreeBytesEntry *a, const BtreeBytesEntry *b) {
 
-	int i_new_item_in_all = new_item_in_left
-		? i_new_item : left->n_items + 1 + i_new_item;
+	size_t n_bytes = MIN(btree_entry_size(a), btree_entry_size(b));
+	size_t i = 0;
+	while (i < n_bytes && btree_entry_byte(a, i) == btree_entry_byte(b, i))
+		i++;
+	return i;
+}
 
-	BtreeItem all_items[BTREE_MAX_KEYS * 2 + 2];
-	int n_all_items = 0;
+static void btree_entry_copy_key(
+	const BtreeBytesEntry *entry, size_t from, size_t to, char *dest) {
 
-	for (int i = 0; i < left->n_items; i++) {
-		if (n_all_items == i_new_item_in_all)
-			all_items[n_all_items++] = new_item;
-		all_items[n_all_items++] = left->items[i];
+	// Bytes [from, to) of the key. `dest` may be the key itself.
+	if (from < entry->prefix_size) {
+		size_t n_bytes = MIN(to, entry->prefix_size) - from;
+		memmove(dest, entry->prefix + from, n_bytes);
+		dest += n_bytes;
+		from += n_bytes;
 	}
+	if (from < to)
+		memmove(dest, entry->suffix + (from - entry->prefix_size), to - from);
+}
 
-	if (n_all_items == i_new_item_in_all)
-		all_items[n_all_items++] = new_item;
-	all_items[n_all_items++] = *separator_in_parent;
+static int btree_slotted_get_entries(
+	const char *node, BtreeBytesEntry *entries) {
 
-	for (int i = 0; i < right->n_items; i++) {
-		if (n_all_items == i_new_item_in_all)
-			all_items[n_all_items++] = new_item;
-		all_items[n_all_items++] = right->items[i];
+	// Returns the number of entries. Their keys point into the node.
+	int n_items = btree_node_n_items(node);
+	size_t prefix_size = btree_slotted_prefix_size(node);
+	bool is_leaf = btree_node_is_leaf(node);
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		BtreeBytesEntry *entry = &entries[i_item];
+		entry->prefix = btree_slotted_prefix(node);
+		entry->prefix_size = prefix_size;
+		entry->suffix = btree_slotted_suffix(node, i_item);
+		entry->suffix_size = btree_slotted_suffix_size(node, i_item);
+		entry->shared = (i_item == 0) ? 0
+			: btree_entry_shared(&entries[i_item - 1], entry);
+		if (is_leaf)
+			entry->value = btree_slotted_value(node, i_item);
+		else
+			entry->child = btree_slotted_child(node, i_item + 1);
 	}
+	return n_items;
+}
 
-	if (n_all_items == i_new_item_in_all)
-		all_items[n_all_items++] = new_item;
+static size_t btree_entries_prefix_size(
+	const BtreeBytesEntry *entries, int n_entries) {
 
-	// Collect the children of both nodes and new_right_child into an array.
+	// The keys are sorted, so the prefix they all share is the smallest
+	// prefix shared by neighbors.
+	if (n_entries == 0)
+		return 0;
+	size_t prefix_size = btree_entry_size(&entries[0]);
+	for (int i = 1; i < n_entries; i++)
+		prefix_size = MIN(prefix_size, entries[i].shared);
+	return prefix_size;
+}
 
-	int i_new_child = i_new_item + 1;
-	int i_new_child_in_all = new_item_in_left
-		? i_new_child : left->n_items + 1 + i_new_child;
+static void btree_slotted_fill(
+	Btree *btree, char *node, const BtreeBytesEntry *entries,
+	int n_entries) {
 
-	BtreePtr all_children[BTREE_MAX_CHILDREN * 2 + 1];
-	int n_all_children = 0;
+	// Rebuild the node (keeping its kind and links) from the entries, which
+	// mustn't point into it. In an internal node, the entries' children are
+	// children 1 to n_entries.
+	size_t prefix_size = btree_entries_prefix_size(entries, n_entries);
+	size_t payload_size = btree_slotted_payload_size(node);
+	btree_node_set_n_items(node, n_entries);
+	btree_slotted_set_prefix_size(node, prefix_size);
+	if (n_entries > 0) {
+		btree_entry_copy_key(&entries[0], 0, prefix_size,
+		                     node + BTREE_SLOTTED_PREFIX);
+	}
 
-	if (!left->is_leaf) {
-		for (int i = 0; i < left->n_items + 1; i++) {
-			if (n_all_children == i_new_child_in_all)
-				all_children[n_all_children++] = new_right_child;
-			all_children[n_all_children++] = left->children[i];
-		}
+	uint16_t *slots = btree_slotted_slots(node);
+	size_t cells_start = btree->block_size;
+	for (int i = 0; i < n_entries; i++) {
+		const BtreeBytesEntry *entry = &entries[i];
+		uint16_t suffix_size = btree_entry_size(entry) - prefix_size;
+		cells_start -= sizeof(suffix_size) + suffix_size + payload_size;
+		char *cell = node + cells_start;
+		memcpy(cell, &suffix_size, sizeof(suffix_size));
+		cell += sizeof(suffix_size);
+		btree_entry_copy_key(entry, prefix_size, btree_entry_size(entry),
+		                     cell);
+		cell += suffix_size;
+		if (btree_node_is_leaf(node))
+			memcpy(cell, &entry->value, payload_size);
+		else
+			memcpy(cell, &entry->child, payload_size);
+		slots[i] = cells_start;
+	}
+	xassert(1, (char *) (slots + n_entries) <= node + cells_start);
+	btree_slotted_set_cells_start(node, cells_start);
+}
 
-		for (int i = 0; i < right->n_items + 1; i++) {
-			if (n_all_children == i_new_child_in_all)
-				all_children[n_all_children++] = new_right_child;
-			all_children[n_all_children++] = right->children[i];
-		}
+static bool btree_slotted_insert(
+	char *node, int i_item, const char *key, size_t key_size,
+	BtreeValue value, BtreePtr right_child) {
 
-		if (n_all_children == i_new_child_in_all)
-			all_children[n_all_children++] = new_right_child;
+	// Insert the key in place, if it has the node's prefix and there's room
+	// for its slot and cell. Returns false otherwise.
+
+	size_t prefix_size = btree_slotted_prefix_size(node);
+	if (key_size < prefix_size ||
+	    memcmp(key, btree_slotted_prefix(node), prefix_size) != 0)
+		return false;
+
+	int n_items = btree_node_n_items(node);
+	uint16_t *slots = btree_slotted_slots(node);
+	size_t payload_size = btree_slotted_payload_size(node);
+	uint16_t suffix_size = key_size - prefix_size;
+	size_t cell_size = sizeof(suffix_size) + suffix_size + payload_size;
+	size_t cells_start = btree_slotted_cells_start(node);
+	if ((char *) (slots + n_items + 1) + cell_size > node + cells_start)
+		return false;
+
+	cells_start -= cell_size;
+	char *cell = node + cells_start;
+	memcpy(cell, &suffix_size, sizeof(suffix_size));
+	memcpy(cell + sizeof(suffix_size), key + prefix_size, suffix_size);
+	if (btree_node_is_leaf(node)) {
+		memcpy(cell + sizeof(suffix_size) + suffix_size, &value,
+		       payload_size);
+	} else {
+		memcpy(cell + sizeof(suffix_size) + suffix_size, &right_child,
+		       payload_size);
 	}
+	memmove(slots + i_item + 1, slots + i_item,
+	        (n_items - i_item) * sizeof(*slots));
+	slots[i_item] = cells_start;
+	btree_node_set_n_items(node, n_items + 1);
+	btree_slotted_set_cells_start(node, cells_start);
+	return true;
+}
 
-	// Distribute the items among the left node, the place for an item in the
-	// parent, and the right node.
+static size_t btree_slotted_fill_size(
+	size_t prefix_size, size_t sum_of_sizes, int n_entries) {
 
-	left->n_items = (n_all_items - 1) / 2;
-	right->n_items = n_all_items - 1 - left->n_items;
+	// The bytes used by a node, if btree_slotted_fill puts the entries in it.
+	// sum_of_sizes is the sum of (slot + cell without a prefix) sizes.
+	return btree_slotted_slots_offset(prefix_size) + sum_of_sizes
+		- n_entries * prefix_size;
+}
 
-	int i_next_key = 0;
-	for (int i = 0; i < left->n_items; i++)
-		left->items[i] = all_items[i_next_key++];
-	*separator_in_parent = all_items[i_next_key++];
-	for (int i = 0; i < right->n_items; i++)
-		right->items[i] = all_items[i_next_key++];
-	xassert(1, i_next_key == n_all_items);
+static int btree_bytes_split_point(
+	Btree *btree, const BtreeBytesEntry *entries, int n_entries,
+	bool is_leaf) {
 
-	// Distribute the children between the nodes.
+	// The number of entries to leave in the left node when splitting (in an
+	// internal node, the next one goes up to the parent), such that both
+	// nodes fit, and the bigger one is as small as possible. The entries
+	// (except for the new one) used to fit with a common prefix. Any new key
+	// without that prefix can only be first or last, and the old entries fit
+	// on their own, so there's always a split that works.
 
-	if (!left->is_leaf) {
-		int i_next_child = 0;
-		for (int i = 0; i < left->n_items + 1; i++)
-			left->children[i] = all_children[i_next_child++];
-		for (int i = 0; i < right->n_items + 1; i++)
-			right->children[i] = all_children[i_next_child++];
-		xassert(1, i_next_child == n_all_children);
+	size_t payload_size = is_leaf ? sizeof(BtreeValue) : sizeof(BtreePtr);
+	size_t entry_overhead = 2 * sizeof(uint16_t) + payload_size;
+	size_t *left_sizes = btree->scratch_sizes; // For the first i entries.
+	size_t prefix_size = 0;
+	size_t sum_of_sizes = 0;
+	for (int i = 0; i < n_entries; i++) {
+		prefix_size = (i == 0) ? btree_entry_size(&entries[0])
+			: MIN(prefix_size, entries[i].shared);
+		sum_of_sizes += entry_overhead + btree_entry_size(&entries[i]);
+		left_sizes[i + 1] =
+			btree_slotted_fill_size(prefix_size, sum_of_sizes, i + 1);
 	}
 
-	// Check node validity.
-	xassert(2, btree_node_valid(*left, false) &&
-	        btree_node_valid(*right, false));
+	int n_up = is_leaf ? 0 : 1;
+	int best_n_left = 0;
+	size_t best_size = SIZE_MAX;
+	sum_of_sizes = 0;
+	for (int i_right = n_entries - 1; i_right - n_up >= 1; i_right--) {
+		prefix_size = (i_right == n_entries - 1)
+			? btree_entry_size(&entries[i_right])
+			: MIN(prefix_size, entries[i_right + 1].shared);
+		sum_of_sizes += entry_overhead + btree_entry_size(&entries[i_right]);
+		size_t right_size = btree_slotted_fill_size(
+			prefix_size, sum_of_sizes, n_entries - i_right);
+		int n_left = i_right - n_up;
+		size_t size = MAX(left_sizes[n_left], right_size);
+		if (size <= btree->block_size && size < best_size) {
+			best_n_left = n_left;
+			best_size = size;
+		}
+	}
+	xassert(1, best_n_left > 0);
+	return best_n_left;
 }
 
-typedef struct {
-	BtreePtr ptr;
-	BtreeNode node;
-} BtreeNodeCache;
+static void btree_bytes_up_pass(
+	Btree *btree, BtreePathStep *path, int depth,
+	const char *key, size_t key_size, BtreeValue value) {
 
-enum { BTREE_CACHE_N_NODES = 32 };
-// Should exceed log_{BTREE_MAX_KEYS}(max possible number of items in the tree).
+	// Insert the key into the leaf at path[depth], at i_child, and go up the
+	// path, splitting nodes as long as necessary. A leaf split sends up the
+	// shortest key which is greater than the left leaf's keys, and not
+	// greater than the right leaf's (suffix truncation), so internal nodes
+	// keep only the distinguishing bytes of the keys.
 
-static void btree_array_insert(
-	void *array, size_t n_elems_before_insert, size_t elem_size,
-	void *new, size_t i_new) {
+	BtreePtr right_child = BTREE_NULL;
+	while (true) {
+		BtreePtr node_ptr = path[depth].ptr;
+		int i_item = path[depth].i_child;
+		char *node = btree_modify_node(btree, node_ptr);
+		if (btree_slotted_insert(node, i_item, key, key_size, value,
+		                         right_child))
+			return;
 
-	xassert(1, i_new <= n_elems_before_insert);
-	memmove((char *) array + (i_new + 1) * elem_size,
-			(char *) array + i_new * elem_size,
-			(n_elems_before_insert - i_new) * elem_size);
-	memcpy((char *) array + i_new * elem_size, new, elem_size);
-}
+		// Decode the entries (from a copy of the node, so that the node can
+		// be rebuilt), and add the new one.
+		bool is_leaf = btree_node_is_leaf(node);
+		memcpy(btree->scratch_block, node, btree->block_size);
+		BtreeBytesEntry *entries = btree->scratch_entries;
+		int n_entries = btree_slotted_get_entries(btree->scratch_block,
+		                                          entries);
+		BtreeBytesEntry new_entry = {
+			.prefix = key, .prefix_size = key_size,
+			.suffix = key + key_size, .suffix_size = 0,
+			.value = value, .child = right_child
+		};
+		btree_array_insert(entries, n_entries, sizeof(*entries),
+		                   &new_entry, i_item);
+		n_entries++;
+		entries[i_item].shared = (i_item == 0) ? 0
+			: btree_entry_shared(&entries[i_item - 1], &entries[i_item]);
+		if (i_item + 1 < n_entries) {
+			entries[i_item + 1].shared = btree_entry_shared(
+				&entries[i_item], &entries[i_item + 1]);
+		}
 
-static bool btree_set_try_compensate(
-	Btree *btree,
-	BtreeNode node, BtreePtr node_ptr,
-	BtreeNode parent, BtreePtr parent_ptr,
-	BtreeItem new_item, BtreePtr new_right_child,
-	int i_in_node, int i_node_in_parent) {
-
-	if (i_node_in_parent > 0) { // Has a left sibling.
-		BtreePtr left_sibling_ptr = parent.children[i_node_in_parent - 1];
-		BtreeNode left_sibling = btree_read_node(btree, left_sibling_ptr);
-
-		if (left_sibling.n_items < BTREE_MAX_KEYS) {
-			btree_compensate(&parent.items[i_node_in_parent - 1],
-			                 &left_sibling, &node,
-			                 new_item, new_right_child, false, i_in_node);
-			btree_write_node(btree, parent, parent_ptr);
-			btree_write_node(btree, left_sibling, left_sibling_ptr);
-			btree_write_node(btree, node, node_ptr);
-			return true;
+		size_t sum_of_sizes = 0;
+		for (int i = 0; i < n_entries; i++) {
+			sum_of_sizes += 2 * sizeof(uint16_t) + btree_entry_size(&entries[i])
+				+ btree_slotted_payload_size(node);
+		}
+		if (btree_slotted_fill_size(
+		        btree_entries_prefix_size(entries, n_entries),
+		        sum_of_sizes, n_entries) <= btree->block_size) {
+			btree_slotted_fill(btree, node, entries, n_entries);
+			return;
 		}
-	}
 
-	if (i_node_in_parent < parent.n_items) { // Has a right sibling.
-		BtreePtr right_sibling_ptr = parent.children[i_node_in_parent + 1];
-		BtreeNode right_sibling = btree_read_node(btree, right_sibling_ptr);
+		// Split the node. In an internal node, the middle entry goes up,
+		// and its child becomes the right node's first child.
+		int n_left = btree_bytes_split_point(btree, entries, n_entries,
+		                                     is_leaf);
+		BtreePtr new_ptr = btree_alloc_block(btree, node_ptr);
+		char *new_node = btree_init_node(btree, new_ptr, is_leaf);
+		btree_slotted_fill(btree, node, entries, n_left);
+		const BtreeBytesEntry *up = &entries[n_left];
+		if (is_leaf) {
+			btree_slotted_fill(btree, new_node, entries + n_left,
+			                   n_entries - n_left);
+			BtreePtr next_ptr = btree_slotted_link(node, BTREE_LINK_NEXT);
+			btree_slotted_set_link(new_node, BTREE_LINK_PREV, node_ptr);
+			btree_slotted_set_link(new_node, BTREE_LINK_NEXT, next_ptr);
+			btree_slotted_set_link(node, BTREE_LINK_NEXT, new_ptr);
+			if (next_ptr != BTREE_NULL) {
+				btree_slotted_set_link(btree_modify_node(btree, next_ptr),
+				                       BTREE_LINK_PREV, new_ptr);
+			}
+			key_size = up->shared + 1;
+		} else {
+			btree_slotted_set_link(new_node, 0, up->child);
+			btree_slotted_fill(btree, new_node, entries + n_left + 1,
+			                   n_entries - n_left - 1);
+			key_size = btree_entry_size(up);
+		}
+		btree_entry_copy_key(up, 0, key_size, btree->scratch_key);
+		key = btree->scratch_key;
+		right_child = new_ptr;
 
-		if (right_sibling.n_items < BTREE_MAX_KEYS) {
-			btree_compensate(&parent.items[i_node_in_parent],
-			                 &node, &right_sibling,
-			                 new_item, new_right_child, true, i_in_node);
-			btree_write_node(btree, parent, parent_ptr);
-			btree_write_node(btree, node, node_ptr);
-			btree_write_node(btree, right_sibling, right_sibling_ptr);
-			return true;
+		if (depth == 0) {
+			// Split the root, and make a new one above it.
+			BtreePtr root_ptr = btree_alloc_block(btree, node_ptr);
+			char *root = btree_init_node(btree, root_ptr, false);
+			btree_slotted_set_link(root, 0, node_ptr);
+			btree_slotted_insert(root, 0, key, key_size, 0, right_child);
+			btree->superblock.root = root_ptr;
+			return;
 		}
+		depth--;
 	}
+}
 
-	return false;
+int btree_cached_levels(Btree *btree) {
+	pthread_rwlock_rdlock(&btree->top_lock);
+	int n_levels = btree->top.n_levels;
+	pthread_rwlock_unlock(&btree->top_lock);
+	return n_levels;
 }
 
-static void btree_set_up_pass(
-	Btree *btree,
-	BtreeItem new_item, BtreePtr new_right_child, int i_in_node,
-	BtreeNodeCache *cache, int node_depth) {
+size_t btree_max_key_size(Btree *btree) {
+	return btree_bytes_max_key_size(btree->block_size);
+}
 
-	// Insert new_item into the node stored in cache[node_depth] on position
-	// i_in_node. Recurse upwards the tree (using the cache) if necessary.
+static BtreePtr btree_bytes_lookup_step(
+	const char *node, const void *key, size_t key_size,
+	bool *found, BtreeValue *value) {
+
+	if (!btree_node_is_leaf(node)) {
+		return btree_slotted_child(
+			node, btree_slotted_find_child(node, key, key_size));
+	}
+	int i_item = btree_slotted_lower_bound(node, key, key_size, found);
+	if (*found)
+		*value = btree_slotted_value(node, i_item);
+	return BTREE_NULL;
+}
 
-	xassert(1, node_depth >= 0 && node_depth < BTREE_CACHE_N_NODES);
+bool btree_get_bytes(
+	Btree *btree, const void *key, size_t key_size, BtreeValue *value) {
 
-	BtreePtr node_ptr = cache[node_depth].ptr;
-	BtreeNode node = cache[node_depth].node;
+	xassert(1, btree->layout == BTREE_LAYOUT_BYTES);
+	return btree_lookup(btree, BTREE_NULL, btree_bytes_lookup_step,
+	                    key, key_size, value);
+}
 
-	xassert(1, i_in_node <= node.n_items);
-	xassert(1, (node_ptr == btree->superblock.root && node_depth == 0) ||
-	        (node_ptr != btree->superblock.root && node_depth > 0));
-	xassert(1, (node.is_leaf && new_right_child == BTREE_NULL) ||
-	        (!node.is_leaf && new_right_child != BTREE_NULL));
+void btree_set_bytes(
+	Btree *btree, const void *key, size_t key_size, BtreeValue value,
+	bool *replaced, BtreeValue *old_value) {
 
-	// If there's free space in the node, just insert the item.
+	xassert(1, btree->layout == BTREE_LAYOUT_BYTES);
+	xassert(1, key_size <= btree_max_key_size(btree));
+	xassert(1, (replaced == NULL) == (old_value == NULL));
+	btree_begin(btree);
 
-	if (node.n_items < BTREE_MAX_KEYS) {
-		btree_array_insert(node.items, node.n_items, sizeof(node.items[0]),
-		                   &new_item, i_in_node);
-		btree_array_insert(node.children, node.n_items + 1,
-		                   sizeof(node.children[0]),
-		                   &new_right_child, i_in_node + 1);
-		node.n_items++;
-		btree_write_node(btree, node, node_ptr);
-		return;
+	// Go down the tree to the leaf, and remember the path.
+	BtreePathStep path[BTREE_MAX_DEPTH];
+	int depth = 0;
+	BtreePtr node_ptr = btree->superblock.root;
+	while (true) {
+		xassert(1, depth < BTREE_MAX_DEPTH);
+		const char *node = btree_pin_node(btree, node_ptr);
+		path[depth].ptr = node_ptr;
+		if (btree_node_is_leaf(node)) {
+			btree_unpin_node(btree, node_ptr, node);
+			break;
+		}
+		int i_child = btree_slotted_find_child(node, key, key_size);
+		path[depth].i_child = i_child;
+		BtreePtr child_ptr = btree_slotted_child(node, i_child);
+		btree_unpin_node(btree, node_ptr, node);
+		node_ptr = child_ptr;
+		depth++;
 	}
 
-	// The node is full. If it's not the root, try to compensate
-	// (move some items to a sibling node).
+	const char *leaf = btree_pin_node(btree, node_ptr);
+	bool found;
+	int i_item = btree_slotted_lower_bound(leaf, key, key_size, &found);
+	if (replaced != NULL) {
+		*replaced = found;
+		if (found)
+			*old_value = btree_slotted_value(leaf, i_item);
+	}
+	btree_unpin_node(btree, node_ptr, leaf);
 
-	BtreePtr parent_ptr;
-	int i_node_in_parent;
-	if (node_ptr == btree->superblock.root) {
-		parent_ptr = BTREE_NULL;
+	if (found) {
+		btree_slotted_set_value(btree_modify_node(btree, node_ptr),
+		                        i_item, value);
 	} else {
-		parent_ptr = cache[node_depth - 1].ptr;
-		BtreeNode parent = cache[node_depth - 1].node;
-
-		i_node_in_parent = 0;
-		while (i_node_in_parent < BTREE_MAX_CHILDREN &&
-			   parent.children[i_node_in_parent] != node_ptr)
-			i_node_in_parent++;
-		// Defensive programming in case the B-Tree is malformed.
-		xassert(1, i_node_in_parent < BTREE_MAX_CHILDREN);
-
-		bool compensation_successful = btree_set_try_compensate(
-			btree, node, node_ptr,
-			cache[node_depth - 1].node, cache[node_depth - 1].ptr,
-			new_item, new_right_child, i_in_node, i_node_in_parent);
-		if (compensation_successful)
-			return;
+		path[depth].i_child = i_item;
+		btree_bytes_up_pass(btree, path, depth, key, key_size, value);
 	}
+	btree_end(btree);
+}
 
-	// Can't compensate. We'll have to split the node (add a right sibling).
-
-	BtreeNode new_sibling = btree_new_node();
-	new_sibling.is_leaf = node.is_leaf;
-
-	// Collect items in the node to split and the new item into an array.
-	BtreeItem all_items[BTREE_MAX_KEYS + 1];
-	memcpy(all_items, node.items, BTREE_MAX_KEYS * sizeof(all_items[0]));
-	btree_array_insert(all_items, BTREE_MAX_KEYS, sizeof(all_items[0]),
-	                   &new_item, i_in_node);
-
-	// Distribute the items between the two nodes and the item separating them.
-	node.n_items = BTREE_MIN_KEYS;
-	memcpy(node.items, all_items, node.n_items * sizeof(node.items[0]));
-	BtreeItem separator = all_items[node.n_items];
-	new_sibling.n_items = ARRAY_LEN(all_items) - node.n_items - 1;
-	memcpy(new_sibling.items, all_items + node.n_items + 1,
-	       new_sibling.n_items * sizeof(new_sibling.items[0]));
-
-	new_sibling.is_leaf = node.is_leaf;
-	if (!node.is_leaf) {
-		// Collect children of the node to split and the new child into an
-		// array.
-		BtreePtr all_children[BTREE_MAX_CHILDREN + 1];
-		memcpy(all_children, node.children,
-			   BTREE_MAX_CHILDREN * sizeof(all_children[0]));
-		btree_array_insert(all_children, BTREE_MAX_CHILDREN,
-		                   sizeof(all_children[0]),
-		                   &new_right_child, i_in_node + 1);
-
-		// Distribute the children between the two nodes.
-		memcpy(node.children, all_children,
-			   (node.n_items + 1) * sizeof(node.children[0]));
-		memcpy(new_sibling.children, all_children + node.n_items + 1,
-			   (new_sibling.n_items + 1) * sizeof(new_sibling.children[0]));
-	}
-
-	btree_write_node(btree, node, node_ptr);
-	BtreePtr new_sibling_ptr = btree_alloc_block(btree);
-	btree_write_node(btree, new_sibling, new_sibling_ptr);
-
-	if (parent_ptr != BTREE_NULL) {
-		btree_set_up_pass(btree, separator, new_sibling_ptr,
-		                  i_node_in_parent, cache, node_depth - 1);
-	} else { // We're splitting the root.
-		BtreeNode new_root = btree_new_node();
-		new_root.is_leaf = false;
-		new_root.n_items = 1;
-		new_root.items[0] = separator;
-		new_root.children[0] = node_ptr;
-		new_root.children[1] = new_sibling_ptr;
-
-		btree->superblock.root = btree_alloc_block(btree);
-		btree_write_node(btree, new_root, btree->superblock.root);
-	}
-}
-
-static void btree_set_down_pass(
-	Btree *btree, BtreeItem new_item,
-	bool *replaced, BtreeValue *old_value,
-	BtreeNodeCache *cache, BtreePtr node_ptr, int node_depth) {
-
-	// Recurse down the tree to find the appropriate node for new_item and
-	// insert the item there. Fill the cache while doing this.
-
-	xassert(1, node_depth >= 0 && node_depth < BTREE_CACHE_N_NODES);
-	xassert(1, (replaced == NULL) == (old_value == NULL));
-
-	BtreeNode node = btree_read_node(btree, node_ptr);
-	cache[node_depth].ptr = node_ptr;
-	cache[node_depth].node = node;
-
-	// Index of first key which is >= `key`, or node.n_items if there are none.
-	int i_new_item = 0;
-	while (i_new_item < node.n_items &&
-	       btree_item_cmp(node.items[i_new_item], new_item) < 0)
-		i_new_item++;
+void btree_walk_bytes(
+	Btree *btree,
+	void (*callback)(const void *key, size_t key_size, BtreeValue, void *),
+	void *callback_context) {
 
-	if (i_new_item < node.n_items &&
-	    btree_item_cmp(node.items[i_new_item], new_item) == 0) {
+	// Like btree_walk_leaves. Keys are put together in scratch_key.
+	xassert(1, btree->layout == BTREE_LAYOUT_BYTES);
+	pthread_mutex_lock(&btree->write_lock);
+	BtreePtr node_ptr = btree->superblock.root;
+	while (true) {
+		const char *node = btree_pin_node(btree, node_ptr);
+		bool is_leaf = btree_node_is_leaf(node);
+		BtreePtr child_ptr = is_leaf ? BTREE_NULL
+			: btree_slotted_child(node, 0);
+		btree_unpin_node(btree, node_ptr, node);
+		if (is_leaf)
+			break;
+		node_ptr = child_ptr;
+	}
 
-		// We found the exact key, so let's set its associated value.
-		if (replaced != NULL) {
-			*replaced = true;
-			*old_value = node.items[i_new_item].value;
+	char *key = btree->scratch_key;
+	while (node_ptr != BTREE_NULL) {
+		const char *node = btree_pin_node(btree, node_ptr);
+		size_t prefix_size = btree_slotted_prefix_size(node);
+		memcpy(key, btree_slotted_prefix(node), prefix_size);
+		for (int i_item = 0; i_item < btree_node_n_items(node); i_item++) {
+			size_t suffix_size = btree_slotted_suffix_size(node, i_item);
+			memcpy(key + prefix_size, btree_slotted_suffix(node, i_item),
+			       suffix_size);
+			callback(key, prefix_size + suffix_size,
+			         btree_slotted_value(node, i_item), callback_context);
 		}
-		node.items[i_new_item].value = new_item.value;
-		btree_write_node(btree, node, node_ptr);
-		return;
+		BtreePtr next_ptr = btree_slotted_link(node, BTREE_LINK_NEXT);
+		btree_unpin_node(btree, node_ptr, node);
+		node_ptr = next_ptr;
 	}
+	pthread_mutex_unlock(&btree->write_lock);
+}
 
-	if (!node.is_leaf) {
-		// We know that keys[i_new_item - 1] < new_item.key < keys[i_new_item],
-		// so new_item (if it exists) will be in the i_new_item-th child's
-		// subtree.
-		return btree_set_down_pass(
-			btree, new_item, replaced, old_value,
-			cache, node.children[i_new_item], node_depth + 1);
-	}
+// Bulk loading. Leaves are written as the items arrive, while the items
+// separating them (and the leaves' block numbers) are kept in memory. When
+// all items have arrived, the levels above are built from those, one by one.
+// Every level is written sequentially, in batches of BTREE_LOAD_BATCH nodes.
+// In a B+ tree, the separators between leaves are copies of the next leaf's
+// first key.
+enum { BTREE_LOAD_BATCH = 64 };
 
-	btree_set_up_pass(
-		btree, new_item, BTREE_NULL, i_new_item, cache, node_depth);
-}
+struct BtreeLoader { // Typedef'd in the header file.
+	Btree *btree;
+	int leaf_fill; // Items in each full node.
+	int internal_fill;
+	BtreePtr last_leaf; // The last one written.
 
-void btree_set(
-	Btree *btree, BtreeKey key, BtreeValue value,
-	bool *replaced, BtreeValue *old_value) {
+	// The last leaf, which is still being filled, and the one before it,
+	// which isn't written yet (the two may have to be rebalanced at the end).
+	BtreeItem *leaf;
+	int n_leaf_items;
+	BtreeItem *prev_leaf;
+	int n_prev_leaf_items; // -1 if there's no previous leaf.
+	BtreePackedStats leaf_stats; // Whether a packed leaf fits in its block.
 
-	BtreeItem item = {key, value};
-	BtreeNodeCache cache[BTREE_CACHE_N_NODES];
-	btree_set_down_pass(
-		btree, item, replaced, old_value,
-		cache, btree->superblock.root, 0);
+	// The written nodes of the level being built, and the items separating
+	// them (plus the one separating the last one from prev_leaf).
+	BtreePtr *children;
+	BtreeItem *separators;
+	size_t n_children;
+	size_t capacity;
+};
+
+static int btree_load_fill(double fill_factor, int max_keys) {
+	return MIN(MAX((int) (fill_factor * max_keys + 0.5), max_keys / 2),
+	           max_keys);
 }
 
-static bool btree_get_at_node(
-	Btree *btree, BtreePtr node_ptr, BtreeKey key, BtreeValue *value) {
+BtreeLoader *btree_load_begin(
+	const char *file_name, size_t block_size, BtreeLayout layout,
+	double fill_factor) {
 
-	BtreeNode node = btree_read_node(btree, node_ptr);
+	xassert(1, block_size >= BTREE_MIN_BLOCK_SIZE &&
+	        block_size <= BTREE_MAX_BLOCK_SIZE &&
+	        (block_size & (block_size - 1)) == 0);
+	xassert(1, fill_factor > 0 && fill_factor <= 1);
+	xassert(1, layout != BTREE_LAYOUT_BYTES);
 
-	// Index of first key which is >= `key`, or node.n_items if there are none.
-	int i_item = 0;
-	while (i_item < node.n_items &&
-	       btree_key_cmp(node.items[i_item].key, key) < 0)
-		i_item++;
+	BtreeLoader *loader = malloc(sizeof(*loader));
+	xassert(1, loader != NULL);
 
-	if (i_item < node.n_items &&
-	    btree_key_cmp(node.items[i_item].key, key) == 0) {
+	Btree *btree = btree_init(
+		fs_open(file_name, true, BTREE_FS_MODE), block_size, layout);
+	btree->space = space_new(btree->file, 0, block_size, 1, block_size);
+	btree_bloom_open(btree, file_name, true);
+	btree->superblock.root = BTREE_NULL;
+	btree->superblock.block_size = block_size;
+	btree->superblock.layout = layout;
+	loader->btree = btree;
 
-		// We found the key.
-		if (value != NULL)
-			*value = node.items[i_item].value;
-		return true;
-	} else if (!node.is_leaf) {
-		// We know that keys[i_item - 1] < item.key < keys[i_item], so the key
-		// (if it exists) will be in the i_item-th child's subtree.
-		return btree_get_at_node(btree, node.children[i_item], key, value);
-	} else {
-		return false;
-	}
+	loader->leaf_fill = btree_load_fill(fill_factor, btree->max_leaf_keys);
+	loader->internal_fill =
+		btree_load_fill(fill_factor, btree->max_internal_keys);
+	loader->last_leaf = BTREE_NULL;
+
+	// With room for the item after the leaf (see btree_load_add).
+	loader->leaf = malloc(
+		(btree->max_leaf_keys + 1) * sizeof(*loader->leaf));
+	loader->prev_leaf = malloc(
+		(btree->max_leaf_keys + 1) * sizeof(*loader->prev_leaf));
+	xassert(1, loader->leaf != NULL && loader->prev_leaf != NULL);
+	loader->n_leaf_items = 0;
+	loader->n_prev_leaf_items = -1;
+	loader->leaf_stats = (BtreePackedStats) {.n_items = 0};
+
+	loader->children = NULL;
+	loader->separators = NULL;
+	loader->n_children = 0;
+	loader->capacity = 0;
+	return loader;
 }
 
-bool btree_get(Btree *btree, BtreeKey key, BtreeValue *value) {
-	return btree_get_at_node(btree, btree->superblock.root, key, value);
+static BtreePtr btree_load_write_node(
+	BtreeLoader *loader, const BtreeItem *items, const BtreePtr *children,
+	int n_items, bool is_root) {
+
+	Btree *btree = loader->btree;
+	BtreePtr ptr = space_alloc(btree->space, SPACE_NULL);
+	if (is_root)
+		btree->superblock.root = ptr; // Before btree_node_valid checks it.
+
+	char *node = btree_init_node(btree, ptr, children == NULL);
+	btree_node_fill(node, items, children, n_items);
+	if (btree_node_is_plus_leaf(node)) {
+		// Leaves are written one after another, before any other nodes, so
+		// the next one will be in the next block (btree_load_end unlinks the
+		// last one).
+		xassert(1, loader->last_leaf == BTREE_NULL ||
+		        ptr == loader->last_leaf + 1);
+		btree_node_set_link(node, BTREE_LINK_PREV, loader->last_leaf);
+		btree_node_set_link(node, BTREE_LINK_NEXT, ptr + 1);
+	}
+	if (children == NULL)
+		loader->last_leaf = ptr;
+	if (btree->n_queued == BTREE_LOAD_BATCH)
+		btree_flush_writes(btree);
+	return ptr;
 }
 
-static void btree_print_at_node(
-	Btree *btree, FILE *stream, BtreePtr node_ptr, int level) {
+static void btree_load_push_child(
+	BtreeLoader *loader, BtreePtr child, const BtreeItem *separator) {
 
-	enum { INDENT_WIDTH = 4 };
+	// Add a node to the level being built. `separator` is the item after it
+	// (NULL for the last node).
 
-	BtreeNode node = btree_read_node(btree, node_ptr);
+	if (loader->n_children == loader->capacity) {
+		loader->capacity = MAX(64, loader->capacity * 2);
+		loader->children = realloc(
+			loader->children, loader->capacity * sizeof(*loader->children));
+		loader->separators = realloc(
+			loader->separators,
+			loader->capacity * sizeof(*loader->separators));
+		xassert(1, loader->children != NULL && loader->separators != NULL);
+	}
 
-	fprintf(stream, "%*sNode %" BTREE_PTR_PRINT ":\n",
-	        level * INDENT_WIDTH, "", node_ptr);
+	loader->children[loader->n_children] = child;
+	if (separator != NULL)
+		loader->separators[loader->n_children] = *separator;
+	loader->n_children++;
+}
 
-	for (int i_item = 0; i_item < node.n_items; i_item++) {
-		if (!node.is_leaf) {
-			btree_print_at_node(btree, stream, node.children[i_item],
-			                    level + 1);
-		}
-		printf("%*s%" BTREE_KEY_PRINT " => %" BTREE_VALUE_PRINT "\n",
-		       (level + 1) * INDENT_WIDTH, "",
-		       node.items[i_item].key, node.items[i_item].value);
+void btree_load_add(BtreeLoader *loader, BtreeKey key, BtreeValue value) {
+	xassert(1, loader->n_leaf_items <= loader->leaf_fill);
+	BtreeItem item = {key, value};
+
+	if (loader->n_leaf_items > 0) {
+		xassert(1, btree_key_cmp(
+			loader->leaf[loader->n_leaf_items - 1].key, key) < 0);
+	} else if (loader->n_prev_leaf_items >= 0) {
+		xassert(1, btree_key_cmp(
+			loader->separators[loader->n_children - 1].key, key) < 0);
 	}
-	if (!node.is_leaf && node.n_items > 0) {
-		btree_print_at_node(btree, stream,
-		                    node.children[node.n_items], level + 1);
+
+	Btree *btree = loader->btree;
+	loader->leaf[loader->n_leaf_items++] = item;
+	btree_packed_add(&loader->leaf_stats, item);
+	if (loader->n_leaf_items <= loader->leaf_fill &&
+	    (btree->layout != BTREE_LAYOUT_PACKED ||
+	     loader->n_leaf_items <= btree->max_plain_leaf_keys ||
+	     btree_packed_size(&loader->leaf_stats) <= btree->block_size))
+		return;
+
+	// The leaf is full (or, packed, wouldn't fit in its block with this
+	// item), and this item will separate it from the next one (and, in a B+
+	// tree, start it). Write the previous leaf, and keep this one in memory
+	// instead.
+	int n_full_items = loader->n_leaf_items - 1;
+	if (loader->n_prev_leaf_items >= 0) {
+		BtreePtr ptr = btree_load_write_node(
+			loader, loader->prev_leaf, NULL, loader->n_prev_leaf_items, false);
+		loader->children[loader->n_children - 1] = ptr;
+	}
+	BtreeItem *full = loader->leaf;
+	loader->leaf = loader->prev_leaf;
+	loader->prev_leaf = full;
+	loader->n_prev_leaf_items = n_full_items;
+	loader->n_leaf_items = 0;
+	loader->leaf_stats = (BtreePackedStats) {.n_items = 0};
+	if (btree_is_bplus(btree)) {
+		loader->leaf[loader->n_leaf_items++] = item;
+		btree_packed_add(&loader->leaf_stats, item);
 	}
+	// The leaf's block number is filled in when it's written.
+	btree_load_push_child(loader, BTREE_NULL,
+	                      &loader->prev_leaf[n_full_items]);
 }
 
-void btree_print(Btree *btree, FILE *stream) {
-	btree_print_at_node(btree, stream, btree->superblock.root, 0);
-}
+static void btree_load_finish_leaves(BtreeLoader *loader) {
+	Btree *btree = loader->btree;
 
-static void btree_walk_at_node(
-	Btree *btree, BtreePtr node_ptr,
-	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+	if (loader->n_prev_leaf_items < 0) { // The only leaf is the root.
+		BtreePtr ptr = btree_load_write_node(
+			loader, loader->leaf, NULL, loader->n_leaf_items, true);
+		btree_load_push_child(loader, ptr, NULL);
+		return;
+	}
 
-	BtreeNode node = btree_read_node(btree, node_ptr);
+	// The last leaf may have too few items. Redistribute the items of the
+	// last two leaves (and the separator, unless it's a copy), or merge the
+	// leaves if they fit in one. Packed leaves are merged only if the items
+	// fit unpacked, and otherwise the last one only gets up to the minimum
+	// (so that both fit, like in btree_borrow).
+	int n_separators = btree_is_bplus(btree) ? 0 : 1;
+	int min_keys = btree->max_plain_leaf_keys / 2;
+	BtreeItem *all_items = btree->scratch_items;
+	int n_all_items = loader->n_prev_leaf_items;
+	memcpy(all_items, loader->prev_leaf, n_all_items * sizeof(*all_items));
+	if (n_separators > 0)
+		all_items[n_all_items++] = loader->separators[loader->n_children - 1];
+	memcpy(all_items + n_all_items, loader->leaf,
+	       loader->n_leaf_items * sizeof(*all_items));
+	n_all_items += loader->n_leaf_items;
 
-	for (int i_item = 0; i_item < node.n_items; i_item++) {
-		if (!node.is_leaf) {
-			btree_walk_at_node(btree, node.children[i_item],
-			                   callback, callback_context);
-		}
-		callback(node.items[i_item].key, node.items[i_item].value,
-		         callback_context);
+	if (loader->n_leaf_items >= min_keys) {
+		loader->children[loader->n_children - 1] = btree_load_write_node(
+			loader, loader->prev_leaf, NULL, loader->n_prev_leaf_items,
+			false);
+		BtreePtr ptr = btree_load_write_node(
+			loader, loader->leaf, NULL, loader->n_leaf_items, false);
+		btree_load_push_child(loader, ptr, NULL);
+	} else if (n_all_items <= btree->max_plain_leaf_keys) {
+		bool is_root = (loader->n_children == 1);
+		loader->children[loader->n_children - 1] = btree_load_write_node(
+			loader, all_items, NULL, n_all_items, is_root);
+	} else {
+		int n_left_items = btree->layout == BTREE_LAYOUT_PACKED
+			? n_all_items - min_keys : (n_all_items - n_separators) / 2;
+		loader->children[loader->n_children - 1] = btree_load_write_node(
+			loader, all_items, NULL, n_left_items, false);
+		loader->separators[loader->n_children - 1] = all_items[n_left_items];
+		BtreePtr ptr = btree_load_write_node(
+			loader, all_items + n_left_items + n_separators, NULL,
+			n_all_items - n_left_items - n_separators, false);
+		btree_load_push_child(loader, ptr, NULL);
 	}
-	if (!node.is_leaf) {
-		btree_walk_at_node(btree, node.children[node.n_items],
-		                   callback, callback_context);
+}
+
+static void btree_load_build_level(BtreeLoader *loader) {
+	// Replace the children (and separators) with the level above them.
+
+	Btree *btree = loader->btree;
+	size_t n_children = loader->n_children;
+	BtreePtr *children = loader->children;
+	BtreeItem *separators = loader->separators;
+	loader->children = NULL;
+	loader->separators = NULL;
+	loader->n_children = 0;
+	loader->capacity = 0;
+
+	// The number of nodes is chosen so that they get about fill + 1 children
+	// each, but still within the limits.
+	int max_keys = btree->max_internal_keys;
+	size_t n_nodes = n_children / (loader->internal_fill + 1);
+	n_nodes = MAX(n_nodes, (n_children + max_keys) / (max_keys + 1));
+	n_nodes = MIN(n_nodes, n_children / (max_keys / 2 + 1));
+	n_nodes = MAX(n_nodes, (size_t) 1);
+
+	size_t i_child = 0;
+	for (size_t i_node = 0; i_node < n_nodes; i_node++) {
+		size_t n_node_children =
+			n_children / n_nodes + (i_node < n_children % n_nodes);
+		BtreePtr ptr = btree_load_write_node(
+			loader, separators + i_child, children + i_child,
+			n_node_children - 1, n_nodes == 1);
+		i_child += n_node_children;
+		btree_load_push_child(loader, ptr, i_node + 1 < n_nodes
+		                      ? &separators[i_child - 1] : NULL);
 	}
+	xassert(1, i_child == n_children);
+
+	free(children);
+	free(separators);
 }
 
-void btree_walk(
-	Btree *btree,
-	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context) {
+Btree *btree_load_end(BtreeLoader *loader) {
+	btree_load_finish_leaves(loader);
+	while (loader->n_children > 1)
+		btree_load_build_level(loader);
 
-	btree_walk_at_node(btree, btree->superblock.root,
-	                   callback, callback_context);
+	Btree *btree = loader->btree;
+	xassert(1, btree->superblock.root == loader->children[0]);
+	if (btree_is_bplus(btree)) {
+		btree_node_set_link(btree_modify_node(btree, loader->last_leaf),
+		                    BTREE_LINK_NEXT, BTREE_NULL);
+	}
+	btree_flush_writes(btree);
+	btree_sync(btree);
+	// The keys aren't in the filter, so it's built in the background.
+	btree_bloom_replace(btree, NULL);
+	pthread_mutex_lock(&btree->write_lock);
+	btree_bloom_request(btree);
+	pthread_mutex_unlock(&btree->write_lock);
+
+	free(loader->leaf);
+	free(loader->prev_leaf);
+	free(loader->children);
+	free(loader->separators);
+	free(loader);
+	return btree;
+}
+
+BtreeBloomStats btree_bloom_stats(Btree *btree) {
+	BtreeBloomStats stats;
+	stats.n_negatives = __atomic_load_n(&btree->bloom_stats.n_negatives,
+	                                    __ATOMIC_RELAXED);
+	stats.n_false_positives = __atomic_load_n(
+		&btree->bloom_stats.n_false_positives, __ATOMIC_RELAXED);
+	stats.n_rebuilds = __atomic_load_n(&btree->bloom_stats.n_rebuilds,
+	                                   __ATOMIC_RELAXED);
+	return stats;
 }
 
 FsStats btree_fs_stats(Btree *btree) {
 	return fs_stats(btree->file);
 }
+
+void btree_fs_latency(Btree *btree, FsLatency *snapshot) {
+	fs_latency(btree->file, snapshot);
+}
@@ -3,28 +3,228 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "fs.h"
+#include "wal.h"
 
 // Settings.
-enum { BTREE_BLOCK_SIZE = 256 };
+enum {
+	BTREE_DEFAULT_BLOCK_SIZE = 256,
+	BTREE_CACHE_PAGE_SIZE = 4096, // Raised to the block size if that's bigger.
+	BTREE_CACHE_SIZE = 1 << 20, // Buffer pool budget in bytes; 0 disables it.
+	// Memory for copies of the upper levels of the tree (see
+	// btree_cached_levels); 0 disables them.
+	BTREE_TOP_CACHE_SIZE = 1 << 20,
+	BTREE_N_LATCHES = 4096, // Node versions checked by lock-free readers.
+	// Bits per key of the Bloom filter (see btree_bloom_stats); 0 disables
+	// it. The filter starts with room for BTREE_BLOOM_MIN_KEYS keys, and is
+	// rebuilt BTREE_BLOOM_REBUILD_STEP keys at a time.
+	BTREE_BLOOM_BITS_PER_KEY = 10,
+	BTREE_BLOOM_MIN_KEYS = 1 << 14,
+	BTREE_BLOOM_REBUILD_STEP = 1024,
+	BTREE_WALK_TASKS_PER_THREAD = 16 // Subtrees per thread in parallel walks.
+};
+#define BTREE_FS_MODE FS_MODE_BUFFERED // Or FS_MODE_MMAP, FS_MODE_DIRECT.
 typedef uint32_t BtreeKey;
 typedef uint64_t BtreeValue;
 #define BTREE_KEY_PRINT PRIu32
 #define BTREE_VALUE_PRINT PRIu64
+// Search for keys in nodes with SSE2 or AVX2, if the compiler targets them.
+// Only valid if BtreeKey is uint32_t and btree_key_cmp is its usual order.
+#define BTREE_SIMD_SEARCH 1
+// Decode packed leaves (see BTREE_LAYOUT_PACKED) with SSE2 or AVX2, under the
+// same conditions.
+#define BTREE_SIMD_UNPACK 1
 int btree_key_cmp(BtreeKey a, BtreeKey b);
 
+enum { BTREE_MIN_BLOCK_SIZE = 256, BTREE_MAX_BLOCK_SIZE = 64 << 10 };
+
+typedef enum {
+	BTREE_LAYOUT_B, // Items (keys with values) in all nodes.
+	BTREE_LAYOUT_BPLUS, // Values only in the leaves, which are linked, so
+	                    // that scans go from leaf to leaf. Internal nodes
+	                    // only have keys and children, so they have more
+	                    // children, and the tree is shorter.
+	BTREE_LAYOUT_BYTES, // Variable-length keys (see btree_get_bytes), in
+	                    // slotted nodes with prefix compression. Otherwise
+	                    // like BTREE_LAYOUT_BPLUS.
+	BTREE_LAYOUT_PACKED // Like BTREE_LAYOUT_BPLUS, but leaves are written
+	                    // compressed when that's smaller: the gaps between
+	                    // keys and the values, each minus their minimum, are
+	                    // bit-packed. A leaf holds up to about twice as many
+	                    // items as a B+ tree's, if they fit in the block. Only
+	                    // valid if BtreeKey is an unsigned integer and
+	                    // btree_key_cmp is its usual order.
+} BtreeLayout;
+
 typedef struct Btree Btree;
 
-Btree *btree_new(const char *file_name);
+typedef struct {
+	BtreeKey key;
+	BtreeValue value;
+} BtreeItem;
+
+// The block size has to be a power of 2 between BTREE_MIN_BLOCK_SIZE and
+// BTREE_MAX_BLOCK_SIZE. It determines the number of keys in a node (the
+// fan-out). It's recorded in the superblock, as is the layout.
+Btree *btree_new(
+	const char *file_name, size_t block_size, BtreeLayout layout);
+// Open a tree created by btree_new (and closed by btree_destroy). Doesn't
+// read anything but the superblock. Returns NULL if the file doesn't contain
+// a tree, or it's in an incompatible format.
+Btree *btree_open(const char *file_name);
 void btree_destroy(Btree *btree);
 
+// Threads: a tree can be used from several threads at once, except for
+// opening and closing it. btree_get, btree_get_bytes and btree_snapshot_get
+// take no locks (they start over if a writer changes a node under them).
+// Modifications are serialized, and walks, printing and open cursors keep
+// them out for their duration.
 bool btree_get(Btree *btree, BtreeKey key, BtreeValue *value);
 void btree_set(
 	Btree *btree, BtreeKey key, BtreeValue value,
 	bool *replaced, BtreeValue *old_value);
+// Set many items at once, as if by btree_set in order (so for a repeated key,
+// the last value wins), but sorted first: keys that fall in the same leaf are
+// applied in one visit, and each modified node is written once per batch.
+// replaced and old_values (both NULL, or arrays of n_items) are filled in
+// like btree_set's, for each item.
+void btree_set_batch(
+	Btree *btree, const BtreeItem *items, size_t n_items,
+	bool *replaced, BtreeValue *old_values);
+// Like btree_set_batch, but a compare-and-set: each key is only set if it's
+// in the tree with the value expected[i], and replaced[i] tells whether it
+// was. Keys which aren't in the tree aren't added.
+void btree_replace_batch(
+	Btree *btree, const BtreeItem *items, size_t n_items,
+	const BtreeValue *expected, bool *replaced);
+// Returns false if the key doesn't exist. Otherwise, sets *old_value (unless
+// it's NULL) to the deleted value.
+bool btree_delete(Btree *btree, BtreeKey key, BtreeValue *old_value);
+
+// Bulk loading: build a new tree from items sorted by key (without
+// duplicates), bottom-up, at sequential write speed. Nodes get fill_factor
+// (between 0.5 and 1) of their capacity, except where that would break the
+// B-tree's invariants. The resulting tree has the minimum height for that.
+typedef struct BtreeLoader BtreeLoader;
+BtreeLoader *btree_load_begin(
+	const char *file_name, size_t block_size, BtreeLayout layout,
+	double fill_factor);
+void btree_load_add(BtreeLoader *loader, BtreeKey key, BtreeValue value);
+Btree *btree_load_end(BtreeLoader *loader); // Frees the loader.
 
 void btree_print(Btree *btree, FILE *stream);
 void btree_walk(
 	Btree *btree,
 	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context);
 
+// Walk the tree with n_threads threads, for full scans that would otherwise
+// read one block at a time: the upper levels are split into about
+// n_threads * BTREE_WALK_TASKS_PER_THREAD disjoint subtrees, which the
+// threads walk in parallel. Thread i calls the callback with
+// callback_contexts[i] (e.g. for per-thread counts or checksums), for the
+// items of whichever subtrees it takes, so the items don't come in key
+// order. Modifications wait until the walk is done.
+void btree_walk_parallel(
+	Btree *btree, int n_threads,
+	void (*callback)(BtreeKey, BtreeValue, void *),
+	void **callback_contexts);
+// The same, but the callback is called from the calling thread, in key
+// order. The threads keep the items of up to 2 * n_threads subtrees which
+// are waiting to be passed on in memory.
+void btree_walk_parallel_ordered(
+	Btree *btree, int n_threads,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context);
+
+// Ordered iteration. A cursor starts at the first key >= `key`, and reads
+// only the nodes it passes through, so a scan of [lo, hi) (seek to lo, then
+// next until the key is >= hi) costs O(height + items / fan-out) block
+// reads. Until the cursor is closed (by the thread which opened it), the
+// tree can't be modified, so that thread mustn't try.
+typedef struct BtreeCursor BtreeCursor;
+BtreeCursor *btree_cursor_seek(Btree *btree, BtreeKey key);
+// False if the cursor is past the last item (or before the first).
+bool btree_cursor_get(BtreeCursor *cursor, BtreeKey *key, BtreeValue *value);
+// Move to the next (or previous) item. Return false if there isn't one.
+// Moving back from past the end goes to the last item, and vice versa.
+bool btree_cursor_next(BtreeCursor *cursor);
+bool btree_cursor_prev(BtreeCursor *cursor);
+void btree_cursor_close(BtreeCursor *cursor);
+
+// Snapshots: a snapshot sees the tree as it was when it was taken, however
+// the tree is modified later, so e.g. a long walk can go on between other
+// operations. While there are open snapshots, modifications are
+// copy-on-write: the modified nodes which a snapshot may see are written to
+// new blocks, as are their ancestors, up to a new root. The old blocks are
+// freed when the snapshots are closed (if the program crashes first, they
+// stay allocated). Snapshot lookups and walks take no locks, so writers
+// (including a walk's callback) go on meanwhile. Not supported for
+// BTREE_LAYOUT_BYTES.
+typedef struct BtreeSnapshot BtreeSnapshot;
+BtreeSnapshot *btree_snapshot_open(Btree *btree);
+void btree_snapshot_close(BtreeSnapshot *snapshot);
+bool btree_snapshot_get(
+	BtreeSnapshot *snapshot, BtreeKey key, BtreeValue *value);
+void btree_snapshot_walk(
+	BtreeSnapshot *snapshot,
+	void (*callback)(BtreeKey, BtreeValue, void *), void *callback_context);
+
+// Compaction: move the nodes to the start of the file, level by level from
+// the root down, each level in key order (so that scans read the leaves in
+// file order), then shrink the file to them. Each call moves up to max_nodes
+// nodes as one operation, going on from where the previous call left off, so
+// other operations can run between calls (though the ones that change the
+// tree's shape may leave some nodes out of order). Returns true once it's
+// done, and the file is synced (by a checkpoint, with a log) and shrunk; the
+// next call starts over. While snapshots are open, calls do nothing (and
+// return false), so the compaction goes on once they're closed. Not supported
+// for BTREE_LAYOUT_BYTES.
+bool btree_compact(Btree *btree, size_t max_nodes);
+
+// Variable-length keys, for trees created with BTREE_LAYOUT_BYTES (which
+// only support these functions, and opening, closing and printing). Keys are
+// byte strings, ordered by memcmp (a key is before the longer ones it's a
+// prefix of), of at most btree_max_key_size bytes -- about a quarter of a
+// node, so that a node can always be split. Keys in a node are stored
+// without the prefix they all share, and internal nodes only keep as much of
+// a key as is needed to separate their children, so long keys with common
+// prefixes (like paths) still give a high fan-out.
+size_t btree_max_key_size(Btree *btree);
+bool btree_get_bytes(
+	Btree *btree, const void *key, size_t key_size, BtreeValue *value);
+void btree_set_bytes(
+	Btree *btree, const void *key, size_t key_size, BtreeValue value,
+	bool *replaced, BtreeValue *old_value);
+void btree_walk_bytes(
+	Btree *btree,
+	void (*callback)(const void *key, size_t key_size, BtreeValue, void *),
+	void *callback_context);
+
+// Write-ahead logging (see wal.h): replay the tree's records in the log
+// (`id` is the tree's participant id), then log every operation as a
+// transaction. btree_destroy detaches the tree, and has to be called before
+// wal_close.
+void btree_attach_wal(Btree *btree, Wal *wal, uint8_t id);
+
+// Bloom filter of the keys (unless BTREE_BLOOM_BITS_PER_KEY is 0, or the
+// layout is BTREE_LAYOUT_BYTES): btree_get checks it first, so most lookups
+// of missing keys read nothing. It's kept in memory, and saved to
+// <file_name>.bloom when the tree is closed. btree_set adds keys to it, but
+// deleted keys stay in it, so a thread (one per tree) rebuilds it in the
+// background, from the keys in the tree, BTREE_BLOOM_REBUILD_STEP of them
+// between other operations: when it has more deleted keys than live ones, or
+// more keys than it has room for, and when there isn't one (after a crash, a
+// bulk load or a replay of the log).
+typedef struct {
+	uint64_t n_negatives; // Lookups answered by the filter alone.
+	uint64_t n_false_positives; // Lookups it let through which found nothing.
+	uint64_t n_rebuilds;
+} BtreeBloomStats;
+BtreeBloomStats btree_bloom_stats(Btree *btree);
+
+// The levels of internal nodes (from the root down) which are kept in memory,
+// so that going through them takes no I/O: as many as fit in
+// BTREE_TOP_CACHE_SIZE (0 until the first operation after opening the tree).
+// They're updated in place as the tree changes.
+int btree_cached_levels(Btree *btree);
+
 FsStats btree_fs_stats(Btree *btree);
+void btree_fs_latency(Btree *btree, FsLatency *snapshot);
@@ -0,0 +1,182 @@
+#include "compact.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include "xassert.h"
+#include "utils.h"
+
+typedef enum {
+	COMPACTION_TREE,
+	COMPACTION_RECORDS_OUT, // To the end of the record file.
+	COMPACTION_RECORDS_IN, // To the lowest free indices.
+	COMPACTION_DONE
+} CompactionPhase;
+
+struct Compaction { // Typedef'd in the header file.
+	Btree *btree;
+	Recf *recf;
+	CompactionPhase phase;
+	// Items up to last_key (if there was one) have been done in this phase.
+	bool has_last_key;
+	BtreeKey last_key;
+	// In the first pass, records which are already where the second would
+	// put them (at the index of their item in key order) stay there.
+	RecfRecordIdx rank;
+	bool moved_out;
+
+	// The items moved by a step (with their new values), their old values,
+	// the copied records, and whether the items were replaced.
+	BtreeItem *items;
+	BtreeValue *old_values;
+	RecfRecord *records;
+	bool *replaced;
+	size_t capacity;
+};
+
+Compaction *compaction_begin(Btree *btree, Recf *recf) {
+	Compaction *compaction = malloc(sizeof(*compaction));
+	xassert(1, compaction != NULL);
+	compaction->btree = btree;
+	compaction->recf = recf;
+	compaction->phase = COMPACTION_TREE;
+	compaction->has_last_key = false;
+	compaction->rank = 0;
+	compaction->moved_out = false;
+	compaction->items = NULL;
+	compaction->old_values = NULL;
+	compaction->records = NULL;
+	compaction->replaced = NULL;
+	compaction->capacity = 0;
+	return compaction;
+}
+
+void compaction_end(Compaction *compaction) {
+	free(compaction->items);
+	free(compaction->old_values);
+	free(compaction->records);
+	free(compaction->replaced);
+	free(compaction);
+}
+
+static size_t compaction_next_items(
+	Compaction *compaction, size_t max_items) {
+
+	// Fetch the next items of the phase (up to max_items of them).
+	if (compaction->capacity < max_items) {
+		compaction->capacity = max_items;
+		compaction->items = realloc(
+			compaction->items, max_items * sizeof(*compaction->items));
+		compaction->old_values = realloc(
+			compaction->old_values,
+			max_items * sizeof(*compaction->old_values));
+		compaction->records = realloc(
+			compaction->records, max_items * sizeof(*compaction->records));
+		compaction->replaced = realloc(
+			compaction->replaced, max_items * sizeof(*compaction->replaced));
+		xassert(1, compaction->items != NULL &&
+		        compaction->old_values != NULL &&
+		        compaction->records != NULL && compaction->replaced != NULL);
+	}
+
+	BtreeCursor *cursor = btree_cursor_seek(
+		compaction->btree, compaction->has_last_key ? compaction->last_key : 0);
+	BtreeKey key;
+	BtreeValue value;
+	if (compaction->has_last_key && btree_cursor_get(cursor, &key, &value) &&
+	    btree_key_cmp(key, compaction->last_key) == 0)
+		btree_cursor_next(cursor);
+	size_t n_items = 0;
+	while (n_items < max_items && btree_cursor_get(cursor, &key, &value)) {
+		compaction->items[n_items++] = (BtreeItem) {key, value};
+		btree_cursor_next(cursor);
+	}
+	btree_cursor_close(cursor);
+
+	if (n_items > 0) {
+		compaction->has_last_key = true;
+		compaction->last_key = compaction->items[n_items - 1].key;
+	}
+	return n_items;
+}
+
+static void compaction_move_records(
+	Compaction *compaction, size_t n_items, bool to_end) {
+
+	// Copy the records, point the items at the copies, then delete the
+	// originals. Items whose records stay are left out. Other operations may
+	// have changed an item since it was read, so it's only pointed at the
+	// copy if its value is still the original; if not, the copy is deleted.
+	size_t n_moved = 0;
+	for (size_t i = 0; i < n_items; i++) {
+		BtreeItem item = compaction->items[i];
+		if (to_end && item.value == compaction->rank++)
+			continue;
+		RecfRecord record;
+		RecfRecordIdx idx = recf_copy(
+			compaction->recf, item.value, to_end, &record);
+		if (idx == item.value)
+			continue;
+		compaction->old_values[n_moved] = item.value;
+		compaction->records[n_moved] = record;
+		compaction->items[n_moved++] = (BtreeItem) {item.key, idx};
+	}
+	compaction->moved_out |= to_end && n_moved > 0;
+	btree_replace_batch(compaction->btree, compaction->items, n_moved,
+	                    compaction->old_values, compaction->replaced);
+
+	// If the original was deleted and its index reused for a newer record of
+	// the same key after the copy was made, the item goes back to it.
+	size_t n_restored = 0;
+	for (size_t i = 0; i < n_moved; i++) {
+		BtreeItem item = compaction->items[i];
+		RecfRecordIdx old_idx = compaction->old_values[i];
+		if (!compaction->replaced[i]) {
+			recf_delete(compaction->recf, item.value);
+		} else if (recf_get(compaction->recf, old_idx) ==
+		           compaction->records[i]) {
+			recf_delete(compaction->recf, old_idx);
+		} else {
+			compaction->old_values[n_restored] = item.value;
+			compaction->items[n_restored++] = (BtreeItem) {item.key, old_idx};
+		}
+	}
+	btree_replace_batch(compaction->btree, compaction->items, n_restored,
+	                    compaction->old_values, compaction->replaced);
+	for (size_t i = 0; i < n_restored; i++) {
+		recf_delete(compaction->recf, compaction->replaced[i]
+		            ? compaction->old_values[i] : compaction->items[i].value);
+	}
+}
+
+bool compaction_step(Compaction *compaction, size_t max_moves) {
+	xassert(1, max_moves > 0);
+	switch (compaction->phase) {
+	case COMPACTION_TREE:
+		if (btree_compact(compaction->btree, max_moves))
+			compaction->phase = COMPACTION_RECORDS_OUT;
+		return false;
+	case COMPACTION_RECORDS_OUT:
+	case COMPACTION_RECORDS_IN: {
+		size_t n_items = compaction_next_items(compaction, max_moves);
+		if (n_items > 0) {
+			compaction_move_records(
+				compaction, n_items,
+				compaction->phase == COMPACTION_RECORDS_OUT);
+			return false;
+		}
+		compaction->has_last_key = false;
+		// If no records were moved out, the rest are already in place.
+		if (compaction->phase == COMPACTION_RECORDS_OUT &&
+		    compaction->moved_out) {
+			compaction->phase = COMPACTION_RECORDS_IN;
+			return false;
+		}
+		recf_shrink(compaction->recf);
+		compaction->phase = COMPACTION_DONE;
+		return true;
+	}
+	case COMPACTION_DONE:
+		return true;
+	}
+	xassert(1, false);
+	return true;
+}
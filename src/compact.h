@@ -0,0 +1,36 @@
+// Compaction of a tree and its record file, whose records the tree's values
+// index (as in main.c): the tree's nodes are moved to the start of its file
+// in key order (see btree_compact), and so are the records, then both files
+// are shrunk. It runs in steps, so other operations can go on between them.
+//
+// The records are moved in two passes over the items, in key order: first
+// each record is copied to the end of the file (unless it's already where
+// it'll end up), which leaves the start free, then back to the lowest free
+// index. Each copy is added, set as the item's value, and then the original
+// is deleted, in separate transactions (like a set in main.c), so a crash at
+// most leaks a record. The value is only set if it hasn't changed since the
+// item was read (otherwise the copy is deleted instead), so other operations
+// may run during a step. Until the second pass, the record file takes up to
+// twice its size.
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "btree.h"
+#include "recf.h"
+
+// Settings.
+enum {
+	COMPACTION_STEP_SIZE = 1024 // Nodes or items moved by a step of the
+	                            // compact command in main.c.
+};
+
+typedef struct Compaction Compaction;
+
+Compaction *compaction_begin(Btree *btree, Recf *recf);
+// Move up to max_moves nodes or items. Returns true once the compaction is
+// done. Other operations may run during the steps and between them. Items
+// added past the current position are moved in the same pass, so a pass can't
+// finish while they're added faster than it goes.
+bool compaction_step(Compaction *compaction, size_t max_moves);
+// Stops the compaction if it isn't done. The files stay valid either way.
+void compaction_end(Compaction *compaction);
@@ -2,68 +2,1304 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(FS_HAVE_IO_URING)
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+#endif
 #include "xassert.h"
+#include "utils.h"
+
+#define FS_NO_PAGE ((FsOffset) -1)
+
+// Address space reserved for a memory-mapped file. Growing the file maps more
+// of it, so pointers into the mapping stay valid.
+#define FS_MMAP_RESERVE \
+	((size_t) (sizeof(void *) >= 8 ? UINT64_C(1) << 36 : UINT32_C(1) << 30))
+
+#if defined(FS_HAVE_IO_URING)
+enum { FS_RING_N_ENTRIES = 64 };
+
+typedef struct {
+	int fd; // -1 if io_uring isn't available (in which case we fall back to
+	        // preadv and pwritev).
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	unsigned n_unsubmitted;
+	unsigned n_in_flight; // Submitted, but not reaped.
+	struct iovec iovecs[FS_RING_N_ENTRIES];
+} FsRing;
+#endif
+
+typedef struct FsPage FsPage;
+struct FsPage {
+	FsOffset offset; // FS_NO_PAGE if the frame is unused.
+	size_t size;
+	char *data;
+	int n_pins;
+	bool dirty;
+	bool referenced; // For the CLOCK eviction algorithm.
+	FsPage *next; // In a hash bucket, or in the list of uncached pins.
+};
 
 struct FsFile { // The typedef is in fs.h.
-	FILE *file;
+	// Lookups of cached pages (and reads of memory-mapped files) share the
+	// lock, so they only update counters (atomically, like the pages'
+	// n_pins). Everything else, including misses (which may evict a page),
+	// holds it exclusively.
+	pthread_rwlock_t lock;
+
+	int fd;
+	FsMode mode;
 	FsOffset size;
 	FsStats stats;
+	FsLatency latency;
+	uint64_t batch_start; // 0 if no batch is waiting for fs_wait.
+	bool batch_has_writes;
+
+	// FS_MODE_MMAP only.
+	char *map;
+	size_t map_size; // Mapped part of the reservation, in whole OS pages.
+	size_t os_page_size;
+	FsOffset dirty_begin; // Range modified since the last fs_sync.
+	FsOffset dirty_end;
+
+	// Buffer pool. Pages are looked up in a hash table with chaining and
+	// evicted using the CLOCK algorithm (an approximation of LRU).
+	size_t page_size; // 0 if the buffer pool is disabled.
+	size_t max_pages;
+	FsPage **frames;
+	size_t n_frames;
+	size_t frames_capacity;
+	size_t clock_hand;
+	FsPage **buckets;
+	size_t n_buckets; // Power of 2.
+
+	// Pins of ranges which aren't cached (because the buffer pool is
+	// disabled). They're read on fs_pin and written on fs_unpin.
+	FsPage *uncached_pins;
+
+	void (*write_hook)(void *); // See fs_set_write_hook.
+	void *write_hook_context;
+
+#if defined(FS_HAVE_IO_URING)
+	FsRing *ring; // Created on the first batch.
+#endif
 };
 
-FsFile *fs_open(const char *name, bool truncate) {
+static uint64_t fs_now(void) {
+	// CLOCK_MONOTONIC is read in user space (through the vDSO), so this is
+	// cheap enough to call on every operation.
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t fs_histogram_bucket(uint64_t value) {
+	if (value < FS_HISTOGRAM_SUB_BUCKETS)
+		return value;
+	int exponent = 63 - __builtin_clzll(value); // At least 3.
+	return (exponent - 2) * FS_HISTOGRAM_SUB_BUCKETS +
+		((value >> (exponent - 3)) & (FS_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t fs_histogram_bucket_max(size_t bucket) {
+	if (bucket < FS_HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	int exponent = bucket / FS_HISTOGRAM_SUB_BUCKETS + 2;
+	uint64_t sub_bucket = bucket % FS_HISTOGRAM_SUB_BUCKETS;
+	uint64_t min = (FS_HISTOGRAM_SUB_BUCKETS + sub_bucket) << (exponent - 3);
+	return min + ((UINT64_C(1) << (exponent - 3)) - 1);
+}
+
+static void fs_count(uint64_t *counter, uint64_t n) {
+	// For counters updated under the shared lock.
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void fs_histogram_record(FsHistogram *histogram, uint64_t value) {
+	fs_count(&histogram->counts[fs_histogram_bucket(value)], 1);
+	fs_count(&histogram->n, 1);
+	// A failed compare-and-swap reloads `max`.
+	uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t fs_histogram_percentile(const FsHistogram *histogram,
+                                 double percentile) {
+	if (histogram->n == 0)
+		return 0;
+
+	double rank = percentile / 100 * histogram->n;
+	uint64_t n_below = MAX((uint64_t) rank + (rank > (uint64_t) rank), 1);
+	uint64_t n_seen = 0;
+	for (size_t i = 0; i < FS_HISTOGRAM_N_BUCKETS; i++) {
+		n_seen += histogram->counts[i];
+		if (n_seen >= n_below)
+			return MIN(fs_histogram_bucket_max(i), histogram->max);
+	}
+	return histogram->max;
+}
+
+void fs_histogram_subtract(FsHistogram *a, const FsHistogram *b) {
+	// The maximum can't be subtracted, but a's is still an upper bound.
+	for (size_t i = 0; i < FS_HISTOGRAM_N_BUCKETS; i++) {
+		xassert(1, a->counts[i] >= b->counts[i]);
+		a->counts[i] -= b->counts[i];
+	}
+	a->n -= b->n;
+}
+
+static size_t fs_round_up(size_t n, size_t multiple) {
+	return (n + multiple - 1) / multiple * multiple;
+}
+
+static void fs_check_aligned(
+	FsFile *file, const void *buf, FsOffset offset, size_t n_bytes) {
+
+	// O_DIRECT only works with aligned buffers, offsets and sizes.
+	if (file->mode != FS_MODE_DIRECT)
+		return;
+	xassert(1, (uintptr_t) buf % FS_DIRECT_ALIGNMENT == 0);
+	xassert(1, offset % FS_DIRECT_ALIGNMENT == 0);
+	xassert(1, n_bytes % FS_DIRECT_ALIGNMENT == 0);
+}
+
+static FsOffset fs_round_size(FsFile *file, FsOffset size) {
+	// With O_DIRECT, the file's size is kept aligned, so that every page
+	// of the buffer pool can be read and written whole.
+	if (file->mode != FS_MODE_DIRECT)
+		return size;
+	return fs_round_up(size, FS_DIRECT_ALIGNMENT);
+}
+
+static void fs_map_resize(FsFile *file, FsOffset size) {
+	// Map the file up to `size` into the reserved address space, and return
+	// the rest of the reservation to inaccessible anonymous memory (so that
+	// stray accesses past the end fault instead of raising SIGBUS later).
+
+	size_t new_map_size = fs_round_up(size, file->os_page_size);
+	xassert(1, new_map_size <= FS_MMAP_RESERVE);
+
+	if (new_map_size > file->map_size) {
+		void *mmap_result = mmap(
+			file->map + file->map_size, new_map_size - file->map_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			file->fd, file->map_size);
+		xassert(1, mmap_result != MAP_FAILED);
+	} else if (new_map_size < file->map_size) {
+		void *mmap_result = mmap(
+			file->map + new_map_size, file->map_size - new_map_size,
+			PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+			-1, 0);
+		xassert(1, mmap_result != MAP_FAILED);
+	}
+	file->map_size = new_map_size;
+}
+
+static void fs_truncate(FsFile *file, FsOffset size);
+
+FsFile *fs_open(const char *name, bool truncate, FsMode mode) {
 	FsFile *file = malloc(sizeof(*file));
 	xassert(1, file != NULL);
+	int lock_result = pthread_rwlock_init(&file->lock, NULL);
+	xassert(1, lock_result == 0);
 
-	file->stats.n_reads = 0;
-	file->stats.n_writes = 0;
+	fs_reset_stats(file);
+	file->batch_start = 0;
+	file->batch_has_writes = false;
 
-	file->file = fopen(name, truncate ? "w+b" : "a+b");
-	xassert(1, file->file != NULL);
+	file->mode = mode;
+	int flags = O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0) |
+		(mode == FS_MODE_DIRECT ? O_DIRECT : 0);
+	file->fd = open(name, flags, 0666);
+	xassert(1, file->fd != -1);
 
 	struct stat file_stat;
-	int fstat_result = fstat(fileno(file->file), &file_stat);
+	int fstat_result = fstat(file->fd, &file_stat);
 	xassert(1, fstat_result != -1);
 	file->size = file_stat.st_size;
 
+	file->map = NULL;
+	file->map_size = 0;
+	file->os_page_size = sysconf(_SC_PAGESIZE);
+	file->dirty_begin = 0;
+	file->dirty_end = 0;
+	if (mode == FS_MODE_MMAP) {
+		file->map = mmap(
+			NULL, FS_MMAP_RESERVE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		xassert(1, file->map != MAP_FAILED);
+		fs_map_resize(file, file->size);
+	}
+
+	file->page_size = 0;
+	file->max_pages = 0;
+	file->frames = NULL;
+	file->n_frames = 0;
+	file->frames_capacity = 0;
+	file->clock_hand = 0;
+	file->buckets = NULL;
+	file->n_buckets = 0;
+	file->uncached_pins = NULL;
+	file->write_hook = NULL;
+	file->write_hook_context = NULL;
+#if defined(FS_HAVE_IO_URING)
+	file->ring = NULL;
+#endif
+
+	if (file->size != fs_round_size(file, file->size))
+		fs_truncate(file, file->size);
+
 	return file;
 }
 
+static void fs_pread(
+	FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+
+	fs_check_aligned(file, dest, offset, n_bytes);
+	ssize_t pread_result = pread(file->fd, dest, n_bytes, offset);
+	xassert(1, (size_t) pread_result == n_bytes);
+}
+
+static void fs_before_write(FsFile *file) {
+	// Called before anything reaches the file (or, for memory-mapped files,
+	// the mapping, which the kernel may write back at any time).
+	if (file->write_hook != NULL)
+		file->write_hook(file->write_hook_context);
+}
+
+void fs_set_write_hook(
+	FsFile *file, void (*hook)(void *context), void *context) {
+
+	pthread_rwlock_wrlock(&file->lock);
+	file->write_hook = hook;
+	file->write_hook_context = context;
+	pthread_rwlock_unlock(&file->lock);
+}
+
+static void fs_pwrite(
+	FsFile *file, const void *src, FsOffset offset, size_t n_bytes) {
+
+	fs_check_aligned(file, src, offset, n_bytes);
+	fs_before_write(file);
+	ssize_t pwrite_result = pwrite(file->fd, src, n_bytes, offset);
+	xassert(1, (size_t) pwrite_result == n_bytes);
+}
+
+static int fs_request_offset_cmp(const void *a, const void *b) {
+	FsOffset offset_a = ((const FsRequest *) a)->offset;
+	FsOffset offset_b = ((const FsRequest *) b)->offset;
+	return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+static void fs_vectored_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests) {
+
+	// Fallback for when io_uring isn't available: one preadv or pwritev per
+	// run of requests which are adjacent in the file.
+
+	FsRequest *sorted = malloc(n_requests * sizeof(*sorted));
+	xassert(1, sorted != NULL);
+	memcpy(sorted, requests, n_requests * sizeof(*sorted));
+	qsort(sorted, n_requests, sizeof(*sorted), fs_request_offset_cmp);
+
+	enum { MAX_IOVECS = 64 };
+	struct iovec iovecs[MAX_IOVECS];
+
+	size_t i_run = 0;
+	while (i_run < n_requests) {
+		size_t n_iovecs = 0;
+		size_t n_bytes = 0;
+		bool write = sorted[i_run].write;
+		FsOffset offset = sorted[i_run].offset;
+
+		while (i_run + n_iovecs < n_requests && n_iovecs < MAX_IOVECS &&
+		       n_iovecs < IOV_MAX) {
+			const FsRequest *request = &sorted[i_run + n_iovecs];
+			if (request->write != write || request->offset != offset + n_bytes)
+				break;
+			iovecs[n_iovecs].iov_base = request->buf;
+			iovecs[n_iovecs].iov_len = request->n_bytes;
+			n_bytes += request->n_bytes;
+			n_iovecs++;
+		}
+
+		ssize_t result = write
+			? pwritev(file->fd, iovecs, n_iovecs, offset)
+			: preadv(file->fd, iovecs, n_iovecs, offset);
+		xassert(1, (size_t) result == n_bytes);
+		i_run += n_iovecs;
+	}
+
+	free(sorted);
+}
+
+#if defined(FS_HAVE_IO_URING)
+static FsRing *fs_ring_new(void) {
+	FsRing *ring = malloc(sizeof(*ring));
+	xassert(1, ring != NULL);
+	ring->n_unsubmitted = 0;
+	ring->n_in_flight = 0;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, FS_RING_N_ENTRIES, &params);
+	if (ring->fd == -1) // E.g. an old kernel, or forbidden by seccomp.
+		return ring;
+
+	ring->sq_ring_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size =
+		params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_SHARED | MAP_POPULATE;
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, prot, flags,
+	                     ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, prot, flags,
+	                     ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, prot, flags,
+	                  ring->fd, IORING_OFF_SQES);
+	xassert(1, ring->sq_ring != MAP_FAILED && ring->cq_ring != MAP_FAILED &&
+	        ring->sqes != MAP_FAILED);
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return ring;
+}
+
+static void fs_ring_destroy(FsRing *ring) {
+	xassert(1, ring->n_in_flight == 0);
+	if (ring->fd != -1) {
+		munmap(ring->sqes, ring->sqes_size);
+		munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+	}
+	free(ring);
+}
+
+static void fs_ring_enter(FsRing *ring, unsigned min_complete) {
+	// Submit the queued entries and wait for at least min_complete
+	// completions, then reap everything that's completed.
+
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int enter_result = syscall(__NR_io_uring_enter, ring->fd,
+	                           ring->n_unsubmitted, min_complete, flags,
+	                           NULL, 0);
+	xassert(1, enter_result >= 0);
+	xassert(1, (unsigned) enter_result == ring->n_unsubmitted);
+	ring->n_unsubmitted = 0;
+
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		xassert(1, cqe->res >= 0 && (uint64_t) cqe->res == cqe->user_data);
+		ring->n_in_flight--;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void fs_ring_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests) {
+
+	FsRing *ring = file->ring;
+	for (size_t i = 0; i < n_requests; i++) {
+		if (ring->n_in_flight == FS_RING_N_ENTRIES)
+			fs_ring_enter(ring, 1);
+
+		unsigned tail = *ring->sq_tail;
+		unsigned index = tail & *ring->sq_mask;
+
+		// Each entry in flight owns the iovec with the same index as its
+		// submission queue entry (entries are consumed in order).
+		struct iovec *iovec = &ring->iovecs[index];
+		iovec->iov_base = requests[i].buf;
+		iovec->iov_len = requests[i].n_bytes;
+
+		struct io_uring_sqe *sqe = &ring->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = requests[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = file->fd;
+		sqe->off = requests[i].offset;
+		sqe->addr = (uint64_t) (uintptr_t) iovec;
+		sqe->len = 1;
+		sqe->user_data = requests[i].n_bytes; // Expected result.
+
+		ring->sq_array[index] = index;
+		__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		ring->n_unsubmitted++;
+		ring->n_in_flight++;
+	}
+
+	// One system call for the whole batch (unless it didn't fit in the ring).
+	if (ring->n_unsubmitted > 0)
+		fs_ring_enter(ring, 0);
+}
+#endif
+
+static void fs_raw_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests) {
+
+	// Bypasses the buffer pool.
+
+	bool has_writes = false;
+	for (size_t i = 0; i < n_requests; i++) {
+		fs_check_aligned(file, requests[i].buf, requests[i].offset,
+		                 requests[i].n_bytes);
+		has_writes |= requests[i].write;
+	}
+	if (has_writes)
+		fs_before_write(file);
+
+#if defined(FS_HAVE_IO_URING)
+	if (file->ring == NULL)
+		file->ring = fs_ring_new();
+	if (file->ring->fd != -1) {
+		fs_ring_batch(file, requests, n_requests);
+		return;
+	}
+#endif
+	fs_vectored_batch(file, requests, n_requests);
+}
+
+static void fs_raw_wait(FsFile *file) {
+#if defined(FS_HAVE_IO_URING)
+	if (file->ring != NULL && file->ring->fd != -1) {
+		while (file->ring->n_in_flight > 0)
+			fs_ring_enter(file->ring, file->ring->n_in_flight);
+	}
+#else
+	(void) file;
+#endif
+}
+
+static size_t fs_bucket(FsFile *file, FsOffset page_offset) {
+	return (page_offset / file->page_size) & (file->n_buckets - 1);
+}
+
+static void fs_page_unlink(FsFile *file, FsPage *page) {
+	FsPage **link = &file->buckets[fs_bucket(file, page->offset)];
+	while (*link != page) {
+		xassert(1, *link != NULL);
+		link = &(*link)->next;
+	}
+	*link = page->next;
+	page->offset = FS_NO_PAGE;
+	page->next = NULL;
+}
+
+static void fs_page_write_back(FsFile *file, FsPage *page) {
+	// Don't write past the end of the file -- only fs_set_size changes it.
+	if (!page->dirty)
+		return;
+	page->dirty = false;
+	if (page->offset >= file->size)
+		return;
+	fs_pwrite(file, page->data, page->offset,
+	          MIN(page->size, file->size - page->offset));
+}
+
+static void fs_page_load(FsFile *file, FsPage *page) {
+	size_t n_in_file = page->offset >= file->size
+		? 0 : MIN(page->size, file->size - page->offset);
+	fs_pread(file, page->data, page->offset, n_in_file);
+	memset(page->data + n_in_file, 0, page->size - n_in_file);
+}
+
+static FsPage *fs_page_new_frame(FsFile *file) {
+	if (file->n_frames == file->frames_capacity) {
+		file->frames_capacity = MAX(16, file->frames_capacity * 2);
+		file->frames = realloc(
+			file->frames, file->frames_capacity * sizeof(*file->frames));
+		xassert(1, file->frames != NULL);
+	}
+
+	FsPage *page = malloc(sizeof(*page));
+	xassert(1, page != NULL);
+	page->offset = FS_NO_PAGE;
+	page->size = file->page_size;
+	page->data = fs_alloc_buffer(file->page_size);
+	page->n_pins = 0;
+	page->dirty = false;
+	page->referenced = false;
+	page->next = NULL;
+
+	file->frames[file->n_frames++] = page;
+	return page;
+}
+
+static FsPage *fs_page_victim(FsFile *file) {
+	// Returns an unused frame, evicting a page if necessary.
+
+	if (file->n_frames < file->max_pages)
+		return fs_page_new_frame(file);
+
+	// Two sweeps are enough to clear every reference bit and come back to the
+	// first unpinned frame.
+	for (size_t i = 0; i < 2 * file->n_frames; i++) {
+		FsPage *page = file->frames[file->clock_hand];
+		file->clock_hand = (file->clock_hand + 1) % file->n_frames;
+
+		if (page->n_pins > 0)
+			continue;
+		if (page->referenced) {
+			page->referenced = false;
+			continue;
+		}
+
+		if (page->offset != FS_NO_PAGE) {
+			fs_page_write_back(file, page);
+			fs_page_unlink(file, page);
+			file->stats.n_evictions++;
+		}
+		return page;
+	}
+
+	// Everything is pinned.
+	return fs_page_new_frame(file);
+}
+
+static FsPage *fs_page_get_unloaded(
+	FsFile *file, FsOffset page_offset, bool *is_new) {
+
+	// Returns the page pinned. On a miss, *is_new is set and the page's data
+	// is garbage -- the caller has to load or overwrite it.
+
+	xassert(1, page_offset % file->page_size == 0);
+	*is_new = false;
+
+	FsPage **bucket = &file->buckets[fs_bucket(file, page_offset)];
+	for (FsPage *page = *bucket; page != NULL; page = page->next) {
+		if (page->offset == page_offset) {
+			file->stats.n_hits++;
+			page->referenced = true;
+			page->n_pins++;
+			return page;
+		}
+	}
+
+	file->stats.n_misses++;
+	FsPage *page = fs_page_victim(file);
+	page->offset = page_offset;
+	page->referenced = true;
+	page->n_pins = 1;
+	page->next = *bucket;
+	*bucket = page;
+	*is_new = true;
+	return page;
+}
+
+static FsPage *fs_page_get(FsFile *file, FsOffset page_offset, bool load) {
+	// Returns the page pinned. If load is false, the caller is going to
+	// overwrite the whole page, so there's no need to read it on a miss.
+
+	bool is_new;
+	FsPage *page = fs_page_get_unloaded(file, page_offset, &is_new);
+	if (is_new && load)
+		fs_page_load(file, page);
+	return page;
+}
+
+static void fs_page_release(FsPage *page, bool dirty) {
+	xassert(1, page->n_pins > 0);
+	page->n_pins--;
+	page->dirty = page->dirty || dirty;
+}
+
+static void fs_do_flush(FsFile *file);
+
+static void fs_drop_cache(FsFile *file) {
+	fs_do_flush(file);
+	for (size_t i = 0; i < file->n_frames; i++) {
+		xassert(1, file->frames[i]->n_pins == 0);
+		free(file->frames[i]->data);
+		free(file->frames[i]);
+	}
+	free(file->frames);
+	free(file->buckets);
+
+	file->page_size = 0;
+	file->max_pages = 0;
+	file->frames = NULL;
+	file->n_frames = 0;
+	file->frames_capacity = 0;
+	file->clock_hand = 0;
+	file->buckets = NULL;
+	file->n_buckets = 0;
+}
+
 void fs_close(FsFile *file) {
 	xassert(1, file != NULL);
-	fclose(file->file);
+	xassert(1, file->uncached_pins == NULL);
+	fs_drop_cache(file);
+#if defined(FS_HAVE_IO_URING)
+	if (file->ring != NULL)
+		fs_ring_destroy(file->ring);
+#endif
+	if (file->mode == FS_MODE_MMAP) {
+		int munmap_result = munmap(file->map, FS_MMAP_RESERVE);
+		xassert(1, munmap_result != -1);
+	}
+	close(file->fd);
+	pthread_rwlock_destroy(&file->lock);
 	free(file);
 }
 
-void fs_set_size(FsFile *file, FsOffset size) {
+void fs_set_cache(FsFile *file, size_t page_size, size_t max_bytes) {
 	xassert(1, file != NULL);
+	fs_drop_cache(file);
 
-	int ftruncate_result = ftruncate(fileno(file->file), size);
-	xassert(1, ftruncate_result != -1);
+	// The page cache already holds a mapped file, so there's nothing to add.
+	if (max_bytes == 0 || file->mode == FS_MODE_MMAP)
+		return;
+
+	xassert(1, page_size > 0);
+	xassert(1, file->mode != FS_MODE_DIRECT ||
+	        page_size % FS_DIRECT_ALIGNMENT == 0);
+	file->page_size = page_size;
+	file->max_pages = MAX(1, max_bytes / page_size);
+
+	file->n_buckets = 1;
+	while (file->n_buckets < 2 * file->max_pages)
+		file->n_buckets *= 2;
+	file->buckets = calloc(file->n_buckets, sizeof(*file->buckets));
+	xassert(1, file->buckets != NULL);
+}
+
+static void fs_resized(FsFile *file, FsOffset size) {
 	file->size = size;
+
+	if (file->mode == FS_MODE_MMAP) {
+		fs_map_resize(file, size);
+		file->dirty_end = MIN(file->dirty_end, size);
+		file->dirty_begin = MIN(file->dirty_begin, file->dirty_end);
+		return;
+	}
+
+	// Drop cached pages past the new end. If the file grows again, the bytes
+	// past the current end have to read as zeros, like after ftruncate.
+	for (size_t i = 0; i < file->n_frames; i++) {
+		FsPage *page = file->frames[i];
+		if (page->offset == FS_NO_PAGE || page->offset + page->size <= size)
+			continue;
+
+		if (page->offset >= size) {
+			xassert(1, page->n_pins == 0);
+			page->dirty = false;
+			fs_page_unlink(file, page);
+		} else {
+			memset(page->data + (size - page->offset), 0,
+			       page->offset + page->size - size);
+		}
+	}
 }
 
-void fs_read(FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+static void fs_truncate(FsFile *file, FsOffset size) {
+	size = fs_round_size(file, size);
+	int ftruncate_result = ftruncate(file->fd, size);
+	xassert(1, ftruncate_result != -1);
+	fs_resized(file, size);
+}
+
+void fs_set_size(FsFile *file, FsOffset size) {
 	xassert(1, file != NULL);
-	xassert(1, offset < file->size);
+	uint64_t start = fs_now();
+	pthread_rwlock_wrlock(&file->lock);
+	fs_truncate(file, size);
+	pthread_rwlock_unlock(&file->lock);
+	fs_histogram_record(&file->latency.set_size, fs_now() - start);
+}
 
-	file->stats.n_reads++;
+void fs_allocate(FsFile *file, FsOffset size) {
+	xassert(1, file != NULL);
+	size = fs_round_size(file, size);
+	pthread_rwlock_wrlock(&file->lock);
+	if (size <= file->size) {
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
 
-	ssize_t pread_result = pread(fileno(file->file), dest, n_bytes, offset);
-	xassert(1, (size_t) pread_result == n_bytes);
+	uint64_t start = fs_now();
+	int fallocate_result =
+		fallocate(file->fd, 0, file->size, size - file->size);
+	if (fallocate_result == -1) {
+		// Not supported by the filesystem.
+		fs_truncate(file, size);
+	} else {
+		fs_resized(file, size);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	fs_histogram_record(&file->latency.set_size, fs_now() - start);
+}
+
+void *fs_alloc_buffer(size_t n_bytes) {
+	void *buffer;
+	int result = posix_memalign(&buffer, FS_DIRECT_ALIGNMENT,
+	                            MAX(n_bytes, (size_t) 1));
+	xassert(1, result == 0);
+	return buffer;
+}
+
+FsOffset fs_size(FsFile *file) {
+	pthread_rwlock_rdlock(&file->lock);
+	FsOffset size = file->size;
+	pthread_rwlock_unlock(&file->lock);
+	return size;
+}
+
+static void fs_map_mark_dirty(FsFile *file, FsOffset offset, size_t n_bytes) {
+	if (file->dirty_begin == file->dirty_end) {
+		file->dirty_begin = offset;
+		file->dirty_end = offset + n_bytes;
+	} else {
+		file->dirty_begin = MIN(file->dirty_begin, offset);
+		file->dirty_end = MAX(file->dirty_end, offset + n_bytes);
+	}
+}
+
+static FsPage *fs_page_find(FsFile *file, FsOffset page_offset) {
+	// NULL if the page isn't cached. Only looks (see FsFile.lock).
+	FsPage *page = file->buckets[fs_bucket(file, page_offset)];
+	while (page != NULL && page->offset != page_offset)
+		page = page->next;
+	return page;
+}
+
+static bool fs_shared_read(
+	FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+
+	// Under the shared lock. Returns false (having maybe copied a part) if a
+	// page has to be loaded, which needs the exclusive lock.
+
+	if (file->mode == FS_MODE_MMAP) {
+		xassert(1, offset + n_bytes <= file->size);
+		memcpy(dest, file->map + offset, n_bytes);
+		return true;
+	}
+
+	if (file->page_size == 0) {
+		fs_pread(file, dest, offset, n_bytes);
+		return true;
+	}
+
+	uint64_t n_hits = 0;
+	while (n_bytes > 0) {
+		size_t offset_in_page = offset % file->page_size;
+		size_t n_in_page = MIN(n_bytes, file->page_size - offset_in_page);
+
+		FsPage *page = fs_page_find(file, offset - offset_in_page);
+		if (page == NULL)
+			return false;
+		__atomic_store_n(&page->referenced, true, __ATOMIC_RELAXED);
+		memcpy(dest, page->data + offset_in_page, n_in_page);
+		n_hits++;
+
+		dest = (char *) dest + n_in_page;
+		offset += n_in_page;
+		n_bytes -= n_in_page;
+	}
+	fs_count(&file->stats.n_hits, n_hits);
+	return true;
+}
+
+static void fs_do_read(
+	FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+
+	if (file->mode == FS_MODE_MMAP) {
+		xassert(1, offset + n_bytes <= file->size);
+		memcpy(dest, file->map + offset, n_bytes);
+		return;
+	}
+
+	if (file->page_size == 0) {
+		fs_pread(file, dest, offset, n_bytes);
+		return;
+	}
+
+	while (n_bytes > 0) {
+		size_t offset_in_page = offset % file->page_size;
+		size_t n_in_page = MIN(n_bytes, file->page_size - offset_in_page);
+
+		FsPage *page = fs_page_get(file, offset - offset_in_page, true);
+		memcpy(dest, page->data + offset_in_page, n_in_page);
+		fs_page_release(page, false);
+
+		dest = (char *) dest + n_in_page;
+		offset += n_in_page;
+		n_bytes -= n_in_page;
+	}
+}
+
+static void fs_cached_write(
+	FsFile *file, const void *src, FsOffset offset, size_t n_bytes) {
+
+	while (n_bytes > 0) {
+		size_t offset_in_page = offset % file->page_size;
+		size_t n_in_page = MIN(n_bytes, file->page_size - offset_in_page);
+
+		bool whole_page = (n_in_page == file->page_size);
+		FsPage *page = fs_page_get(file, offset - offset_in_page, !whole_page);
+		memcpy(page->data + offset_in_page, src, n_in_page);
+		fs_page_release(page, true);
+
+		src = (const char *) src + n_in_page;
+		offset += n_in_page;
+		n_bytes -= n_in_page;
+	}
+}
+
+static void fs_do_write(
+	FsFile *file, const void *src, FsOffset offset, size_t n_bytes) {
+
+	if (file->mode == FS_MODE_MMAP) {
+		xassert(1, offset + n_bytes <= file->size);
+		fs_before_write(file);
+		memcpy(file->map + offset, src, n_bytes);
+		fs_map_mark_dirty(file, offset, n_bytes);
+		return;
+	}
+
+	if (file->page_size == 0) {
+		fs_pwrite(file, src, offset, n_bytes);
+		return;
+	}
+
+	fs_cached_write(file, src, offset, n_bytes);
+}
+
+bool fs_try_read(FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+	xassert(1, file != NULL);
+
+	// The size is checked again if the exclusive lock has to be taken.
+	uint64_t start = fs_now();
+	pthread_rwlock_rdlock(&file->lock);
+	if (offset + n_bytes > file->size) {
+		pthread_rwlock_unlock(&file->lock);
+		return false;
+	}
+	fs_count(&file->stats.n_reads, 1);
+	fs_count(&file->stats.n_read_bytes, n_bytes);
+	bool done = fs_shared_read(file, dest, offset, n_bytes);
+	pthread_rwlock_unlock(&file->lock);
+	if (!done) {
+		pthread_rwlock_wrlock(&file->lock);
+		bool in_file = offset + n_bytes <= file->size;
+		if (in_file)
+			fs_do_read(file, dest, offset, n_bytes);
+		pthread_rwlock_unlock(&file->lock);
+		if (!in_file)
+			return false;
+	}
+	fs_histogram_record(&file->latency.read, fs_now() - start);
+	return true;
+}
+
+void fs_read(FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+	bool in_file = fs_try_read(file, dest, offset, n_bytes);
+	xassert(1, in_file);
 }
 
 void fs_write(FsFile *file, const void *src, FsOffset offset, size_t n_bytes) {
 	xassert(1, file != NULL);
-	xassert(1, offset < file->size);
 
+	uint64_t start = fs_now();
+	pthread_rwlock_wrlock(&file->lock);
+	xassert(1, offset < file->size);
 	file->stats.n_writes++;
+	file->stats.n_written_bytes += n_bytes;
+	fs_do_write(file, src, offset, n_bytes);
+	pthread_rwlock_unlock(&file->lock);
+	fs_histogram_record(&file->latency.write, fs_now() - start);
+}
 
-	ssize_t pwrite_result = pwrite(fileno(file->file), src, n_bytes, offset);
-	xassert(1, (size_t) pwrite_result == n_bytes);
+static void fs_cached_read_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests) {
+
+	// Pin every page that the reads touch, then load all the missing ones
+	// with a single batch.
+
+	size_t max_pages = 0;
+	for (size_t i = 0; i < n_requests; i++)
+		max_pages += requests[i].n_bytes / file->page_size + 2;
+	FsPage **pages = malloc(max_pages * sizeof(*pages));
+	FsRequest *loads = malloc(max_pages * sizeof(*loads));
+	xassert(1, pages != NULL && loads != NULL);
+	size_t n_pages = 0;
+	size_t n_loads = 0;
+
+	for (size_t i = 0; i < n_requests; i++) {
+		FsOffset end = requests[i].offset + requests[i].n_bytes;
+		FsOffset page_offset =
+			requests[i].offset - requests[i].offset % file->page_size;
+		for (; page_offset < end; page_offset += file->page_size) {
+			bool is_new;
+			FsPage *page = fs_page_get_unloaded(file, page_offset, &is_new);
+			pages[n_pages++] = page;
+			if (!is_new)
+				continue;
+
+			size_t n_in_file = MIN(page->size, file->size - page->offset);
+			memset(page->data + n_in_file, 0, page->size - n_in_file);
+			FsRequest load = {false, page->data, page->offset, n_in_file};
+			loads[n_loads++] = load;
+		}
+	}
+
+	if (n_loads > 0) {
+		fs_raw_batch(file, loads, n_loads);
+		fs_raw_wait(file);
+	}
+
+	size_t i_page = 0;
+	for (size_t i = 0; i < n_requests; i++) {
+		char *dest = requests[i].buf;
+		FsOffset offset = requests[i].offset;
+		size_t n_bytes = requests[i].n_bytes;
+		while (n_bytes > 0) {
+			size_t offset_in_page = offset % file->page_size;
+			size_t n_in_page = MIN(n_bytes, file->page_size - offset_in_page);
+			memcpy(dest, pages[i_page++]->data + offset_in_page, n_in_page);
+			dest += n_in_page;
+			offset += n_in_page;
+			n_bytes -= n_in_page;
+		}
+	}
+
+	for (i_page = 0; i_page < n_pages; i_page++)
+		fs_page_release(pages[i_page], false);
+	free(pages);
+	free(loads);
+}
+
+void fs_submit_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests) {
+
+	xassert(1, file != NULL);
+	pthread_rwlock_wrlock(&file->lock);
+
+	// Several batches submitted before fs_wait are timed together.
+	if (file->batch_start == 0)
+		file->batch_start = fs_now();
+
+	bool has_reads = false;
+	for (size_t i = 0; i < n_requests; i++) {
+		xassert(1, requests[i].offset + requests[i].n_bytes <= file->size);
+		if (requests[i].write) {
+			file->stats.n_writes++;
+			file->stats.n_written_bytes += requests[i].n_bytes;
+			file->batch_has_writes = true;
+		} else {
+			file->stats.n_reads++;
+			file->stats.n_read_bytes += requests[i].n_bytes;
+			has_reads = true;
+		}
+	}
+
+	if (file->mode == FS_MODE_MMAP) {
+		if (file->batch_has_writes)
+			fs_before_write(file);
+		for (size_t i = 0; i < n_requests; i++) {
+			const FsRequest *request = &requests[i];
+			if (request->write) {
+				memcpy(file->map + request->offset, request->buf,
+				       request->n_bytes);
+				fs_map_mark_dirty(file, request->offset, request->n_bytes);
+			} else {
+				memcpy(request->buf, file->map + request->offset,
+				       request->n_bytes);
+			}
+		}
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+
+	if (file->page_size == 0) {
+		fs_raw_batch(file, requests, n_requests);
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+
+	// With the buffer pool, writes only touch memory (unless they evict
+	// something), and reads need I/O only for the pages that miss.
+	for (size_t i = 0; i < n_requests; i++) {
+		if (requests[i].write) {
+			fs_cached_write(file, requests[i].buf,
+			                requests[i].offset, requests[i].n_bytes);
+		}
+	}
+
+	if (has_reads) {
+		FsRequest *reads = malloc(n_requests * sizeof(*reads));
+		xassert(1, reads != NULL);
+		size_t n_reads = 0;
+		for (size_t i = 0; i < n_requests; i++) {
+			if (!requests[i].write)
+				reads[n_reads++] = requests[i];
+		}
+		fs_cached_read_batch(file, reads, n_reads);
+		free(reads);
+	}
+	pthread_rwlock_unlock(&file->lock);
+}
+
+void fs_wait(FsFile *file) {
+	xassert(1, file != NULL);
+	pthread_rwlock_wrlock(&file->lock);
+	fs_raw_wait(file);
+
+	if (file->batch_start != 0) {
+		fs_histogram_record(file->batch_has_writes
+		                    ? &file->latency.write : &file->latency.read,
+		                    fs_now() - file->batch_start);
+		file->batch_start = 0;
+		file->batch_has_writes = false;
+	}
+	pthread_rwlock_unlock(&file->lock);
+}
+
+static void *fs_do_pin(FsFile *file, FsOffset offset, size_t n_bytes) {
+	if (file->mode == FS_MODE_MMAP)
+		return file->map + offset;
+
+	if (file->page_size == 0) {
+		FsPage *pin = malloc(sizeof(*pin));
+		xassert(1, pin != NULL);
+		pin->offset = offset;
+		pin->size = n_bytes;
+		pin->data = fs_alloc_buffer(n_bytes);
+		pin->n_pins = 1;
+		pin->dirty = false;
+		pin->next = file->uncached_pins;
+		file->uncached_pins = pin;
+
+		fs_pread(file, pin->data, offset, n_bytes);
+		return pin->data;
+	}
+
+	size_t offset_in_page = offset % file->page_size;
+	xassert(1, offset_in_page + n_bytes <= file->page_size);
+	FsPage *page = fs_page_get(file, offset - offset_in_page, true);
+	return page->data + offset_in_page;
+}
+
+static void *fs_shared_pin(FsFile *file, FsOffset offset, size_t n_bytes) {
+	// Under the shared lock, like fs_shared_read. Returns NULL if the pin
+	// needs the exclusive lock.
+
+	if (file->mode == FS_MODE_MMAP)
+		return file->map + offset;
+	if (file->page_size == 0)
+		return NULL; // The list of uncached pins changes.
+
+	size_t offset_in_page = offset % file->page_size;
+	xassert(1, offset_in_page + n_bytes <= file->page_size);
+	FsPage *page = fs_page_find(file, offset - offset_in_page);
+	if (page == NULL)
+		return NULL;
+	__atomic_fetch_add(&page->n_pins, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->referenced, true, __ATOMIC_RELAXED);
+	fs_count(&file->stats.n_hits, 1);
+	return page->data + offset_in_page;
+}
+
+void *fs_pin(FsFile *file, FsOffset offset, size_t n_bytes, bool writable) {
+	xassert(1, file != NULL);
+
+	uint64_t start = fs_now();
+	pthread_rwlock_rdlock(&file->lock);
+	xassert(1, offset + n_bytes <= file->size);
+	// The kernel may write back the mapping as soon as it's modified.
+	if (writable && file->mode == FS_MODE_MMAP)
+		fs_before_write(file);
+	fs_count(&file->stats.n_reads, 1);
+	fs_count(&file->stats.n_read_bytes, n_bytes);
+	void *data = fs_shared_pin(file, offset, n_bytes);
+	pthread_rwlock_unlock(&file->lock);
+	if (data == NULL) {
+		pthread_rwlock_wrlock(&file->lock);
+		data = fs_do_pin(file, offset, n_bytes);
+		pthread_rwlock_unlock(&file->lock);
+	}
+	fs_histogram_record(&file->latency.read, fs_now() - start);
+	return data;
+}
+
+static void fs_do_unpin(FsFile *file, FsOffset offset, bool dirty) {
+	// Pins which aren't in the buffer pool.
+	if (dirty)
+		file->stats.n_writes++;
+
+	if (file->mode == FS_MODE_MMAP) {
+		// The size of the pinned range isn't known here, so mark the whole
+		// OS page (it's what msync works on anyway). The hook was called by
+		// fs_pin.
+		if (dirty) {
+			FsOffset page_begin = offset - offset % file->os_page_size;
+			fs_map_mark_dirty(file, page_begin, MIN(
+				file->os_page_size, file->size - page_begin));
+		}
+	} else {
+		FsPage **link = &file->uncached_pins;
+		while ((*link)->offset != offset) {
+			link = &(*link)->next;
+			xassert(1, *link != NULL);
+		}
+
+		FsPage *pin = *link;
+		*link = pin->next;
+		if (dirty)
+			fs_pwrite(file, pin->data, pin->offset, pin->size);
+		free(pin->data);
+		free(pin);
+	}
+}
+
+void fs_unpin(FsFile *file, FsOffset offset, bool dirty) {
+	xassert(1, file != NULL);
+	if (file->mode == FS_MODE_MMAP && !dirty)
+		return;
+
+	// Unpinning a cached page only changes the page, so it's done under the
+	// shared lock.
+	if (file->page_size != 0) {
+		pthread_rwlock_rdlock(&file->lock);
+		FsPage *page = fs_page_find(file, offset - offset % file->page_size);
+		xassert(1, page != NULL);
+		if (dirty) {
+			fs_count(&file->stats.n_writes, 1);
+			__atomic_store_n(&page->dirty, true, __ATOMIC_RELAXED);
+		}
+		int n_pins = __atomic_fetch_sub(&page->n_pins, 1, __ATOMIC_RELEASE);
+		xassert(1, n_pins > 0);
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&file->lock);
+	fs_do_unpin(file, offset, dirty);
+	pthread_rwlock_unlock(&file->lock);
+}
+
+static int fs_page_offset_cmp(const void *a, const void *b) {
+	FsOffset offset_a = (*(FsPage **) a)->offset;
+	FsOffset offset_b = (*(FsPage **) b)->offset;
+	return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+static void fs_do_flush(FsFile *file) {
+	if (file->n_frames == 0)
+		return;
+
+	// Write the dirty pages in file order with a single batch, so that the
+	// disk sees mostly sequential writes (and adjacent pages can be
+	// coalesced).
+	FsPage **dirty = malloc(file->n_frames * sizeof(*dirty));
+	FsRequest *writes = malloc(file->n_frames * sizeof(*writes));
+	xassert(1, dirty != NULL && writes != NULL);
+	size_t n_dirty = 0;
+	for (size_t i = 0; i < file->n_frames; i++) {
+		if (file->frames[i]->dirty)
+			dirty[n_dirty++] = file->frames[i];
+	}
+	qsort(dirty, n_dirty, sizeof(*dirty), fs_page_offset_cmp);
+
+	size_t n_writes = 0;
+	for (size_t i = 0; i < n_dirty; i++) {
+		FsPage *page = dirty[i];
+		page->dirty = false;
+		if (page->offset >= file->size)
+			continue;
+		FsRequest write = {true, page->data, page->offset,
+		                   MIN(page->size, file->size - page->offset)};
+		writes[n_writes++] = write;
+	}
+	if (n_writes > 0) {
+		fs_raw_batch(file, writes, n_writes);
+		fs_raw_wait(file);
+	}
+
+	free(dirty);
+	free(writes);
+}
+
+void fs_flush(FsFile *file) {
+	xassert(1, file != NULL);
+	pthread_rwlock_wrlock(&file->lock);
+	fs_do_flush(file);
+	pthread_rwlock_unlock(&file->lock);
+}
+
+void fs_sync(FsFile *file) {
+	xassert(1, file != NULL);
+
+	// The lock isn't held while waiting for the disk.
+	pthread_rwlock_wrlock(&file->lock);
+	if (file->mode == FS_MODE_MMAP) {
+		FsOffset begin =
+			file->dirty_begin - file->dirty_begin % file->os_page_size;
+		FsOffset end = file->dirty_end;
+		file->dirty_begin = file->dirty_end = 0;
+		pthread_rwlock_unlock(&file->lock);
+		if (begin == end)
+			return;
+		int msync_result = msync(file->map + begin, end - begin, MS_SYNC);
+		xassert(1, msync_result != -1);
+		return;
+	}
+
+	fs_do_flush(file);
+	pthread_rwlock_unlock(&file->lock);
+	int fdatasync_result = fdatasync(file->fd);
+	xassert(1, fdatasync_result != -1);
 }
 
 FsStats fs_stats(FsFile *file) {
-	return file->stats;
+	// The exclusive lock waits for the counters updated under the shared
+	// one.
+	pthread_rwlock_wrlock(&file->lock);
+	FsStats stats = file->stats;
+	pthread_rwlock_unlock(&file->lock);
+	return stats;
+}
+
+void fs_latency(FsFile *file, FsLatency *snapshot) {
+	pthread_rwlock_wrlock(&file->lock);
+	*snapshot = file->latency;
+	pthread_rwlock_unlock(&file->lock);
+}
+
+void fs_reset_stats(FsFile *file) {
+	pthread_rwlock_wrlock(&file->lock);
+	memset(&file->stats, 0, sizeof(file->stats));
+	memset(&file->latency, 0, sizeof(file->latency));
+	pthread_rwlock_unlock(&file->lock);
 }
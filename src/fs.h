@@ -9,17 +9,127 @@ typedef uint64_t FsOffset;
 
 typedef struct FsFile FsFile;
 
+typedef enum {
+	FS_MODE_BUFFERED, // pread and pwrite, optionally through the buffer pool.
+	FS_MODE_MMAP, // The whole file is mapped into memory.
+	FS_MODE_DIRECT // Like FS_MODE_BUFFERED, but bypassing the kernel's page
+	               // cache (O_DIRECT). Reads and writes that reach the disk
+	               // (i.e. aren't absorbed by the buffer pool) have to be
+	               // aligned to FS_DIRECT_ALIGNMENT, as do buffer pool pages.
+	               // The file's size is rounded up to it.
+} FsMode;
+
+enum { FS_DIRECT_ALIGNMENT = 4096 };
+
 typedef struct {
 	uint64_t n_reads;
 	uint64_t n_writes;
+	uint64_t n_read_bytes;
+	uint64_t n_written_bytes; // Not counting fs_unpin (the size isn't known).
+
+	// Buffer pool (all counted in pages).
+	uint64_t n_hits;
+	uint64_t n_misses;
+	uint64_t n_evictions;
 } FsStats;
 
-FsFile *fs_open(const char *name, bool truncate);
+// Latency histogram with logarithmic buckets, each power of 2 split into
+// FS_HISTOGRAM_SUB_BUCKETS linear ones (like HdrHistogram), so the relative
+// error of a percentile is at most 1 / FS_HISTOGRAM_SUB_BUCKETS.
+enum {
+	FS_HISTOGRAM_SUB_BUCKETS = 8,
+	FS_HISTOGRAM_N_BUCKETS = 64 * FS_HISTOGRAM_SUB_BUCKETS
+};
+
+typedef struct {
+	uint64_t counts[FS_HISTOGRAM_N_BUCKETS];
+	uint64_t n;
+	uint64_t max;
+} FsHistogram;
+
+// Per-call latencies in nanoseconds. Batches are timed from fs_submit_batch
+// to fs_wait, and go to `write` if they contain any writes.
+typedef struct {
+	FsHistogram read; // fs_read, fs_pin.
+	FsHistogram write; // fs_write.
+	FsHistogram set_size; // fs_set_size, fs_allocate.
+} FsLatency;
+
+void fs_histogram_record(FsHistogram *histogram, uint64_t value);
+// An upper bound of the value below which `percentile` (0 to 100) percent of
+// the recorded values are. 0 if the histogram is empty.
+uint64_t fs_histogram_percentile(const FsHistogram *histogram,
+                                 double percentile);
+// a -= b, where b is an earlier snapshot of a.
+void fs_histogram_subtract(FsHistogram *a, const FsHistogram *b);
+
+// Any of the functions may be called from several threads at once, except
+// fs_open, fs_close and fs_set_cache, which need the file to themselves. A
+// batch (from fs_submit_batch to fs_wait) has to be the only one on the file.
+// Reads and pins of cached pages (and of memory-mapped files) run in
+// parallel, everything else one at a time. Nothing keeps one thread from
+// writing to a range which another one is reading (or has pinned).
+FsFile *fs_open(const char *name, bool truncate, FsMode mode);
 void fs_close(FsFile *file);
 
 void fs_set_size(FsFile *file, FsOffset size);
+// Grow the file and reserve disk space for it (with fallocate, if the
+// filesystem supports it). Never shrinks the file.
+void fs_allocate(FsFile *file, FsOffset size);
+FsOffset fs_size(FsFile *file);
+
+// A buffer aligned to FS_DIRECT_ALIGNMENT (free it with free).
+void *fs_alloc_buffer(size_t n_bytes);
 
 void fs_read(FsFile *file, void *dest, FsOffset offset, size_t n_bytes);
+// Like fs_read, but returns false instead of reading past the end of the
+// file (for readers which may race with fs_set_size).
+bool fs_try_read(FsFile *file, void *dest, FsOffset offset, size_t n_bytes);
 void fs_write(FsFile *file, const void *src, FsOffset offset, size_t n_bytes);
 
+// Batched I/O. The requests are submitted together (with io_uring if it's
+// available, otherwise with one preadv or pwritev per run of adjacent
+// requests) and may complete in any order. Until fs_wait returns, the buffers
+// have to stay valid and the ranges mustn't be accessed in any other way.
+// Requests in a batch mustn't overlap.
+typedef struct {
+	bool write;
+	void *buf;
+	FsOffset offset;
+	size_t n_bytes;
+} FsRequest;
+
+void fs_submit_batch(
+	FsFile *file, const FsRequest *requests, size_t n_requests);
+void fs_wait(FsFile *file);
+
+// Buffer pool. Until this is called, every read and write goes straight to the
+// file. max_bytes is a soft limit -- if all pages are pinned, the pool grows
+// beyond it. Ignored for memory-mapped files.
+void fs_set_cache(FsFile *file, size_t page_size, size_t max_bytes);
+
+// Direct access to the bytes of a range that doesn't cross a page boundary.
+// The pointer is valid until the matching fs_unpin. Pass writable = true to
+// modify the bytes, and then dirty = true if they were modified. For
+// memory-mapped files, this is a pointer into the mapping (no copying at
+// all), and it stays valid when the file grows; a writable pin calls the
+// write hook (see fs_set_write_hook) first.
+void *fs_pin(FsFile *file, FsOffset offset, size_t n_bytes, bool writable);
+void fs_unpin(FsFile *file, FsOffset offset, bool dirty);
+
+// Write back all dirty pages.
+void fs_flush(FsFile *file);
+
+// Make everything written so far durable (fs_flush, then fdatasync or msync).
+void fs_sync(FsFile *file);
+
+// Call `hook` before any bytes are written to the file: for the buffer pool,
+// when dirty pages are written back; otherwise, on every write (for
+// memory-mapped files, before the mapping is modified). Used for write-ahead
+// logging (see wal.h). Pass NULL to remove it.
+void fs_set_write_hook(
+	FsFile *file, void (*hook)(void *context), void *context);
+
 FsStats fs_stats(FsFile *file);
+void fs_latency(FsFile *file, FsLatency *snapshot); // FsLatency is big.
+void fs_reset_stats(FsFile *file); // Counters and histograms.
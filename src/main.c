@@ -4,17 +4,32 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "btree.h"
+#include "compact.h"
 #include "fs.h"
 #include "recf.h"
+#include "wal.h"
 #include "utils.h"
 
+// Participant ids in the write-ahead log.
+enum { WAL_ID_BTREE, WAL_ID_RECF };
+
 typedef struct {
 	Btree *btree;
 	Recf *recf;
+	Wal *wal;
 	bool show_stats;
+	// Whether a command returns only once its changes are durable (otherwise,
+	// the log is synced in the background, see wal.h).
+	bool wait_for_sync;
+	Compaction *compaction; // In progress (see the compact command), or NULL.
+
+	// Latency snapshots for show-stats (kept here because they are big).
+	FsLatency old_btree_latency, old_recf_latency, old_wal_latency;
+	FsLatency new_latency;
 } Context;
 
 void print_key_value_record(BtreeKey key, BtreeValue value, Context *context) {
@@ -26,6 +41,64 @@ void list_btree_callback(BtreeKey key, BtreeValue value, void *context) {
 	print_key_value_record(key, value, (Context *) context);
 }
 
+void count_callback(BtreeKey key, BtreeValue value, void *n_items) {
+	(void) key;
+	(void) value;
+	(*(uint64_t *) n_items)++;
+}
+
+void print_stats_diff(const char *name, FsStats old, FsStats new) {
+	printf("%s reads: %" PRIu64 ", writes: %" PRIu64
+	       "; bytes read: %" PRIu64 ", written: %" PRIu64
+	       "; cache hits: %" PRIu64 ", misses: %" PRIu64
+	       ", evictions: %" PRIu64 "\n", name,
+	       new.n_reads - old.n_reads, new.n_writes - old.n_writes,
+	       new.n_read_bytes - old.n_read_bytes,
+	       new.n_written_bytes - old.n_written_bytes,
+	       new.n_hits - old.n_hits, new.n_misses - old.n_misses,
+	       new.n_evictions - old.n_evictions);
+}
+
+void print_bloom_diff(BtreeBloomStats old, BtreeBloomStats new) {
+	// The false positive rate is of the lookups of missing keys.
+	uint64_t n_negatives = new.n_negatives - old.n_negatives;
+	uint64_t n_false_positives = new.n_false_positives - old.n_false_positives;
+	if (n_negatives + n_false_positives == 0)
+		return;
+	printf("Bloom filter negatives: %" PRIu64 ", false positives: %" PRIu64
+	       " (%.2f%%)\n", n_negatives, n_false_positives,
+	       100.0 * n_false_positives / (n_negatives + n_false_positives));
+}
+
+void print_histogram(
+	const char *name, const FsHistogram *histogram, bool *first) {
+
+	if (histogram->n == 0)
+		return;
+	printf("%s %s %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+	       *first ? "" : ",", name,
+	       fs_histogram_percentile(histogram, 50),
+	       fs_histogram_percentile(histogram, 99),
+	       fs_histogram_percentile(histogram, 99.9));
+	*first = false;
+}
+
+// Subtracts `old` from `new` in place.
+void print_latency_diff(const char *name, FsLatency *old, FsLatency *new) {
+	fs_histogram_subtract(&new->read, &old->read);
+	fs_histogram_subtract(&new->write, &old->write);
+	fs_histogram_subtract(&new->set_size, &old->set_size);
+	if (new->read.n + new->write.n + new->set_size.n == 0)
+		return;
+
+	printf("%s latency in ns (p50/p99/p99.9):", name);
+	bool first = true;
+	print_histogram("read", &new->read, &first);
+	print_histogram("write", &new->write, &first);
+	print_histogram("set-size", &new->set_size, &first);
+	printf("\n");
+}
+
 void execute_cmd(char *cmd, Context *context) { // Modifies the input string.
 	const char DELIMITERS[] = " \t\r\n";
 
@@ -40,6 +113,11 @@ void execute_cmd(char *cmd, Context *context) { // Modifies the input string.
 
 	FsStats old_btree_stats = btree_fs_stats(context->btree);
 	FsStats old_recf_stats = recf_fs_stats(context->recf);
+	FsStats old_wal_stats = wal_fs_stats(context->wal);
+	BtreeBloomStats old_bloom_stats = btree_bloom_stats(context->btree);
+	btree_fs_latency(context->btree, &context->old_btree_latency);
+	recf_fs_latency(context->recf, &context->old_recf_latency);
+	wal_fs_latency(context->wal, &context->old_wal_latency);
 
 	if (n_tokens == 0)
 		return;
@@ -100,9 +178,93 @@ void execute_cmd(char *cmd, Context *context) { // Modifies the input string.
 		btree_print(context->btree, stdout);
 	} else if (strcmp(operation, "print") == 0) {
 		btree_walk(context->btree, &list_btree_callback, context);
+	} else if (strcmp(operation, "count") == 0) {
+		// With a thread per core, each counting the items it sees.
+		enum { MAX_THREADS = 64 };
+		long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+		int n_threads = MIN(MAX(n_cores, 1), MAX_THREADS);
+		uint64_t counts[MAX_THREADS] = {0};
+		void *count_contexts[MAX_THREADS];
+		for (int i = 0; i < n_threads; i++)
+			count_contexts[i] = &counts[i];
+		btree_walk_parallel(context->btree, n_threads, count_callback,
+		                    count_contexts);
+		uint64_t n_items = 0;
+		for (int i = 0; i < n_threads; i++)
+			n_items += counts[i];
+		printf("%" PRIu64 "\n", n_items);
+	} else if (strcmp(operation, "range") == 0) {
+		if (n_tokens != 3) {
+			fprintf(stderr, "ERROR: Invalid syntax. Use: range <lo> <hi>\n");
+			return;
+		}
+
+		char *remaining_lo, *remaining_hi;
+		BtreeKey lo = strtoll(args[0], &remaining_lo, 10);
+		BtreeKey hi = strtoll(args[1], &remaining_hi, 10);
+		if (remaining_lo[0] != '\0' || remaining_hi[0] != '\0') {
+			fprintf(stderr, "ERROR: The keys must be positive integers.\n");
+			return;
+		}
+
+		// Keys from lo (inclusive) to hi (exclusive).
+		BtreeCursor *cursor = btree_cursor_seek(context->btree, lo);
+		BtreeKey key;
+		BtreeValue value;
+		while (btree_cursor_get(cursor, &key, &value) &&
+		       btree_key_cmp(key, hi) < 0) {
+			print_key_value_record(key, value, context);
+			btree_cursor_next(cursor);
+		}
+		btree_cursor_close(cursor);
 	} else if (strcmp(operation, "delete") == 0) {
-		fprintf(stderr, "ERROR: Not implemented.\n");
-		return;
+		if (n_tokens != 2) {
+			fprintf(stderr, "ERROR: Invalid syntax. Use: delete <key>\n");
+			return;
+		}
+
+		char *remaining_key;
+		BtreeKey key = strtoll(args[0], &remaining_key, 10);
+		if (remaining_key[0] != '\0') {
+			fprintf(stderr, "ERROR: The key must be a positive integer.\n");
+			return;
+		}
+
+		RecfRecordIdx idx;
+		if (btree_delete(context->btree, key, &idx)) {
+			recf_delete(context->recf, idx);
+		} else {
+			fprintf(stderr, "ERROR: The key %" BTREE_KEY_PRINT
+			        " doesn't exist in the tree.\n", key);
+		}
+	} else if (strcmp(operation, "compact") == 0) {
+		// The whole compaction, or a step of it (which goes on from the last
+		// one), so that other commands can run in between.
+		char *remaining_moves = "";
+		size_t max_moves = COMPACTION_STEP_SIZE;
+		if (n_tokens == 2)
+			max_moves = strtoull(args[0], &remaining_moves, 10);
+		if (n_tokens > 2 || remaining_moves[0] != '\0' || max_moves == 0) {
+			fprintf(stderr, "ERROR: Invalid syntax. Use: compact [moves]\n");
+			return;
+		}
+
+		if (context->compaction == NULL) {
+			context->compaction =
+				compaction_begin(context->btree, context->recf);
+		}
+		bool done;
+		do {
+			done = compaction_step(context->compaction, max_moves);
+		} while (!done && n_tokens == 1);
+		if (done) {
+			compaction_end(context->compaction);
+			context->compaction = NULL;
+		} else {
+			printf("Compaction in progress.\n");
+		}
+	} else if (strcmp(operation, "sync") == 0) {
+		wal_sync(context->wal);
 	} else if (strcmp(operation, "show-stats") == 0) {
 		if (n_tokens == 1 || (n_tokens == 2 && strcmp(args[0], "true") == 0)) {
 			context->show_stats = true;
@@ -120,27 +282,118 @@ void execute_cmd(char *cmd, Context *context) { // Modifies the input string.
 		return;
 	}
 
+	if (context->wait_for_sync)
+		wal_sync(context->wal);
+
 	if (context->show_stats) {
-		FsStats new_btree_stats = btree_fs_stats(context->btree);
-		FsStats new_recf_stats = recf_fs_stats(context->recf);
-		printf("Tree reads: %" PRIu64 ", writes: %" PRIu64
-		       "; record file reads: %" PRIu64 ", writes: %" PRIu64 "\n",
-		       new_btree_stats.n_reads - old_btree_stats.n_reads,
-		       new_btree_stats.n_writes - old_btree_stats.n_writes,
-		       new_recf_stats.n_reads - old_recf_stats.n_reads,
-		       new_recf_stats.n_writes - old_recf_stats.n_writes);
+		print_stats_diff("Tree", old_btree_stats,
+		                 btree_fs_stats(context->btree));
+		print_stats_diff("Record file", old_recf_stats,
+		                 recf_fs_stats(context->recf));
+		print_stats_diff("Log", old_wal_stats, wal_fs_stats(context->wal));
+		print_bloom_diff(old_bloom_stats, btree_bloom_stats(context->btree));
+
+		btree_fs_latency(context->btree, &context->new_latency);
+		print_latency_diff("Tree", &context->old_btree_latency,
+		                   &context->new_latency);
+		recf_fs_latency(context->recf, &context->new_latency);
+		print_latency_diff("Record file", &context->old_recf_latency,
+		                   &context->new_latency);
+		wal_fs_latency(context->wal, &context->new_latency);
+		print_latency_diff("Log", &context->old_wal_latency,
+		                   &context->new_latency);
 	}
 }
 
 int main(int argc, char **argv) {
 	srand(time(NULL));
 
+	const char BTREE_FILE_NAME[] = "btree.dat";
+	const char RECF_FILE_NAME[] = "recf.dat";
+	const char WAL_FILE_NAME[] = "wal.dat";
+
+	size_t block_size = BTREE_DEFAULT_BLOCK_SIZE;
+	BtreeLayout layout = BTREE_LAYOUT_B;
+	bool create = false;
+	int option;
+	while ((option = getopt(argc, argv, "b:npc")) != -1) {
+		char *remaining;
+		switch (option) {
+		case 'b':
+			block_size = strtoul(optarg, &remaining, 10);
+			if (remaining[0] != '\0' ||
+			    block_size < BTREE_MIN_BLOCK_SIZE ||
+			    block_size > BTREE_MAX_BLOCK_SIZE ||
+			    (block_size & (block_size - 1)) != 0) {
+				fprintf(stderr, "ERROR: The block size must be a power of 2 "
+				        "between %d and %d.\n",
+				        BTREE_MIN_BLOCK_SIZE, BTREE_MAX_BLOCK_SIZE);
+				return 1;
+			}
+			break;
+		case 'n':
+			create = true;
+			break;
+		case 'p':
+			layout = BTREE_LAYOUT_BPLUS;
+			break;
+		case 'c':
+			layout = BTREE_LAYOUT_PACKED;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n] [-b block_size] [-p | -c] "
+			        "[script]\n"
+			        "  -n  Create new files, even if they exist.\n"
+			        "  -b  Block size of new files.\n"
+			        "  -p  Make the new tree a B+ tree.\n"
+			        "  -c  Make it a B+ tree with compressed leaves.\n",
+			        argv[0]);
+			return 1;
+		}
+	}
+
+	// Open the existing files (if there are both of them), or create new
+	// ones.
+	bool btree_exists = access(BTREE_FILE_NAME, F_OK) == 0;
+	bool recf_exists = access(RECF_FILE_NAME, F_OK) == 0;
+	if (!create && btree_exists != recf_exists) {
+		fprintf(stderr, "ERROR: Only one of %s and %s exists. "
+		        "Use -n to create new files.\n",
+		        BTREE_FILE_NAME, RECF_FILE_NAME);
+		return 1;
+	}
+
+	// A new log for new files. Otherwise, attaching the files to the log
+	// replays whatever it has (if the program crashed).
 	Context context;
-	context.btree = btree_new("btree.dat");
-	context.recf = recf_new("recf.dat");
+	context.wal = wal_open(WAL_FILE_NAME, create || !btree_exists);
+	if (context.wal == NULL) {
+		fprintf(stderr, "ERROR: %s is invalid.\n", WAL_FILE_NAME);
+		return 1;
+	}
+	if (create || !btree_exists) {
+		context.btree = btree_new(BTREE_FILE_NAME, block_size, layout);
+		context.recf = recf_new(RECF_FILE_NAME, block_size);
+	} else {
+		context.btree = btree_open(BTREE_FILE_NAME);
+		context.recf = recf_open(RECF_FILE_NAME);
+		if (context.btree == NULL || context.recf == NULL) {
+			fprintf(stderr, "ERROR: %s or %s is invalid. "
+			        "Use -n to create new files.\n",
+			        BTREE_FILE_NAME, RECF_FILE_NAME);
+			return 1;
+		}
+	}
+	btree_attach_wal(context.btree, context.wal, WAL_ID_BTREE);
+	recf_attach_wal(context.recf, context.wal, WAL_ID_RECF);
 	context.show_stats = false;
+	context.compaction = NULL;
 
-	bool interactive = (argc == 1);
+	// Commands typed in are acknowledged (by the next prompt) once they're
+	// durable. A script's are made durable in the background, so that a long
+	// one doesn't wait for an fdatasync per command.
+	bool interactive = (optind == argc);
+	context.wait_for_sync = interactive;
 	if (interactive) {
 		char *line = NULL;
 		while ((line = readline("(btree) "))) {
@@ -155,7 +408,7 @@ int main(int argc, char **argv) {
 			free(line);
 		}
 	} else {
-		char *file_name = argv[1];
+		char *file_name = argv[optind];
 		FILE *file = fopen(file_name, "r");
 		if (file == NULL) {
 			perror("ERROR: Can't open file");
@@ -172,7 +425,10 @@ int main(int argc, char **argv) {
 		free(line_buffer);
 	}
 
+	if (context.compaction != NULL)
+		compaction_end(context.compaction);
 	recf_destroy(context.recf);
 	btree_destroy(context.btree);
+	wal_close(context.wal);
 	return 0;
 }
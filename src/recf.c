@@ -4,8 +4,10 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
 #include "xassert.h"
 #include "fs.h"
+#include "space.h"
 #include "utils.h"
 
 #define RECF_NULL ((RecfRecordIdx) -1)
@@ -14,192 +16,419 @@
 
 typedef RecfRecordIdx RecfBlockIdx; // Index of a block in the file.
 
-enum {
-	RECF_ITEM_SIZE = MAX(sizeof(RecfRecord), sizeof(RecfRecordIdx)),
-	RECF_MAX_RECORDS = RECF_BLOCK_SIZE / RECF_ITEM_SIZE
-};
-
-static RecfBlockIdx recf_idx_to_block(RecfRecordIdx idx) {
-	return idx / RECF_MAX_RECORDS + 1;
-}
-
-static FsOffset recf_idx_to_disk_offset(RecfRecordIdx idx) {
-	return RECF_BLOCK_SIZE * recf_idx_to_block(idx) +
-		RECF_ITEM_SIZE * (idx % RECF_MAX_RECORDS);
-}
+enum { RECF_ITEM_SIZE = MAX(sizeof(RecfRecord), sizeof(RecfRecordIdx)) };
 
 // The first block (address 0) of the file is the superblock (which stores
-// metadata).
+// metadata). It starts with a magic number and a format version.
+#define RECF_MAGIC UINT64_C(0x00464345524B4B50) // "PKKRECF\0" (little-endian).
+enum { RECF_VERSION = 1 };
+
 typedef struct {
-	RecfRecordIdx free_list_head;
+	uint64_t magic;
+	uint32_t version;
+	RecfRecordIdx n_free; // Free records below `end` (see space.h).
 	RecfRecordIdx end; // Number of used records.
+	uint64_t block_size;
 } RecfSuperblock;
 
+// Cache of the most recently written block.
 typedef struct {
-	RecfRecordIdx next_free;
-} RecfFree; // Free block (which is always an entry in the free list).
+	bool dirty;
+	RecfBlockIdx block;
+	char *data; // Aligned for O_DIRECT.
+} RecfCache;
 
 struct Recf { // Typedef'd in the header file.
+	// recf_get shares the lock (so it doesn't touch the cache, see
+	// recf_peek_record). Everything that modifies the file holds it
+	// exclusively.
+	pthread_rwlock_t lock;
+
 	FsFile *file;
-	RecfSuperblock superblock; // Cache.
-};
+	RecfSuperblock superblock; // Cache. Only updated from `space` on sync.
+	Space *space; // Records are contiguous, starting at the first block.
+	RecfCache cache;
 
-// Cache the most recently used block.
-static struct {
-	bool dirty;
-	RecfBlockIdx block;
-	char data[RECF_BLOCK_SIZE];
-} recf_cache = {false, RECF_NULL, {0}};
+	size_t block_size;
+	size_t max_records; // In a block.
 
-static void recf_cache_flush(FsFile *file) {
-	if (!recf_cache.dirty)
-		return;
-	recf_cache.dirty = false;
-	fs_write(file, recf_cache.data,
-	         recf_cache.block * RECF_BLOCK_SIZE, RECF_BLOCK_SIZE);
-}
+	// Write-ahead logging (see recf_attach_wal). NULL if it's off.
+	Wal *wal;
+	uint8_t wal_id;
 
-static void recf_cache_block(FsFile *file, RecfBlockIdx block) {
-	if (block == recf_cache.block)
-		return;
+	bool shrink_pending; // The file shrinks on the next sync.
+};
 
-	if (block != RECF_NULL)
-		recf_cache_flush(file);
+// Records in the write-ahead log.
+typedef enum {
+	RECF_WAL_ADD, // Arg: the record's index. Bytes: the record.
+	RECF_WAL_DELETE, // Arg: the record's index.
+	RECF_WAL_SNAPSHOT, // Bytes: the space snapshot.
+	RECF_WAL_SHRINK // See recf_do_shrink.
+} RecfWalRecord;
 
-	fs_read(file, recf_cache.data, block * RECF_BLOCK_SIZE, RECF_BLOCK_SIZE);
-	recf_cache.block = block;
+static RecfBlockIdx recf_idx_to_block(Recf *recf, RecfRecordIdx idx) {
+	return idx / recf->max_records + 1;
 }
 
-static void recf_read(
-	FsFile *file, void *dest, FsOffset offset, size_t n_bytes) {
+static FsOffset recf_idx_to_disk_offset(Recf *recf, RecfRecordIdx idx) {
+	return recf->block_size * recf_idx_to_block(recf, idx) +
+		RECF_ITEM_SIZE * (idx % recf->max_records);
+}
 
-	// Read using cache.
+static void recf_cache_flush(Recf *recf) {
+	if (!recf->cache.dirty)
+		return;
+	recf->cache.dirty = false;
+	fs_write(recf->file, recf->cache.data,
+	         recf->cache.block * recf->block_size, recf->block_size);
+}
 
-	RecfBlockIdx block = offset / RECF_BLOCK_SIZE;
-	recf_cache_block(file, block);
+static void recf_cache_block(Recf *recf, RecfBlockIdx block) {
+	if (block == recf->cache.block)
+		return;
 
-	int offset_in_block = offset - block * RECF_BLOCK_SIZE;
-	xassert(1, offset_in_block + n_bytes <= RECF_BLOCK_SIZE);
-	memcpy(dest, recf_cache.data + offset_in_block, n_bytes);
+	if (block != RECF_NULL)
+		recf_cache_flush(recf);
+
+	fs_read(recf->file, recf->cache.data,
+	        block * recf->block_size, recf->block_size);
+	recf->cache.block = block;
 }
 
 static void recf_write(
-	FsFile *file, const void *src, FsOffset offset, size_t n_bytes) {
+	Recf *recf, const void *src, FsOffset offset, size_t n_bytes) {
 
 	// Write using cache.
 
-	RecfBlockIdx block = offset / RECF_BLOCK_SIZE;
-	recf_cache_block(file, block);
+	RecfBlockIdx block = offset / recf->block_size;
+	recf_cache_block(recf, block);
 
-	int offset_in_block = offset - block * RECF_BLOCK_SIZE;
-	xassert(1, offset_in_block + n_bytes <= RECF_BLOCK_SIZE);
-	memcpy(recf_cache.data + offset_in_block, src, n_bytes);
-	recf_cache.dirty = true;
+	size_t offset_in_block = offset - block * recf->block_size;
+	xassert(1, offset_in_block + n_bytes <= recf->block_size);
+	memcpy(recf->cache.data + offset_in_block, src, n_bytes);
+	recf->cache.dirty = true;
 }
 
-static void recf_read_superblock(Recf *recf) {
-	recf_read(recf->file, &recf->superblock, 0, sizeof(recf->superblock));
+static bool recf_read_superblock(FsFile *file, RecfSuperblock *superblock) {
+	// Returns false if the file isn't a record file (in this format). Like
+	// btree_read_superblock, this reads as much as is surely in the file.
+
+	size_t n_bytes = MIN(fs_size(file), (FsOffset) FS_DIRECT_ALIGNMENT);
+	if (n_bytes < RECF_MIN_BLOCK_SIZE)
+		return false;
+	char *block = fs_alloc_buffer(n_bytes); // Aligned for O_DIRECT.
+	fs_read(file, block, 0, n_bytes);
+	memcpy(superblock, block, sizeof(*superblock));
+	free(block);
+
+	return superblock->magic == RECF_MAGIC &&
+		superblock->version == RECF_VERSION &&
+		superblock->block_size >= RECF_MIN_BLOCK_SIZE &&
+		superblock->block_size <= RECF_MAX_BLOCK_SIZE &&
+		(superblock->block_size & (superblock->block_size - 1)) == 0;
 }
 
 static void recf_write_superblock(Recf *recf) {
-	recf_write(recf->file, &recf->superblock, 0, sizeof(recf->superblock));
+	recf_write(recf, &recf->superblock, 0, sizeof(recf->superblock));
 }
 
-static RecfFree recf_read_free(Recf *recf, RecfRecordIdx idx) {
-	RecfFree free;
-	recf_read(recf->file, &free, recf_idx_to_disk_offset(idx), sizeof(free));
-	return free;
-}
-
-static void recf_write_free(Recf *recf, RecfFree free, RecfRecordIdx idx) {
-	recf_write(recf->file, &free, recf_idx_to_disk_offset(idx), sizeof(free));
-}
-
-static RecfRecord recf_read_record(Recf *recf, RecfRecordIdx idx) {
+static RecfRecord recf_peek_record(Recf *recf, RecfRecordIdx idx) {
+	// Read a record without changing the cache. Only the cached block may be
+	// newer than the file.
+	RecfBlockIdx block = recf_idx_to_block(recf, idx);
+	size_t offset_in_block =
+		recf_idx_to_disk_offset(recf, idx) - block * recf->block_size;
 	RecfRecord record;
-	recf_read(recf->file, &record,
-	          recf_idx_to_disk_offset(idx), sizeof(record));
+	if (block == recf->cache.block) {
+		memcpy(&record, recf->cache.data + offset_in_block, sizeof(record));
+		return record;
+	}
+
+	// The whole block, as O_DIRECT without the buffer pool needs.
+	FsOffset block_offset = block * recf->block_size;
+	const char *data = fs_pin(
+		recf->file, block_offset, recf->block_size, false);
+	memcpy(&record, data + offset_in_block, sizeof(record));
+	fs_unpin(recf->file, block_offset, false);
 	return record;
 }
 
 static void recf_write_record(
 	Recf *recf, RecfRecord record, RecfRecordIdx idx) {
 
-	recf_write(recf->file, &record,
-	           recf_idx_to_disk_offset(idx), sizeof(record));
+	recf_write(recf, &record,
+	           recf_idx_to_disk_offset(recf, idx), sizeof(record));
 }
 
 static void recf_sync(Recf *recf) {
+	space_save(recf->space);
+	recf->superblock.n_free = space_n_free(recf->space);
+	recf->superblock.end = space_end(recf->space);
 	recf_write_superblock(recf);
-	recf_cache_flush(recf->file);
+	recf_cache_flush(recf);
+	fs_sync(recf->file);
+	if (recf->shrink_pending) {
+		space_truncate(recf->space);
+		recf->shrink_pending = false;
+	}
 }
 
-Recf *recf_new(const char *file_name) {
+static Recf *recf_init(FsFile *file, size_t block_size) {
+	// The part of opening the file that's common to recf_new and recf_open.
+
 	Recf *recf = malloc(sizeof(*recf));
+	xassert(1, recf != NULL);
+
+	recf->block_size = block_size;
+	recf->max_records = block_size / RECF_ITEM_SIZE;
+	xassert(1, recf->max_records * RECF_ITEM_SIZE == block_size);
+
+	recf->cache.dirty = false;
+	recf->cache.block = RECF_NULL;
+	recf->cache.data = fs_alloc_buffer(block_size);
+
+	recf->wal = NULL;
+	recf->wal_id = 0;
+	recf->shrink_pending = false;
+
+	int lock_result = pthread_rwlock_init(&recf->lock, NULL);
+	xassert(1, lock_result == 0);
+
+	recf->file = file;
+	// A page has to hold whole blocks.
+	fs_set_cache(recf->file, MAX(RECF_CACHE_PAGE_SIZE, block_size),
+	             RECF_CACHE_SIZE);
+	// Without the buffer pool, O_DIRECT reads and writes whole blocks.
+	xassert(1, RECF_FS_MODE != FS_MODE_DIRECT || RECF_CACHE_SIZE > 0 ||
+	        block_size % FS_DIRECT_ALIGNMENT == 0);
+
+	return recf;
+}
+
+Recf *recf_new(const char *file_name, size_t block_size) {
+	xassert(1, block_size >= RECF_MIN_BLOCK_SIZE &&
+	        block_size <= RECF_MAX_BLOCK_SIZE &&
+	        (block_size & (block_size - 1)) == 0);
 
-	recf->file = fs_open(file_name, true);
-	fs_set_size(recf->file, RECF_BLOCK_SIZE);
+	Recf *recf = recf_init(fs_open(file_name, true, RECF_FS_MODE), block_size);
+	fs_set_size(recf->file, block_size);
+	recf->space = space_new(recf->file, block_size, RECF_ITEM_SIZE, 0,
+	                        block_size);
 
+	recf->superblock.magic = RECF_MAGIC;
+	recf->superblock.version = RECF_VERSION;
 	recf->superblock.end = 0;
-	recf->superblock.free_list_head = RECF_NULL;
+	recf->superblock.n_free = 0;
+	recf->superblock.block_size = block_size;
 	recf_write_superblock(recf);
 
 	return recf;
 }
 
+Recf *recf_open(const char *file_name) {
+	FsFile *file = fs_open(file_name, false, RECF_FS_MODE);
+	RecfSuperblock superblock;
+	if (!recf_read_superblock(file, &superblock)) {
+		fs_close(file);
+		return NULL;
+	}
+
+	// The free space map is read lazily.
+	Recf *recf = recf_init(file, superblock.block_size);
+	recf->superblock = superblock;
+	recf->space = space_load(recf->file, recf->block_size, RECF_ITEM_SIZE, 0,
+	                         recf->block_size, superblock.end,
+	                         superblock.n_free);
+	return recf;
+}
+
 void recf_destroy(Recf *recf) {
 	xassert(1, recf->file != NULL);
 	recf_sync(recf);
+	if (recf->wal != NULL)
+		wal_detach(recf->wal, recf->wal_id);
+	space_destroy(recf->space);
 	fs_close(recf->file);
+	pthread_rwlock_destroy(&recf->lock);
+	free(recf->cache.data);
 	free(recf);
 }
 
 static RecfRecordIdx recf_alloc_record(Recf *recf) {
-	RecfRecordIdx free_idx = recf->superblock.free_list_head;
-	if (free_idx != RECF_NULL) {
-		// If the free list is non-empty, use its first element.
-		RecfRecordIdx next_free = recf_read_free(recf, free_idx).next_free;
-		recf->superblock.free_list_head = next_free;
-		return free_idx;
-	} else {
-		RecfRecordIdx old_end = recf->superblock.end;
-		recf->superblock.end++;
-
-		if (old_end == 0 ||
-			recf_idx_to_block(recf->superblock.end - 1) >
-			recf_idx_to_block(old_end - 1)) {
-			fs_set_size(recf->file, RECF_BLOCK_SIZE *
-						(recf_idx_to_block(recf->superblock.end - 1) + 1));
-		}
+	// Records are allocated in the file order (the space manager prefers
+	// the lowest free record), so there's no point in a locality hint.
+	return space_alloc(recf->space, SPACE_NULL);
+}
 
-		return old_end;
+static void recf_dealloc_record(Recf *recf, RecfRecordIdx idx) {
+	// Only marks the record as free; doesn't shrink the file (see
+	// recf_shrink).
+	space_free(recf->space, idx);
+}
+
+static void recf_do_shrink(Recf *recf) {
+	// The cached block is dropped if it's past the new end (its records are
+	// all free), as the free space map may go there. The superblock (block
+	// 0) never is.
+	space_shrink(recf->space);
+	recf->shrink_pending = true;
+	if (recf->cache.block != RECF_NULL && recf->cache.block > 0 &&
+	    (recf->cache.block - 1) * recf->max_records >=
+	    space_end(recf->space)) {
+		recf->cache.dirty = false;
+		recf->cache.block = RECF_NULL;
 	}
 }
 
-static void recf_dealloc_record(Recf *recf, RecfRecordIdx idx) {
-	// Only adds to the free list; doesn't shrink the file.
-	RecfFree new_free;
-	new_free.next_free = recf->superblock.free_list_head;
-	recf_write_free(recf, new_free, idx);
-	recf->superblock.free_list_head = idx;
+static void recf_wal_redo(
+	void *recf_void, uint8_t type, uint64_t arg,
+	const void *bytes, size_t n_bytes) {
+
+	Recf *recf = recf_void;
+	switch ((RecfWalRecord) type) {
+	case RECF_WAL_ADD: {
+		RecfRecord record;
+		xassert(1, n_bytes == sizeof(record));
+		memcpy(&record, bytes, sizeof(record));
+		space_alloc_at(recf->space, arg);
+		recf_write_record(recf, record, arg);
+		break;
+	}
+	case RECF_WAL_DELETE:
+		recf_dealloc_record(recf, arg);
+		break;
+	case RECF_WAL_SNAPSHOT:
+		space_restore(recf->space, bytes);
+		break;
+	case RECF_WAL_SHRINK:
+		recf_do_shrink(recf);
+		break;
+	default:
+		xassert(1, false);
+	}
+}
+
+static void recf_wal_sync(void *recf_void) {
+	Recf *recf = recf_void;
+	pthread_rwlock_wrlock(&recf->lock);
+	recf_sync(recf);
+	pthread_rwlock_unlock(&recf->lock);
+}
+
+static void recf_wal_snapshot(void *recf_void) {
+	Recf *recf = recf_void;
+	pthread_rwlock_wrlock(&recf->lock);
+	size_t n_bytes = space_snapshot_size(recf->space);
+	char *snapshot = malloc(n_bytes);
+	xassert(1, snapshot != NULL);
+	space_snapshot(recf->space, snapshot);
+	wal_append(recf->wal, recf->wal_id, RECF_WAL_SNAPSHOT, 0,
+	           snapshot, n_bytes);
+	free(snapshot);
+	pthread_rwlock_unlock(&recf->lock);
+}
+
+void recf_attach_wal(Recf *recf, Wal *wal, uint8_t id) {
+	xassert(1, recf->wal == NULL);
+	recf->wal = wal;
+	recf->wal_id = id;
+	fs_set_write_hook(recf->file, wal_write_hook, wal);
+	WalParticipant participant = {
+		recf_wal_redo, recf_wal_sync, recf_wal_snapshot, recf};
+	wal_attach(wal, id, &participant);
 }
 
 RecfRecordIdx recf_add(Recf *recf, RecfRecord record) {
+	// With write-ahead logging, the record only goes to the one-block cache
+	// before the commit, so it can't reach the file any earlier. (The lock is
+	// released before the commit, which may sync the log.)
+	if (recf->wal != NULL)
+		wal_begin(recf->wal);
+	pthread_rwlock_wrlock(&recf->lock);
 	RecfRecordIdx idx = recf_alloc_record(recf);
 	recf_write_record(recf, record, idx);
+	if (recf->wal != NULL) {
+		wal_append(recf->wal, recf->wal_id, RECF_WAL_ADD, idx,
+		           &record, sizeof(record));
+	}
+	pthread_rwlock_unlock(&recf->lock);
+	if (recf->wal != NULL)
+		wal_commit(recf->wal);
 	return idx;
 }
 
 RecfRecord recf_get(Recf *recf, RecfRecordIdx idx) {
-	xassert(1, idx < recf->superblock.end);
-	return recf_read_record(recf, idx);
+	pthread_rwlock_rdlock(&recf->lock);
+	xassert(1, space_is_used(recf->space, idx));
+	RecfRecord record = recf_peek_record(recf, idx);
+	pthread_rwlock_unlock(&recf->lock);
+	return record;
 }
 
 void recf_delete(Recf *recf, RecfRecordIdx idx) {
-	xassert(1, idx < recf->superblock.end);
+	if (recf->wal != NULL)
+		wal_begin(recf->wal);
+	pthread_rwlock_wrlock(&recf->lock);
+	xassert(1, space_is_used(recf->space, idx));
 	recf_dealloc_record(recf, idx);
+	if (recf->wal != NULL)
+		wal_append(recf->wal, recf->wal_id, RECF_WAL_DELETE, idx, NULL, 0);
+	pthread_rwlock_unlock(&recf->lock);
+	if (recf->wal != NULL)
+		wal_commit(recf->wal);
+}
+
+RecfRecordIdx recf_copy(
+	Recf *recf, RecfRecordIdx idx, bool to_end, RecfRecord *record) {
+
+	// Logged like recf_add. The record may have been deleted since the
+	// caller read its index.
+	if (recf->wal != NULL)
+		wal_begin(recf->wal);
+	pthread_rwlock_wrlock(&recf->lock);
+	RecfRecordIdx new_idx = to_end ? space_end(recf->space)
+		: space_lowest_free(recf->space);
+	if (space_is_used(recf->space, idx) && (to_end || new_idx < idx)) {
+		*record = recf_peek_record(recf, idx);
+		space_alloc_at(recf->space, new_idx);
+		recf_write_record(recf, *record, new_idx);
+		if (recf->wal != NULL) {
+			wal_append(recf->wal, recf->wal_id, RECF_WAL_ADD, new_idx,
+			           record, sizeof(*record));
+		}
+	} else {
+		new_idx = idx;
+	}
+	pthread_rwlock_unlock(&recf->lock);
+	if (recf->wal != NULL)
+		wal_commit(recf->wal);
+	return new_idx;
+}
+
+void recf_shrink(Recf *recf) {
+	// The file only shrinks on the next sync (once the new end is durable,
+	// as the records past it may have been deleted by the latest
+	// transactions), which is done right away.
+	if (recf->wal != NULL)
+		wal_begin(recf->wal);
+	pthread_rwlock_wrlock(&recf->lock);
+	if (recf->wal != NULL)
+		wal_append(recf->wal, recf->wal_id, RECF_WAL_SHRINK, 0, NULL, 0);
+	recf_do_shrink(recf);
+	pthread_rwlock_unlock(&recf->lock);
+	if (recf->wal != NULL) {
+		wal_commit(recf->wal);
+		wal_checkpoint(recf->wal);
+	} else {
+		recf_wal_sync(recf);
+	}
 }
 
 FsStats recf_fs_stats(Recf *recf) {
 	return fs_stats(recf->file);
 }
+
+void recf_fs_latency(Recf *recf, FsLatency *snapshot) {
+	fs_latency(recf->file, snapshot);
+}
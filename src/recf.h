@@ -2,21 +2,53 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include "fs.h"
+#include "wal.h"
 
 // Settings.
-enum { RECF_BLOCK_SIZE = 256 }; // Alignment; should be the disk's block size.
+enum {
+	RECF_DEFAULT_BLOCK_SIZE = 256,
+	RECF_CACHE_PAGE_SIZE = 4096, // Raised to the block size if that's bigger.
+	RECF_CACHE_SIZE = 1 << 20 // Buffer pool budget in bytes; 0 disables it.
+};
+#define RECF_FS_MODE FS_MODE_BUFFERED // Or FS_MODE_MMAP, FS_MODE_DIRECT.
 typedef uint64_t RecfRecord;
 #define RECF_RECORD_PRINT PRIu64
 
 typedef uint64_t RecfRecordIdx;
 
+enum { RECF_MIN_BLOCK_SIZE = 256, RECF_MAX_BLOCK_SIZE = 64 << 10 };
+
 typedef struct Recf Recf;
 
-Recf *recf_new(const char *file_name);
+// Records are grouped into blocks (the unit of I/O, which should be the
+// disk's block size). The block size has to be a power of 2 between
+// RECF_MIN_BLOCK_SIZE and RECF_MAX_BLOCK_SIZE, and is recorded in the
+// superblock.
+Recf *recf_new(const char *file_name, size_t block_size);
+// Open a file created by recf_new (and closed by recf_destroy). Returns NULL
+// if it isn't a record file, or it's in an incompatible format.
+Recf *recf_open(const char *file_name);
 void recf_destroy(Recf *recf);
 
+// These may be called from several threads at once. Reads run in parallel,
+// additions and deletions one at a time.
 RecfRecordIdx recf_add(Recf *recf, RecfRecord record);
 RecfRecord recf_get(Recf *recf, RecfRecordIdx idx);
 void recf_delete(Recf *recf, RecfRecordIdx idx);
 
+// For compaction (see compact.h). recf_copy copies the record to the end of
+// the file (if `to_end` is set), or to the lowest free index if that's below
+// idx, sets *record to it, and returns the copy's index (idx if there's no
+// copy, including when idx has been deleted meanwhile). The original stays
+// until it's deleted. recf_shrink drops the free records at the end, syncs the
+// file (by a checkpoint, with a log) and shrinks it.
+RecfRecordIdx recf_copy(
+	Recf *recf, RecfRecordIdx idx, bool to_end, RecfRecord *record);
+void recf_shrink(Recf *recf);
+
+// Write-ahead logging, like btree_attach_wal: recf_add and recf_delete are
+// transactions.
+void recf_attach_wal(Recf *recf, Wal *wal, uint8_t id);
+
 FsStats recf_fs_stats(Recf *recf);
+void recf_fs_latency(Recf *recf, FsLatency *snapshot);
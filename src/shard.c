@@ -0,0 +1,520 @@
+#include "shard.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "xassert.h"
+#include "wal.h"
+#include "utils.h"
+
+// Participant ids in each shard's log.
+enum { SHARD_WAL_ID_BTREE, SHARD_WAL_ID_RECF };
+
+// Counts down the requests of a call, so that the caller can wait for all of
+// them (e.g. one per shard) at once.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int n_left;
+} ShardWaiter;
+
+typedef enum {
+	SHARD_GET, SHARD_SET, SHARD_SET_BATCH, SHARD_DELETE, SHARD_SCAN,
+	SHARD_SYNC, SHARD_STOP
+} ShardOp;
+
+typedef struct {
+	ShardOp op;
+	ShardWaiter *waiter;
+	// GET, SET, DELETE: the key and the record (which GET sets). SCAN: the
+	// first key, then the key to continue from.
+	BtreeKey key;
+	RecfRecord record;
+	bool found; // GET, DELETE. SCAN: whether there are items left.
+	// SET_BATCH: the shard's items. SCAN: room for up to n_items, then the
+	// number of items found.
+	ShardsItem *items;
+	size_t n_items;
+} ShardRequest;
+
+typedef struct {
+	Btree *btree;
+	Recf *recf;
+	Wal *wal;
+
+	pthread_t worker;
+	// A ring buffer of requests, waiting for the worker.
+	pthread_mutex_t queue_lock;
+	pthread_cond_t not_empty, not_full;
+	ShardRequest *queue[SHARD_QUEUE_SIZE];
+	size_t queue_start, queue_len;
+} Shard;
+
+struct Shards { // Typedef'd in the header file.
+	int n_shards;
+	ShardsPartition partition;
+	Shard shards[SHARD_MAX_SHARDS];
+};
+
+int shards_range_partition(BtreeKey key, int n_shards) {
+	// (With one shard, the range size would overflow.)
+	if (n_shards == 1)
+		return 0;
+	return key / ((BtreeKey) -1 / n_shards + 1);
+}
+
+int shards_hash_partition(BtreeKey key, int n_shards) {
+	// Multiplicative hashing (the golden ratio), then the top bits.
+	uint64_t hash = (uint64_t) key * UINT64_C(0x9E3779B97F4A7C15);
+	return (hash >> 32) * n_shards >> 32;
+}
+
+static void shard_waiter_init(ShardWaiter *waiter, int n_requests) {
+	int lock_result = pthread_mutex_init(&waiter->lock, NULL);
+	int cond_result = pthread_cond_init(&waiter->done, NULL);
+	xassert(1, lock_result == 0 && cond_result == 0);
+	waiter->n_left = n_requests;
+}
+
+static void shard_waiter_wait(ShardWaiter *waiter) {
+	// Also destroys the waiter.
+	pthread_mutex_lock(&waiter->lock);
+	while (waiter->n_left > 0)
+		pthread_cond_wait(&waiter->done, &waiter->lock);
+	pthread_mutex_unlock(&waiter->lock);
+	pthread_cond_destroy(&waiter->done);
+	pthread_mutex_destroy(&waiter->lock);
+}
+
+static void shard_waiter_signal(ShardWaiter *waiter) {
+	pthread_mutex_lock(&waiter->lock);
+	if (--waiter->n_left == 0)
+		pthread_cond_signal(&waiter->done);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+static void shard_submit(Shard *shard, ShardRequest *request) {
+	pthread_mutex_lock(&shard->queue_lock);
+	while (shard->queue_len == SHARD_QUEUE_SIZE)
+		pthread_cond_wait(&shard->not_full, &shard->queue_lock);
+	shard->queue[(shard->queue_start + shard->queue_len++) %
+	             SHARD_QUEUE_SIZE] = request;
+	pthread_cond_signal(&shard->not_empty);
+	pthread_mutex_unlock(&shard->queue_lock);
+}
+
+static size_t shard_next_requests(
+	Shard *shard, ShardRequest *requests[SHARD_QUEUE_SIZE]) {
+
+	// Takes all waiting requests (at least one).
+	pthread_mutex_lock(&shard->queue_lock);
+	while (shard->queue_len == 0)
+		pthread_cond_wait(&shard->not_empty, &shard->queue_lock);
+	size_t n_requests = shard->queue_len;
+	for (size_t i = 0; i < n_requests; i++) {
+		requests[i] = shard->queue[shard->queue_start];
+		shard->queue_start = (shard->queue_start + 1) % SHARD_QUEUE_SIZE;
+	}
+	shard->queue_len = 0;
+	pthread_cond_broadcast(&shard->not_full);
+	pthread_mutex_unlock(&shard->queue_lock);
+	return n_requests;
+}
+
+static void shard_set_batch(Shard *shard, ShardsItem *items, size_t n_items) {
+	// Like btree_set: add the records, then set the keys (all in one batch),
+	// then free the records they replaced.
+	if (n_items == 0)
+		return;
+	BtreeItem *btree_items = malloc(n_items * sizeof(*btree_items));
+	bool *replaced = malloc(n_items * sizeof(*replaced));
+	BtreeValue *old_idxs = malloc(n_items * sizeof(*old_idxs));
+	xassert(1, btree_items != NULL && replaced != NULL && old_idxs != NULL);
+	for (size_t i = 0; i < n_items; i++) {
+		btree_items[i].key = items[i].key;
+		btree_items[i].value = recf_add(shard->recf, items[i].record);
+	}
+	btree_set_batch(shard->btree, btree_items, n_items, replaced, old_idxs);
+	for (size_t i = 0; i < n_items; i++) {
+		if (replaced[i])
+			recf_delete(shard->recf, old_idxs[i]);
+	}
+	free(old_idxs);
+	free(replaced);
+	free(btree_items);
+}
+
+static void shard_scan(Shard *shard, ShardRequest *request) {
+	size_t max_items = request->n_items;
+	request->n_items = 0;
+	BtreeCursor *cursor = btree_cursor_seek(shard->btree, request->key);
+	BtreeKey key;
+	BtreeValue idx;
+	while (request->n_items < max_items &&
+	       btree_cursor_get(cursor, &key, &idx)) {
+		ShardsItem *item = &request->items[request->n_items++];
+		item->key = key;
+		item->record = recf_get(shard->recf, idx);
+		btree_cursor_next(cursor);
+	}
+	request->found = btree_cursor_get(cursor, &key, &idx);
+	if (request->found)
+		request->key = key;
+	btree_cursor_close(cursor);
+}
+
+static void shard_execute(Shard *shard, ShardRequest *request) {
+	RecfRecordIdx idx;
+	switch (request->op) {
+	case SHARD_GET:
+		request->found = btree_get(shard->btree, request->key, &idx);
+		if (request->found)
+			request->record = recf_get(shard->recf, idx);
+		break;
+	case SHARD_SET: {
+		// Like shard_set_batch, without the arrays.
+		RecfRecordIdx new_idx = recf_add(shard->recf, request->record);
+		bool replaced = false;
+		btree_set(shard->btree, request->key, new_idx, &replaced, &idx);
+		if (replaced)
+			recf_delete(shard->recf, idx);
+		break;
+	}
+	case SHARD_SET_BATCH:
+		shard_set_batch(shard, request->items, request->n_items);
+		break;
+	case SHARD_DELETE:
+		request->found = btree_delete(shard->btree, request->key, &idx);
+		if (request->found)
+			recf_delete(shard->recf, idx);
+		break;
+	case SHARD_SCAN:
+		shard_scan(shard, request);
+		break;
+	case SHARD_SYNC:
+		wal_sync(shard->wal);
+		break;
+	case SHARD_STOP:
+		break;
+	}
+}
+
+static void *shard_worker(void *shard_void) {
+	// Requests are done once their changes are durable: the worker carries
+	// out all waiting ones, then syncs the log once for all of them.
+	Shard *shard = shard_void;
+	ShardRequest *requests[SHARD_QUEUE_SIZE];
+	while (true) {
+		size_t n_requests = shard_next_requests(shard, requests);
+		bool stop = false;
+		for (size_t i = 0; i < n_requests; i++) {
+			stop = stop || requests[i]->op == SHARD_STOP;
+			shard_execute(shard, requests[i]);
+		}
+		wal_sync(shard->wal);
+		for (size_t i = 0; i < n_requests; i++)
+			shard_waiter_signal(requests[i]->waiter); // It may be gone now.
+		if (stop)
+			return NULL;
+	}
+}
+
+static bool shard_open_files(
+	Shard *shard, const char *prefix, int i_shard, bool create,
+	size_t block_size, BtreeLayout layout) {
+
+	// Like main.c: a new log for new files, otherwise attaching the files
+	// replays it.
+	size_t name_size = strlen(prefix) + 32;
+	char *btree_name = malloc(name_size);
+	char *recf_name = malloc(name_size);
+	char *wal_name = malloc(name_size);
+	xassert(1, btree_name != NULL && recf_name != NULL && wal_name != NULL);
+	snprintf(btree_name, name_size, "%s-%d-btree.dat", prefix, i_shard);
+	snprintf(recf_name, name_size, "%s-%d-recf.dat", prefix, i_shard);
+	snprintf(wal_name, name_size, "%s-%d-wal.dat", prefix, i_shard);
+	create = create || access(btree_name, F_OK) != 0 ||
+		access(recf_name, F_OK) != 0;
+
+	shard->btree = NULL;
+	shard->recf = NULL;
+	shard->wal = wal_open(wal_name, create);
+	if (shard->wal != NULL && create) {
+		shard->btree = btree_new(btree_name, block_size, layout);
+		shard->recf = recf_new(recf_name, block_size);
+	} else if (shard->wal != NULL) {
+		shard->btree = btree_open(btree_name);
+		shard->recf = recf_open(recf_name);
+	}
+	free(wal_name);
+	free(recf_name);
+	free(btree_name);
+
+	if (shard->btree == NULL || shard->recf == NULL) {
+		if (shard->recf != NULL)
+			recf_destroy(shard->recf);
+		if (shard->btree != NULL)
+			btree_destroy(shard->btree);
+		if (shard->wal != NULL)
+			wal_close(shard->wal);
+		return false;
+	}
+	btree_attach_wal(shard->btree, shard->wal, SHARD_WAL_ID_BTREE);
+	recf_attach_wal(shard->recf, shard->wal, SHARD_WAL_ID_RECF);
+	return true;
+}
+
+static void shard_close_files(Shard *shard) {
+	recf_destroy(shard->recf);
+	btree_destroy(shard->btree);
+	wal_close(shard->wal);
+}
+
+Shards *shards_open(
+	const char *prefix, int n_shards, bool create, size_t block_size,
+	BtreeLayout layout, ShardsPartition partition) {
+
+	xassert(1, n_shards >= 1 && n_shards <= SHARD_MAX_SHARDS);
+	Shards *shards = malloc(sizeof(*shards));
+	xassert(1, shards != NULL);
+	shards->n_shards = n_shards;
+	shards->partition =
+		partition != NULL ? partition : shards_range_partition;
+
+	for (int i = 0; i < n_shards; i++) {
+		if (!shard_open_files(&shards->shards[i], prefix, i, create,
+		                      block_size, layout)) {
+			while (i-- > 0)
+				shard_close_files(&shards->shards[i]);
+			free(shards);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < n_shards; i++) {
+		Shard *shard = &shards->shards[i];
+		int lock_result = pthread_mutex_init(&shard->queue_lock, NULL);
+		int cond_result = pthread_cond_init(&shard->not_empty, NULL) |
+			pthread_cond_init(&shard->not_full, NULL);
+		xassert(1, lock_result == 0 && cond_result == 0);
+		shard->queue_start = 0;
+		shard->queue_len = 0;
+		int create_result = pthread_create(&shard->worker, NULL,
+		                                   shard_worker, shard);
+		xassert(1, create_result == 0);
+	}
+	return shards;
+}
+
+void shards_close(Shards *shards) {
+	// Requests submitted before this are done first.
+	ShardRequest requests[SHARD_MAX_SHARDS];
+	ShardWaiter waiter;
+	shard_waiter_init(&waiter, shards->n_shards);
+	for (int i = 0; i < shards->n_shards; i++) {
+		requests[i].op = SHARD_STOP;
+		requests[i].waiter = &waiter;
+		shard_submit(&shards->shards[i], &requests[i]);
+	}
+	shard_waiter_wait(&waiter);
+
+	for (int i = 0; i < shards->n_shards; i++) {
+		Shard *shard = &shards->shards[i];
+		pthread_join(shard->worker, NULL);
+		pthread_cond_destroy(&shard->not_full);
+		pthread_cond_destroy(&shard->not_empty);
+		pthread_mutex_destroy(&shard->queue_lock);
+		shard_close_files(shard);
+	}
+	free(shards);
+}
+
+static Shard *shards_shard_of(Shards *shards, BtreeKey key) {
+	int i_shard = shards->partition(key, shards->n_shards);
+	xassert(1, i_shard >= 0 && i_shard < shards->n_shards);
+	return &shards->shards[i_shard];
+}
+
+static void shards_request(
+	Shards *shards, ShardOp op, BtreeKey key, ShardRequest *request) {
+
+	// Submit a request for the key's shard, and wait for it.
+	ShardWaiter waiter;
+	shard_waiter_init(&waiter, 1);
+	request->op = op;
+	request->waiter = &waiter;
+	request->key = key;
+	shard_submit(shards_shard_of(shards, key), request);
+	shard_waiter_wait(&waiter);
+}
+
+bool shards_get(Shards *shards, BtreeKey key, RecfRecord *record) {
+	ShardRequest request;
+	shards_request(shards, SHARD_GET, key, &request);
+	if (request.found && record != NULL)
+		*record = request.record;
+	return request.found;
+}
+
+void shards_set(Shards *shards, BtreeKey key, RecfRecord record) {
+	ShardRequest request = {.record = record};
+	shards_request(shards, SHARD_SET, key, &request);
+}
+
+bool shards_delete(Shards *shards, BtreeKey key) {
+	ShardRequest request;
+	shards_request(shards, SHARD_DELETE, key, &request);
+	return request.found;
+}
+
+void shards_set_batch(
+	Shards *shards, const ShardsItem *items, size_t n_items) {
+
+	// Group the items by shard (keeping their order, for repeated keys),
+	// then submit every shard's group at once.
+	int n_shards = shards->n_shards;
+	int *item_shards = malloc(n_items * sizeof(*item_shards));
+	ShardsItem *grouped = malloc(n_items * sizeof(*grouped));
+	xassert(1, item_shards != NULL && grouped != NULL);
+	size_t group_start[SHARD_MAX_SHARDS + 1] = {0};
+	for (size_t i = 0; i < n_items; i++) {
+		item_shards[i] = shards_shard_of(shards, items[i].key) -
+			shards->shards;
+		group_start[item_shards[i] + 1]++;
+	}
+	for (int i = 0; i < n_shards; i++)
+		group_start[i + 1] += group_start[i];
+	size_t group_end[SHARD_MAX_SHARDS];
+	memcpy(group_end, group_start, n_shards * sizeof(*group_end));
+	for (size_t i = 0; i < n_items; i++)
+		grouped[group_end[item_shards[i]]++] = items[i];
+
+	ShardRequest requests[SHARD_MAX_SHARDS];
+	ShardWaiter waiter;
+	int n_requests = 0;
+	for (int i = 0; i < n_shards; i++)
+		n_requests += group_end[i] > group_start[i];
+	shard_waiter_init(&waiter, n_requests);
+	for (int i = 0; i < n_shards; i++) {
+		if (group_end[i] == group_start[i])
+			continue;
+		requests[i].op = SHARD_SET_BATCH;
+		requests[i].waiter = &waiter;
+		requests[i].items = &grouped[group_start[i]];
+		requests[i].n_items = group_end[i] - group_start[i];
+		shard_submit(&shards->shards[i], &requests[i]);
+	}
+	shard_waiter_wait(&waiter);
+	free(grouped);
+	free(item_shards);
+}
+
+void shards_sync(Shards *shards) {
+	ShardRequest requests[SHARD_MAX_SHARDS];
+	ShardWaiter waiter;
+	shard_waiter_init(&waiter, shards->n_shards);
+	for (int i = 0; i < shards->n_shards; i++) {
+		requests[i].op = SHARD_SYNC;
+		requests[i].waiter = &waiter;
+		shard_submit(&shards->shards[i], &requests[i]);
+	}
+	shard_waiter_wait(&waiter);
+}
+
+// The walk keeps the items fetched from each shard (a stream), and a heap of
+// the streams which have any left, by their next key.
+typedef struct {
+	ShardRequest request; // The last scan.
+	size_t i_next; // In request.items.
+} ShardStream;
+
+static BtreeKey shard_stream_key(const ShardStream *stream) {
+	return stream->request.items[stream->i_next].key;
+}
+
+static bool shard_heap_less(ShardStream *streams, int a, int b) {
+	return btree_key_cmp(shard_stream_key(&streams[a]),
+	                     shard_stream_key(&streams[b])) < 0;
+}
+
+static void shard_heap_sift_down(
+	ShardStream *streams, int *heap, size_t n_heap, size_t i) {
+
+	while (true) {
+		size_t smallest = i;
+		for (size_t child = 2 * i + 1; child <= 2 * i + 2; child++) {
+			if (child < n_heap &&
+			    shard_heap_less(streams, heap[child], heap[smallest]))
+				smallest = child;
+		}
+		if (smallest == i)
+			return;
+		int tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+static void shard_scan_all(
+	Shards *shards, ShardStream *streams, const int *i_shards, int n) {
+
+	// Fetch the next items of the given shards, in parallel.
+	ShardWaiter waiter;
+	shard_waiter_init(&waiter, n);
+	for (int i = 0; i < n; i++) {
+		ShardStream *stream = &streams[i_shards[i]];
+		stream->request.op = SHARD_SCAN;
+		stream->request.waiter = &waiter;
+		stream->request.n_items = SHARD_SCAN_SIZE;
+		stream->i_next = 0;
+		shard_submit(&shards->shards[i_shards[i]], &stream->request);
+	}
+	shard_waiter_wait(&waiter);
+}
+
+void shards_walk(
+	Shards *shards,
+	void (*callback)(BtreeKey, RecfRecord, void *), void *callback_context) {
+
+	int n_shards = shards->n_shards;
+	ShardStream *streams = malloc(n_shards * sizeof(*streams));
+	ShardsItem *items = malloc(
+		n_shards * SHARD_SCAN_SIZE * sizeof(*items));
+	xassert(1, streams != NULL && items != NULL);
+	int heap[SHARD_MAX_SHARDS];
+	for (int i = 0; i < n_shards; i++) {
+		streams[i].request.items = &items[i * SHARD_SCAN_SIZE];
+		streams[i].request.key = 0;
+		heap[i] = i;
+	}
+	shard_scan_all(shards, streams, heap, n_shards);
+
+	size_t n_heap = 0;
+	for (int i = 0; i < n_shards; i++) {
+		if (streams[i].request.n_items > 0)
+			heap[n_heap++] = i;
+	}
+	for (size_t i = n_heap / 2; i-- > 0;)
+		shard_heap_sift_down(streams, heap, n_heap, i);
+
+	while (n_heap > 0) {
+		ShardStream *stream = &streams[heap[0]];
+		const ShardsItem *item = &stream->request.items[stream->i_next++];
+		callback(item->key, item->record, callback_context);
+
+		// Refill the stream (from the key after the last one), or drop it.
+		if (stream->i_next == stream->request.n_items) {
+			if (stream->request.found)
+				shard_scan_all(shards, streams, &heap[0], 1);
+			if (stream->i_next == stream->request.n_items)
+				heap[0] = heap[--n_heap];
+		}
+		shard_heap_sift_down(streams, heap, n_heap, 0);
+	}
+
+	free(items);
+	free(streams);
+}
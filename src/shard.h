@@ -0,0 +1,61 @@
+// Sharding: keys partitioned between several independent trees, each with
+// its own record file and log (so its own files, and its own group commits),
+// and each served by a worker thread. Nothing inside the trees is shared, so
+// the shards' operations run in parallel (on as many cores and disks as
+// there are shards).
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "btree.h"
+#include "recf.h"
+
+// Settings.
+enum {
+	SHARD_MAX_SHARDS = 64,
+	SHARD_QUEUE_SIZE = 256, // Requests waiting for a shard's worker.
+	SHARD_SCAN_SIZE = 1024 // Items fetched from a shard at a time by walks.
+};
+
+typedef struct Shards Shards;
+
+typedef struct {
+	BtreeKey key;
+	RecfRecord record;
+} ShardsItem;
+
+// Maps a key to its shard (below n_shards). It has to stay the same for the
+// files' lifetime.
+typedef int (*ShardsPartition)(BtreeKey key, int n_shards);
+// Splits the keys into n_shards ranges of equal size (the default).
+int shards_range_partition(BtreeKey key, int n_shards);
+// Spreads runs of consecutive keys between all shards, so that e.g.
+// sequential inserts go to all of them.
+int shards_hash_partition(BtreeKey key, int n_shards);
+
+// Shard i's files are <prefix>-<i>-btree.dat, -recf.dat and -wal.dat. New
+// ones are created if `create` is set or they don't exist (with the given
+// block size and layout). `partition` may be NULL for
+// shards_range_partition. Returns NULL if existing files are invalid.
+Shards *shards_open(
+	const char *prefix, int n_shards, bool create, size_t block_size,
+	BtreeLayout layout, ShardsPartition partition);
+void shards_close(Shards *shards);
+
+// These may be called from several threads at once. Each waits until the
+// shard's worker is done with the request, and its changes are durable (the
+// requests that were waiting together share an fdatasync).
+bool shards_get(Shards *shards, BtreeKey key, RecfRecord *record);
+void shards_set(Shards *shards, BtreeKey key, RecfRecord record);
+// Like btree_set_batch (a repeated key's last record wins). The shards set
+// their parts of the batch in parallel.
+void shards_set_batch(Shards *shards, const ShardsItem *items, size_t n_items);
+bool shards_delete(Shards *shards, BtreeKey key);
+// Make everything so far durable (see wal_sync), in all shards at once.
+void shards_sync(Shards *shards);
+
+// All items in key order, whichever shards they're in: the shards' items are
+// fetched SHARD_SCAN_SIZE at a time (between other requests), and merged.
+// Items changed during the walk may or may not be seen.
+void shards_walk(
+	Shards *shards,
+	void (*callback)(BtreeKey, RecfRecord, void *), void *callback_context);
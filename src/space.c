@@ -0,0 +1,308 @@
+#include "space.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "xassert.h"
+#include "utils.h"
+
+enum {
+	SPACE_MIN_EXTENT = 64 << 10, // Bytes.
+	SPACE_MAX_EXTENT = 64 << 20,
+	SPACE_NEAR_WINDOW = 8 // Words of the free map (of 64 units each).
+};
+
+struct Space { // Typedef'd in the header file.
+	FsFile *file;
+	FsOffset base;
+	size_t unit_size;
+	SpaceUnit n_reserved;
+	size_t map_align;
+
+	SpaceUnit end;
+	SpaceUnit n_free;
+	SpaceUnit first_free_hint; // There are no free units below it.
+
+	// Bit set = unit used. Bits past `end` are also set, so that appending
+	// doesn't have to touch the map. If there are no free units, the map
+	// isn't needed -- it's created (or read from the file) lazily.
+	uint64_t *map;
+	size_t map_capacity; // In words.
+	bool map_loaded;
+	pthread_mutex_t map_lock; // For loading the map (see space_is_used).
+};
+
+static size_t space_n_words(SpaceUnit n_units) {
+	return (n_units + 63) / 64;
+}
+
+static FsOffset space_map_offset(Space *space) {
+	FsOffset end_offset = space->base + space->end * space->unit_size;
+	return (end_offset + space->map_align - 1)
+		/ space->map_align * space->map_align;
+}
+
+Space *space_load(
+	FsFile *file, FsOffset base, size_t unit_size, SpaceUnit n_reserved,
+	size_t map_align, SpaceUnit end, SpaceUnit n_free) {
+
+	xassert(1, end >= n_reserved && n_free <= end - n_reserved);
+
+	Space *space = malloc(sizeof(*space));
+	xassert(1, space != NULL);
+	space->file = file;
+	space->base = base;
+	space->unit_size = unit_size;
+	space->n_reserved = n_reserved;
+	space->map_align = map_align;
+	space->end = end;
+	space->n_free = n_free;
+	space->first_free_hint = n_reserved;
+	space->map = NULL;
+	space->map_capacity = 0;
+	space->map_loaded = false;
+	int lock_result = pthread_mutex_init(&space->map_lock, NULL);
+	xassert(1, lock_result == 0);
+	return space;
+}
+
+Space *space_new(
+	FsFile *file, FsOffset base, size_t unit_size, SpaceUnit n_reserved,
+	size_t map_align) {
+
+	return space_load(file, base, unit_size, n_reserved, map_align,
+	                  n_reserved, 0);
+}
+
+void space_destroy(Space *space) {
+	pthread_mutex_destroy(&space->map_lock);
+	free(space->map);
+	free(space);
+}
+
+static void space_reserve_map(Space *space, size_t n_words) {
+	if (n_words <= space->map_capacity)
+		return;
+
+	size_t new_capacity = MAX(n_words, space->map_capacity * 2);
+	space->map = realloc(space->map, new_capacity * sizeof(*space->map));
+	xassert(1, space->map != NULL);
+	memset(space->map + space->map_capacity, 0xFF,
+	       (new_capacity - space->map_capacity) * sizeof(*space->map));
+	space->map_capacity = new_capacity;
+}
+
+static void space_ensure_map(Space *space) {
+	// Several threads may get here at once from space_is_used.
+	if (__atomic_load_n(&space->map_loaded, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&space->map_lock);
+	if (space->map_loaded) {
+		pthread_mutex_unlock(&space->map_lock);
+		return;
+	}
+
+	size_t n_words = space_n_words(space->end);
+	space_reserve_map(space, MAX(n_words, 1));
+	if (space->n_free > 0 && n_words > 0) {
+		// Without free units, the map is all ones and there's nothing to read.
+		fs_read(space->file, space->map, space_map_offset(space),
+		        n_words * sizeof(*space->map));
+		if (space->end % 64 != 0)
+			space->map[n_words - 1] |= UINT64_MAX << (space->end % 64);
+	}
+	__atomic_store_n(&space->map_loaded, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&space->map_lock);
+}
+
+static void space_grow_file(Space *space, FsOffset min_size) {
+	FsOffset size = fs_size(space->file);
+	if (min_size <= size)
+		return;
+
+	FsOffset extent = MIN(MAX(size, SPACE_MIN_EXTENT), SPACE_MAX_EXTENT);
+	fs_allocate(space->file, MAX(min_size, size + extent));
+}
+
+static int space_lowest_free_bit(uint64_t word) {
+	xassert(1, word != UINT64_MAX);
+	return __builtin_ctzll(~word);
+}
+
+static SpaceUnit space_find_free_near(Space *space, SpaceUnit near) {
+	size_t n_words = space_n_words(space->end);
+	size_t i_near = MIN(near / 64, n_words - 1);
+
+	// Check the words at increasing distance from `near`, alternating sides.
+	for (size_t distance = 0; distance <= SPACE_NEAR_WINDOW; distance++) {
+		if (i_near + distance < n_words &&
+		    space->map[i_near + distance] != UINT64_MAX) {
+			return (i_near + distance) * 64 +
+				space_lowest_free_bit(space->map[i_near + distance]);
+		}
+		if (distance <= i_near && distance > 0 &&
+		    space->map[i_near - distance] != UINT64_MAX) {
+			return (i_near - distance) * 64 +
+				space_lowest_free_bit(space->map[i_near - distance]);
+		}
+	}
+	return SPACE_NULL;
+}
+
+static SpaceUnit space_find_free(Space *space) {
+	size_t n_words = space_n_words(space->end);
+	for (size_t i = space->first_free_hint / 64; i < n_words; i++) {
+		if (space->map[i] != UINT64_MAX) {
+			space->first_free_hint = i * 64;
+			return i * 64 + space_lowest_free_bit(space->map[i]);
+		}
+	}
+	xassert(1, false); // n_free is wrong.
+	return SPACE_NULL;
+}
+
+SpaceUnit space_alloc(Space *space, SpaceUnit near) {
+	if (space->n_free > 0) {
+		space_ensure_map(space);
+
+		SpaceUnit unit = SPACE_NULL;
+		if (near != SPACE_NULL)
+			unit = space_find_free_near(space, near);
+		if (unit == SPACE_NULL)
+			unit = space_find_free(space);
+
+		xassert(1, unit >= space->n_reserved && unit < space->end);
+		space->map[unit / 64] |= UINT64_C(1) << (unit % 64);
+		space->n_free--;
+		return unit;
+	}
+
+	// No free units, so append one.
+	SpaceUnit unit = space->end++;
+	if (space->map_loaded)
+		space_reserve_map(space, space_n_words(space->end));
+	space_grow_file(space, space->base + space->end * space->unit_size);
+	return unit;
+}
+
+void space_free(Space *space, SpaceUnit unit) {
+	xassert(1, unit >= space->n_reserved && unit < space->end);
+	space_ensure_map(space);
+	xassert(1, space_is_used(space, unit));
+
+	space->map[unit / 64] &= ~(UINT64_C(1) << (unit % 64));
+	space->n_free++;
+	space->first_free_hint = MIN(space->first_free_hint, unit);
+}
+
+bool space_is_used(Space *space, SpaceUnit unit) {
+	if (unit >= space->end)
+		return false;
+	if (unit < space->n_reserved || space->n_free == 0)
+		return true;
+	space_ensure_map(space);
+	return (space->map[unit / 64] >> (unit % 64)) & 1;
+}
+
+SpaceUnit space_end(Space *space) {
+	return space->end;
+}
+
+SpaceUnit space_n_free(Space *space) {
+	return space->n_free;
+}
+
+SpaceUnit space_lowest_free(Space *space) {
+	if (space->n_free == 0)
+		return space->end;
+	space_ensure_map(space);
+	return space_find_free(space);
+}
+
+void space_shrink(Space *space) {
+	if (space->n_free > 0) {
+		space_ensure_map(space);
+		// Bits past `end` have to stay set (see struct Space).
+		while (space->n_free > 0 && space->end > space->n_reserved &&
+		       !space_is_used(space, space->end - 1)) {
+			space->end--;
+			space->map[space->end / 64] |= UINT64_C(1) << (space->end % 64);
+			space->n_free--;
+		}
+	}
+}
+
+void space_truncate(Space *space) {
+	// Whole aligned blocks are kept (like those after the last unit).
+	FsOffset size = space_map_offset(space);
+	if (space->n_free > 0) { // See space_save.
+		size += space_n_words(space->end) * sizeof(*space->map);
+		size = (size + space->map_align - 1)
+			/ space->map_align * space->map_align;
+	}
+	if (size < fs_size(space->file))
+		fs_set_size(space->file, size);
+}
+
+void space_save(Space *space) {
+	if (space->n_free == 0)
+		return; // See space_ensure_map.
+
+	space_ensure_map(space);
+	FsOffset offset = space_map_offset(space);
+	size_t n_bytes = space_n_words(space->end) * sizeof(*space->map);
+	space_grow_file(space, offset + n_bytes);
+	fs_write(space->file, space->map, offset, n_bytes);
+}
+
+size_t space_snapshot_size(Space *space) {
+	// The map is left out if there are no free units (see space_ensure_map).
+	size_t n_map_words = space->n_free > 0 ? space_n_words(space->end) : 0;
+	return 2 * sizeof(uint64_t) + n_map_words * sizeof(*space->map);
+}
+
+void space_snapshot(Space *space, void *dest) {
+	uint64_t header[2] = {space->end, space->n_free};
+	memcpy(dest, header, sizeof(header));
+	if (space->n_free > 0) {
+		space_ensure_map(space);
+		memcpy((char *) dest + sizeof(header), space->map,
+		       space_n_words(space->end) * sizeof(*space->map));
+	}
+}
+
+void space_restore(Space *space, const void *snapshot) {
+	uint64_t header[2];
+	memcpy(header, snapshot, sizeof(header));
+	space->end = header[0];
+	space->n_free = header[1];
+	xassert(1, space->end >= space->n_reserved &&
+	        space->n_free <= space->end - space->n_reserved);
+	space->first_free_hint = space->n_reserved;
+
+	// Start from a map of ones (past `end`, it has to stay that way).
+	size_t n_words = space_n_words(space->end);
+	space_reserve_map(space, MAX(n_words, 1));
+	memset(space->map, 0xFF, space->map_capacity * sizeof(*space->map));
+	if (space->n_free > 0) {
+		memcpy(space->map, (const char *) snapshot + sizeof(header),
+		       n_words * sizeof(*space->map));
+	}
+	space->map_loaded = true;
+	space_grow_file(space, space->base + space->end * space->unit_size);
+}
+
+void space_alloc_at(Space *space, SpaceUnit unit) {
+	if (unit == space->end) {
+		space->end++;
+		if (space->map_loaded)
+			space_reserve_map(space, space_n_words(space->end));
+		space_grow_file(space, space->base + space->end * space->unit_size);
+		return;
+	}
+
+	xassert(1, unit >= space->n_reserved && unit < space->end);
+	space_ensure_map(space);
+	xassert(1, !space_is_used(space, unit));
+	space->map[unit / 64] |= UINT64_C(1) << (unit % 64);
+	space->n_free--;
+}
@@ -0,0 +1,62 @@
+// Free space management for a file made of equally sized units (B-tree blocks
+// or records).
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "fs.h"
+
+typedef uint64_t SpaceUnit;
+#define SPACE_NULL ((SpaceUnit) -1)
+
+typedef struct Space Space;
+
+// Unit i is stored at base + i * unit_size. Units below n_reserved (e.g. the
+// superblock) are never given out. The free map is saved just past the last
+// allocated unit, aligned to map_align bytes.
+Space *space_new(
+	FsFile *file, FsOffset base, size_t unit_size, SpaceUnit n_reserved,
+	size_t map_align);
+
+// Load the state saved by space_save. `end` and `n_free` are the values of
+// space_end and space_n_free at that time. The free map itself is only read
+// when it's first needed.
+Space *space_load(
+	FsFile *file, FsOffset base, size_t unit_size, SpaceUnit n_reserved,
+	size_t map_align, SpaceUnit end, SpaceUnit n_free);
+
+void space_destroy(Space *space);
+
+// Allocate a unit, preferably close to `near` (pass SPACE_NULL if there's no
+// preference). The file grows in geometrically increasing extents, so this
+// rarely needs a system call.
+SpaceUnit space_alloc(Space *space, SpaceUnit near);
+void space_free(Space *space, SpaceUnit unit);
+// Several threads may call this at once (but nothing else meanwhile).
+bool space_is_used(Space *space, SpaceUnit unit);
+
+SpaceUnit space_end(Space *space); // One past the highest allocated unit.
+SpaceUnit space_n_free(Space *space); // Free units below space_end.
+// The unit space_alloc(space, SPACE_NULL) would give out, without
+// allocating it.
+SpaceUnit space_lowest_free(Space *space);
+
+// Drop the free units at the end (so that space_end goes down). The file
+// keeps its size until space_truncate.
+void space_shrink(Space *space);
+// Shrink the file to the units and the map written by space_save. Whatever
+// records `end` has to be durable first, so that it never points past the
+// end of the file.
+void space_truncate(Space *space);
+
+void space_save(Space *space);
+
+// For write-ahead logging (see wal.h): the state (`end`, `n_free` and the
+// free map) as a snapshot of space_snapshot_size bytes, and a way to restore
+// it, then replay allocations with space_alloc_at (and frees with
+// space_free).
+size_t space_snapshot_size(Space *space);
+void space_snapshot(Space *space, void *dest);
+void space_restore(Space *space, const void *snapshot);
+// Allocate the given unit, which has to be free or space_end.
+void space_alloc_at(Space *space, SpaceUnit unit);
@@ -0,0 +1,517 @@
+#include "wal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "xassert.h"
+#include "utils.h"
+
+// The log starts with a header, followed by frames: each participant's
+// records, and after the records of a transaction, a commit frame with their
+// checksum. The checksum is seeded with the log's generation, which grows
+// with each checkpoint, so leftovers of an older log (or of a transaction
+// that was being written during a crash) end the replay.
+#define WAL_MAGIC UINT64_C(0x00004C41574B4B50) // "PKKWAL\0\0" (little-endian).
+enum { WAL_COMMIT_ID = 255, WAL_FRAME_ALIGNMENT = 8 };
+
+typedef struct {
+	uint64_t magic;
+	uint64_t generation;
+} WalHeader;
+
+typedef struct {
+	uint32_t n_bytes; // Not counting the padding.
+	uint8_t id; // WAL_COMMIT_ID for a commit frame.
+	uint8_t type;
+	uint16_t padding;
+	uint64_t arg; // For a commit frame, the checksum.
+} WalFrame;
+
+typedef struct {
+	uint8_t id;
+	WalParticipant participant;
+} WalAttached;
+
+struct Wal { // Typedef'd in the header file.
+	// Held from wal_begin to wal_commit, and by whatever changes the set of
+	// participants or checkpoints. `in_transaction` and `checksum` are only
+	// touched under it.
+	pthread_mutex_t transaction_lock;
+	// For the buffer and everything else that wal_sync touches (it's called
+	// from write hooks, on any thread). Taken after the participants' locks.
+	pthread_mutex_t lock;
+	// Broadcast (under `lock`) when a sync ends.
+	pthread_cond_t synced;
+
+	FsFile *file; // Without the buffer pool.
+	uint64_t generation;
+	WalStats stats;
+
+	// The frames which aren't in the file yet. They start at buffer_offset.
+	// The ones before committed_end (an offset in the file) belong to
+	// committed transactions, and are written by wal_sync.
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_capacity;
+	FsOffset buffer_offset;
+	FsOffset committed_end;
+	FsOffset synced_end;
+	bool syncing; // A thread is in fdatasync (without holding `lock`).
+
+	// Syncs the log every WAL_MAX_SYNC_DELAY_MS, if there's anything to sync.
+	pthread_t flusher;
+	pthread_cond_t flusher_wake; // For flusher_stop.
+	bool flusher_stop;
+
+	bool in_transaction;
+	uint64_t checksum; // Of the frames since the last commit.
+	// The participants' syncs don't force the log (it's synced before them).
+	bool checkpointing;
+
+	WalAttached attached[WAL_MAX_PARTICIPANTS];
+	size_t n_attached;
+
+	// The committed part of the log found by wal_open (header included). It's
+	// kept until the participants which have records in it are attached.
+	char *replay;
+	size_t replay_size;
+	bool unattached[WAL_COMMIT_ID];
+	size_t n_unattached;
+};
+
+static size_t wal_padded(size_t n_bytes) {
+	return (n_bytes + WAL_FRAME_ALIGNMENT - 1)
+		/ WAL_FRAME_ALIGNMENT * WAL_FRAME_ALIGNMENT;
+}
+
+static uint64_t wal_checksum(uint64_t hash, const void *bytes, size_t n) {
+	// FNV-1a.
+	const unsigned char *pos = bytes;
+	for (size_t i = 0; i < n; i++) {
+		hash ^= pos[i];
+		hash *= UINT64_C(0x100000001B3);
+	}
+	return hash;
+}
+
+static uint64_t wal_checksum_seed(uint64_t generation) {
+	return UINT64_C(0xCBF29CE484222325) ^ generation;
+}
+
+static void *wal_buffer_push(Wal *wal, size_t n_bytes) {
+	// Returns zeroed space for n_bytes at the end of the buffer.
+	if (wal->buffer_size + n_bytes > wal->buffer_capacity) {
+		wal->buffer_capacity =
+			MAX(wal->buffer_size + n_bytes, wal->buffer_capacity * 2);
+		wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+		xassert(1, wal->buffer != NULL);
+	}
+	void *dest = wal->buffer + wal->buffer_size;
+	memset(dest, 0, n_bytes);
+	wal->buffer_size += n_bytes;
+	return dest;
+}
+
+static FsOffset wal_end(Wal *wal) {
+	return wal->buffer_offset + wal->buffer_size;
+}
+
+static void wal_start_log(Wal *wal, uint64_t generation) {
+	// Discard the log and start an empty one (written by the next wal_sync).
+	xassert(1, !wal->syncing);
+	fs_set_size(wal->file, 0);
+	wal->generation = generation;
+	wal->buffer_size = 0;
+	wal->buffer_offset = 0;
+	WalHeader header = {WAL_MAGIC, generation};
+	memcpy(wal_buffer_push(wal, sizeof(header)), &header, sizeof(header));
+	wal->committed_end = sizeof(header);
+	wal->synced_end = 0;
+	wal->checksum = wal_checksum_seed(generation);
+}
+
+static size_t wal_next_frame(
+	const char *log, size_t log_size, size_t pos, WalFrame *frame) {
+
+	// Returns the position after the frame at `pos`, or 0 if it doesn't fit.
+	if (log_size - pos < sizeof(*frame))
+		return 0;
+	memcpy(frame, log + pos, sizeof(*frame));
+	size_t frame_size = sizeof(*frame) + wal_padded(frame->n_bytes);
+	if (log_size - pos < frame_size)
+		return 0;
+	return pos + frame_size;
+}
+
+static size_t wal_scan(Wal *wal, const char *log, size_t log_size) {
+	// Returns the size of the committed part of the log, and marks the
+	// participants which have records in it.
+
+	uint64_t checksum = wal_checksum_seed(wal->generation);
+	bool in_transaction[WAL_COMMIT_ID] = {false};
+	size_t committed_end = sizeof(WalHeader);
+	size_t pos = committed_end;
+	while (true) {
+		WalFrame frame;
+		size_t next = wal_next_frame(log, log_size, pos, &frame);
+		if (next == 0)
+			break;
+		if (frame.id != WAL_COMMIT_ID) {
+			checksum = wal_checksum(checksum, log + pos, next - pos);
+			in_transaction[frame.id] = true;
+			pos = next;
+			continue;
+		}
+
+		if (frame.n_bytes != 0 || frame.arg != checksum)
+			break;
+		for (size_t id = 0; id < WAL_COMMIT_ID; id++) {
+			if (in_transaction[id] && !wal->unattached[id]) {
+				wal->unattached[id] = true;
+				wal->n_unattached++;
+			}
+			in_transaction[id] = false;
+		}
+		checksum = wal_checksum_seed(wal->generation);
+		committed_end = pos = next;
+	}
+	return committed_end;
+}
+
+static void wal_sync_to(Wal *wal, FsOffset end);
+
+static void *wal_flusher(void *wal_void) {
+	// Makes commits durable soon even if nobody waits for them.
+	Wal *wal = wal_void;
+	pthread_mutex_lock(&wal->lock);
+	while (!wal->flusher_stop) {
+		wal_sync_to(wal, wal->committed_end);
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += WAL_MAX_SYNC_DELAY_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&wal->flusher_wake, &wal->lock, &deadline);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return NULL;
+}
+
+static void wal_start_flusher(Wal *wal) {
+	pthread_condattr_t attr;
+	int cond_result = pthread_condattr_init(&attr) |
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) |
+		pthread_cond_init(&wal->flusher_wake, &attr) |
+		pthread_cond_init(&wal->synced, NULL);
+	pthread_condattr_destroy(&attr);
+	xassert(1, cond_result == 0);
+	wal->flusher_stop = false;
+	int create_result =
+		pthread_create(&wal->flusher, NULL, wal_flusher, wal);
+	xassert(1, create_result == 0);
+}
+
+Wal *wal_open(const char *file_name, bool truncate) {
+	FsFile *file = fs_open(file_name, truncate, FS_MODE_BUFFERED);
+
+	Wal *wal = malloc(sizeof(*wal));
+	xassert(1, wal != NULL);
+	int lock_result = pthread_mutex_init(&wal->transaction_lock, NULL);
+	xassert(1, lock_result == 0);
+	lock_result = pthread_mutex_init(&wal->lock, NULL);
+	xassert(1, lock_result == 0);
+	wal->file = file;
+	memset(&wal->stats, 0, sizeof(wal->stats));
+	wal->buffer = NULL;
+	wal->buffer_capacity = 0;
+	wal->syncing = false;
+	wal->in_transaction = false;
+	wal->checkpointing = false;
+	wal->n_attached = 0;
+	wal->replay = NULL;
+	wal->replay_size = 0;
+	memset(wal->unattached, 0, sizeof(wal->unattached));
+	wal->n_unattached = 0;
+
+	// A log too short for a header was being started during a crash (after
+	// a checkpoint, so there's nothing to replay).
+	size_t size = fs_size(file);
+	if (size < sizeof(WalHeader)) {
+		wal_start_log(wal, 1);
+		wal_start_flusher(wal);
+		return wal;
+	}
+
+	char *log = malloc(size);
+	xassert(1, log != NULL);
+	fs_read(file, log, 0, size);
+	WalHeader header;
+	memcpy(&header, log, sizeof(header));
+	if (header.magic != WAL_MAGIC) {
+		free(log);
+		fs_close(file);
+		pthread_mutex_destroy(&wal->transaction_lock);
+		pthread_mutex_destroy(&wal->lock);
+		free(wal);
+		return NULL;
+	}
+
+	// Drop the uncommitted tail, and append after the committed part.
+	wal->generation = header.generation;
+	wal->replay = log;
+	wal->replay_size = wal_scan(wal, log, size);
+	fs_set_size(file, wal->replay_size);
+	wal->buffer_size = 0;
+	wal->buffer_offset = wal->replay_size;
+	wal->committed_end = wal->synced_end = wal->replay_size;
+	wal->checksum = wal_checksum_seed(wal->generation);
+	if (wal->n_unattached == 0) {
+		free(wal->replay);
+		wal->replay = NULL;
+	}
+	wal_start_flusher(wal);
+	return wal;
+}
+
+void wal_close(Wal *wal) {
+	xassert(1, wal->n_attached == 0 && !wal->in_transaction);
+	pthread_mutex_lock(&wal->lock);
+	wal->flusher_stop = true;
+	pthread_cond_signal(&wal->flusher_wake);
+	pthread_mutex_unlock(&wal->lock);
+	int join_result = pthread_join(wal->flusher, NULL);
+	xassert(1, join_result == 0);
+
+	// The participants synced their files when they were detached, so the
+	// log is only needed for the ones that were never attached.
+	if (wal->n_unattached == 0)
+		wal_start_log(wal, wal->generation + 1);
+	wal_sync(wal);
+
+	fs_close(wal->file);
+	pthread_cond_destroy(&wal->flusher_wake);
+	pthread_cond_destroy(&wal->synced);
+	pthread_mutex_destroy(&wal->transaction_lock);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal->buffer);
+	free(wal->replay);
+	free(wal);
+}
+
+static void wal_replay(
+	Wal *wal, uint8_t id, const WalParticipant *participant) {
+
+	size_t pos = sizeof(WalHeader);
+	while (pos < wal->replay_size) {
+		WalFrame frame;
+		size_t next =
+			wal_next_frame(wal->replay, wal->replay_size, pos, &frame);
+		xassert(1, next != 0); // wal_scan checked it.
+		if (frame.id == id) {
+			participant->redo(participant->context, frame.type, frame.arg,
+			                  wal->replay + pos + sizeof(frame), frame.n_bytes);
+		}
+		pos = next;
+	}
+}
+
+static void wal_do_commit(Wal *wal);
+
+void wal_attach(Wal *wal, uint8_t id, const WalParticipant *participant) {
+	pthread_mutex_lock(&wal->transaction_lock);
+	xassert(1, id != WAL_COMMIT_ID && !wal->in_transaction);
+	xassert(1, wal->n_attached < WAL_MAX_PARTICIPANTS);
+	for (size_t i = 0; i < wal->n_attached; i++)
+		xassert(1, wal->attached[i].id != id);
+	wal->attached[wal->n_attached].id = id;
+	wal->attached[wal->n_attached].participant = *participant;
+	wal->n_attached++;
+
+	if (wal->unattached[id]) {
+		wal_replay(wal, id, participant);
+		wal->unattached[id] = false;
+		if (--wal->n_unattached == 0) {
+			free(wal->replay);
+			wal->replay = NULL;
+		}
+	}
+
+	// From now on, the log is replayed onto the synced files (which may be
+	// overwritten before the next checkpoint, see WalParticipant.snapshot).
+	participant->sync(participant->context);
+	wal->in_transaction = true;
+	participant->snapshot(participant->context);
+	wal_do_commit(wal);
+	pthread_mutex_unlock(&wal->transaction_lock);
+}
+
+void wal_detach(Wal *wal, uint8_t id) {
+	pthread_mutex_lock(&wal->transaction_lock);
+	xassert(1, !wal->in_transaction);
+	for (size_t i = 0; i < wal->n_attached; i++) {
+		if (wal->attached[i].id == id) {
+			wal->attached[i] = wal->attached[--wal->n_attached];
+			pthread_mutex_unlock(&wal->transaction_lock);
+			return;
+		}
+	}
+	xassert(1, false); // Not attached.
+}
+
+static void wal_do_checkpoint(Wal *wal) {
+	// Under the transaction lock.
+	xassert(1, !wal->in_transaction && wal->n_unattached == 0);
+
+	// Once the participants' files are synced, the log can start over, with
+	// their snapshots. Until then, a crash while they're being written is
+	// recovered from the old log, so it has to have every committed
+	// transaction first.
+	pthread_mutex_lock(&wal->lock);
+	wal_sync_to(wal, wal->committed_end);
+	wal->checkpointing = true;
+	pthread_mutex_unlock(&wal->lock);
+	for (size_t i = 0; i < wal->n_attached; i++) {
+		WalParticipant *participant = &wal->attached[i].participant;
+		participant->sync(participant->context);
+	}
+	pthread_mutex_lock(&wal->lock);
+	wal->checkpointing = false;
+	wal_start_log(wal, wal->generation + 1);
+	pthread_mutex_unlock(&wal->lock);
+
+	wal->in_transaction = true;
+	for (size_t i = 0; i < wal->n_attached; i++) {
+		WalParticipant *participant = &wal->attached[i].participant;
+		participant->snapshot(participant->context);
+	}
+	wal_do_commit(wal);
+	pthread_mutex_lock(&wal->lock);
+	wal_sync_to(wal, wal->committed_end);
+	wal->stats.n_checkpoints++;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_begin(Wal *wal) {
+	pthread_mutex_lock(&wal->transaction_lock);
+	xassert(1, !wal->in_transaction);
+	pthread_mutex_lock(&wal->lock);
+	bool full = wal_end(wal) >= WAL_CHECKPOINT_SIZE;
+	pthread_mutex_unlock(&wal->lock);
+	if (full && wal->n_unattached == 0)
+		wal_do_checkpoint(wal);
+	wal->in_transaction = true;
+}
+
+void wal_append(
+	Wal *wal, uint8_t id, uint8_t type, uint64_t arg,
+	const void *bytes, size_t n_bytes) {
+
+	xassert(1, wal->in_transaction && id != WAL_COMMIT_ID);
+	xassert(1, n_bytes <= UINT32_MAX);
+	WalFrame frame = {(uint32_t) n_bytes, id, type, 0, arg};
+	size_t frame_size = sizeof(frame) + wal_padded(n_bytes);
+	pthread_mutex_lock(&wal->lock);
+	char *dest = wal_buffer_push(wal, frame_size);
+	memcpy(dest, &frame, sizeof(frame));
+	if (n_bytes > 0)
+		memcpy(dest + sizeof(frame), bytes, n_bytes);
+	wal->checksum = wal_checksum(wal->checksum, dest, frame_size);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+static void wal_do_commit(Wal *wal) {
+	// Under the transaction lock (which the caller releases).
+	xassert(1, wal->in_transaction);
+	wal->in_transaction = false;
+	pthread_mutex_lock(&wal->lock);
+	if (wal_end(wal) == wal->committed_end) {
+		pthread_mutex_unlock(&wal->lock);
+		return; // Nothing was logged.
+	}
+
+	WalFrame frame = {0, WAL_COMMIT_ID, 0, 0, wal->checksum};
+	memcpy(wal_buffer_push(wal, sizeof(frame)), &frame, sizeof(frame));
+	wal->checksum = wal_checksum_seed(wal->generation);
+	wal->committed_end = wal_end(wal);
+	wal->stats.n_commits++;
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_commit(Wal *wal) {
+	wal_do_commit(wal);
+	pthread_mutex_unlock(&wal->transaction_lock);
+}
+
+static void wal_sync_to(Wal *wal, FsOffset end) {
+	// Under wal->lock. Returns once the log is durable up to `end` (or a
+	// checkpoint started a new one, which it only does once everything is
+	// synced). One thread (the leader) writes all committed frames, and syncs
+	// them without holding the lock, so that more transactions can commit in
+	// the meantime. Threads which need a part of the log that's being synced
+	// wait for the leader, and the ones it didn't cover lead the next sync,
+	// so a single fdatasync makes all transactions committed meanwhile
+	// durable.
+	uint64_t generation = wal->generation;
+	while (wal->generation == generation && wal->synced_end < end) {
+		if (wal->syncing) {
+			pthread_cond_wait(&wal->synced, &wal->lock);
+			continue;
+		}
+
+		// Write the committed frames (keeping the open transaction's ones).
+		wal->syncing = true;
+		FsOffset committed_end = wal->committed_end;
+		size_t n_committed = committed_end - wal->buffer_offset;
+		if (n_committed > 0) {
+			fs_allocate(wal->file, committed_end);
+			fs_write(wal->file, wal->buffer, wal->buffer_offset, n_committed);
+			memmove(wal->buffer, wal->buffer + n_committed,
+			        wal->buffer_size - n_committed);
+			wal->buffer_size -= n_committed;
+			wal->buffer_offset = committed_end;
+		}
+
+		pthread_mutex_unlock(&wal->lock);
+		fs_sync(wal->file);
+		pthread_mutex_lock(&wal->lock);
+		wal->synced_end = committed_end;
+		wal->syncing = false;
+		wal->stats.n_syncs++;
+		pthread_cond_broadcast(&wal->synced);
+	}
+}
+
+void wal_sync(Wal *wal) {
+	pthread_mutex_lock(&wal->lock);
+	wal_sync_to(wal, wal->committed_end);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_checkpoint(Wal *wal) {
+	pthread_mutex_lock(&wal->transaction_lock);
+	wal_do_checkpoint(wal);
+	pthread_mutex_unlock(&wal->transaction_lock);
+}
+
+void wal_write_hook(void *wal_void) {
+	Wal *wal = wal_void;
+	pthread_mutex_lock(&wal->lock);
+	if (!wal->checkpointing)
+		wal_sync_to(wal, wal->committed_end);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+WalStats wal_stats(Wal *wal) {
+	pthread_mutex_lock(&wal->lock);
+	WalStats stats = wal->stats;
+	pthread_mutex_unlock(&wal->lock);
+	return stats;
+}
+
+FsStats wal_fs_stats(Wal *wal) {
+	return fs_stats(wal->file);
+}
+
+void wal_fs_latency(Wal *wal, FsLatency *snapshot) {
+	fs_latency(wal->file, snapshot);
+}
@@ -0,0 +1,100 @@
+// Write-ahead log (redo only) shared by several files, e.g. a B-tree and its
+// record file.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "fs.h"
+
+// Settings.
+enum {
+	WAL_MAX_SYNC_DELAY_MS = 10, // Longest a commit stays only in memory
+	                            // (unless someone waits for it sooner).
+	WAL_CHECKPOINT_SIZE = 4 << 20, // Log size (in bytes) that triggers a
+	                               // checkpoint at the next transaction.
+	WAL_MAX_PARTICIPANTS = 8
+};
+
+typedef struct Wal Wal;
+
+// The users of the log (participants) log the changes they make to their
+// files, each as a record with a type, a 64-bit argument (e.g. a block
+// number) and optional bytes, all of which are up to the participant. The
+// records of a transaction are replayed after a crash only if it was
+// committed, and the log was synced after that.
+//
+// Commits are grouped: wal_commit only appends to the log's buffer, and
+// wal_sync waits until everything committed so far is durable. Threads which
+// call it at once share an fdatasync, which also covers whatever was
+// committed while the previous one ran. A background thread syncs the log
+// every WAL_MAX_SYNC_DELAY_MS, so a crash loses at most the transactions of
+// the last few milliseconds, and never a part of one -- a change is
+// acknowledged as durable only after wal_sync. To make that safe, the
+// participants' files have to call wal_sync before anything is written to
+// them (see fs_set_write_hook) -- with the buffer pool, that only happens
+// when dirty pages are written back. (Without it, or for memory-mapped
+// files, every write forces the log, so commits aren't grouped.)
+// Participants also mustn't write anything of a transaction to their files
+// before it's committed.
+//
+// A checkpoint (when the log grows past WAL_CHECKPOINT_SIZE) syncs every
+// participant's files, and starts a new log.
+//
+// Any thread may start a transaction: wal_begin waits until the previous one
+// is committed, so transactions are serialized, and their commits are grouped
+// whichever threads they came from. A checkpoint calls the participants'
+// callbacks from the thread that's starting a transaction. So a participant
+// which has a lock of its own takes it in the callbacks, and after wal_begin
+// in its operations (never the other way around).
+typedef struct {
+	// Apply a record of a committed transaction (when replaying the log).
+	void (*redo)(void *context, uint8_t type, uint64_t arg,
+	             const void *bytes, size_t n_bytes);
+	// Make the participant's files durable.
+	void (*sync)(void *context);
+	// Log whatever is needed to replay the later records, but isn't in the
+	// files or may be overwritten (e.g. a free space map, which is saved
+	// past the last block). Every log starts with that.
+	void (*snapshot)(void *context);
+	void *context;
+} WalParticipant;
+
+typedef struct {
+	uint64_t n_commits;
+	uint64_t n_syncs;
+	uint64_t n_checkpoints;
+} WalStats;
+
+// Returns NULL if the file exists, but isn't a log. `truncate` discards the
+// log (when the participants' files are created anew).
+Wal *wal_open(const char *file_name, bool truncate);
+// The participants have to be detached first.
+void wal_close(Wal *wal);
+
+// Replay the participant's committed records (`id` identifies them in the
+// log, so it has to stay the same between runs; it's below 255), then sync
+// its files and log its snapshot. Until all participants which have records
+// in the log are attached, there are no checkpoints.
+void wal_attach(Wal *wal, uint8_t id, const WalParticipant *participant);
+// The participant's files have to be synced first.
+void wal_detach(Wal *wal, uint8_t id);
+
+// Transactions don't nest. A checkpoint may happen in wal_begin, so
+// everything committed before has to be in the participants' files or
+// buffers (which their `sync` writes) by then.
+void wal_begin(Wal *wal);
+void wal_append(
+	Wal *wal, uint8_t id, uint8_t type, uint64_t arg,
+	const void *bytes, size_t n_bytes);
+void wal_commit(Wal *wal);
+
+// Make all committed transactions durable (waiting for them, see above).
+void wal_sync(Wal *wal);
+void wal_checkpoint(Wal *wal);
+
+// For fs_set_write_hook (the context is the log).
+void wal_write_hook(void *wal);
+
+WalStats wal_stats(Wal *wal);
+FsStats wal_fs_stats(Wal *wal);
+void wal_fs_latency(Wal *wal, FsLatency *snapshot);
@@ -0,0 +1,98 @@
+// For cmocka.
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include "bloom.h"
+
+enum { N_KEYS = 100000, BITS_PER_KEY = 10 };
+
+static int count_false_positives(const Bloom *bloom) {
+	// Of N_KEYS keys which were never added (odd ones).
+	int n_false_positives = 0;
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		n_false_positives += bloom_may_contain(bloom, i * 2 + 1);
+	return n_false_positives;
+}
+
+static void test_add_check() {
+	Bloom *bloom = bloom_new(N_KEYS, BITS_PER_KEY);
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		bloom_add(bloom, i * 2);
+
+	// No false negatives, and about 1% false positives.
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		assert_true(bloom_may_contain(bloom, i * 2));
+	assert_true(count_false_positives(bloom) < N_KEYS / 50);
+	assert_int_equal(bloom_n_keys(bloom), N_KEYS);
+	bloom_destroy(bloom);
+}
+
+static void test_overfilled() {
+	// With 4 times the keys it was sized for, the filter still has no false
+	// negatives, but lets through many more missing keys.
+	Bloom *bloom = bloom_new(N_KEYS / 4, BITS_PER_KEY);
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		bloom_add(bloom, i * 2);
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		assert_true(bloom_may_contain(bloom, i * 2));
+	assert_true(count_false_positives(bloom) > N_KEYS / 10);
+	assert_true(bloom_n_keys(bloom) > bloom_capacity(bloom));
+	bloom_destroy(bloom);
+}
+
+static void test_count_removed() {
+	Bloom *bloom = bloom_new(100, BITS_PER_KEY);
+	for (uint64_t key = 0; key < 10; key++)
+		bloom_add(bloom, key);
+	bloom_count_removed(bloom);
+	bloom_count_removed(bloom);
+	assert_int_equal(bloom_n_keys(bloom), 8);
+	assert_int_equal(bloom_n_stale(bloom), 2);
+
+	// The bits of removed keys stay set.
+	for (uint64_t key = 0; key < 10; key++)
+		assert_true(bloom_may_contain(bloom, key));
+	bloom_destroy(bloom);
+}
+
+static void test_save_load() {
+	FsFile *file = fs_open("test-bloom", true, FS_MODE_BUFFERED);
+	assert_null(bloom_load(file)); // Empty.
+
+	Bloom *bloom = bloom_new(N_KEYS, BITS_PER_KEY);
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		bloom_add(bloom, i * 2);
+	bloom_count_removed(bloom);
+	bloom_save(bloom, file);
+
+	Bloom *loaded = bloom_load(file);
+	assert_non_null(loaded);
+	assert_int_equal(bloom_capacity(loaded), N_KEYS);
+	assert_int_equal(bloom_n_keys(loaded), N_KEYS - 1);
+	assert_int_equal(bloom_n_stale(loaded), 1);
+	for (uint64_t i = 0; i < N_KEYS; i++)
+		assert_true(bloom_may_contain(loaded, i * 2));
+	assert_int_equal(count_false_positives(loaded),
+	                 count_false_positives(bloom));
+	bloom_destroy(loaded);
+	bloom_destroy(bloom);
+
+	// A file that's cut short isn't loaded.
+	fs_set_size(file, fs_size(file) - 8);
+	assert_null(bloom_load(file));
+	fs_close(file);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_add_check),
+		cmocka_unit_test(test_overfilled),
+		cmocka_unit_test(test_count_removed),
+		cmocka_unit_test(test_save_load),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -5,14 +5,20 @@
 #include <cmocka.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
 #include "btree.h"
+#include "utils.h"
 
 Btree *btree = NULL;
 
 static int init() {
 	srand(time(NULL));
-	btree = btree_new("test-btree.dat");
+	btree = btree_new("test-btree.dat", BTREE_DEFAULT_BLOCK_SIZE,
+	                  BTREE_LAYOUT_B);
 	return 0;
 }
 
@@ -105,10 +111,1087 @@ static void test_set_get() {
 	}
 }
 
+static void count_callback(BtreeKey key, BtreeValue value, void *context) {
+	(void) key;
+	(void) value;
+	(*(int *) context)++;
+}
+
+// The tests below run with each of these.
+static const BtreeLayout LAYOUTS[] = {
+	BTREE_LAYOUT_B, BTREE_LAYOUT_BPLUS, BTREE_LAYOUT_PACKED
+};
+
+static void check_block_sizes(BtreeLayout layout) {
+	enum { N_ITEMS = 10000 };
+	const size_t BLOCK_SIZES[] = {
+		BTREE_MIN_BLOCK_SIZE, 4096, BTREE_MAX_BLOCK_SIZE
+	};
+
+	for (size_t i_size = 0; i_size < ARRAY_LEN(BLOCK_SIZES); i_size++) {
+		Btree *sized = btree_new("test-btree-sized.dat", BLOCK_SIZES[i_size],
+		                         layout);
+
+		// Keys are unique, so that all of them can be checked afterwards.
+		for (int i_item = 0; i_item < N_ITEMS; i_item++)
+			btree_set(sized, i_item * 7919 % N_ITEMS, i_item, NULL, NULL);
+
+		for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+			BtreeValue value;
+			assert_true(btree_get(sized, i_item * 7919 % N_ITEMS, &value));
+			assert_true(value == (BtreeValue) i_item);
+		}
+
+		int n_walked = 0;
+		btree_walk(sized, count_callback, &n_walked);
+		assert_int_equal(n_walked, N_ITEMS);
+
+		btree_destroy(sized);
+	}
+}
+
+static void test_block_sizes() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_block_sizes(LAYOUTS[i_layout]);
+}
+
+static void check_set_batch(BtreeLayout layout) {
+	enum { N_KEYS = 5000, N_BATCHES = 20, BATCH_SIZE = 1000 };
+	Btree *batched = btree_new("test-btree-batch.dat", BTREE_MIN_BLOCK_SIZE,
+	                           layout);
+
+	// Compare with a plain array. Batches have repeated keys, and later ones
+	// replace most of the earlier keys.
+	static BtreeValue expected[N_KEYS];
+	static bool present[N_KEYS];
+	memset(present, 0, sizeof(present));
+	srand(1);
+	for (int i_batch = 0; i_batch < N_BATCHES; i_batch++) {
+		BtreeItem batch[BATCH_SIZE];
+		bool replaced[BATCH_SIZE];
+		BtreeValue old_values[BATCH_SIZE];
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			batch[i].key = rand() % N_KEYS;
+			batch[i].value = i_batch * BATCH_SIZE + i;
+		}
+		btree_set_batch(batched, batch, BATCH_SIZE, replaced, old_values);
+
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			BtreeKey key = batch[i].key;
+			assert_int_equal(replaced[i], present[key]);
+			if (present[key])
+				assert_true(old_values[i] == expected[key]);
+			present[key] = true;
+			expected[key] = batch[i].value;
+		}
+	}
+	btree_set_batch(batched, NULL, 0, NULL, NULL);
+
+	// Each modified node is written once per batch, so setting every key
+	// again writes as many blocks as setting each key twice (the second time
+	// in reverse order), and far fewer than there are keys.
+	static BtreeItem again[2 * N_KEYS];
+	size_t n_again = 0;
+	for (BtreeKey key = 0; key < N_KEYS; key++) {
+		if (present[key]) {
+			again[n_again++] = (BtreeItem) {key, key};
+			expected[key] = key;
+		}
+	}
+	uint64_t n_writes = btree_fs_stats(batched).n_writes;
+	btree_set_batch(batched, again, n_again, NULL, NULL);
+	uint64_t n_once = btree_fs_stats(batched).n_writes - n_writes;
+	for (size_t i = 0; i < n_again; i++)
+		again[n_again + i] = again[n_again - 1 - i];
+	n_writes = btree_fs_stats(batched).n_writes;
+	btree_set_batch(batched, again, 2 * n_again, NULL, NULL);
+	assert_true(btree_fs_stats(batched).n_writes - n_writes == n_once);
+	assert_true(n_once < n_again / 4);
+
+	int n_present = 0;
+	for (BtreeKey key = 0; key < N_KEYS; key++) {
+		BtreeValue value;
+		assert_int_equal(btree_get(batched, key, &value), present[key]);
+		if (present[key]) {
+			assert_true(value == expected[key]);
+			n_present++;
+		}
+	}
+	int n_walked = 0;
+	btree_walk(batched, count_callback, &n_walked);
+	assert_int_equal(n_walked, n_present);
+
+	btree_destroy(batched);
+}
+
+static void test_set_batch() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_set_batch(LAYOUTS[i_layout]);
+}
+
+static void check_cursor(BtreeLayout layout) {
+	enum { N_ITEMS = 3000 };
+	Btree *scanned = btree_new("test-btree-cursor.dat", BTREE_MIN_BLOCK_SIZE,
+	                           layout);
+	BtreeKey key;
+	BtreeValue value;
+
+	// An empty tree.
+	BtreeCursor *cursor = btree_cursor_seek(scanned, 0);
+	assert_false(btree_cursor_get(cursor, &key, &value));
+	assert_false(btree_cursor_next(cursor));
+	assert_false(btree_cursor_prev(cursor));
+	btree_cursor_close(cursor);
+
+	// Even keys, so that seeks to odd ones land between them.
+	for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+		BtreeKey even_key = 2 * (i_item * 7919 % N_ITEMS);
+		btree_set(scanned, even_key, even_key + 1, NULL, NULL);
+	}
+
+	for (BtreeKey seek_key = 0; seek_key < 2 * N_ITEMS - 1; seek_key += 7) {
+		cursor = btree_cursor_seek(scanned, seek_key);
+		assert_true(btree_cursor_get(cursor, &key, &value));
+		assert_int_equal(key, (seek_key + 1) / 2 * 2);
+		assert_true(value == key + 1);
+
+		// Half-open range of up to 100 keys.
+		int n_in_range = 0;
+		while (btree_cursor_get(cursor, &key, &value) &&
+		       key < seek_key + 200) {
+			assert_int_equal(key, (seek_key + 1) / 2 * 2 + 2 * n_in_range);
+			n_in_range++;
+			btree_cursor_next(cursor);
+		}
+		assert_int_equal(n_in_range,
+		                 MIN(100, N_ITEMS - (seek_key + 1) / 2));
+		btree_cursor_close(cursor);
+	}
+
+	// Forward from the start, then back from past the end.
+	cursor = btree_cursor_seek(scanned, 0);
+	assert_false(btree_cursor_prev(cursor));
+	assert_false(btree_cursor_get(cursor, &key, &value));
+	for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+		assert_true(btree_cursor_next(cursor));
+		assert_true(btree_cursor_get(cursor, &key, &value));
+		assert_int_equal(key, 2 * i_item);
+	}
+	assert_false(btree_cursor_next(cursor));
+	for (int i_item = N_ITEMS - 1; i_item >= 0; i_item--) {
+		assert_true(btree_cursor_prev(cursor));
+		assert_true(btree_cursor_get(cursor, &key, &value));
+		assert_int_equal(key, 2 * i_item);
+	}
+	assert_false(btree_cursor_prev(cursor));
+	btree_cursor_close(cursor);
+
+	cursor = btree_cursor_seek(scanned, 2 * N_ITEMS);
+	assert_false(btree_cursor_get(cursor, &key, &value));
+	assert_true(btree_cursor_prev(cursor));
+	assert_true(btree_cursor_get(cursor, &key, &value));
+	assert_int_equal(key, 2 * (N_ITEMS - 1));
+	btree_cursor_close(cursor);
+
+	btree_destroy(scanned);
+}
+
+static void test_cursor() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_cursor(LAYOUTS[i_layout]);
+}
+
+static off_t file_size(const char *file_name) {
+	struct stat file_stat;
+	assert_int_equal(stat(file_name, &file_stat), 0);
+	return file_stat.st_size;
+}
+
+static void check_delete(BtreeLayout layout) {
+	enum { N_ITEMS = 5000 };
+	const char FILE_NAME[] = "test-btree-delete.dat";
+
+	Btree *pruned = btree_new(FILE_NAME, BTREE_MIN_BLOCK_SIZE, layout);
+	for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+		BtreeKey key = i_item * 7919 % N_ITEMS;
+		btree_set(pruned, key, key + 1, NULL, NULL);
+	}
+	btree_destroy(pruned);
+	off_t full_size = file_size(FILE_NAME);
+
+	// Delete the odd keys, then the even ones, in a different order than
+	// they were inserted. All nodes are checked by btree_walk.
+	pruned = btree_open(FILE_NAME);
+	for (int i_pass = 0; i_pass < 2; i_pass++) {
+		for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+			BtreeKey key = i_item * 4999 % N_ITEMS;
+			if (key % 2 != (BtreeKey) (1 - i_pass))
+				continue;
+			BtreeValue value;
+			assert_true(btree_delete(pruned, key, &value));
+			assert_true(value == key + 1);
+			assert_false(btree_delete(pruned, key, NULL));
+			assert_false(btree_get(pruned, key, NULL));
+		}
+
+		int n_walked = 0;
+		btree_walk(pruned, count_callback, &n_walked);
+		assert_int_equal(n_walked, i_pass == 0 ? N_ITEMS / 2 : 0);
+		for (BtreeKey key = 0; key < N_ITEMS; key += 2) {
+			BtreeValue value;
+			assert_int_equal(btree_get(pruned, key, &value), i_pass == 0);
+		}
+	}
+
+	// The freed blocks are reused.
+	for (int i_item = 0; i_item < N_ITEMS; i_item++)
+		btree_set(pruned, i_item, i_item, NULL, NULL);
+	btree_destroy(pruned);
+	assert_true(file_size(FILE_NAME) <= full_size);
+}
+
+static void test_delete() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_delete(LAYOUTS[i_layout]);
+}
+
+static void check_loaded(Btree *loaded, int n_items) {
+	for (int i_item = 0; i_item < n_items; i_item++) {
+		BtreeValue value;
+		assert_true(btree_get(loaded, i_item * 3, &value));
+		assert_true(value == (BtreeValue) i_item);
+		assert_false(btree_get(loaded, i_item * 3 + 1, NULL));
+	}
+
+	int n_walked = 0;
+	btree_walk(loaded, count_callback, &n_walked);
+	assert_int_equal(n_walked, n_items);
+}
+
+static void check_bulk_load(BtreeLayout layout) {
+	const double FILL_FACTORS[] = {0.5, 0.8, 1};
+	const int N_ITEMS[] = {0, 1, 2, 12, 13, 25, 26, 27, 100, 169, 1000, 20000};
+
+	for (size_t i_fill = 0; i_fill < ARRAY_LEN(FILL_FACTORS); i_fill++) {
+		for (size_t i_n = 0; i_n < ARRAY_LEN(N_ITEMS); i_n++) {
+			int n_items = N_ITEMS[i_n];
+			BtreeLoader *loader = btree_load_begin(
+				"test-btree-loaded.dat", BTREE_MIN_BLOCK_SIZE,
+				layout, FILL_FACTORS[i_fill]);
+			for (int i_item = 0; i_item < n_items; i_item++)
+				btree_load_add(loader, i_item * 3, i_item);
+			Btree *loaded = btree_load_end(loader);
+			check_loaded(loaded, n_items);
+
+			// The tree has to stay valid after inserting more items.
+			for (int i_item = 0; i_item < n_items; i_item++)
+				btree_set(loaded, i_item * 3 + 2, i_item, NULL, NULL);
+			int n_walked = 0;
+			btree_walk(loaded, count_callback, &n_walked);
+			assert_int_equal(n_walked, n_items * 2);
+
+			btree_destroy(loaded);
+		}
+	}
+}
+
+static void test_bulk_load() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_bulk_load(LAYOUTS[i_layout]);
+}
+
+static void check_reopen(BtreeLayout layout) {
+	enum { N_ITEMS = 5000 };
+	const char FILE_NAME[] = "test-btree-reopen.dat";
+
+	Btree *reopened = btree_new(FILE_NAME, 1024, layout);
+	for (int i_item = 0; i_item < N_ITEMS; i_item++)
+		btree_set(reopened, i_item * 2, i_item, NULL, NULL);
+	btree_destroy(reopened);
+
+	// Add more items after reopening, then check all of them.
+	reopened = btree_open(FILE_NAME);
+	assert_non_null(reopened);
+	for (int i_item = 0; i_item < N_ITEMS; i_item++)
+		btree_set(reopened, i_item * 2 + 1, i_item, NULL, NULL);
+	btree_destroy(reopened);
+
+	reopened = btree_open(FILE_NAME);
+	assert_non_null(reopened);
+	for (int i_key = 0; i_key < N_ITEMS * 2; i_key++) {
+		BtreeValue value;
+		assert_true(btree_get(reopened, i_key, &value));
+		assert_true(value == (BtreeValue) i_key / 2);
+	}
+	int n_walked = 0;
+	btree_walk(reopened, count_callback, &n_walked);
+	assert_int_equal(n_walked, N_ITEMS * 2);
+	btree_destroy(reopened);
+
+	// Not a B-tree.
+	FILE *garbage = fopen(FILE_NAME, "w");
+	for (int i = 0; i < 4096; i++)
+		fputc(i, garbage);
+	fclose(garbage);
+	assert_null(btree_open(FILE_NAME));
+}
+
+static void test_reopen() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_reopen(LAYOUTS[i_layout]);
+}
+
+// Snapshots are checked against generations of changes: generation 0 has
+// keys [0, N_ITEMS), later ones set, overwrite and delete some keys.
+enum { SNAPSHOT_N_ITEMS = 3000, SNAPSHOT_MAX_KEY = SNAPSHOT_N_ITEMS * 3 / 2 };
+
+static bool snapshot_expected(int generation, BtreeKey key, BtreeValue *value) {
+	*value = key * 10 + generation;
+	switch (generation) {
+	case 0:
+		return key < SNAPSHOT_N_ITEMS;
+	case 1:
+		if (key >= SNAPSHOT_N_ITEMS)
+			return true;
+		if (key % 2 == 1)
+			*value = key * 10;
+		return key % 3 != 0;
+	default:
+		return key % 5 != 0;
+	}
+}
+
+static void snapshot_make_generation(Btree *tree, int generation) {
+	for (BtreeKey key = 0; key < SNAPSHOT_MAX_KEY; key++) {
+		BtreeValue value;
+		if (snapshot_expected(generation, key, &value))
+			btree_set(tree, key, value, NULL, NULL);
+		else
+			btree_delete(tree, key, NULL);
+	}
+}
+
+static void check_generation(
+	Btree *tree, BtreeSnapshot *snapshot, int generation) {
+
+	RetrievedItems retrieved;
+	retrieved.max_n_items = SNAPSHOT_MAX_KEY;
+	retrieved.n_items = 0;
+	retrieved.items = malloc(retrieved.max_n_items * sizeof(*retrieved.items));
+	if (snapshot != NULL)
+		btree_snapshot_walk(snapshot, retrieve_callback, &retrieved);
+	else
+		btree_walk(tree, retrieve_callback, &retrieved);
+
+	int i_retrieved = 0;
+	for (BtreeKey key = 0; key < SNAPSHOT_MAX_KEY; key++) {
+		BtreeValue expected_value, value;
+		bool expected = snapshot_expected(generation, key, &expected_value);
+		bool found = snapshot != NULL
+			? btree_snapshot_get(snapshot, key, &value)
+			: btree_get(tree, key, &value);
+		assert_int_equal(found, expected);
+		if (!expected)
+			continue;
+		assert_true(value == expected_value);
+		assert_true(i_retrieved < retrieved.n_items);
+		assert_true(retrieved.items[i_retrieved].key == key);
+		assert_true(retrieved.items[i_retrieved].value == expected_value);
+		i_retrieved++;
+	}
+	assert_int_equal(retrieved.n_items, i_retrieved);
+	free(retrieved.items);
+}
+
+static void check_snapshots(BtreeLayout layout) {
+	const char FILE_NAME[] = "test-btree-snapshots.dat";
+
+	Btree *tree = btree_new(FILE_NAME, BTREE_MIN_BLOCK_SIZE, layout);
+	for (BtreeKey key = 0; key < SNAPSHOT_N_ITEMS; key++)
+		btree_set(tree, key, key * 10, NULL, NULL);
+
+	// Each snapshot keeps seeing its generation while the tree changes.
+	BtreeSnapshot *first = btree_snapshot_open(tree);
+	snapshot_make_generation(tree, 1);
+	BtreeSnapshot *second = btree_snapshot_open(tree);
+	check_generation(tree, first, 0);
+	snapshot_make_generation(tree, 2);
+	check_generation(tree, first, 0);
+	check_generation(tree, second, 1);
+	check_generation(tree, NULL, 2);
+
+	// Closing the older snapshot frees only the blocks which no other one
+	// sees.
+	btree_snapshot_close(first);
+	for (BtreeKey key = 0; key < SNAPSHOT_MAX_KEY; key++)
+		btree_set(tree, key, key * 10 + 2, NULL, NULL);
+	check_generation(tree, second, 1);
+	btree_snapshot_close(second);
+	for (BtreeKey key = 0; key < SNAPSHOT_MAX_KEY; key += 5)
+		btree_delete(tree, key, NULL);
+	check_generation(tree, NULL, 2);
+	btree_destroy(tree);
+
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	check_generation(tree, NULL, 2);
+
+	// Rewriting the whole tree under a snapshot copies it, but the copies
+	// are reused once the snapshot is closed, so the file doesn't keep
+	// growing. (Generation 3 is generation 2 with different values.)
+	off_t base_size = 0;
+	int generation = 2;
+	for (int i_round = 0; i_round < 8; i_round++) {
+		BtreeSnapshot *snapshot = btree_snapshot_open(tree);
+		int next_generation = 5 - generation;
+		snapshot_make_generation(tree, next_generation);
+		check_generation(tree, snapshot, generation);
+		check_generation(tree, NULL, next_generation);
+		btree_snapshot_close(snapshot);
+		generation = next_generation;
+		if (i_round == 0) {
+			btree_destroy(tree);
+			base_size = file_size(FILE_NAME);
+			tree = btree_open(FILE_NAME);
+			assert_non_null(tree);
+		}
+	}
+	btree_destroy(tree);
+	assert_true(file_size(FILE_NAME) <= base_size * 3 / 2);
+}
+
+static void test_snapshots() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_snapshots(LAYOUTS[i_layout]);
+}
+
+// A snapshot walk doesn't keep writers out: a writer thread keeps switching
+// the tree between generations 1 and 0 during the walk (which waits for it
+// to get going), and the walk's callback writes too.
+enum { SNAPSHOT_WRITER_MIN_WRITES = 1000 };
+
+typedef struct {
+	Btree *tree;
+	RetrievedItems retrieved;
+	int n_writes;
+	bool walked;
+} SnapshotWritersTest;
+
+static void *snapshot_writer(void *test_void) {
+	SnapshotWritersTest *test = test_void;
+	for (int generation = 1;
+	     !__atomic_load_n(&test->walked, __ATOMIC_ACQUIRE);
+	     generation = 1 - generation) {
+		for (BtreeKey key = 0; key < SNAPSHOT_MAX_KEY; key++) {
+			BtreeValue value;
+			if (snapshot_expected(generation, key, &value))
+				btree_set(test->tree, key, value, NULL, NULL);
+			else
+				btree_delete(test->tree, key, NULL);
+			__atomic_fetch_add(&test->n_writes, 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+static void snapshot_writers_callback(
+	BtreeKey key, BtreeValue value, void *test_void) {
+
+	SnapshotWritersTest *test = test_void;
+	if (test->retrieved.n_items == 0) {
+		while (__atomic_load_n(&test->n_writes, __ATOMIC_ACQUIRE) <
+		       SNAPSHOT_WRITER_MIN_WRITES)
+			sched_yield();
+	}
+	btree_set(test->tree, SNAPSHOT_MAX_KEY + key, value, NULL, NULL);
+	retrieve_callback(key, value, &test->retrieved);
+}
+
+static void check_snapshot_writers(BtreeLayout layout) {
+	SnapshotWritersTest test = {
+		.tree = btree_new("test-btree-snapshots.dat", BTREE_MIN_BLOCK_SIZE,
+		                  layout),
+		.retrieved = {
+			.items = malloc(SNAPSHOT_MAX_KEY * sizeof(Item)),
+			.n_items = 0, .max_n_items = SNAPSHOT_MAX_KEY},
+		.n_writes = 0, .walked = false};
+	assert_non_null(test.retrieved.items);
+	snapshot_make_generation(test.tree, 0);
+	BtreeSnapshot *snapshot = btree_snapshot_open(test.tree);
+
+	pthread_t writer;
+	assert_int_equal(
+		pthread_create(&writer, NULL, snapshot_writer, &test), 0);
+	btree_snapshot_walk(snapshot, snapshot_writers_callback, &test);
+	__atomic_store_n(&test.walked, true, __ATOMIC_RELEASE);
+	assert_int_equal(pthread_join(writer, NULL), 0);
+
+	// The walk saw generation 0, whatever the writers did meanwhile.
+	assert_int_equal(test.retrieved.n_items, SNAPSHOT_N_ITEMS);
+	for (int i = 0; i < test.retrieved.n_items; i++) {
+		assert_true(test.retrieved.items[i].key == (BtreeKey) i);
+		assert_true(test.retrieved.items[i].value == (BtreeValue) i * 10);
+	}
+	check_generation(test.tree, snapshot, 0);
+	btree_snapshot_close(snapshot);
+	free(test.retrieved.items);
+	btree_destroy(test.tree);
+}
+
+static void test_snapshot_writers() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_snapshot_writers(LAYOUTS[i_layout]);
+}
+
+// Threads. Even keys stay in the tree, while writers insert and delete odd
+// ones (splitting and merging nodes all the time), and readers check that
+// they see what they should. cmocka's assertions only work in the main
+// thread, so the others count errors.
+enum { THREADS_N_KEYS = 20000, THREADS_N_WRITERS = 2, THREADS_N_READERS = 3,
+       THREADS_N_ROUNDS = 4 };
+
+typedef struct {
+	Btree *tree;
+	int i_writer;
+	int n_writers_left;
+	int n_errors;
+} ThreadsTest;
+
+static bool threads_writer_key(BtreeKey key, int i_writer) {
+	return key % 2 == 1 && (int) (key / 2 % THREADS_N_WRITERS) == i_writer;
+}
+
+static void *threads_writer(void *test_void) {
+	ThreadsTest *test = test_void;
+	int i_writer = __atomic_fetch_add(&test->i_writer, 1, __ATOMIC_RELAXED);
+	for (int i_round = 0; i_round < THREADS_N_ROUNDS; i_round++) {
+		for (BtreeKey key = 0; key < THREADS_N_KEYS; key++) {
+			if (threads_writer_key(key, i_writer))
+				btree_set(test->tree, key, key * 3, NULL, NULL);
+		}
+		for (BtreeKey key = 0; key < THREADS_N_KEYS; key++) {
+			if (threads_writer_key(key, i_writer) &&
+			    !btree_delete(test->tree, key, NULL))
+				__atomic_fetch_add(&test->n_errors, 1, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_fetch_sub(&test->n_writers_left, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *threads_reader(void *test_void) {
+	ThreadsTest *test = test_void;
+	unsigned seed = (unsigned) (uintptr_t) &seed;
+	while (__atomic_load_n(&test->n_writers_left, __ATOMIC_ACQUIRE) > 0) {
+		BtreeKey key = rand_r(&seed) % THREADS_N_KEYS;
+		BtreeValue value;
+		bool found = btree_get(test->tree, key, &value);
+		if ((key % 2 == 0 && !found) || (found && value != key * 3))
+			__atomic_fetch_add(&test->n_errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void check_threads(BtreeLayout layout) {
+	Btree *tree = btree_new("test-btree-threads.dat", BTREE_MIN_BLOCK_SIZE,
+	                        layout);
+	for (BtreeKey key = 0; key < THREADS_N_KEYS; key += 2)
+		btree_set(tree, key, key * 3, NULL, NULL);
+
+	ThreadsTest test = {tree, 0, THREADS_N_WRITERS, 0};
+	pthread_t threads[THREADS_N_WRITERS + THREADS_N_READERS];
+	for (int i = 0; i < THREADS_N_WRITERS + THREADS_N_READERS; i++) {
+		assert_int_equal(pthread_create(
+			&threads[i], NULL,
+			i < THREADS_N_WRITERS ? threads_writer : threads_reader,
+			&test), 0);
+	}
+	for (int i = 0; i < THREADS_N_WRITERS + THREADS_N_READERS; i++)
+		assert_int_equal(pthread_join(threads[i], NULL), 0);
+	assert_int_equal(test.n_errors, 0);
+
+	RetrievedItems retrieved = {
+		.items = malloc(THREADS_N_KEYS * sizeof(Item)),
+		.n_items = 0, .max_n_items = THREADS_N_KEYS};
+	assert_non_null(retrieved.items);
+	btree_walk(tree, retrieve_callback, &retrieved);
+	assert_int_equal(retrieved.n_items, THREADS_N_KEYS / 2);
+	for (int i = 0; i < retrieved.n_items; i++) {
+		assert_true(retrieved.items[i].key == (BtreeKey) i * 2);
+		assert_true(retrieved.items[i].value == (BtreeValue) i * 6);
+	}
+	free(retrieved.items);
+	btree_destroy(tree);
+}
+
+static void test_threads() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_threads(LAYOUTS[i_layout]);
+}
+
+typedef struct {
+	int n_items;
+	uint64_t sum_of_keys;
+	uint64_t sum_of_values;
+} WalkSums;
+
+static void walk_sums_callback(BtreeKey key, BtreeValue value, void *context) {
+	WalkSums *sums = context;
+	sums->n_items++;
+	sums->sum_of_keys += key;
+	sums->sum_of_values += value;
+}
+
+static void check_walk_parallel(BtreeLayout layout, int n_items) {
+	enum { N_THREADS = 4 };
+	Btree *tree = btree_new("test-btree-parallel.dat", BTREE_MIN_BLOCK_SIZE,
+	                        layout);
+	for (int i = 0; i < n_items; i++) {
+		int i_item = i * 7919 % n_items;
+		btree_set(tree, i_item * 7, i_item, NULL, NULL);
+	}
+
+	// Every thread sums up what it sees.
+	WalkSums sums[N_THREADS] = {{0}};
+	void *contexts[N_THREADS];
+	for (int i = 0; i < N_THREADS; i++)
+		contexts[i] = &sums[i];
+	btree_walk_parallel(tree, N_THREADS, walk_sums_callback, contexts);
+	WalkSums total = {0};
+	for (int i = 0; i < N_THREADS; i++) {
+		total.n_items += sums[i].n_items;
+		total.sum_of_keys += sums[i].sum_of_keys;
+		total.sum_of_values += sums[i].sum_of_values;
+	}
+	uint64_t sum_of_idxs = (uint64_t) n_items * (n_items - 1) / 2;
+	assert_int_equal(total.n_items, n_items);
+	assert_true(total.sum_of_keys == sum_of_idxs * 7);
+	assert_true(total.sum_of_values == sum_of_idxs);
+
+	RetrievedItems retrieved = {
+		.items = malloc((n_items + 1) * sizeof(Item)),
+		.n_items = 0, .max_n_items = n_items};
+	assert_non_null(retrieved.items);
+	btree_walk_parallel_ordered(tree, N_THREADS - 1, retrieve_callback,
+	                            &retrieved);
+	assert_int_equal(retrieved.n_items, n_items);
+	for (int i = 0; i < n_items; i++) {
+		assert_true(retrieved.items[i].key == (BtreeKey) i * 7);
+		assert_true(retrieved.items[i].value == (BtreeValue) i);
+	}
+	free(retrieved.items);
+	btree_destroy(tree);
+}
+
+static void test_walk_parallel() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++) {
+		check_walk_parallel(LAYOUTS[i_layout], 0);
+		check_walk_parallel(LAYOUTS[i_layout], 10);
+		check_walk_parallel(LAYOUTS[i_layout], 30000);
+	}
+}
+
+static void check_cached_levels(BtreeLayout layout) {
+	enum { N_ITEMS = 20000, N_GETS = 1000, N_KEPT = 6 };
+	const char FILE_NAME[] = "test-btree-top.dat";
+	Btree *tree = btree_new(FILE_NAME, BTREE_DEFAULT_BLOCK_SIZE, layout);
+	for (BtreeKey i = 0; i < N_ITEMS; i++) {
+		BtreeKey key = i * 7919 % N_ITEMS;
+		btree_set(tree, key, key * 3, NULL, NULL);
+	}
+	btree_destroy(tree);
+
+	// Copied by the first operation after opening the tree.
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	assert_int_equal(btree_cached_levels(tree), 0);
+	BtreeValue value;
+	assert_true(btree_get(tree, 0, &value));
+
+	// All internal nodes fit (with the default budget), so lookups only read
+	// leaves.
+	FsStats old_stats = btree_fs_stats(tree);
+	for (BtreeKey i = 0; i < N_GETS; i++) {
+		BtreeKey key = i * 13 % N_ITEMS;
+		assert_true(btree_get(tree, key, &value));
+		assert_true(value == (BtreeValue) key * 3);
+	}
+	uint64_t n_reads = btree_fs_stats(tree).n_reads - old_stats.n_reads;
+	if (BTREE_TOP_CACHE_SIZE >= 1 << 20) {
+		assert_true(btree_cached_levels(tree) >= 1);
+		assert_true(n_reads <= N_GETS);
+	}
+
+	// The copies follow splits, merges and new roots.
+	for (BtreeKey key = N_ITEMS; key < 2 * N_ITEMS; key++)
+		btree_set(tree, key, key * 3, NULL, NULL);
+	for (BtreeKey key = 0; key < 2 * N_ITEMS; key += 3)
+		assert_true(btree_delete(tree, key, NULL));
+	for (BtreeKey key = 0; key < 2 * N_ITEMS; key++) {
+		assert_int_equal(btree_get(tree, key, &value), key % 3 != 0);
+		if (key % 3 != 0)
+			assert_true(value == (BtreeValue) key * 3);
+	}
+	// Few enough keys for the root to be a leaf.
+	for (BtreeKey key = 0; key < 2 * N_ITEMS - N_KEPT; key++)
+		btree_delete(tree, key, NULL);
+	assert_int_equal(btree_cached_levels(tree), 0);
+	for (BtreeKey key = 2 * N_ITEMS - N_KEPT; key < 2 * N_ITEMS; key++) {
+		assert_int_equal(btree_get(tree, key, &value), key % 3 != 0);
+		if (key % 3 != 0)
+			assert_true(value == (BtreeValue) key * 3);
+	}
+	btree_destroy(tree);
+}
+
+static void test_cached_levels() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_cached_levels(LAYOUTS[i_layout]);
+}
+
+// A reader checks the keys that stay (multiples of 4) during compaction.
+typedef struct {
+	Btree *tree;
+	bool done;
+	int n_errors;
+} CompactReader;
+
+static void *compact_reader(void *reader_void) {
+	CompactReader *reader = reader_void;
+	unsigned seed = (unsigned) (uintptr_t) &seed;
+	while (!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE)) {
+		BtreeKey key = rand_r(&seed) % 5000 * 4;
+		BtreeValue value;
+		if (!btree_get(reader->tree, key, &value) || value != key)
+			__atomic_fetch_add(&reader->n_errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void check_compact(BtreeLayout layout) {
+	enum { N_ITEMS = 20000, STEP_SIZE = 16 };
+	const char FILE_NAME[] = "test-btree-compact.dat";
+
+	// Nodes scattered by inserts in random order, in a file that's mostly
+	// free after the deletes.
+	Btree *tree = btree_new(FILE_NAME, BTREE_MIN_BLOCK_SIZE, layout);
+	for (BtreeKey i = 0; i < N_ITEMS; i++) {
+		BtreeKey key = i * 7919 % N_ITEMS;
+		btree_set(tree, key, key, NULL, NULL);
+	}
+	for (BtreeKey key = 0; key < N_ITEMS; key++) {
+		if (key % 4 != 0)
+			assert_true(btree_delete(tree, key, NULL));
+	}
+	btree_destroy(tree);
+	off_t full_size = file_size(FILE_NAME);
+
+	// Compact in steps, adding an item between them, while a reader looks
+	// up the others.
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	CompactReader reader = {tree, false, 0};
+	pthread_t thread;
+	assert_int_equal(
+		pthread_create(&thread, NULL, compact_reader, &reader), 0);
+	BtreeKey n_added = 0;
+	while (!btree_compact(tree, STEP_SIZE)) {
+		if (n_added == 1) {
+			// Nothing is moved while a snapshot is open.
+			BtreeSnapshot *snapshot = btree_snapshot_open(tree);
+			assert_false(btree_compact(tree, SIZE_MAX));
+			BtreeValue value;
+			assert_true(btree_snapshot_get(snapshot, 4, &value));
+			assert_true(value == 4);
+			btree_snapshot_close(snapshot);
+		}
+		btree_set(tree, N_ITEMS + n_added, N_ITEMS + n_added, NULL, NULL);
+		n_added++;
+	}
+	__atomic_store_n(&reader.done, true, __ATOMIC_RELEASE);
+	assert_int_equal(pthread_join(thread, NULL), 0);
+	assert_int_equal(reader.n_errors, 0);
+	assert_true(n_added > 1);
+
+	// Then all at once. After that, every node is in place, so compacting
+	// again moves nothing.
+	assert_true(btree_compact(tree, SIZE_MAX));
+	off_t compact_size = file_size(FILE_NAME);
+	assert_true(btree_compact(tree, SIZE_MAX));
+	assert_true(file_size(FILE_NAME) == compact_size);
+	btree_destroy(tree);
+	// Packed leaves hold twice the items before the deletes, but the same
+	// minimum after them, so their file shrinks less.
+	assert_true(file_size(FILE_NAME) < (layout == BTREE_LAYOUT_PACKED
+	                                    ? full_size * 3 / 4 : full_size / 2));
+
+	// The leaves are still linked both ways.
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	int n_items = N_ITEMS / 4 + n_added;
+	BtreeCursor *cursor = btree_cursor_seek(tree, 0);
+	for (int i = 0; i < n_items; i++) {
+		BtreeKey key;
+		BtreeValue value;
+		assert_true(btree_cursor_get(cursor, &key, &value));
+		assert_true(key == (i < N_ITEMS / 4 ? (BtreeKey) i * 4
+		                    : (BtreeKey) (N_ITEMS + i - N_ITEMS / 4)));
+		assert_true(value == key);
+		assert_int_equal(btree_cursor_next(cursor), i < n_items - 1);
+	}
+	for (int i = 0; i < n_items; i++)
+		assert_true(btree_cursor_prev(cursor));
+	BtreeKey key;
+	BtreeValue value;
+	assert_true(btree_cursor_get(cursor, &key, &value) && key == 0);
+	assert_false(btree_cursor_prev(cursor));
+	btree_cursor_close(cursor);
+	btree_destroy(tree);
+}
+
+static void test_compact() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_compact(LAYOUTS[i_layout]);
+}
+
+static off_t check_packed(BtreeLayout layout, BtreeValue multiplier) {
+	// Keys with gaps, and values which take about 16 bits if the multiplier
+	// is small, or too many to pack if it's large (so the leaves are kept
+	// plain). Returns the file's size.
+	enum { N_ITEMS = 50000 };
+	const char FILE_NAME[] = "test-btree-packed.dat";
+	Btree *tree = btree_new(FILE_NAME, 4096, layout);
+	for (BtreeKey i_item = 0; i_item < N_ITEMS; i_item++) {
+		BtreeKey i = i_item * 7919 % N_ITEMS;
+		btree_set(tree, i * 3, i * multiplier, NULL, NULL);
+	}
+	for (BtreeKey i = 0; i < N_ITEMS; i += 5) {
+		btree_set(tree, i * 3, i * multiplier + 1, NULL, NULL);
+		assert_true(btree_delete(tree, i * 3 + 3, NULL));
+	}
+	btree_destroy(tree);
+
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	for (BtreeKey i = 0; i < N_ITEMS; i++) {
+		BtreeValue value;
+		bool found = btree_get(tree, i * 3, &value);
+		assert_int_equal(found, i % 5 != 1);
+		if (found)
+			assert_true(value == i * multiplier + (i % 5 == 0));
+		assert_false(btree_get(tree, i * 3 + 1, NULL));
+	}
+	btree_destroy(tree);
+	return file_size(FILE_NAME);
+}
+
+static void test_packed_leaves() {
+	assert_true(check_packed(BTREE_LAYOUT_PACKED, 1) <
+	            check_packed(BTREE_LAYOUT_BPLUS, 1) * 3 / 4);
+	check_packed(BTREE_LAYOUT_PACKED, UINT64_C(0x9E3779B97F4A7C15));
+}
+
+static void wait_for_bloom_rebuild(Btree *tree, uint64_t n_rebuilds) {
+	// Until the background thread has built more than n_rebuilds filters.
+	while (btree_bloom_stats(tree).n_rebuilds <= n_rebuilds)
+		sched_yield();
+}
+
+static uint64_t count_ruled_out(
+	Btree *tree, BtreeKey start, BtreeKey stride, int n_keys) {
+
+	// Look up n_keys keys from start, stride apart (none of which may be in
+	// the tree), and return how many of them the filter answered.
+	uint64_t n_negatives = btree_bloom_stats(tree).n_negatives;
+	for (int i = 0; i < n_keys; i++)
+		assert_false(btree_get(tree, start + i * stride, NULL));
+	return btree_bloom_stats(tree).n_negatives - n_negatives;
+}
+
+static void check_bloom(BtreeLayout layout) {
+	enum { N_ITEMS = 40000 };
+	const char FILE_NAME[] = "test-btree-bloom.dat";
+	char bloom_file_name[64];
+	snprintf(bloom_file_name, sizeof(bloom_file_name), "%s.bloom", FILE_NAME);
+
+	// Even keys. Lookups of odd ones are mostly answered by the filter (which
+	// grows with the tree), and the rest are counted as false positives.
+	Btree *tree = btree_new(FILE_NAME, BTREE_MIN_BLOCK_SIZE, layout);
+	for (BtreeKey i = 0; i < N_ITEMS; i++)
+		btree_set(tree, i * 7919 % N_ITEMS * 2, i, NULL, NULL);
+	wait_for_bloom_rebuild(tree, 0);
+	for (BtreeKey i = 0; i < N_ITEMS; i++)
+		assert_true(btree_get(tree, i * 2, NULL));
+	BtreeBloomStats before = btree_bloom_stats(tree);
+	uint64_t n_ruled_out = count_ruled_out(tree, 1, 2, N_ITEMS);
+	assert_true(n_ruled_out > N_ITEMS * 9 / 10);
+	assert_int_equal(btree_bloom_stats(tree).n_false_positives -
+	                 before.n_false_positives, N_ITEMS - n_ruled_out);
+
+	// Deleted keys stay in the filter until it's rebuilt.
+	uint64_t n_rebuilds = btree_bloom_stats(tree).n_rebuilds;
+	for (BtreeKey i = 0; i < N_ITEMS; i++) {
+		if (i % 4 != 0)
+			assert_true(btree_delete(tree, i * 2, NULL));
+	}
+	wait_for_bloom_rebuild(tree, n_rebuilds);
+	assert_true(count_ruled_out(tree, 2, 8, N_ITEMS / 4) > N_ITEMS / 8);
+	for (BtreeKey i = 0; i < N_ITEMS; i += 4)
+		assert_true(btree_get(tree, i * 2, NULL));
+	btree_destroy(tree);
+
+	// Reopened, the tree loads the filter (and empties the file until it's
+	// closed). Without it, the filter is rebuilt.
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	assert_int_equal(file_size(bloom_file_name), 0);
+	assert_true(count_ruled_out(tree, 1, 2, N_ITEMS) > N_ITEMS * 9 / 10);
+	assert_int_equal(btree_bloom_stats(tree).n_rebuilds, 0);
+	btree_destroy(tree);
+	assert_true(file_size(bloom_file_name) > 0);
+
+	remove(bloom_file_name);
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	assert_int_equal(count_ruled_out(tree, 1, 2, 1), 0);
+	wait_for_bloom_rebuild(tree, 0);
+	assert_true(count_ruled_out(tree, 1, 2, N_ITEMS) > N_ITEMS * 9 / 10);
+	for (BtreeKey i = 0; i < N_ITEMS; i += 4)
+		assert_true(btree_get(tree, i * 2, NULL));
+	btree_destroy(tree);
+
+	// After a bulk load too.
+	BtreeLoader *loader = btree_load_begin(
+		FILE_NAME, BTREE_MIN_BLOCK_SIZE, layout, 1);
+	for (BtreeKey i = 0; i < N_ITEMS; i++)
+		btree_load_add(loader, i * 2, i);
+	tree = btree_load_end(loader);
+	wait_for_bloom_rebuild(tree, 0);
+	assert_true(count_ruled_out(tree, 1, 2, N_ITEMS) > N_ITEMS * 9 / 10);
+	btree_destroy(tree);
+}
+
+static void test_bloom() {
+	for (size_t i_layout = 0; i_layout < ARRAY_LEN(LAYOUTS); i_layout++)
+		check_bloom(LAYOUTS[i_layout]);
+}
+
+typedef struct {
+	char last_key[BTREE_MAX_BLOCK_SIZE / 4];
+	size_t last_key_size;
+	int n_keys;
+} BytesWalk;
+
+static void bytes_walk_callback(
+	const void *key, size_t key_size, BtreeValue value, void *context) {
+
+	(void) value;
+	BytesWalk *walk = context;
+	assert_true(key_size <= sizeof(walk->last_key));
+	if (walk->n_keys > 0) {
+		int cmp = memcmp(walk->last_key, key,
+		                 MIN(walk->last_key_size, key_size));
+		assert_true(cmp < 0 ||
+		            (cmp == 0 && walk->last_key_size < key_size));
+	}
+	memcpy(walk->last_key, key, key_size);
+	walk->last_key_size = key_size;
+	walk->n_keys++;
+}
+
+static size_t format_bytes_key(char *key, int i) {
+	// Long keys with common prefixes, like paths.
+	return sprintf(key, "tenant-%02d/objects/2016/%06d", i % 7, i);
+}
+
+static void check_bytes_keys(size_t block_size) {
+	enum { N_ITEMS = 5000, N_EXTRA_ITEMS = 4 };
+	const char FILE_NAME[] = "test-btree-bytes.dat";
+	char key[64];
+
+	Btree *tree = btree_new(FILE_NAME, block_size, BTREE_LAYOUT_BYTES);
+	for (int i_item = 0; i_item < N_ITEMS; i_item++) {
+		int i = i_item * 7919 % N_ITEMS;
+		bool replaced;
+		BtreeValue old_value;
+		btree_set_bytes(tree, key, format_bytes_key(key, i), i,
+		                &replaced, &old_value);
+		assert_false(replaced);
+	}
+
+	// The empty key, zero bytes, a prefix of other keys, the longest key.
+	size_t max_key_size = btree_max_key_size(tree);
+	char *long_key = malloc(max_key_size);
+	assert_non_null(long_key);
+	memset(long_key, 0xFF, max_key_size);
+	btree_set_bytes(tree, "", 0, N_ITEMS, NULL, NULL);
+	btree_set_bytes(tree, "\0", 1, N_ITEMS + 1, NULL, NULL);
+	btree_set_bytes(tree, "tenant-03", 9, N_ITEMS + 2, NULL, NULL);
+	btree_set_bytes(tree, long_key, max_key_size, N_ITEMS + 3, NULL, NULL);
+
+	for (int i = 0; i < N_ITEMS; i += 3) {
+		bool replaced;
+		BtreeValue old_value;
+		btree_set_bytes(tree, key, format_bytes_key(key, i), i + N_ITEMS,
+		                &replaced, &old_value);
+		assert_true(replaced);
+		assert_true(old_value == (BtreeValue) i);
+	}
+	btree_destroy(tree);
+
+	tree = btree_open(FILE_NAME);
+	assert_non_null(tree);
+	for (int i = 0; i < N_ITEMS; i++) {
+		BtreeValue value;
+		assert_true(btree_get_bytes(tree, key, format_bytes_key(key, i),
+		                            &value));
+		assert_true(value == (BtreeValue) (i % 3 == 0 ? i + N_ITEMS : i));
+	}
+	BtreeValue value;
+	assert_true(btree_get_bytes(tree, "", 0, &value));
+	assert_true(value == N_ITEMS);
+	assert_true(btree_get_bytes(tree, "\0", 1, &value));
+	assert_true(value == N_ITEMS + 1);
+	assert_true(btree_get_bytes(tree, "tenant-03", 9, &value));
+	assert_true(value == N_ITEMS + 2);
+	assert_true(btree_get_bytes(tree, long_key, max_key_size, &value));
+	assert_true(value == N_ITEMS + 3);
+	assert_false(btree_get_bytes(tree, "\0\0", 2, NULL));
+	assert_false(btree_get_bytes(tree, "tenant-03/", 10, NULL));
+	assert_false(btree_get_bytes(tree, "tenant-99", 9, NULL));
+	assert_false(btree_get_bytes(tree, long_key, max_key_size - 1, NULL));
+
+	BytesWalk walk = {.n_keys = 0};
+	btree_walk_bytes(tree, bytes_walk_callback, &walk);
+	assert_int_equal(walk.n_keys, N_ITEMS + N_EXTRA_ITEMS);
+	btree_destroy(tree);
+	free(long_key);
+}
+
+static void test_bytes_keys() {
+	check_bytes_keys(BTREE_MIN_BLOCK_SIZE);
+	check_bytes_keys(4096);
+}
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_set_walk),
 		cmocka_unit_test(test_set_get),
+		cmocka_unit_test(test_block_sizes),
+		cmocka_unit_test(test_set_batch),
+		cmocka_unit_test(test_cursor),
+		cmocka_unit_test(test_delete),
+		cmocka_unit_test(test_bulk_load),
+		cmocka_unit_test(test_reopen),
+		cmocka_unit_test(test_snapshots),
+		cmocka_unit_test(test_snapshot_writers),
+		cmocka_unit_test(test_threads),
+		cmocka_unit_test(test_walk_parallel),
+		cmocka_unit_test(test_cached_levels),
+		cmocka_unit_test(test_compact),
+		cmocka_unit_test(test_packed_leaves),
+		cmocka_unit_test(test_bloom),
+		cmocka_unit_test(test_bytes_keys),
 	};
 
 	return cmocka_run_group_tests(tests, init, shutdown);
@@ -0,0 +1,216 @@
+// For cmocka.
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "compact.h"
+#include "wal.h"
+
+const char BTREE_FILE_NAME[] = "test-compact-btree.dat";
+const char RECF_FILE_NAME[] = "test-compact-recf.dat";
+const char WAL_FILE_NAME[] = "test-compact-wal.dat";
+enum { WAL_ID_BTREE, WAL_ID_RECF };
+
+typedef struct {
+	Btree *btree;
+	Recf *recf;
+	Wal *wal;
+} Files;
+
+static Files files_open(bool create) {
+	Files files;
+	files.wal = wal_open(WAL_FILE_NAME, create);
+	assert_non_null(files.wal);
+	files.btree = create ? btree_new(BTREE_FILE_NAME, BTREE_MIN_BLOCK_SIZE,
+	                                 BTREE_LAYOUT_BPLUS)
+		: btree_open(BTREE_FILE_NAME);
+	files.recf = create ? recf_new(RECF_FILE_NAME, RECF_DEFAULT_BLOCK_SIZE)
+		: recf_open(RECF_FILE_NAME);
+	assert_non_null(files.btree);
+	assert_non_null(files.recf);
+	btree_attach_wal(files.btree, files.wal, WAL_ID_BTREE);
+	recf_attach_wal(files.recf, files.wal, WAL_ID_RECF);
+	return files;
+}
+
+static void files_close(Files files) {
+	recf_destroy(files.recf);
+	btree_destroy(files.btree);
+	wal_close(files.wal);
+}
+
+// Like the commands in main.c.
+static void files_set(Files files, BtreeKey key, RecfRecord record) {
+	RecfRecordIdx idx = recf_add(files.recf, record);
+	bool replaced = false;
+	RecfRecordIdx old_idx;
+	btree_set(files.btree, key, idx, &replaced, &old_idx);
+	if (replaced)
+		recf_delete(files.recf, old_idx);
+}
+
+static off_t file_size(const char *file_name) {
+	struct stat file_stat;
+	assert_int_equal(stat(file_name, &file_stat), 0);
+	return file_stat.st_size;
+}
+
+// Keys set in random order, every one twice (so that the records are out of
+// order), and then three in four deleted.
+enum { N_KEYS = 20000 };
+
+static RecfRecord key_record(BtreeKey key) {
+	return (RecfRecord) key * 3 + 1;
+}
+
+static void fill(Files files) {
+	for (int i_pass = 0; i_pass < 2; i_pass++) {
+		for (BtreeKey i = 0; i < N_KEYS; i++) {
+			BtreeKey key = i * 7919 % N_KEYS;
+			files_set(files, key, i_pass == 0 ? 0 : key_record(key));
+		}
+	}
+	for (BtreeKey key = 0; key < N_KEYS; key++) {
+		RecfRecordIdx idx;
+		if (key % 4 != 0) {
+			assert_true(btree_delete(files.btree, key, &idx));
+			recf_delete(files.recf, idx);
+		}
+	}
+}
+
+static void check_items(Files files, BtreeKey n_added) {
+	// The kept keys, then the added ones (past N_KEYS). If the records are
+	// compacted, they're in key order.
+	BtreeKey n_items = N_KEYS / 4 + n_added;
+	BtreeCursor *cursor = btree_cursor_seek(files.btree, 0);
+	for (BtreeKey i = 0; i < n_items; i++) {
+		BtreeKey key;
+		BtreeValue idx;
+		assert_true(btree_cursor_get(cursor, &key, &idx));
+		assert_true(key == (i < N_KEYS / 4 ? i * 4 : N_KEYS + i - N_KEYS / 4));
+		assert_true(idx == i);
+		assert_true(recf_get(files.recf, idx) == key_record(key));
+		btree_cursor_next(cursor);
+	}
+	BtreeKey key;
+	BtreeValue idx;
+	assert_false(btree_cursor_get(cursor, &key, &idx));
+	btree_cursor_close(cursor);
+}
+
+static void test_compact() {
+	Files files = files_open(true);
+	fill(files);
+	files_close(files);
+	off_t btree_size = file_size(BTREE_FILE_NAME);
+	off_t recf_size = file_size(RECF_FILE_NAME);
+
+	// Add keys between the first steps, then set kept ones again. (Keys added
+	// at the end all the time would keep the passes from finishing.)
+	enum { N_ADDED = 100 };
+	files = files_open(false);
+	Compaction *compaction = compaction_begin(files.btree, files.recf);
+	BtreeKey n_steps = 0;
+	while (!compaction_step(compaction, 64)) {
+		BtreeKey key = n_steps < N_ADDED ? N_KEYS + n_steps
+			: n_steps * 4 % N_KEYS;
+		files_set(files, key, key_record(key));
+		n_steps++;
+	}
+	compaction_end(compaction);
+	assert_true(n_steps > N_ADDED);
+
+	// Then again at once, which puts the added keys' records in place.
+	compaction = compaction_begin(files.btree, files.recf);
+	while (!compaction_step(compaction, COMPACTION_STEP_SIZE))
+		;
+	compaction_end(compaction);
+	check_items(files, N_ADDED);
+	files_close(files);
+	assert_true(file_size(BTREE_FILE_NAME) < btree_size / 2);
+	assert_true(file_size(RECF_FILE_NAME) < recf_size / 2);
+
+	files = files_open(false);
+	check_items(files, N_ADDED);
+	files_close(files);
+}
+
+// A thread sets the kept keys again (deleting and adding some of them) while
+// the steps run.
+typedef struct {
+	Files files;
+	bool stop;
+} ConcurrentTest;
+
+static void *concurrent_setter(void *test_void) {
+	ConcurrentTest *test = test_void;
+	for (BtreeKey i = 0; !__atomic_load_n(&test->stop, __ATOMIC_RELAXED); i++) {
+		BtreeKey key = i * 4 % N_KEYS;
+		RecfRecordIdx idx;
+		if (i % 3 == 0 && btree_delete(test->files.btree, key, &idx))
+			recf_delete(test->files.recf, idx);
+		files_set(test->files, key, key_record(key));
+	}
+	return NULL;
+}
+
+static void test_concurrent() {
+	ConcurrentTest test = {files_open(true), false};
+	fill(test.files);
+	pthread_t thread;
+	assert_int_equal(
+		pthread_create(&thread, NULL, concurrent_setter, &test), 0);
+	Compaction *compaction = compaction_begin(test.files.btree, test.files.recf);
+	while (!compaction_step(compaction, 64))
+		;
+	compaction_end(compaction);
+	__atomic_store_n(&test.stop, true, __ATOMIC_RELAXED);
+	assert_int_equal(pthread_join(thread, NULL), 0);
+
+	// Nothing lost or leaked: once compacted again, the records are in key
+	// order.
+	compaction = compaction_begin(test.files.btree, test.files.recf);
+	while (!compaction_step(compaction, COMPACTION_STEP_SIZE))
+		;
+	compaction_end(compaction);
+	check_items(test.files, 0);
+	files_close(test.files);
+}
+
+static void test_recovery() {
+	// Crash right after compacting (which makes everything durable before
+	// shrinking the files), in a child process.
+	pid_t pid = fork();
+	assert_true(pid != -1);
+	if (pid == 0) {
+		Files files = files_open(true);
+		fill(files);
+		Compaction *compaction = compaction_begin(files.btree, files.recf);
+		while (!compaction_step(compaction, COMPACTION_STEP_SIZE))
+			;
+		_exit(0);
+	}
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	Files files = files_open(false);
+	check_items(files, 0);
+	files_close(files);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_compact),
+		cmocka_unit_test(test_concurrent),
+		cmocka_unit_test(test_recovery),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -12,10 +12,16 @@
 FsFile *file = NULL;
 
 static int init() {
-	file = fs_open("test-file", true);
+	file = fs_open("test-file", true, FS_MODE_BUFFERED);
 	return 0;
 }
 
+static void read_uncached(FsFile *file, void *dest, FsOffset offset,
+                          size_t n_bytes) {
+	ssize_t pread_result = pread(file->fd, dest, n_bytes, offset);
+	assert_int_equal(pread_result, n_bytes);
+}
+
 static int shutdown() {
 	fs_close(file);
 	return 0;
@@ -24,6 +30,9 @@ static int shutdown() {
 static void test_initial_stats() {
 	assert_int_equal(file->stats.n_reads, 0);
 	assert_int_equal(file->stats.n_writes, 0);
+	assert_int_equal(file->stats.n_hits, 0);
+	assert_int_equal(file->stats.n_misses, 0);
+	assert_int_equal(file->stats.n_evictions, 0);
 }
 
 static const int FILE_SIZE = 2500;
@@ -47,6 +56,235 @@ static void test_read_write() {
 static void test_final_stats() {
 	assert_int_equal(file->stats.n_reads, 2);
 	assert_int_equal(file->stats.n_writes, 1);
+	assert_int_equal(file->stats.n_read_bytes, FILE_SIZE);
+	assert_int_equal(file->stats.n_written_bytes, FILE_SIZE);
+
+	assert_int_equal(file->latency.read.n, 2);
+	assert_int_equal(file->latency.write.n, 1);
+	assert_int_equal(file->latency.set_size.n, 1);
+
+	fs_reset_stats(file);
+	assert_int_equal(file->stats.n_reads, 0);
+	assert_int_equal(file->stats.n_read_bytes, 0);
+	assert_int_equal(file->latency.read.n, 0);
+}
+
+static void test_histogram() {
+	// Every bucket covers a range of values that starts right after the
+	// previous one's.
+	for (size_t i = 1; i < FS_HISTOGRAM_N_BUCKETS &&
+	     fs_histogram_bucket_max(i - 1) < UINT64_MAX; i++) {
+		uint64_t min = fs_histogram_bucket_max(i - 1) + 1;
+		assert_int_equal(fs_histogram_bucket(min), i);
+		assert_int_equal(fs_histogram_bucket(fs_histogram_bucket_max(i)), i);
+	}
+	size_t last_bucket = fs_histogram_bucket(UINT64_MAX);
+	assert_true(last_bucket < FS_HISTOGRAM_N_BUCKETS);
+	assert_true(fs_histogram_bucket_max(last_bucket) == UINT64_MAX);
+
+	static FsHistogram histogram, snapshot;
+	for (uint64_t value = 1; value <= 1000; value++)
+		fs_histogram_record(&histogram, value);
+	assert_int_equal(fs_histogram_percentile(&histogram, 0), 1);
+	assert_int_equal(fs_histogram_percentile(&histogram, 100), 1000);
+
+	// Within the precision of the buckets.
+	uint64_t p50 = fs_histogram_percentile(&histogram, 50);
+	assert_true(p50 >= 500 && p50 <= 500 + 500 / FS_HISTOGRAM_SUB_BUCKETS);
+	uint64_t p99 = fs_histogram_percentile(&histogram, 99);
+	assert_true(p99 >= 990 && p99 <= 1000);
+
+	snapshot = histogram;
+	for (int i = 0; i < 10; i++)
+		fs_histogram_record(&histogram, 5);
+	fs_histogram_subtract(&histogram, &snapshot);
+	assert_int_equal(histogram.n, 10);
+	assert_int_equal(fs_histogram_percentile(&histogram, 99.9), 5);
+}
+
+static void test_cache() {
+	enum { PAGE_SIZE = 64, N_PAGES = 4, N_CACHED_PAGES = 2 };
+
+	FsFile *cached = fs_open("test-file-cached", true, FS_MODE_BUFFERED);
+	fs_set_cache(cached, PAGE_SIZE, N_CACHED_PAGES * PAGE_SIZE);
+	fs_set_size(cached, N_PAGES * PAGE_SIZE);
+
+	// Writing whole pages doesn't read them, so these are all misses. Writing
+	// more pages than fit in the cache evicts the first ones (and writes them
+	// back).
+	char data_write[N_PAGES * PAGE_SIZE];
+	for (size_t i_byte = 0; i_byte < ARRAY_LEN(data_write); i_byte++)
+		data_write[i_byte] = (char) rand();
+	fs_write(cached, data_write, 0, sizeof(data_write));
+	assert_int_equal(cached->stats.n_misses, N_PAGES);
+	assert_int_equal(cached->stats.n_evictions, N_PAGES - N_CACHED_PAGES);
+
+	char data_read[N_PAGES * PAGE_SIZE];
+	read_uncached(cached, data_read, 0, PAGE_SIZE);
+	assert_memory_equal(data_write, data_read, PAGE_SIZE);
+
+	// The last page is still cached.
+	fs_read(cached, data_read, (N_PAGES - 1) * PAGE_SIZE + 1, 10);
+	assert_memory_equal(&data_write[(N_PAGES - 1) * PAGE_SIZE + 1],
+	                    data_read, 10);
+	assert_int_equal(cached->stats.n_hits, 1);
+
+	// Pinned pages are modified in place and written back on flush.
+	FsOffset last_page = (N_PAGES - 1) * PAGE_SIZE;
+	char *pinned = fs_pin(cached, last_page, PAGE_SIZE, true);
+	pinned[0] = ~data_write[last_page];
+	fs_unpin(cached, last_page, true);
+	fs_flush(cached);
+	read_uncached(cached, data_read, last_page, 1);
+	assert_int_equal(data_read[0], (char) ~data_write[last_page]);
+
+	// Shrinking and growing the file zeroes the cut off part of a page.
+	fs_set_size(cached, PAGE_SIZE + 1);
+	fs_set_size(cached, 2 * PAGE_SIZE);
+	fs_read(cached, data_read, PAGE_SIZE, PAGE_SIZE);
+	assert_int_equal(data_read[0], data_write[PAGE_SIZE]);
+	for (int i_byte = 1; i_byte < PAGE_SIZE; i_byte++)
+		assert_int_equal(data_read[i_byte], 0);
+
+	fs_close(cached);
+}
+
+static void count_hook(void *context) {
+	(*(int *) context)++;
+}
+
+static void test_mmap() {
+	enum { SMALL_SIZE = 100, LARGE_SIZE = 100000 };
+
+	FsFile *mapped = fs_open("test-file-mapped", true, FS_MODE_MMAP);
+	fs_set_size(mapped, SMALL_SIZE);
+
+	char data_write[SMALL_SIZE];
+	for (size_t i_byte = 0; i_byte < ARRAY_LEN(data_write); i_byte++)
+		data_write[i_byte] = (char) rand();
+	fs_write(mapped, data_write, 0, SMALL_SIZE);
+
+	// A writable pin calls the write hook before the bytes can be modified
+	// (the kernel may write the mapping back at any time), a read-only one
+	// doesn't.
+	int n_hook_calls = 0;
+	fs_set_write_hook(mapped, count_hook, &n_hook_calls);
+	fs_pin(mapped, 0, SMALL_SIZE, false);
+	fs_unpin(mapped, 0, false);
+	assert_int_equal(n_hook_calls, 0);
+	char *pinned = fs_pin(mapped, 0, SMALL_SIZE, true);
+	assert_int_equal(n_hook_calls, 1);
+	fs_set_write_hook(mapped, NULL, NULL);
+
+	// The pinned pointer survives growing the file.
+	fs_set_size(mapped, LARGE_SIZE);
+	assert_memory_equal(pinned, data_write, SMALL_SIZE);
+	pinned[0] = ~data_write[0];
+	data_write[0] = pinned[0];
+	fs_unpin(mapped, 0, true);
+	char last_byte = 42;
+	fs_write(mapped, &last_byte, LARGE_SIZE - 1, 1);
+
+	// Writes through the mapping are visible to pread.
+	fs_sync(mapped);
+	char data_read[SMALL_SIZE];
+	read_uncached(mapped, data_read, 0, SMALL_SIZE);
+	assert_memory_equal(data_read, data_write, SMALL_SIZE);
+	read_uncached(mapped, data_read, LARGE_SIZE - 1, 1);
+	assert_int_equal(data_read[0], 42);
+
+	fs_close(mapped);
+}
+
+static void test_batch() {
+	enum { REQUEST_SIZE = 256, N_BLOCKS = 200 };
+
+	FsFile *batched = fs_open("test-file-batched", true, FS_MODE_BUFFERED);
+	fs_set_size(batched, N_BLOCKS * REQUEST_SIZE);
+
+	// Write every block in reverse order, with more requests than fit in the
+	// io_uring submission queue.
+	static char data_write[N_BLOCKS][REQUEST_SIZE];
+	FsRequest requests[N_BLOCKS];
+	for (int i_block = 0; i_block < N_BLOCKS; i_block++) {
+		for (int i_byte = 0; i_byte < REQUEST_SIZE; i_byte++)
+			data_write[i_block][i_byte] = (char) rand();
+		int i_request = N_BLOCKS - 1 - i_block;
+		requests[i_request].write = true;
+		requests[i_request].buf = data_write[i_block];
+		requests[i_request].offset = i_block * REQUEST_SIZE;
+		requests[i_request].n_bytes = REQUEST_SIZE;
+	}
+	fs_submit_batch(batched, requests, N_BLOCKS);
+	fs_wait(batched);
+
+	static char data_read[N_BLOCKS][REQUEST_SIZE];
+	read_uncached(batched, data_read, 0, sizeof(data_read));
+	assert_memory_equal(data_read, data_write, sizeof(data_read));
+
+	// Read every other block back.
+	memset(data_read, 0, sizeof(data_read));
+	for (int i_request = 0; i_request < N_BLOCKS / 2; i_request++) {
+		requests[i_request].write = false;
+		requests[i_request].buf = data_read[i_request];
+		requests[i_request].offset = 2 * i_request * REQUEST_SIZE;
+	}
+	fs_submit_batch(batched, requests, N_BLOCKS / 2);
+	fs_wait(batched);
+	for (int i_request = 0; i_request < N_BLOCKS / 2; i_request++) {
+		assert_memory_equal(data_read[i_request], data_write[2 * i_request],
+		                    REQUEST_SIZE);
+	}
+
+	// The preadv fallback (adjacent blocks are coalesced).
+	memset(data_read, 0, sizeof(data_read));
+	for (int i_request = 0; i_request < N_BLOCKS; i_request++) {
+		requests[i_request].write = false;
+		requests[i_request].buf = data_read[i_request];
+		requests[i_request].offset = i_request * REQUEST_SIZE;
+	}
+	fs_vectored_batch(batched, requests, N_BLOCKS);
+	assert_memory_equal(data_read, data_write, sizeof(data_read));
+
+	// Through the buffer pool.
+	fs_set_cache(batched, 4 * REQUEST_SIZE, 8 * REQUEST_SIZE);
+	memset(data_read, 0, sizeof(data_read));
+	fs_submit_batch(batched, requests, N_BLOCKS);
+	fs_wait(batched);
+	assert_memory_equal(data_read, data_write, sizeof(data_read));
+
+	fs_close(batched);
+}
+
+static void test_direct() {
+	FsFile *direct = fs_open("test-file-direct", true, FS_MODE_DIRECT);
+
+	// The size is rounded up to the alignment.
+	fs_set_size(direct, 1);
+	assert_int_equal(fs_size(direct), FS_DIRECT_ALIGNMENT);
+	fs_set_size(direct, 2 * FS_DIRECT_ALIGNMENT);
+
+	char *data_write = fs_alloc_buffer(FS_DIRECT_ALIGNMENT);
+	char *data_read = fs_alloc_buffer(FS_DIRECT_ALIGNMENT);
+	for (int i_byte = 0; i_byte < FS_DIRECT_ALIGNMENT; i_byte++)
+		data_write[i_byte] = (char) rand();
+	fs_write(direct, data_write, FS_DIRECT_ALIGNMENT, FS_DIRECT_ALIGNMENT);
+	fs_read(direct, data_read, FS_DIRECT_ALIGNMENT, FS_DIRECT_ALIGNMENT);
+	assert_memory_equal(data_read, data_write, FS_DIRECT_ALIGNMENT);
+
+	// With the buffer pool, unaligned accesses are fine.
+	fs_set_cache(direct, FS_DIRECT_ALIGNMENT, 4 * FS_DIRECT_ALIGNMENT);
+	char small[3];
+	fs_read(direct, small, FS_DIRECT_ALIGNMENT + 5, sizeof(small));
+	assert_memory_equal(small, &data_write[5], sizeof(small));
+	fs_write(direct, "abc", 7, 3);
+	fs_flush(direct);
+	read_uncached(direct, data_read, 0, FS_DIRECT_ALIGNMENT);
+	assert_memory_equal(&data_read[7], "abc", 3);
+
+	free(data_write);
+	free(data_read);
+	fs_close(direct);
 }
 
 int main(void) {
@@ -54,6 +292,11 @@ int main(void) {
 		cmocka_unit_test(test_initial_stats),
 		cmocka_unit_test(test_read_write),
 		cmocka_unit_test(test_final_stats),
+		cmocka_unit_test(test_histogram),
+		cmocka_unit_test(test_cache),
+		cmocka_unit_test(test_mmap),
+		cmocka_unit_test(test_batch),
+		cmocka_unit_test(test_direct),
 	};
 
 	return cmocka_run_group_tests(tests, init, shutdown);
@@ -0,0 +1,146 @@
+// For cmocka.
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "shard.h"
+#include "utils.h"
+
+const char PREFIX[] = "test-shard";
+enum { N_SHARDS = 4, N_ITEMS = 20000 };
+
+// Spread over the whole key range (so that every range has some of them).
+// The multiplier is odd, so the keys are distinct.
+static BtreeKey item_key(int i) {
+	return (BtreeKey) (i * UINT32_C(2654435761));
+}
+
+typedef struct {
+	BtreeKey last_key;
+	int n_items;
+	RecfRecord sum_of_records;
+} Walk;
+
+static void walk_callback(BtreeKey key, RecfRecord record, void *context) {
+	Walk *walk = context;
+	if (walk->n_items > 0)
+		assert_true(btree_key_cmp(walk->last_key, key) < 0);
+	walk->last_key = key;
+	walk->n_items++;
+	walk->sum_of_records += record;
+}
+
+static void check_walk(Shards *shards, int n_items, RecfRecord sum) {
+	Walk walk = {.n_items = 0, .sum_of_records = 0};
+	shards_walk(shards, walk_callback, &walk);
+	assert_int_equal(walk.n_items, n_items);
+	assert_true(walk.sum_of_records == sum);
+}
+
+static void check_shards(ShardsPartition partition) {
+	Shards *shards = shards_open(PREFIX, N_SHARDS, true,
+	                             BTREE_DEFAULT_BLOCK_SIZE, BTREE_LAYOUT_BPLUS,
+	                             partition);
+	assert_non_null(shards);
+
+	// A batch, in which the first items repeat at the end with new records
+	// (which win), then single sets.
+	enum { N_REPEATED = 100 };
+	ShardsItem *items = malloc((N_ITEMS + N_REPEATED) * sizeof(*items));
+	assert_non_null(items);
+	for (int i = 0; i < N_ITEMS; i++)
+		items[i] = (ShardsItem) {item_key(i), i};
+	for (int i = 0; i < N_REPEATED; i++)
+		items[N_ITEMS + i] = (ShardsItem) {item_key(i), i + N_ITEMS};
+	shards_set_batch(shards, items, N_ITEMS + N_REPEATED);
+	free(items);
+	for (int i = N_REPEATED; i < 2 * N_REPEATED; i++)
+		shards_set(shards, item_key(i), i + N_ITEMS);
+
+	// Delete every third item.
+	RecfRecord sum = 0;
+	int n_items = 0;
+	for (int i = 0; i < N_ITEMS; i++) {
+		if (i % 3 == 0) {
+			assert_true(shards_delete(shards, item_key(i)));
+			assert_false(shards_delete(shards, item_key(i)));
+			continue;
+		}
+		sum += i < 2 * N_REPEATED ? i + N_ITEMS : i;
+		n_items++;
+	}
+
+	for (int i = 0; i < N_ITEMS; i++) {
+		RecfRecord record;
+		bool found = shards_get(shards, item_key(i), &record);
+		assert_int_equal(found, i % 3 != 0);
+		if (found)
+			assert_true(record == (RecfRecord)
+			            (i < 2 * N_REPEATED ? i + N_ITEMS : i));
+	}
+	check_walk(shards, n_items, sum);
+	shards_close(shards);
+
+	shards = shards_open(PREFIX, N_SHARDS, false, BTREE_DEFAULT_BLOCK_SIZE,
+	                     BTREE_LAYOUT_BPLUS, partition);
+	assert_non_null(shards);
+	check_walk(shards, n_items, sum);
+	shards_close(shards);
+}
+
+static void test_shards() {
+	check_shards(NULL);
+	check_shards(shards_hash_partition);
+}
+
+// Several threads set their own keys at once.
+enum { N_THREADS = 4 };
+
+typedef struct {
+	Shards *shards;
+	int i_thread;
+} ThreadsTest;
+
+static void *threads_setter(void *test_void) {
+	ThreadsTest *test = test_void;
+	int i_thread = __atomic_fetch_add(&test->i_thread, 1, __ATOMIC_RELAXED);
+	for (int i = i_thread; i < N_ITEMS; i += N_THREADS)
+		shards_set(test->shards, item_key(i), i);
+	return NULL;
+}
+
+static void test_threads() {
+	ThreadsTest test = {
+		shards_open(PREFIX, N_SHARDS, true, BTREE_DEFAULT_BLOCK_SIZE,
+		            BTREE_LAYOUT_B, shards_hash_partition),
+		0};
+	assert_non_null(test.shards);
+	pthread_t threads[N_THREADS];
+	for (int i = 0; i < N_THREADS; i++) {
+		assert_int_equal(
+			pthread_create(&threads[i], NULL, threads_setter, &test), 0);
+	}
+	for (int i = 0; i < N_THREADS; i++)
+		assert_int_equal(pthread_join(threads[i], NULL), 0);
+	shards_sync(test.shards);
+
+	for (int i = 0; i < N_ITEMS; i++) {
+		RecfRecord record;
+		assert_true(shards_get(test.shards, item_key(i), &record));
+		assert_true(record == (RecfRecord) i);
+	}
+	check_walk(test.shards, N_ITEMS,
+	           (RecfRecord) N_ITEMS * (N_ITEMS - 1) / 2);
+	shards_close(test.shards);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_shards),
+		cmocka_unit_test(test_threads),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
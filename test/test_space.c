@@ -0,0 +1,137 @@
+// For cmocka.
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include "space.h"
+
+enum { UNIT_SIZE = 256, N_RESERVED = 1, N_UNITS = 1000 };
+
+FsFile *file = NULL;
+Space *space = NULL;
+
+static int init() {
+	file = fs_open("test-space", true, FS_MODE_BUFFERED);
+	space = space_new(file, 0, UNIT_SIZE, N_RESERVED, UNIT_SIZE);
+	return 0;
+}
+
+static int shutdown() {
+	space_destroy(space);
+	fs_close(file);
+	return 0;
+}
+
+static void test_append() {
+	FsOffset prev_size = 0;
+	int n_grows = 0;
+	for (SpaceUnit i_unit = N_RESERVED; i_unit < N_UNITS; i_unit++) {
+		assert_int_equal(space_alloc(space, SPACE_NULL), i_unit);
+		assert_true(fs_size(file) >= (i_unit + 1) * UNIT_SIZE);
+		if (fs_size(file) != prev_size)
+			n_grows++;
+		prev_size = fs_size(file);
+	}
+
+	// The file grows in extents, not unit by unit.
+	assert_true(n_grows < 10);
+	assert_int_equal(space_end(space), N_UNITS);
+	assert_int_equal(space_n_free(space), 0);
+}
+
+static void test_free_near() {
+	for (SpaceUnit unit = 100; unit < 900; unit += 100)
+		space_free(space, unit);
+	assert_false(space_is_used(space, 500));
+	assert_int_equal(space_n_free(space), 8);
+
+	// Freed units are reused, the closest one first.
+	assert_int_equal(space_alloc(space, 505), 500);
+	assert_int_equal(space_alloc(space, SPACE_NULL), 100);
+	assert_true(space_is_used(space, 500));
+	assert_int_equal(space_n_free(space), 6);
+}
+
+static void test_save_load() {
+	space_save(space);
+	SpaceUnit end = space_end(space);
+	SpaceUnit n_free = space_n_free(space);
+
+	Space *loaded = space_load(file, 0, UNIT_SIZE, N_RESERVED, UNIT_SIZE,
+	                           end, n_free);
+	for (SpaceUnit unit = 0; unit < end; unit++) {
+		assert_int_equal(space_is_used(loaded, unit),
+		                 space_is_used(space, unit));
+	}
+	assert_int_equal(space_alloc(loaded, SPACE_NULL), 200);
+	space_destroy(loaded);
+}
+
+static void test_snapshot_restore() {
+	size_t n_bytes = space_snapshot_size(space);
+	char *snapshot = malloc(n_bytes);
+	assert_non_null(snapshot);
+	space_snapshot(space, snapshot);
+	Space *restored = space_new(file, 0, UNIT_SIZE, N_RESERVED, UNIT_SIZE);
+	space_restore(restored, snapshot);
+	free(snapshot);
+	assert_int_equal(space_end(restored), space_end(space));
+	assert_int_equal(space_n_free(restored), space_n_free(space));
+
+	// Replaying the allocations (which fill the free units, then append) and
+	// frees gives the same state.
+	assert_true(space_n_free(space) > 0);
+	for (int i = 0; i < 10; i++) {
+		SpaceUnit unit = space_alloc(space, SPACE_NULL);
+		space_alloc_at(restored, unit);
+	}
+	space_free(space, 500);
+	space_free(restored, 500);
+	assert_int_equal(space_end(restored), space_end(space));
+	assert_int_equal(space_n_free(restored), space_n_free(space));
+	for (SpaceUnit unit = 0; unit < space_end(space); unit++) {
+		assert_int_equal(space_is_used(restored, unit),
+		                 space_is_used(space, unit));
+	}
+	space_destroy(restored);
+}
+
+static void test_shrink() {
+	// Free the last units, and one before them (which stays).
+	SpaceUnit end = space_end(space);
+	SpaceUnit n_free = space_n_free(space);
+	space_free(space, end - 20);
+	for (SpaceUnit unit = end - 10; unit < end; unit++)
+		space_free(space, unit);
+	space_shrink(space);
+	assert_int_equal(space_end(space), end - 10);
+	assert_int_equal(space_n_free(space), n_free + 1);
+	space_save(space);
+	space_truncate(space);
+	assert_true(fs_size(file) > (end - 10) * UNIT_SIZE &&
+	            fs_size(file) < end * UNIT_SIZE);
+
+	// The free units are given out lowest first, then the file grows again.
+	for (SpaceUnit i = 0; i < n_free + 1; i++) {
+		SpaceUnit unit = space_lowest_free(space);
+		assert_true(unit < end - 10);
+		assert_int_equal(space_alloc(space, SPACE_NULL), unit);
+	}
+	assert_int_equal(space_lowest_free(space), end - 10);
+	assert_int_equal(space_alloc(space, SPACE_NULL), end - 10);
+	assert_true(fs_size(file) > (end - 10) * UNIT_SIZE);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_append),
+		cmocka_unit_test(test_free_near),
+		cmocka_unit_test(test_save_load),
+		cmocka_unit_test(test_snapshot_restore),
+		cmocka_unit_test(test_shrink),
+	};
+
+	return cmocka_run_group_tests(tests, init, shutdown);
+}
@@ -0,0 +1,394 @@
+// For cmocka.
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "btree.h"
+#include "recf.h"
+#include "wal.h"
+
+const char BTREE_FILE_NAME[] = "test-wal-btree.dat";
+const char RECF_FILE_NAME[] = "test-wal-recf.dat";
+const char WAL_FILE_NAME[] = "test-wal.dat";
+enum { WAL_ID_BTREE, WAL_ID_RECF, WAL_ID_CRASH };
+
+typedef struct {
+	Btree *btree;
+	Recf *recf;
+	Wal *wal;
+} Files;
+
+static Files files_open(bool create) {
+	Files files;
+	files.wal = wal_open(WAL_FILE_NAME, create);
+	assert_non_null(files.wal);
+	files.btree = create ? btree_new(BTREE_FILE_NAME, BTREE_DEFAULT_BLOCK_SIZE,
+	                                 BTREE_LAYOUT_B)
+		: btree_open(BTREE_FILE_NAME);
+	files.recf = create ? recf_new(RECF_FILE_NAME, RECF_DEFAULT_BLOCK_SIZE)
+		: recf_open(RECF_FILE_NAME);
+	assert_non_null(files.btree);
+	assert_non_null(files.recf);
+	btree_attach_wal(files.btree, files.wal, WAL_ID_BTREE);
+	recf_attach_wal(files.recf, files.wal, WAL_ID_RECF);
+	return files;
+}
+
+static void files_close(Files files) {
+	recf_destroy(files.recf);
+	btree_destroy(files.btree);
+	wal_close(files.wal);
+}
+
+// Like the commands in main.c.
+static void files_set(Files files, BtreeKey key, RecfRecord record) {
+	RecfRecordIdx idx = recf_add(files.recf, record);
+	bool replaced = false;
+	RecfRecordIdx old_idx;
+	btree_set(files.btree, key, idx, &replaced, &old_idx);
+	if (replaced)
+		recf_delete(files.recf, old_idx);
+}
+
+static void files_delete(Files files, BtreeKey key) {
+	RecfRecordIdx idx;
+	if (btree_delete(files.btree, key, &idx))
+		recf_delete(files.recf, idx);
+}
+
+// The operations come in pairs: set a key, then set it again, and every
+// other time, delete it.
+enum { N_OPERATIONS = 30000, N_KEYS = 100003 };
+
+static BtreeKey operation_key(size_t i) {
+	return (i / 2 * 2) * 7919 % N_KEYS;
+}
+
+static RecfRecord operation_record(size_t i) {
+	return (RecfRecord) i * 3 + 1;
+}
+
+static void do_operations(Files files, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++) {
+		files_set(files, operation_key(i), operation_record(i));
+		if (i % 4 == 3)
+			files_delete(files, operation_key(i - 1));
+	}
+}
+
+static void expected_state(size_t n_operations, RecfRecord *records) {
+	// records[key] = the record, or 0 if the key isn't in the tree.
+	memset(records, 0, N_KEYS * sizeof(*records));
+	for (size_t i = 0; i < n_operations; i++) {
+		records[operation_key(i)] = operation_record(i);
+		if (i % 4 == 3)
+			records[operation_key(i - 1)] = 0;
+	}
+}
+
+static void check_state(Files files, size_t n_operations) {
+	RecfRecord *records = malloc(N_KEYS * sizeof(*records));
+	assert_non_null(records);
+	expected_state(n_operations, records);
+	for (BtreeKey key = 0; key < N_KEYS; key++) {
+		BtreeValue idx;
+		bool found = btree_get(files.btree, key, &idx);
+		assert_int_equal(found, records[key] != 0);
+		if (found)
+			assert_int_equal(recf_get(files.recf, idx), records[key]);
+	}
+	free(records);
+}
+
+static void crash_after(void (*work)(Files files)) {
+	// Runs work() on new files in a child process, which then exits without
+	// closing anything (so that everything still in the buffer pools or the
+	// log's buffer is lost).
+	pid_t pid = fork();
+	assert_true(pid != -1);
+	if (pid == 0) {
+		work(files_open(true));
+		_exit(0);
+	}
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Threads set keys (each its own part of the operations), each waiting until
+// its set is durable.
+enum { GROUP_N_THREADS = 4, GROUP_N_OPERATIONS = 2000 };
+
+typedef struct {
+	Files files;
+	int i_thread;
+} GroupTest;
+
+static void *group_thread(void *test_void) {
+	GroupTest *test = test_void;
+	int i_thread = __atomic_fetch_add(&test->i_thread, 1, __ATOMIC_RELAXED);
+	for (size_t i = i_thread * 2; i < GROUP_N_OPERATIONS;
+	     i += GROUP_N_THREADS * 2) {
+		// A pair at a time, as the second operation of a pair sometimes
+		// deletes the first one's key.
+		do_operations(test->files, i, i + 2);
+		wal_sync(test->files.wal);
+	}
+	return NULL;
+}
+
+static void group_work(Files files) {
+	GroupTest test = {files, 0};
+	WalStats old_stats = wal_stats(files.wal);
+	pthread_t threads[GROUP_N_THREADS];
+	for (int i = 0; i < GROUP_N_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, group_thread, &test) != 0)
+			_exit(1);
+	}
+	for (int i = 0; i < GROUP_N_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	// The threads which waited at once shared syncs (there's a wait per
+	// pair of operations).
+	WalStats stats = wal_stats(files.wal);
+	if (stats.n_syncs - old_stats.n_syncs >= GROUP_N_OPERATIONS / 2)
+		_exit(1);
+}
+
+static void test_group_commit() {
+	// Everything waited for survives a crash.
+	crash_after(group_work);
+	Files files = files_open(false);
+	check_state(files, GROUP_N_OPERATIONS);
+	files_close(files);
+}
+
+static void quiet_work(Files files) {
+	// Don't wait for the commits, but give the log time to be synced.
+	do_operations(files, 0, 1000);
+	usleep(WAL_MAX_SYNC_DELAY_MS * 20 * 1000);
+}
+
+static void test_sync_delay() {
+	crash_after(quiet_work);
+	Files files = files_open(false);
+	check_state(files, 1000);
+	files_close(files);
+}
+
+static bool pair_done(Files files, size_t i_pair) {
+	BtreeKey key = operation_key(2 * i_pair);
+	BtreeValue idx;
+	bool found = btree_get(files.btree, key, &idx);
+	if ((2 * i_pair + 1) % 4 == 3)
+		return !found;
+	return found &&
+		recf_get(files.recf, idx) == operation_record(2 * i_pair + 1);
+}
+
+static void test_recovery() {
+	// Crash (exit without closing anything, so that everything still in the
+	// buffer pools or the log's buffer is lost) after making some of the
+	// operations durable, in a child process. There are enough operations
+	// for dirty pages to be written back, and for checkpoints.
+	enum { N_DURABLE = N_OPERATIONS - 1000 };
+	pid_t pid = fork();
+	assert_true(pid != -1);
+	if (pid == 0) {
+		Files files = files_open(true);
+		do_operations(files, 0, N_DURABLE);
+		wal_sync(files.wal);
+		do_operations(files, N_DURABLE, N_OPERATIONS);
+		_exit(wal_stats(files.wal).n_checkpoints > 0 ? 0 : 1);
+	}
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// A prefix of the operations survives: at least the durable ones, then
+	// maybe a part of a pair, but nothing after it.
+	Files files = files_open(false);
+	size_t i_pair = 0;
+	while (i_pair < N_OPERATIONS / 2 && pair_done(files, i_pair))
+		i_pair++;
+	assert_true(i_pair >= N_DURABLE / 2);
+	if (i_pair < N_OPERATIONS / 2) {
+		BtreeValue idx;
+		if (btree_get(files.btree, operation_key(2 * i_pair), &idx)) {
+			RecfRecord record = recf_get(files.recf, idx);
+			assert_true(record == operation_record(2 * i_pair) ||
+			            record == operation_record(2 * i_pair + 1));
+		}
+	}
+	for (i_pair++; i_pair < N_OPERATIONS / 2; i_pair++) {
+		BtreeValue idx;
+		assert_false(btree_get(files.btree, operation_key(2 * i_pair), &idx));
+	}
+
+	// After recovery, the files work as usual.
+	do_operations(files, 0, N_OPERATIONS);
+	files_close(files);
+	files = files_open(false);
+	check_state(files, N_OPERATIONS);
+	files_close(files);
+}
+
+// A participant which crashes the process when it's synced, once armed.
+static bool crash_armed = false;
+
+static void crash_redo(void *context, uint8_t type, uint64_t arg,
+                       const void *bytes, size_t n_bytes) {
+	(void) context; (void) type; (void) arg; (void) bytes; (void) n_bytes;
+}
+
+static void crash_sync(void *context) {
+	(void) context;
+	if (crash_armed)
+		_exit(0);
+}
+
+static void crash_snapshot(void *context) {
+	(void) context;
+}
+
+static void test_crash_in_checkpoint() {
+	// Crash in the middle of a checkpoint: after the tree's file is synced,
+	// but before the record file is. The records of the last transactions
+	// then have to come from the log.
+	enum { N_CRASH_OPERATIONS = 1000 };
+	pid_t pid = fork();
+	assert_true(pid != -1);
+	if (pid == 0) {
+		Files files;
+		files.wal = wal_open(WAL_FILE_NAME, true);
+		files.btree = btree_new(BTREE_FILE_NAME, BTREE_DEFAULT_BLOCK_SIZE,
+		                        BTREE_LAYOUT_B);
+		files.recf = recf_new(RECF_FILE_NAME, RECF_DEFAULT_BLOCK_SIZE);
+		btree_attach_wal(files.btree, files.wal, WAL_ID_BTREE);
+		WalParticipant crash = {
+			crash_redo, crash_sync, crash_snapshot, NULL};
+		wal_attach(files.wal, WAL_ID_CRASH, &crash);
+		recf_attach_wal(files.recf, files.wal, WAL_ID_RECF);
+
+		do_operations(files, 0, N_CRASH_OPERATIONS);
+		crash_armed = true;
+		wal_checkpoint(files.wal);
+		_exit(1);
+	}
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// The checkpoint made everything before it durable.
+	Files files = files_open(false);
+	check_state(files, N_CRASH_OPERATIONS);
+	files_close(files);
+}
+
+// Writers set their own keys (past N_KEYS) over and over, while readers
+// check the keys set before they started. Errors are counted, as cmocka's
+// assertions only work in the main thread.
+enum { THREADS_N_BASE = 1000, THREADS_N_WRITERS = 3, THREADS_N_READERS = 2,
+       THREADS_N_WRITER_KEYS = 2000, THREADS_N_ROUNDS = 3 };
+
+typedef struct {
+	Files files;
+	RecfRecord *records; // See expected_state.
+	int i_writer;
+	int n_writers_left;
+	int n_errors;
+} ThreadsTest;
+
+static BtreeKey threads_key(int i_writer, int i) {
+	return N_KEYS + i * THREADS_N_WRITERS + i_writer;
+}
+
+static RecfRecord threads_record(BtreeKey key, int i_round) {
+	return (RecfRecord) key * THREADS_N_ROUNDS + i_round + 1;
+}
+
+static void *threads_writer(void *test_void) {
+	ThreadsTest *test = test_void;
+	int i_writer = __atomic_fetch_add(&test->i_writer, 1, __ATOMIC_RELAXED);
+	for (int i_round = 0; i_round < THREADS_N_ROUNDS; i_round++) {
+		for (int i = 0; i < THREADS_N_WRITER_KEYS; i++) {
+			BtreeKey key = threads_key(i_writer, i);
+			files_set(test->files, key, threads_record(key, i_round));
+		}
+	}
+	__atomic_fetch_sub(&test->n_writers_left, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *threads_reader(void *test_void) {
+	ThreadsTest *test = test_void;
+	unsigned seed = (unsigned) (uintptr_t) &seed;
+	while (__atomic_load_n(&test->n_writers_left, __ATOMIC_ACQUIRE) > 0) {
+		BtreeKey key = rand_r(&seed) % N_KEYS;
+		BtreeValue idx;
+		bool found = btree_get(test->files.btree, key, &idx);
+		if (found != (test->records[key] != 0) ||
+		    (found && recf_get(test->files.recf, idx) != test->records[key]))
+			__atomic_fetch_add(&test->n_errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void check_threads_state(Files files) {
+	check_state(files, THREADS_N_BASE);
+	for (int i_writer = 0; i_writer < THREADS_N_WRITERS; i_writer++) {
+		for (int i = 0; i < THREADS_N_WRITER_KEYS; i++) {
+			BtreeKey key = threads_key(i_writer, i);
+			BtreeValue idx;
+			assert_true(btree_get(files.btree, key, &idx));
+			assert_true(recf_get(files.recf, idx) ==
+			            threads_record(key, THREADS_N_ROUNDS - 1));
+		}
+	}
+}
+
+static void test_threads() {
+	ThreadsTest test = {
+		.files = files_open(true),
+		.records = malloc(N_KEYS * sizeof(*test.records)),
+		.i_writer = 0, .n_writers_left = THREADS_N_WRITERS, .n_errors = 0};
+	assert_non_null(test.records);
+	do_operations(test.files, 0, THREADS_N_BASE);
+	expected_state(THREADS_N_BASE, test.records);
+
+	pthread_t threads[THREADS_N_WRITERS + THREADS_N_READERS];
+	for (int i = 0; i < THREADS_N_WRITERS + THREADS_N_READERS; i++) {
+		assert_int_equal(pthread_create(
+			&threads[i], NULL,
+			i < THREADS_N_WRITERS ? threads_writer : threads_reader,
+			&test), 0);
+	}
+	for (int i = 0; i < THREADS_N_WRITERS + THREADS_N_READERS; i++)
+		assert_int_equal(pthread_join(threads[i], NULL), 0);
+	assert_int_equal(test.n_errors, 0);
+	check_threads_state(test.files);
+	free(test.records);
+
+	// And after reopening.
+	files_close(test.files);
+	Files files = files_open(false);
+	check_threads_state(files);
+	files_close(files);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_group_commit),
+		cmocka_unit_test(test_sync_delay),
+		cmocka_unit_test(test_recovery),
+		cmocka_unit_test(test_crash_in_checkpoint),
+		cmocka_unit_test(test_threads),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}